@@ -32,13 +32,13 @@
 #include <sys/time.h>
 
 #include "snap_internal.h"
+#include "snap_btrace.h"
 #include "libsnap.h"
 #include "snap_hls_if.h"
 #include "capiblock.h"
 #include "pp.h"
 
 #undef CONFIG_WAIT_FOR_IRQ	/* Not working */
-#undef CONFIG_MMIO32_NOHWSYNC	/* Do not use hwsync behind lwz */
 
 #define CBLK_PREFETCH_THRESHOLD		10 /* only prefetch if reads_in_flight is small than the threshold */
 #define CBLK_NBLOCKS			2 /* tuneup for the prefetch strategy */
@@ -212,6 +212,7 @@ static inline void cblk_set_status(struct cblk_req *req,
 {
 	/* block_trace("  [%s] req slot %d new status is %s\n", __func__,
 		req->slot, cblk_status_str[status]); */
+	snap_btrace(SNAP_BT_BLOCK_STATUS, req->slot, status, req->lba);
 	req->status = status;
 }
 
@@ -768,12 +769,7 @@ static int __cblk_read(struct cblk_dev *c, uint32_t addr, uint32_t *data)
 	int rc, oldstate;
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-
-#ifdef CONFIG_MMIO32_NOHWSYNC
-	rc = snap_mmio_read32_nohwsync(c->card, (uint64_t)addr, data);
-#else
 	rc = snap_mmio_read32(c->card, (uint64_t)addr, data);
-#endif
 	if (0 != rc)
 		fprintf(stderr, "err: Read MMIO 32 Err %d\n", rc);
 
@@ -809,6 +805,7 @@ static void req_start(struct cblk_req *req, struct cblk_dev *c)
 		__func__, action_name[action_code % ACTION_CONFIG_MAX],
 		req->action, slot, (long long)req->dst, (long long)req->src,
 		(long long)req->size, req->lba, req->tries);
+	snap_btrace(SNAP_BT_BLOCK_START, slot, req->action, req->lba);
 
 	pthread_mutex_lock(&c->dev_lock);
 
@@ -1050,7 +1047,11 @@ static int completion_status(struct cblk_dev *c, int timeout __attribute__((unus
 	}
 #endif
 
-	rc = __cblk_read(c, ACTION_STATUS, &status);
+	/*
+	 * This is polled, a hwsync is only needed once a request got
+	 * completed, before its data buffer is used.
+	 */
+	rc = snap_mmio_read32_nohwsync(c->card, ACTION_STATUS, &status);
 	if (rc != 0) {
 		fprintf(stderr, "err: MMIO32 read ACTION_STATUS %d\n", rc);
 		dev_set_status(c, CBLK_ERROR);
@@ -1074,6 +1075,7 @@ static int completion_status(struct cblk_dev *c, int timeout __attribute__((unus
 		return -3;
 	}
 
+	snap_mmio_hwsync(c->card);
 	slot = status & ACTION_STATUS_COMPLETION_MASK;
 	req = &c->req[slot];
 
@@ -1085,6 +1087,8 @@ static int completion_status(struct cblk_dev *c, int timeout __attribute__((unus
 			__func__, status, slot, req->lba);
 	}
 
+	snap_btrace(SNAP_BT_BLOCK_DONE, slot, req->action, req->lba);
+
 	/* statistics: figure out hardware completion time ... */
 	gettimeofday(&req->h_etime, NULL);
 	usecs = timediff_usec(&req->h_etime, &req->h_stime);
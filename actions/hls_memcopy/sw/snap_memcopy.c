@@ -53,6 +53,7 @@ static void usage(const char *prog)
 	       "  -D, --type-out <HOST_DRAM, CARD_DRAM, UNUSED, ...>.\n"
 	       "  -d, --addr-out <addr>      address e.g. in CARD_RAM.\n"
 	       "  -s, --size <size>          size of data.\n"
+	       "  -k, --chunk <size>         bytes per job, default 1 GiB.\n"
 	       "  -m, --mode <mode>          mode flags.\n"
 	       "  -t, --timeout              timeout in sec to wait for done. (10 sec default)\n"
 	       "  -X, --verify               verify result if possible\n"
@@ -136,6 +137,37 @@ static void snap_prepare_memcopy(struct snap_job *cjob, struct memcopy_job *mjob
 	snap_job_set(cjob, mjob, sizeof(*mjob), NULL, 0);
 }
 
+/*
+ * Copies larger than what fits into a snap_addr run as a chain of jobs
+ * of up to chunk bytes. The pieces do not depend on each other.
+ */
+struct memcopy_chain {
+	uint64_t addr_in;
+	uint64_t addr_out;
+};
+
+static int memcopy_chain_prepare(struct snap_job *cjob, uint64_t offs,
+				 uint32_t len, void *priv)
+{
+	struct memcopy_chain *mc = priv;
+	struct memcopy_job *mjob = (void *)(unsigned long)cjob->win_addr;
+
+	mjob->in.addr = mc->addr_in + offs;
+	mjob->in.size = len;
+	mjob->out.addr = mc->addr_out + offs;
+	mjob->out.size = len;
+	return 0;
+}
+
+static int64_t memcopy_chain_complete(struct snap_job *cjob,
+				      uint64_t offs, uint32_t len, void *priv)
+{
+	(void)cjob;
+	(void)offs;
+	(void)priv;
+	return len;
+}
+
 /**
  * Read accelerator specific registers. Must be called as root!
  */
@@ -144,7 +176,10 @@ int main(int argc, char *argv[])
 	int ch, rc = 0;
 	int card_no = 0;
 	struct snap_card *card = NULL;
-	struct snap_action *action = NULL;
+	struct snap_queue *queue = NULL;
+	struct memcopy_chain mc;
+	struct snap_chain chain;
+	uint32_t chunk = 0;
 	char device[128];
 	struct snap_job cjob;
 	struct memcopy_job mjob;
@@ -178,6 +213,7 @@ int main(int argc, char *argv[])
 			{ "dst-type",	 required_argument, NULL, 'D' },
 			{ "dst-addr",	 required_argument, NULL, 'd' },
 			{ "size",	 required_argument, NULL, 's' },
+			{ "chunk",	 required_argument, NULL, 'k' },
 			{ "mode",	 required_argument, NULL, 'm' },
 			{ "timeout", 	 required_argument, NULL, 't' },
 			{ "verify",	 no_argument,	    NULL, 'X' },
@@ -190,7 +226,7 @@ int main(int argc, char *argv[])
 
 		ch = getopt_long(argc, argv,
 //			 "A:C:i:o:a:S:D:d:x:s:t:XVqvhI",
-         "C:i:o:A:a:D:d:s:m:t:XVvhN",
+         "C:i:o:A:a:D:d:s:k:m:t:XVvhN",
 				 long_options, &option_index);
          
 		if (ch == -1)
@@ -239,6 +275,9 @@ int main(int argc, char *argv[])
 		case 's':
 			size = __str_to_num(optarg);
 			break;
+		case 'k':
+			chunk = __str_to_num(optarg);
+			break;
 		case 'm':
 			mode = strtol(optarg, (char **)NULL, 0);
 			break;
@@ -279,16 +318,28 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
+	card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+				   SNAP_DEVICE_ID_SNAP);
+	if (card == NULL) {
+		fprintf(stderr, "err: failed to open card %u: %s\n",
+			card_no, strerror(errno));
+                fprintf(stderr, "Default mode is FPGA mode.\n");
+                fprintf(stderr, "Did you want to run CPU mode ? => add SNAP_CONFIG=CPU before your command.\n");
+                fprintf(stderr, "Otherwise make sure you ran snap_find_card and snap_maint for your selected card.\n");
+		goto out_error;
+	}
+
 	/* if input file is defined, use that as input */
 	if (input != NULL) {
 		size = __file_size(input);
 		if (size < 0)
-			goto out_error;
+			goto out_error1;
 
 		/* source buffer */
-		ibuff = snap_malloc(size);
+		ibuff = snap_buf_alloc(card, size, SNAP_BUF_HUGE);
 		if (ibuff == NULL)
-			goto out_error;
+			goto out_error1;
 		memset(ibuff, 0, size);
 
 		fprintf(stdout, "reading input data %d bytes from %s\n",
@@ -296,7 +347,7 @@ int main(int argc, char *argv[])
 
 		rc = __file_read(input, ibuff, size);
 		if (rc < 0)
-			goto out_error;
+			goto out_error1;
 
 		type_in = SNAP_ADDRTYPE_HOST_DRAM;
 		addr_in = (unsigned long)ibuff;
@@ -306,9 +357,9 @@ int main(int argc, char *argv[])
 	if (output != NULL) {
 		ssize_t set_size = size + (verify ? sizeof(trailing_zeros) : 0);
 
-		obuff = snap_malloc(set_size);
+		obuff = snap_buf_alloc(card, set_size, SNAP_BUF_HUGE);
 		if (obuff == NULL)
-			goto out_error;
+			goto out_error1;
 		memset(obuff, 0x0, set_size);
 		type_out = SNAP_ADDRTYPE_HOST_DRAM;
 		addr_out = (unsigned long)obuff;
@@ -322,47 +373,46 @@ int main(int argc, char *argv[])
 	       "  type_out:    %x %s\n"
 	       "  addr_out:    %016llx\n"
 	       "  size_in/out: %08lx\n"
+	       "  chunk:       %08x\n"
 	       "  mode:        %08x\n",
 	       input  ? input  : "unknown",
 	       output ? output : "unknown",
 	       type_in,  mem_tab[type_in%4],  (long long)addr_in,
 	       type_out, mem_tab[type_out%4], (long long)addr_out,
-	       size, mode);
-
-	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
-	card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
-				   SNAP_DEVICE_ID_SNAP);
-	if (card == NULL) {
-		fprintf(stderr, "err: failed to open card %u: %s\n",
-			card_no, strerror(errno));
-                fprintf(stderr, "Default mode is FPGA mode.\n");
-                fprintf(stderr, "Did you want to run CPU mode ? => add SNAP_CONFIG=CPU before your command.\n");
-                fprintf(stderr, "Otherwise make sure you ran snap_find_card and snap_maint for your selected card.\n");
-		goto out_error;
-	}
+	       size, chunk, mode);
 
-	action = snap_attach_action(card, MEMCOPY_ACTION_TYPE, action_irq, 60);
-	if (action == NULL) {
+	queue = snap_queue_alloc(card, MEMCOPY_ACTION_TYPE, action_irq, 4, 60);
+	if (queue == NULL) {
 		fprintf(stderr, "err: failed to attach action %u: %s\n",
 			card_no, strerror(errno));
 		goto out_error1;
 	}
 
         // The following snap_prepare_memcopy will fill the software mjob and cjob
-        // structures with the appropriate content
+        // structures with the appropriate content, the chain sets address
+        // and size of each piece
 	snap_prepare_memcopy(&cjob, &mjob,
-			     (void *)addr_in,  size, type_in,
-			     (void *)addr_out, size, type_out);
+			     (void *)addr_in,  0, type_in,
+			     (void *)addr_out, 0, type_out);
+	mc.addr_in = addr_in;
+	mc.addr_out = addr_out;
+	memset(&chain, 0, sizeof(chain));
+	chain.size = size;
+	chain.chunk_size = chunk;
+	chain.depth = 4;
+	chain.prepare = memcopy_chain_prepare;
+	chain.complete = memcopy_chain_complete;
+	chain.priv = &mc;
 
 	__hexdump(stderr, &mjob, sizeof(mjob));
 
         printf("      get starting time\nAction is running ....");
         gettimeofday(&stime, NULL);
-        // The following snap_action_sync_execute_job will transfer the
+        // The following snap_chain_execute_job will transfer the
         // structures cjob and mjob contents to fpga registers and launch
-        // the specified action.
+        // the specified action, once per piece.
         // => timing will thus take into account the registers transfer time added to the action duration
-	rc = snap_action_sync_execute_job(action, &cjob, timeout);
+	rc = snap_chain_execute_job(queue, &cjob, &chain, timeout);
 	gettimeofday(&etime, NULL);
         printf("      got end of exec. time\n");
 	if (rc != 0) {
@@ -415,19 +465,19 @@ int main(int argc, char *argv[])
 		(long long)size, (long long)diff_usec, mib_sec, mem_tab[type_in%4], mem_tab[type_out%4]);
         fprintf(stdout, "This time represents the register transfer time + memcopy action time\n");       
 
-	snap_detach_action(action);
+	snap_queue_free(queue);
 	snap_card_free(card);
 
-	__free(obuff);
-	__free(ibuff);
+	snap_buf_free(obuff);
+	snap_buf_free(ibuff);
 	exit(exit_code);
 
  out_error2:
-	snap_detach_action(action);
+	snap_queue_free(queue);
  out_error1:
 	snap_card_free(card);
  out_error:
-	__free(obuff);
-	__free(ibuff);
+	snap_buf_free(obuff);
+	snap_buf_free(ibuff);
 	exit(EXIT_FAILURE);
 }
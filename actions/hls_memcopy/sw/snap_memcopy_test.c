@@ -0,0 +1,752 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Regression test of the libsnap job interfaces. Each test copies
+ * data with the memcopy action and compares the result: plain jobs,
+ * job queues with synchronous and asynchronous jobs, scatter-gather
+ * lists, chains, streams and the snapd client. The timeout test lets
+ * a job time out and checks that the next job gets its own result.
+ *
+ * Runs with SNAP_CONFIG=CPU and against the libcxl mock, see
+ * tests/test_0x10141000_api.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <snap_tools.h>
+#include <action_memcopy.h>
+#include <libsnap.h>
+#include <snap_hls_if.h>
+#include <snap_internal.h>
+
+#define TEST_SLOW_ACTION_TYPE	0x0000f000	/* Experimental range */
+#define TEST_SLOW_US		1500000		/* Beyond TEST_TIMEOUT */
+#define TEST_TIMEOUT		1		/* Sec for the timeout test */
+
+int verbose_flag = 0;
+
+static const char *version = GIT_VERSION;
+
+static struct snap_card *card = NULL;
+static snap_action_flag_t action_irq = 0;
+static unsigned int timeout = 10;
+
+/*
+ * Memcopy which takes longer than TEST_TIMEOUT. Used by the timeout
+ * test with SNAP_CONFIG=CPU, where the memcopy action never is slow.
+ * On the mock SNAP_MOCK_JOB_US delays the memcopy action instead.
+ */
+static int slow_main(struct snap_sim_action *action,
+		     void *job, unsigned int job_len)
+{
+	struct memcopy_job *js = (struct memcopy_job *)job;
+
+	(void)job_len;
+	usleep(TEST_SLOW_US);
+	memcpy((void *)js->out.addr, (void *)js->in.addr, js->out.size);
+	action->job.retc = SNAP_RETC_SUCCESS;
+	return 0;
+}
+
+static struct snap_sim_action slow_action = {
+	.vendor_id = SNAP_VENDOR_ID_ANY,
+	.device_id = SNAP_DEVICE_ID_ANY,
+	.action_type = TEST_SLOW_ACTION_TYPE,
+
+	.job = { .retc = SNAP_RETC_FAILURE, },
+	.state = ACTION_IDLE,
+	.main = slow_main,
+};
+
+static void fill(uint8_t *buf, size_t size, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = (uint8_t)(seed + i * 7 + (i >> 8));
+}
+
+static void prepare(struct snap_job *cjob, struct memcopy_job *mjob,
+		    const void *src, void *dst, uint32_t size)
+{
+	memset(mjob, 0, sizeof(*mjob));
+	snap_addr_set(&mjob->in, src, size, SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+	snap_addr_set(&mjob->out, dst, size, SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+		      SNAP_ADDRFLAG_END);
+	snap_job_set(cjob, mjob, sizeof(*mjob), NULL, 0);
+}
+
+static int check(const char *test, int rc, struct snap_job *cjob,
+		 const void *src, const void *dst, size_t size)
+{
+	if (rc != 0) {
+		fprintf(stderr, "err: %s: rc %d\n", test, rc);
+		return -1;
+	}
+	if (cjob->retc != SNAP_RETC_SUCCESS) {
+		fprintf(stderr, "err: %s: retc %x\n", test, cjob->retc);
+		return -1;
+	}
+	if (memcmp(src, dst, size) != 0) {
+		fprintf(stderr, "err: %s: data differs\n", test);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_sync(void)
+{
+	struct snap_job cjob;
+	struct memcopy_job mjob;
+	uint32_t size;
+	uint8_t *src, *dst;
+	int rc = 0;
+
+	src = snap_malloc(1 << 20);
+	dst = snap_malloc(1 << 20);
+	if (src == NULL || dst == NULL)
+		goto out;
+
+	for (size = 1; size <= (1 << 20) && rc == 0; size *= 4) {
+		fill(src, size, size);
+		memset(dst, 0, size);
+		prepare(&cjob, &mjob, src, dst, size);
+		rc = snap_sync_execute_job(card, MEMCOPY_ACTION_TYPE,
+					   action_irq, &cjob, timeout,
+					   timeout);
+		rc = check("sync", rc, &cjob, src, dst, size);
+	}
+ out:
+	__free(src);
+	__free(dst);
+	return (src && dst) ? rc : -1;
+}
+
+#define QUEUE_JOBS	64
+#define QUEUE_SIZE	4096
+
+static int test_queue(void)
+{
+	struct snap_queue *q;
+	struct snap_job cjob;
+	struct memcopy_job mjob;
+	uint8_t *src, *dst;
+	int i, rc = -1;
+
+	q = snap_queue_alloc(card, MEMCOPY_ACTION_TYPE, action_irq, 8,
+			     timeout);
+	if (q == NULL)
+		return -1;
+
+	src = snap_malloc(QUEUE_SIZE);
+	dst = snap_malloc(QUEUE_SIZE);
+	if (src == NULL || dst == NULL)
+		goto out;
+
+	for (i = 0, rc = 0; i < QUEUE_JOBS && rc == 0; i++) {
+		fill(src, QUEUE_SIZE, i);
+		memset(dst, 0, QUEUE_SIZE);
+		prepare(&cjob, &mjob, src, dst, QUEUE_SIZE);
+		rc = snap_queue_sync_execute_job(q, &cjob, timeout);
+		rc = check("queue", rc, &cjob, src, dst, QUEUE_SIZE);
+	}
+ out:
+	__free(src);
+	__free(dst);
+	snap_queue_free(q);
+	return rc;
+}
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int async_done = 0;
+static unsigned int async_bad = 0;
+
+static int async_finished(struct snap_queue *q, struct snap_job *cjob)
+{
+	(void)q;
+	pthread_mutex_lock(&async_lock);
+	if (cjob->retc != SNAP_RETC_SUCCESS)
+		async_bad++;
+	async_done++;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+	return 0;
+}
+
+static int test_async(void)
+{
+	static struct snap_job cjob[QUEUE_JOBS];
+	static struct memcopy_job mjob[QUEUE_JOBS];
+	struct snap_queue *q;
+	uint8_t *src, *dst;
+	int i, rc = -1;
+
+	q = snap_queue_alloc(card, MEMCOPY_ACTION_TYPE, action_irq, 8,
+			     timeout);
+	if (q == NULL)
+		return -1;
+
+	src = snap_malloc(QUEUE_JOBS * QUEUE_SIZE);
+	dst = snap_malloc(QUEUE_JOBS * QUEUE_SIZE);
+	if (src == NULL || dst == NULL)
+		goto out;
+
+	fill(src, QUEUE_JOBS * QUEUE_SIZE, 3);
+	memset(dst, 0, QUEUE_JOBS * QUEUE_SIZE);
+	async_done = async_bad = 0;
+	for (i = 0; i < QUEUE_JOBS; i++) {
+		prepare(&cjob[i], &mjob[i], src + i * QUEUE_SIZE,
+			dst + i * QUEUE_SIZE, QUEUE_SIZE);
+		rc = snap_async_execute_job(q, &cjob[i], async_finished);
+		if (rc != 0) {
+			fprintf(stderr, "err: async: submit rc %d\n", rc);
+			goto wait;
+		}
+	}
+ wait:
+	pthread_mutex_lock(&async_lock);
+	while (async_done < (unsigned int)i)
+		pthread_cond_wait(&async_cond, &async_lock);
+	pthread_mutex_unlock(&async_lock);
+
+	if (rc == 0 && async_bad != 0) {
+		fprintf(stderr, "err: async: %u jobs failed\n", async_bad);
+		rc = -1;
+	}
+	if (rc == 0 && memcmp(src, dst, QUEUE_JOBS * QUEUE_SIZE) != 0) {
+		fprintf(stderr, "err: async: data differs\n");
+		rc = -1;
+	}
+ out:
+	__free(src);
+	__free(dst);
+	snap_queue_free(q);
+	return rc;
+}
+
+#define SG_SIZE		100000
+
+static int test_sg(void)
+{
+	static const uint32_t frag[] = { 1, 4095, 7, 30000, 12345, 53552 };
+	struct snap_sg *sg_in, *sg_out;
+	struct snap_job cjob;
+	struct memcopy_job mjob;
+	uint8_t *src, *dst;
+	uint32_t offs, len;
+	unsigned int i;
+	int rc = -1;
+
+	src = malloc(SG_SIZE);
+	dst = malloc(SG_SIZE);
+	sg_in = snap_sg_alloc(4);
+	sg_out = snap_sg_alloc(2);
+	if (!src || !dst || !sg_in || !sg_out)
+		goto out;
+
+	/* Uneven pieces in, fewer and larger ones out */
+	for (i = 0, offs = 0; i < ARRAY_SIZE(frag); offs += frag[i++])
+		if (snap_sg_add(sg_in, src + offs, frag[i],
+				SNAP_ADDRTYPE_HOST_DRAM) != 0)
+			goto out;
+	for (offs = 0; offs < SG_SIZE; offs += len) {
+		len = (SG_SIZE - offs < 33333) ? SG_SIZE - offs : 33333;
+		if (snap_sg_add(sg_out, dst + offs, len,
+				SNAP_ADDRTYPE_HOST_DRAM) != 0)
+			goto out;
+	}
+
+	fill(src, SG_SIZE, 5);
+	memset(dst, 0, SG_SIZE);
+	memset(&mjob, 0, sizeof(mjob));
+	snap_sg_addr_set(&mjob.in, sg_in, SNAP_ADDRFLAG_SRC);
+	snap_sg_addr_set(&mjob.out, sg_out,
+			 SNAP_ADDRFLAG_DST | SNAP_ADDRFLAG_END);
+	snap_job_set(&cjob, &mjob, sizeof(mjob), NULL, 0);
+	rc = snap_sync_execute_job(card, MEMCOPY_ACTION_TYPE, action_irq,
+				   &cjob, timeout, timeout);
+	rc = check("sg", rc, &cjob, src, dst, SG_SIZE);
+ out:
+	snap_sg_free(sg_in);
+	snap_sg_free(sg_out);
+	free(src);
+	free(dst);
+	return rc;
+}
+
+#define CHAIN_SIZE	(16 << 20)
+#define CHAIN_CHUNK	(1 << 20)
+
+struct chain_test {
+	uint8_t *src, *dst;
+	uint64_t next;			/* Offset complete() expects next */
+	unsigned int shorts;		/* Pieces to report as partly done */
+	int bad;
+};
+
+static int chain_prepare(struct snap_job *cjob, uint64_t offs,
+			 uint32_t len, void *priv)
+{
+	struct chain_test *ct = priv;
+	struct memcopy_job *mjob =
+		(struct memcopy_job *)(unsigned long)cjob->win_addr;
+
+	snap_addr_set(&mjob->in, ct->src + offs, len,
+		      SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+	snap_addr_set(&mjob->out, ct->dst + offs, len,
+		      SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+		      SNAP_ADDRFLAG_END);
+	return 0;
+}
+
+static int64_t chain_complete(struct snap_job *cjob, uint64_t offs,
+			      uint32_t len, void *priv)
+{
+	struct chain_test *ct = priv;
+
+	(void)cjob;
+	if (offs != ct->next)
+		ct->bad++;
+
+	/* Pretend some pieces were done only half, the rest is resent */
+	if (ct->shorts && (offs / CHAIN_CHUNK) % 5 == 2) {
+		ct->shorts--;
+		ct->next = offs + len / 2;
+		return len / 2;
+	}
+	ct->next = offs + len;
+	return len;
+}
+
+static int test_chain(void)
+{
+	struct snap_queue *q;
+	struct snap_job cjob;
+	struct memcopy_job mjob;
+	struct chain_test ct;
+	struct snap_chain chain = {
+		.size = CHAIN_SIZE,
+		.chunk_size = CHAIN_CHUNK,
+		.depth = 4,
+		.prepare = chain_prepare,
+		.complete = chain_complete,
+		.priv = &ct,
+	};
+	int rc = -1;
+
+	q = snap_queue_alloc(card, MEMCOPY_ACTION_TYPE, action_irq, 4,
+			     timeout);
+	if (q == NULL)
+		return -1;
+
+	memset(&ct, 0, sizeof(ct));
+	ct.shorts = 3;
+	ct.src = snap_malloc(CHAIN_SIZE);
+	ct.dst = snap_malloc(CHAIN_SIZE);
+	if (ct.src == NULL || ct.dst == NULL)
+		goto out;
+
+	fill(ct.src, CHAIN_SIZE, 9);
+	memset(ct.dst, 0, CHAIN_SIZE);
+	memset(&mjob, 0, sizeof(mjob));
+	snap_job_set(&cjob, &mjob, sizeof(mjob), NULL, 0);
+	rc = snap_chain_execute_job(q, &cjob, &chain, timeout);
+	rc = check("chain", rc, &cjob, ct.src, ct.dst, CHAIN_SIZE);
+	if (rc == 0 && (ct.bad || ct.shorts || ct.next != CHAIN_SIZE)) {
+		fprintf(stderr, "err: chain: %d pieces out of order, "
+			"%u shorts left, ended at %llx\n", ct.bad, ct.shorts,
+			(long long)ct.next);
+		rc = -1;
+	}
+ out:
+	__free(ct.src);
+	__free(ct.dst);
+	snap_queue_free(q);
+	return rc;
+}
+
+#define STREAM_JOBS	100000
+#define STREAM_SLOTS	1024
+
+static int test_stream(void)
+{
+	static uint64_t src[STREAM_SLOTS], dst[STREAM_SLOTS];
+	struct snap_completion done[64];
+	struct snap_stream *s;
+	struct memcopy_job mjob;
+	unsigned long posted = 0, got = 0, bad = 0;
+	unsigned int k;
+	int i, n, rc;
+
+	s = snap_stream_alloc(card, MEMCOPY_ACTION_TYPE, action_irq, 256,
+			      timeout);
+	if (s == NULL)
+		return -1;
+
+	for (k = 0; k < STREAM_SLOTS; k++)
+		src[k] = k * 7 + 1;
+
+	while (got < STREAM_JOBS) {
+		/* Post as many as fit, a slot is reused after its result */
+		while (posted < STREAM_JOBS &&
+		       posted - got < STREAM_SLOTS) {
+			k = posted % STREAM_SLOTS;
+			dst[k] = 0;
+			snap_addr_set(&mjob.in, &src[k], sizeof(src[k]),
+				      SNAP_ADDRTYPE_HOST_DRAM,
+				      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+			snap_addr_set(&mjob.out, &dst[k], sizeof(dst[k]),
+				      SNAP_ADDRTYPE_HOST_DRAM,
+				      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+				      SNAP_ADDRFLAG_END);
+			if (snap_stream_post(s, &mjob, sizeof(mjob),
+					     posted) != 0)
+				break;
+			posted++;
+		}
+		n = snap_stream_poll(s, done, ARRAY_SIZE(done),
+				     timeout * 1000);
+		if (n <= 0) {
+			fprintf(stderr, "err: stream: poll rc %d after %lu "
+				"jobs\n", n, got);
+			bad++;
+			break;
+		}
+		for (i = 0; i < n; i++, got++) {
+			k = got % STREAM_SLOTS;
+			if (done[i].priv_data != got ||
+			    done[i].retc != SNAP_RETC_SUCCESS ||
+			    dst[k] != src[k])
+				bad++;
+		}
+	}
+	rc = snap_stream_free(s, timeout);
+	if (rc != 0 || bad != 0) {
+		fprintf(stderr, "err: stream: %lu of %lu jobs bad, rc %d\n",
+			bad, got, rc);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The first job times out, its late completion must neither be taken
+ * for the next job on the same action nor keep the next job waiting.
+ */
+static int test_timeout_one(const char *test, struct snap_queue *q,
+			    snap_action_type_t action_type)
+{
+	struct snap_job cjob;
+	struct memcopy_job mjob;
+	uint8_t *src, *dst;
+	int i, rc = -1;
+
+	src = snap_malloc(QUEUE_SIZE);
+	dst = snap_malloc(QUEUE_SIZE);
+	if (src == NULL || dst == NULL)
+		goto out;
+
+	for (i = 0; i < 3; i++) {
+		fill(src, QUEUE_SIZE, 0x40 + i);
+		memset(dst, 0, QUEUE_SIZE);
+		prepare(&cjob, &mjob, src, dst, QUEUE_SIZE);
+
+		if (q)
+			rc = snap_queue_sync_execute_job(q, &cjob,
+					i ? timeout : TEST_TIMEOUT);
+		else
+			rc = snap_sync_execute_job(card, action_type,
+					action_irq, &cjob, timeout,
+					i ? timeout : TEST_TIMEOUT);
+		if (i == 0) {
+			if (rc != SNAP_ETIMEDOUT) {
+				fprintf(stderr, "err: %s: rc %d, no timeout\n",
+					test, rc);
+				rc = -1;
+				break;
+			}
+			/* Keep the buffers, the late job still writes */
+			src = snap_malloc(QUEUE_SIZE);
+			dst = snap_malloc(QUEUE_SIZE);
+			if (src == NULL || dst == NULL)
+				goto out;
+			continue;
+		}
+		rc = check(test, rc, &cjob, src, dst, QUEUE_SIZE);
+		if (rc != 0)
+			break;
+	}
+ out:
+	__free(src);
+	__free(dst);
+	return (src && dst) ? rc : -1;
+}
+
+static int test_timeout(snap_action_type_t action_type)
+{
+	struct snap_queue *q;
+	int rc;
+
+	rc = test_timeout_one("timeout sync", NULL, action_type);
+	if (rc != 0)
+		return rc;
+
+	q = snap_queue_alloc(card, action_type, action_irq, 4, timeout);
+	if (q == NULL)
+		return -1;
+	rc = test_timeout_one("timeout queue", q, action_type);
+	snap_queue_free(q);
+	return rc;
+}
+
+#define CLIENT_JOBS	20000
+#define CLIENT_SLOTS	64
+
+static int test_client(void)
+{
+	struct snap_completion done[16];
+	struct snap_client *c;
+	struct memcopy_job mjob;
+	unsigned int posted = 0, got = 0, bad = 0, k;
+	uint8_t *data, *src, *dst;
+	size_t size;
+	int i, n, rc;
+
+	c = snap_client_open(NULL, CLIENT_SLOTS,
+			     CLIENT_SLOTS * 2 * QUEUE_SIZE);
+	if (c == NULL) {
+		perror("err: client: cannot connect to snapd");
+		return -1;
+	}
+	data = snap_client_data(c, &size);
+
+	while (got < CLIENT_JOBS) {
+		while (posted < CLIENT_JOBS && posted - got < CLIENT_SLOTS) {
+			src = data + (posted % CLIENT_SLOTS) * 2 * QUEUE_SIZE;
+			dst = src + QUEUE_SIZE;
+			memset(src, posted & 0xff, QUEUE_SIZE);
+			memset(dst, 0, QUEUE_SIZE);
+			snap_addr_set(&mjob.in, src, QUEUE_SIZE,
+				      SNAP_ADDRTYPE_HOST_DRAM,
+				      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+			snap_addr_set(&mjob.out, dst, QUEUE_SIZE,
+				      SNAP_ADDRTYPE_HOST_DRAM,
+				      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+				      SNAP_ADDRFLAG_END);
+			rc = snap_client_post(c, MEMCOPY_ACTION_TYPE, &mjob,
+					      sizeof(mjob), 0, posted);
+			if (rc == SNAP_EBUSY)
+				break;
+			if (rc != 0) {
+				fprintf(stderr, "err: client: post rc %d\n",
+					rc);
+				bad++;
+				goto out;
+			}
+			posted++;
+		}
+		n = snap_client_poll(c, done, ARRAY_SIZE(done),
+				     timeout * 1000);
+		if (n <= 0) {
+			fprintf(stderr, "err: client: poll rc %d after %u "
+				"jobs\n", n, got);
+			bad++;
+			goto out;
+		}
+		for (i = 0; i < n; i++, got++) {
+			k = got % CLIENT_SLOTS;
+			src = data + k * 2 * QUEUE_SIZE;
+			dst = src + QUEUE_SIZE;
+			if (done[i].priv_data != got ||
+			    done[i].retc != SNAP_RETC_SUCCESS ||
+			    memcmp(src, dst, QUEUE_SIZE) != 0)
+				bad++;
+		}
+	}
+ out:
+	snap_client_close(c);
+	if (bad) {
+		fprintf(stderr, "err: client: %u of %u jobs bad\n", bad, got);
+		return -1;
+	}
+	return 0;
+}
+
+/* The client test is last, all does not run it */
+static const char *tests[] = {
+	"sync", "queue", "async", "sg", "chain", "stream", "timeout",
+	"client",
+};
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v, --verbose] [-V, --version]\n"
+	       "  -C, --card <cardno>        can be (0...3)\n"
+	       "  -T, --test <name>          sync, queue, async, sg, chain,\n"
+	       "                             stream, timeout, client or all.\n"
+	       "                             all runs every test but client,\n"
+	       "                             which needs a running snapd.\n"
+	       "  -S, --slow-sw              timeout test on a slow software\n"
+	       "                             memcopy, for SNAP_CONFIG=CPU.\n"
+	       "  -t, --timeout              timeout in sec to wait for done."
+	       " (10 sec default)\n"
+	       "  -I, --irq                  use interrupts\n"
+	       "  -V, --version              provides version of software\n"
+	       "  -v, --verbose              provides extra (debug) "
+	       "information if any\n"
+	       "\n"
+	       "Example:\n"
+	       "  SNAP_CONFIG=CPU %s -T all -S\n"
+	       "\n",
+	       prog, prog);
+}
+
+static int run_test(const char *name, snap_action_type_t slow_type)
+{
+	int rc = -1;
+
+	printf("%-8s ... ", name);
+	fflush(stdout);
+
+	if (strcmp(name, "sync") == 0)
+		rc = test_sync();
+	else if (strcmp(name, "queue") == 0)
+		rc = test_queue();
+	else if (strcmp(name, "async") == 0)
+		rc = test_async();
+	else if (strcmp(name, "sg") == 0)
+		rc = test_sg();
+	else if (strcmp(name, "chain") == 0)
+		rc = test_chain();
+	else if (strcmp(name, "stream") == 0)
+		rc = test_stream();
+	else if (strcmp(name, "timeout") == 0)
+		rc = test_timeout(slow_type);
+	else if (strcmp(name, "client") == 0)
+		rc = test_client();
+
+	printf("%s\n", rc ? "failed" : "ok");
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, rc = 0;
+	int card_no = 0;
+	char device[128];
+	const char *test = "all";
+	snap_action_type_t slow_type = MEMCOPY_ACTION_TYPE;
+	unsigned int i;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "card",	 required_argument, NULL, 'C' },
+			{ "test",	 required_argument, NULL, 'T' },
+			{ "slow-sw",	 no_argument,	    NULL, 'S' },
+			{ "timeout",	 required_argument, NULL, 't' },
+			{ "irq",	 no_argument,	    NULL, 'I' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "C:T:St:IVvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'C':
+			card_no = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'T':
+			test = optarg;
+			break;
+		case 'S':
+			slow_type = TEST_SLOW_ACTION_TYPE;
+			break;
+		case 't':
+			timeout = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'I':
+			action_irq = SNAP_ACTION_DONE_IRQ | SNAP_ATTACH_IRQ;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (strcmp(test, "all") != 0) {
+		for (i = 0; i < ARRAY_SIZE(tests); i++)
+			if (strcmp(test, tests[i]) == 0)
+				break;
+		if (i == ARRAY_SIZE(tests)) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* The client talks to snapd, which owns the card */
+	if (strcmp(test, "client") == 0)
+		return run_test(test, slow_type) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (slow_type == TEST_SLOW_ACTION_TYPE)
+		snap_action_register(&slow_action);
+
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
+	card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+				   SNAP_DEVICE_ID_SNAP);
+	if (card == NULL) {
+		fprintf(stderr, "err: failed to open card %u: %s\n",
+			card_no, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(tests) - 1; i++) {
+		if (strcmp(test, "all") != 0 && strcmp(test, tests[i]) != 0)
+			continue;
+		if (run_test(tests[i], slow_type) != 0)
+			rc = -1;
+	}
+
+	snap_card_free(card);
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
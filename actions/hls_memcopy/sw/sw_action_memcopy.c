@@ -80,6 +80,18 @@ static int action_main(struct snap_sim_action *action,
 			  "out %d bytes!\n", js->in.size, js->out.size);
 		goto out_err;
 	}
+
+	/* Scatter-gather lists are supported for host memory only */
+	if ((js->in.flags | js->out.flags) & SNAP_ADDRFLAG_EXT) {
+		if ((js->in.type != SNAP_ADDRTYPE_HOST_DRAM) ||
+		    (js->out.type != SNAP_ADDRTYPE_HOST_DRAM))
+			goto out_err;
+
+		act_trace("   copy scatter-gather %ld bytes\n", len);
+		if (snap_sg_copy(&js->out, &js->in) != len)
+			goto out_err;
+		goto out_ok;
+	}
 	/* checking parameters ... */
 	if (js->in.type != SNAP_ADDRTYPE_HOST_DRAM) {
 		snprintf(ifname, sizeof(ifname), MEMORY_FILE,
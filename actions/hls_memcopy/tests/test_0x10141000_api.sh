@@ -0,0 +1,161 @@
+#!/bin/bash
+
+#
+# Copyright 2018 International Business Machines
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+#
+# Regression tests of the libsnap job interfaces without a card. All
+# tests of snap_memcopy_test run with SNAP_CONFIG=CPU and against the
+# libcxl mock in software/mock, with polling and with interrupts. The
+# snapd client test runs against a snapd on the mock, snapd has no
+# software memcopy built in.
+#
+# Build first: make -C software && make -C software mock &&
+#              make -C actions/hls_memcopy/sw
+#
+
+verbose=0
+snap_card=0
+mock=1
+
+# Get path of this script
+THIS_DIR=$(dirname $(readlink -f "$BASH_SOURCE"))
+ACTION_ROOT=$(dirname ${THIS_DIR})
+SNAP_ROOT=$(dirname $(dirname ${ACTION_ROOT}))
+
+echo "Starting :    $0"
+echo "SNAP_ROOT :   ${SNAP_ROOT}"
+echo "ACTION_ROOT : ${ACTION_ROOT}"
+
+function usage() {
+    echo "Usage:"
+    echo "  test_<action_type>_api.sh"
+    echo "    [-C <card>] card to be used for the test"
+    echo "    [-t <trace_level>]"
+    echo "    [-c] SNAP_CONFIG=CPU only, skip the libcxl mock"
+    echo
+}
+
+while getopts ":C:t:ch" opt; do
+    case $opt in
+	C)
+	snap_card=$OPTARG;
+	;;
+	t)
+	export SNAP_TRACE=$OPTARG;
+	;;
+	c)
+	mock=0;
+	;;
+	h)
+	usage;
+	exit 0;
+	;;
+	\?)
+	echo "Invalid option: -$OPTARG" >&2
+	;;
+    esac
+done
+
+export PATH=$PATH:${SNAP_ROOT}/software/tools:${ACTION_ROOT}/sw
+
+# libcxl of the mock, it is loaded for SNAP_CONFIG=CPU too
+if [ ! -f ${SNAP_ROOT}/software/mock/libcxl.so ]; then
+    echo "libcxl mock not built, run make -C ${SNAP_ROOT}/software mock"
+    exit 1
+fi
+export LD_LIBRARY_PATH=${SNAP_ROOT}/software/mock:${SNAP_ROOT}/software/lib:$LD_LIBRARY_PATH
+export SNAP_MOCK_ACTIONS=0x10141000
+export SNAPD_SOCKET=/tmp/snapd_test_$$.sock
+
+rm -f snap_memcopy_test.log
+touch snap_memcopy_test.log
+
+function test_api {
+    local config=$1
+    shift
+
+    echo -n "Doing snap_memcopy_test $config $* ... "
+    cmd="SNAP_CONFIG=$config snap_memcopy_test -C${snap_card} $* >> \
+		snap_memcopy_test.log 2>&1"
+    eval ${cmd}
+    if [ $? -ne 0 ]; then
+	grep -e "err:" -e "\.\.\." snap_memcopy_test.log
+	echo "cmd: ${cmd}"
+	echo "failed"
+	exit 1
+    fi
+    echo "ok"
+}
+
+#### SNAPD CLIENT #####################################################
+
+function test_client {
+    local config=$1
+    local pid cpid rc=0
+
+    echo -n "Doing snap_memcopy_test $config -T client with snapd ... "
+    SNAP_CONFIG=$config snapd -C${snap_card} -w2 >> \
+	snap_memcopy_test.log 2>&1 &
+    pid=$!
+    for (( i=0; i<50; i++ )); do
+	[ -S ${SNAPD_SOCKET} ] && break
+	sleep 0.1
+    done
+
+    # Two clients at a time share the workers of snapd
+    snap_memcopy_test -T client >> snap_memcopy_test.log 2>&1 &
+    cpid=$!
+    snap_memcopy_test -T client >> snap_memcopy_test.log 2>&1 || rc=1
+    wait ${cpid} || rc=1
+
+    kill ${pid}
+    wait ${pid}
+    rm -f ${SNAPD_SOCKET}
+    if [ $rc -ne 0 ]; then
+	grep "err:" snap_memcopy_test.log
+	echo "failed"
+	exit 1
+    fi
+    echo "ok"
+}
+
+#### SNAP_CONFIG=CPU ##################################################
+
+# -S runs the timeout test on a memcopy slower than its timeout
+test_api CPU -T all -S
+
+#### LIBCXL MOCK ######################################################
+
+if [ $mock -eq 1 ]; then
+    # Scatter-gather lists are copied by the software action only
+    for irq in "" "-I"; do
+	for t in sync queue async chain stream; do
+	    test_api FPGA -T $t $irq
+	done
+	SNAP_MOCK_JOB_US=1500000 test_api FPGA -T timeout $irq
+    done
+
+    # Fewer slots than contexts, the jobs wait for the action
+    SNAP_MOCK_SLOTS=1 test_api FPGA -T queue
+    SNAP_MOCK_JOB_US=200 test_api FPGA -T async -I
+
+    test_client FPGA
+fi
+
+rm -f snap_memcopy_test.log
+echo "Test OK"
+exit 0
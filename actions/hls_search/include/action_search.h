@@ -47,7 +47,7 @@ typedef struct search_job {
         uint16_t step;
         uint16_t method;
         uint32_t nb_of_occurrences;
-        uint64_t next_input_addr;
+        uint64_t next_input_addr;       /* != 0: stopped, resume from here */
 } search_job_t;
 
 /* search method */
@@ -25,6 +25,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <endian.h>
 #include <asm/byteorder.h>
 #include <sys/mman.h>
@@ -226,6 +227,53 @@ static int run_one_step(struct snap_queue *queue,
 	return rc;
 }
 
+/*
+ * Ask the running search to stop at its next checkpoint after delay_ms,
+ * see snap_job_cancel(). It returns with SNAP_RETC_STOPPED and gets
+ * passed in again to go on where it stopped.
+ */
+struct search_stopper {
+	struct snap_card *card;
+	struct snap_job *cjob;
+	unsigned int delay_ms;
+	int done;
+};
+
+static void *search_stopper(void *arg)
+{
+	struct search_stopper *st = (struct search_stopper *)arg;
+
+	usleep(st->delay_ms * 1000);
+	/* The job might not have been started yet */
+	while (!__atomic_load_n(&st->done, __ATOMIC_ACQUIRE) &&
+	       (snap_job_cancel(st->card, st->cjob,
+				SNAP_CANCEL_CHECKPOINT) == SNAP_ENOENT))
+		usleep(100);
+	return NULL;
+}
+
+static int run_search_step(struct snap_card *card,
+			   struct snap_queue *queue,
+			   struct snap_job *cjob,
+			   unsigned long timeout,
+			   unsigned int checkpoint_ms)
+{
+	int rc;
+	pthread_t thread;
+	struct search_stopper st = {
+		.card = card, .cjob = cjob, .delay_ms = checkpoint_ms,
+	};
+
+	if ((checkpoint_ms == 0) ||
+	    (pthread_create(&thread, NULL, search_stopper, &st) != 0))
+		return run_one_step(queue, cjob, timeout, 3);
+
+	rc = run_one_step(queue, cjob, timeout, 3);
+	__atomic_store_n(&st.done, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	return rc;
+}
+
 static void snap_print_search_results(struct snap_job *cjob, unsigned int run)
 {
 	unsigned int i;
@@ -288,7 +336,9 @@ static void usage(const char *prog)
 	       "  -p, --pattern <str>    Pattern to search for\n"
 	       "  -E, --expected <num>   Expected # of patterns to find\n"
 	       "  -t, --timeout <num>    timeout in sec (default 10 sec)\n"
-	       "  -N, --No irq           Disable Interrupts (polling)"
+	       "  -N, --No irq           Disable Interrupts (polling)\n"
+	       "  -k, --checkpoint <ms>  Stop the search every <ms> msec and resume it\n"
+	       "                         (software action only)"
                "\n"
                "NOTES : \n"
                " - p is the pattern to look for\n"
@@ -355,14 +405,13 @@ int main(int argc, char *argv[])
 	struct search_job sjob_in;
 	struct search_job sjob_out;
 	ssize_t dsize;
-	uint8_t *pbuff;		/* pattern buffer */
-	uint8_t *dbuff;		/* data buffer */
-	uint64_t *offs;		/* offset buffer */
-	uint8_t *input_addr;
-	uint32_t input_size;
+	uint8_t *pbuff = NULL;	/* pattern buffer */
+	uint8_t *dbuff = NULL;	/* data buffer */
+	uint64_t *offs = NULL;	/* offset buffer */
 	unsigned int attach_timeout = 60;
 	unsigned int timeout = 10;
 	unsigned int items = 42;
+	unsigned int checkpoint_ms = 0;
 	unsigned int total_found = 0;
 	struct timeval etime, stime;
 	long int expected_patterns = -1;
@@ -387,11 +436,12 @@ int main(int argc, char *argv[])
 			{ "verbose",	 no_argument,	    NULL, 'v' },
 			{ "help",	 no_argument,	    NULL, 'h' },
 			{ "noirq",	 no_argument,	    NULL, 'N' },
+			{ "checkpoint",	 required_argument, NULL, 'k' },
 			{ 0,		 no_argument,	    NULL, 0   },
 		};
 
 		ch = getopt_long(argc, argv,
-				 "C:E:m:i:p:I:t:sVvhN",
+				 "C:E:m:i:p:I:t:k:sVvhN",
 				 long_options, &option_index);
 		if (ch == -1)	/* all params processed ? */
 			break;
@@ -435,6 +485,9 @@ int main(int argc, char *argv[])
 		case 'N':	/* irq */
 			action_irq = 0;
 			break;
+		case 'k':
+			checkpoint_ms = strtol(optarg, (char **)NULL, 0);
+			break;
 		default:
 			usage(argv[0]);
 			exit(EXIT_FAILURE);
@@ -455,49 +508,46 @@ int main(int argc, char *argv[])
 	if (dsize < 0)
 		goto out_error;
 
-	dbuff = snap_malloc(dsize);
-	if (dbuff == NULL)
+	/*
+	 * Apply for exclusive action access for action type 0xC0FE.
+	 * Once granted, MMIO to that action will work.
+	 */
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
+	card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+				   SNAP_DEVICE_ID_SNAP);
+	if (card == NULL) {
+		fprintf(stderr, "err: failed to open card %u: %s\n",
+			card_no, strerror(errno));
+                fprintf(stderr, "Default mode is FPGA mode.\n");
+                fprintf(stderr, "Did you want to run CPU mode ? => add SNAP_CONFIG=CPU before your command.\n");
+                fprintf(stderr, "Otherwise make sure you ran snap_find_card and snap_maint for your selected card.\n");       
 		goto out_error;
+	}
+
+	dbuff = snap_buf_alloc(card, dsize, SNAP_BUF_HUGE);
+	if (dbuff == NULL)
+		goto out_error2;
 
 	psize = strlen(pattern_str);
 	/* FIXME pattern is limited to 64 Bytes by hardware in this preliminary release */
 	if (psize > 64) {
 		printf("Pattern is limited to 64 bytes\n");
-		goto out_error0;
+		goto out_error2;
 	}
-	pbuff = snap_malloc(psize);
+	pbuff = snap_buf_alloc(card, psize, 0);
 	if (pbuff == NULL)
-		goto out_error0;
+		goto out_error2;
 	memcpy(pbuff, pattern_str, psize);
 
 	rc = file_read(fname, dbuff, dsize);
 	if (rc < 0)
-		goto out_errorX;
+		goto out_error2;
 
-	offs = snap_malloc(items * sizeof(*offs));
+	offs = snap_buf_alloc(card, items * sizeof(*offs), 0);
 	if (offs == NULL)
-		goto out_errorX;
+		goto out_error2;
 	memset(offs, 0xAB, items * sizeof(*offs));
 
-	input_addr = dbuff;
-	input_size = dsize;
-
-	/*
-	 * Apply for exclusive action access for action type 0xC0FE.
-	 * Once granted, MMIO to that action will work.
-	 */
-	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
-	card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
-				   SNAP_DEVICE_ID_SNAP);
-	if (card == NULL) {
-		fprintf(stderr, "err: failed to open card %u: %s\n",
-			card_no, strerror(errno));
-                fprintf(stderr, "Default mode is FPGA mode.\n");
-                fprintf(stderr, "Did you want to run CPU mode ? => add SNAP_CONFIG=CPU before your command.\n");
-                fprintf(stderr, "Otherwise make sure you ran snap_find_card and snap_maint for your selected card.\n");       
-		goto out_error1;
-	}
-
 	queue = snap_queue_alloc(card, SEARCH_ACTION_TYPE, action_irq, 32,
 				 attach_timeout);
 	if (queue == NULL) {
@@ -580,17 +630,18 @@ int main(int argc, char *argv[])
                         printf(" >>> Default: Naive method (%d) \n", method);
                 }
 		step = 3;
+		snap_prepare_search(&cjob, &sjob_in, &sjob_out,
+				    dbuff, dsize,
+				    offs, items,
+				    pbuff, psize,
+				    method, step);
 
         	run = 0;
         	do {
-            		snap_prepare_search(&cjob, &sjob_in, &sjob_out,
-					    dbuff, dsize,
-					    offs, items,
-					    pbuff, psize,
-					    method, step);
         		printf("Data size = %d - Pattern size = %d \n", (int)dsize, (int)psize);
 
-            		rc |= run_one_step(queue, &cjob, timeout, step);
+            		rc |= run_search_step(card, queue, &cjob, timeout,
+					      checkpoint_ms);
             		if (rc != 0) {
                 		printf("Error out of Step3.\n");
                 		goto out_error3;
@@ -598,14 +649,14 @@ int main(int argc, char *argv[])
 
             		snap_print_search_results(&cjob, run);
 
-            		if (cjob.retc != SNAP_RETC_SUCCESS)  {
+            		if ((cjob.retc != SNAP_RETC_SUCCESS) &&
+			    (cjob.retc != SNAP_RETC_STOPPED)) {
                 		fprintf(stderr, "err: job retc %x!\n", cjob.retc);
                 		goto out_error3;
             		}
 
         		printf("nb of occurrences = %d \n",
 			       (int)sjob_out.nb_of_occurrences);
-            		total_found += sjob_out.nb_of_occurrences;
 
 			/*
            		printf("....................................................\n");
@@ -619,24 +670,17 @@ int main(int argc, char *argv[])
             		snap_print_search_results(&cjob, run);
 			*/
 
-            		/* trigger repeat if search was not complete */
+            		/*
+			 * Trigger repeat if search was not complete, it goes
+			 * on from next_input_addr and adds to the count
+			 */
             		sjob_in.nb_of_occurrences = sjob_out.nb_of_occurrences;
                     	sjob_in.next_input_addr = sjob_out.next_input_addr;
-
-            		if (sjob_out.next_input_addr != 0x0) {
-                		input_size -= (sjob_out.next_input_addr -
-                           		(unsigned long)input_addr);
-                		input_addr = (uint8_t *)(unsigned long)
-                    		sjob_out.next_input_addr;
-
-                		/* Fixup input address and size for next search */
-                		sjob_in.src_text1.addr = (unsigned long)input_addr;
-                		sjob_in.src_text1.size = input_size;
-            		}
             		run++;
 
 
         	} while (sjob_out.next_input_addr != 0x0);
+		total_found += sjob_out.nb_of_occurrences;
 	}
 
 	gettimeofday(&etime, NULL);
@@ -658,24 +702,21 @@ int main(int argc, char *argv[])
 	fprintf(stdout, "Searching took %lld usec\n",
 		(long long)timediff_usec(&etime, &stime));
 
-	free(dbuff);
-	free(pbuff);
-	free(offs);
-
 	snap_queue_free(queue);
 	snap_card_free(card);
+
+	snap_buf_free(dbuff);
+	snap_buf_free(pbuff);
+	snap_buf_free(offs);
 	exit(exit_code);
 
  out_error3:
 	snap_queue_free(queue);
  out_error2:
 	snap_card_free(card);
- out_error1:
-	free(offs);
- out_errorX:
-	free(pbuff);
- out_error0:
-	free(dbuff);
+	snap_buf_free(offs);
+	snap_buf_free(pbuff);
+	snap_buf_free(dbuff);
  out_error:
 	exit(EXIT_FAILURE);
 }
@@ -148,6 +148,117 @@ unsigned int run_sw_search(unsigned int Method,
         return (unsigned int) count;
 }
 
+static int count_matches(unsigned int Method,
+			 char *Pattern, unsigned int PatternSize,
+			 char *Text, unsigned int TextSize)
+{
+	if (Method == 2)
+		return KMP_search(Pattern, PatternSize, Text, TextSize);
+	return Naive_search(Pattern, PatternSize, Text, TextSize);
+}
+
+/*
+ * Search a scatter-gather list fragment by fragment. Matches crossing
+ * fragment borders are searched in a window of the last PatternSize-1
+ * bytes before the border plus the start of the next fragment. They
+ * are counted at the last border they cross, that is the only one
+ * where they fit into the window.
+ */
+static unsigned int run_sw_search_sg(unsigned int Method,
+				     char *Pattern, unsigned int PatternSize,
+				     const struct snap_addr *text)
+{
+	struct snap_sg_iter it;
+	const struct snap_addr *e;
+	char carry[64], window[2 * 64];
+	unsigned int clen = 0, keep, wlen, n, i, frags = 0;
+	unsigned int count = 0;
+	struct timeval etime, stime;
+
+	if ((PatternSize == 0) || (PatternSize > sizeof(carry)))
+		return 0;
+	keep = PatternSize - 1;
+
+	gettimeofday(&stime, NULL);
+	snap_sg_iter_init(&it, text);
+	while ((e = snap_sg_next(&it)) != NULL) {
+		char *data = (char *)(unsigned long)e->addr;
+
+		n = e->size;
+		count += count_matches(Method, Pattern, PatternSize, data, n);
+
+		if (clen) {
+			wlen = MIN(n, keep);
+			memcpy(window, carry, clen);
+			memcpy(window + clen, data, wlen);
+			wlen += clen;
+			for (i = 0; i < clen; i++)
+				if ((i + PatternSize > clen) &&
+				    (i + PatternSize <= wlen) &&
+				    (memcmp(window + i, Pattern,
+					    PatternSize) == 0))
+					count++;
+		}
+
+		/* Keep the last PatternSize-1 bytes seen */
+		if (n >= keep) {
+			memcpy(carry, data + n - keep, keep);
+			clen = keep;
+		} else {
+			i = MIN(clen, keep - n);
+			memmove(carry, carry + clen - i, i);
+			memcpy(carry + i, data, n);
+			clen = i + n;
+		}
+		frags++;
+	}
+	gettimeofday(&etime, NULL);
+
+	fprintf(stdout, "SW run step took %lld usec\n",
+		(long long)timediff_usec(&etime, &stime));
+	printf("pattern size %d - %d fragments - rc = %d \n",
+	       PatternSize, frags, count);
+	return count;
+}
+
+#define SEARCH_CHECKPOINT_BYTES	(1024u * 1024)
+
+/*
+ * Search contiguous text piece by piece, the host can ask the job to
+ * stop between two pieces, see snap_sim_action_stopping(). A match is
+ * counted in the piece it starts in, the search window reaches
+ * PatternSize-1 bytes into the next one.
+ *
+ * @return	offset the search got to, TextSize if it is complete
+ */
+static unsigned int run_sw_search_ckpt(struct snap_sim_action *action,
+				       unsigned int Method,
+				       char *Pattern, unsigned int PatternSize,
+				       char *Text, unsigned int TextSize,
+				       unsigned int *count)
+{
+	unsigned int pos, len, wlen;
+	struct timeval etime, stime;
+
+	*count = 0;
+	gettimeofday(&stime, NULL);
+	for (pos = 0; pos < TextSize; pos += len) {
+		if ((pos != 0) && snap_sim_action_stopping(action))
+			break;
+		len = MIN(TextSize - pos, SEARCH_CHECKPOINT_BYTES);
+		wlen = MIN(TextSize - pos, len + PatternSize - 1);
+		*count += count_matches(Method, Pattern, PatternSize,
+					Text + pos, wlen);
+	}
+	gettimeofday(&etime, NULL);
+
+	fprintf(stdout, "SW run step took %lld usec\n",
+		(long long)timediff_usec(&etime, &stime));
+	printf("pattern size %d - text size %d/%d - rc = %d \n",
+	       PatternSize, pos, TextSize, *count);
+	return pos;
+}
+
 static void __trace_addr(const char *name, struct snap_addr *a)
 {
 	act_trace("  %-12s: %012llx %08x %04x %04x\n",
@@ -159,7 +270,7 @@ static int action_main(struct snap_sim_action *action,
 {
 	struct search_job *js = (struct search_job *)job;
 	char *needle, *haystack;
-	unsigned int needle_len, haystack_len, method;
+	unsigned int needle_len, haystack_len, method, pos, count;
 
 	act_trace("%s(%p, %p, %d) SEARCH\n", __func__, action, job, job_len);
 	__trace_addr("src_text1",   &js->src_text1);
@@ -168,8 +279,17 @@ static int action_main(struct snap_sim_action *action,
 	__trace_addr("src_result",  &js->src_result);
 	__trace_addr("ddr_result",  &js->ddr_result);
 
-	if (js->src_result.addr != 0 && js->src_result.type == SNAP_ADDRTYPE_HOST_DRAM)
-		memset((uint8_t *)js->src_result.addr, 0, js->src_result.size);
+	/* A resumed job keeps the results of the earlier runs */
+	if (js->src_result.addr != 0 &&
+	    js->src_result.type == SNAP_ADDRTYPE_HOST_DRAM &&
+	    js->next_input_addr == 0) {
+		struct snap_sg_iter it;
+		const struct snap_addr *e;
+
+		snap_sg_iter_init(&it, &js->src_result);
+		while ((e = snap_sg_next(&it)) != NULL)
+			memset((uint8_t *)(unsigned long)e->addr, 0, e->size);
+	}
 
 	haystack = (char *)(unsigned long)js->src_text1.addr;
 	haystack_len = js->src_text1.size;
@@ -178,12 +298,39 @@ static int action_main(struct snap_sim_action *action,
 	needle_len = js->src_pattern.size;
 
 	method =  js->method;
+	action->job.retc = SNAP_RETC_SUCCESS;
 
-        if (js->step == 3) 
+	/* Scatter-gather text, the pattern is always contiguous */
+	if ((js->step == 3) && (js->src_text1.flags & SNAP_ADDRFLAG_EXT))
+		js->nb_of_occurrences = run_sw_search_sg(method, needle,
+							 needle_len,
+							 &js->src_text1);
+	else if ((js->step == 3) && (needle_len == 0))
 		js->nb_of_occurrences = run_sw_search(method, (char *)needle, needle_len,
                                         (char *)haystack, haystack_len);
+	else if (js->step == 3) {
+		/*
+		 * A job which got stopped returns with next_input_addr set.
+		 * Passing it in again unchanged goes on from there and
+		 * adds to nb_of_occurrences, 0 starts a new search.
+		 */
+		if ((js->next_input_addr >= js->src_text1.addr) &&
+		    (js->next_input_addr < js->src_text1.addr + haystack_len)) {
+			pos = js->next_input_addr - js->src_text1.addr;
+			haystack += pos;
+			haystack_len -= pos;
+		} else
+			js->nb_of_occurrences = 0;
 
-	action->job.retc = SNAP_RETC_SUCCESS;
+		pos = run_sw_search_ckpt(action, method, needle, needle_len,
+					 haystack, haystack_len, &count);
+		js->nb_of_occurrences += count;
+		js->next_input_addr = 0;
+		if (pos < haystack_len) {
+			js->next_input_addr = (unsigned long)(haystack + pos);
+			action->job.retc = SNAP_RETC_STOPPED;
+		}
+	}
 
 	act_trace("%s SEARCH DONE retc=%x\n", __func__, action->job.retc);
 	return 0;
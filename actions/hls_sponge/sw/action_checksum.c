@@ -556,8 +556,6 @@ struct thread_data {
         int thread_rc;
 };
 
-static struct thread_data *d;
-
 static void *sha3_thread(void *data)
 {
         struct thread_data *d = (struct thread_data *)data;
@@ -589,6 +587,7 @@ static uint64_t sha3_main(uint32_t test_choice, uint32_t nb_elmts, uint32_t freq
        int rc;
         uint32_t run_number;
         uint64_t checksum = 0;
+        struct thread_data *d;
 
         if (_threads == 0) {
                 fprintf(stderr, "err: Min threads must be 1\n");
@@ -684,7 +683,10 @@ static int action_main(struct snap_sim_action *action, void *job,
                 js->chk_out = sha3_main(js->test_choice, js->nb_elmts, js->freq, threads);
                 break;
 	}
-	case CHECKSUM_CRC32:
+	case CHECKSUM_CRC32: {
+		struct snap_sg_iter it;
+		const struct snap_addr *e;
+
 		/* checking parameters ... */
 		if (js->in.type != SNAP_ADDRTYPE_HOST_DRAM)
 			return 0;
@@ -693,10 +695,19 @@ static int action_main(struct snap_sim_action *action, void *job,
 		if (src == NULL)
 			return 0;
 
-		/* calculate the results ... */
-		js->chk_out = do_crc(js->chk_in, src, js->in.size);
+		/* calculate the results, fragment by fragment ... */
+		js->chk_out = js->chk_in;
+		snap_sg_iter_init(&it, &js->in);
+		while ((e = snap_sg_next(&it)) != NULL) {
+			if (e->type != SNAP_ADDRTYPE_HOST_DRAM)
+				return 0;
+			js->chk_out = do_crc(js->chk_out,
+					     (void *)(unsigned long)e->addr,
+					     e->size);
+		}
 		js->chk_out &= 0xffffffff; /* 32-bit only */
 		break;
+	}
 
 	default:
 		return 0;
@@ -51,6 +51,7 @@ static void usage(const char *prog)
 	       "  -A, --type-in <CARD_RAM, HOST_RAM, ...>.\n"
 	       "  -a, --addr-in <addr>      address e.g. in CARD_RAM.\n"
 	       "  -s, --size <size>         size of data.\n"
+	       "  -k, --chunk <size>        bytes per job, default 1 GiB.\n"
 	       "  -c, --choice <SPEED,SHA3,SHAKE,SHA3_SHAKE>  sponge specific input.\n"
 	       "  -n, --number of elements <nb_elmts> sponge specific input.\n"
 	       "  -f, --frequency <freq>        sponge specific input.(up to 65536)\n"
@@ -110,6 +111,38 @@ static void snap_prepare_checksum(struct snap_job *cjob,
 		     mjob_out, sizeof(*mjob_out));
 }
 
+/*
+ * CRC32 and ADLER32 run over the data in jobs of up to chunk bytes,
+ * the checksum of one job is the start value of the next.
+ */
+struct checksum_chain {
+	uint64_t addr_in;
+	uint64_t chk;
+};
+
+static int checksum_chain_prepare(struct snap_job *cjob, uint64_t offs,
+				  uint32_t len, void *priv)
+{
+	struct checksum_chain *cc = priv;
+	struct checksum_job *mjob_in = (void *)(unsigned long)cjob->win_addr;
+
+	mjob_in->in.addr = cc->addr_in + offs;
+	mjob_in->in.size = len;
+	mjob_in->chk_in = cc->chk;
+	return 0;
+}
+
+static int64_t checksum_chain_complete(struct snap_job *cjob,
+				       uint64_t offs __attribute__((unused)),
+				       uint32_t len, void *priv)
+{
+	struct checksum_chain *cc = priv;
+	struct checksum_job *mjob_out = (void *)(unsigned long)cjob->wout_addr;
+
+	cc->chk = mjob_out->chk_out;
+	return len;
+}
+
 static inline
 ssize_t file_size(const char *fname)
 {
@@ -180,6 +213,7 @@ static int do_checksum(int card_no, unsigned long timeout,
 		       unsigned int threads,
 		       unsigned long addr_in,
 		       unsigned char type_in,  unsigned long size,
+		       uint32_t chunk,
 		       uint64_t checksum_start,
 		       checksum_mode_t mode,
 		       test_choice_t test_choice,
@@ -194,9 +228,11 @@ static int do_checksum(int card_no, unsigned long timeout,
 	int rc;
 	char device[128];
 	struct snap_card *card = NULL;
-	struct snap_action *action = NULL;
+	struct snap_queue *queue = NULL;
 	struct snap_job cjob;
 	struct checksum_job mjob_in, mjob_out;
+	struct checksum_chain cc;
+	struct snap_chain chain;
 	struct timeval etime, stime;
         uint64_t nb_keccak_calls, nb_of_runs = 0;
         int j;
@@ -205,6 +241,7 @@ static int do_checksum(int card_no, unsigned long timeout,
 		"  type_in:  %x\n"
 		"  addr_in:  %016llx\n"
 		"  size:     %08lx\n"
+		"  chunk:    %08x\n"
 		"  checksum_start: %016llx\n"
 		"  mode:     %08x %s\n"
 		"  test_choice:%02d %s\n"
@@ -212,7 +249,7 @@ static int do_checksum(int card_no, unsigned long timeout,
 		"  freq:    %08d\n"
 		"  job_size: %ld bytes\n",
 		type_in, (long long)addr_in,
-		size, (long long)checksum_start, mode,
+		size, chunk, (long long)checksum_start, mode,
 		checksum_mode_str[mode % CHECKSUM_MODE_MAX], test_choice,
 		test_choice_str[test_choice % CHECKSUM_TYPE_MAX],
 		nb_elmts, freq, sizeof(struct checksum_job));
@@ -229,20 +266,32 @@ static int do_checksum(int card_no, unsigned long timeout,
 		goto out_error;
 	}
 
-	action = snap_attach_action(card, CHECKSUM_ACTION_TYPE, action_irq, 60);
-	if (action == NULL) {
-		fprintf(stderr, "err (%d): Card: %d failed to attach action 0x%x: %s\n",
+	queue = snap_queue_alloc(card, CHECKSUM_ACTION_TYPE, action_irq, 1, 60);
+	if (queue == NULL) {
+		fprintf(stderr, "err (%d): Card: %d failed to get queue for action 0x%x: %s\n",
 			errno, card_no, CHECKSUM_ACTION_TYPE, strerror(errno));
 		goto out_error1;
 	}
 
 	snap_prepare_checksum(&cjob, &mjob_in, &mjob_out,
-			     (void *)addr_in, size, type_in,
+			     (void *)addr_in, 0, type_in,
 			      mode, checksum_start, test_choice, nb_elmts, freq,
 			      threads);
 
 	gettimeofday(&stime, NULL);
-	rc = snap_action_sync_execute_job(action, &cjob, timeout);
+	if (mode == CHECKSUM_SPONGE)
+		rc = snap_queue_sync_execute_job(queue, &cjob, timeout);
+	else {
+		cc.addr_in = addr_in;
+		cc.chk = checksum_start;
+		memset(&chain, 0, sizeof(chain));
+		chain.size = size;
+		chain.chunk_size = chunk;
+		chain.prepare = checksum_chain_prepare;
+		chain.complete = checksum_chain_complete;
+		chain.priv = &cc;
+		rc = snap_chain_execute_job(queue, &cjob, &chain, timeout);
+	}
 	gettimeofday(&etime, NULL);
 	if (rc != 0) {
 		fprintf(stderr, "err: job execution %d: %s!\n", rc,
@@ -276,7 +325,7 @@ static int do_checksum(int card_no, unsigned long timeout,
                  (double)(timediff_usec(&etime, &stime)));
         }
 
-	snap_detach_action(action);
+	snap_queue_free(queue);
 	snap_card_free(card);
 
 	if (_checksum)
@@ -291,7 +340,7 @@ static int do_checksum(int card_no, unsigned long timeout,
 	return 0;
 
  out_error2:
-	snap_detach_action(action);
+	snap_queue_free(queue);
  out_error1:
 	snap_card_free(card);
  out_error:
@@ -310,6 +359,7 @@ int main(int argc, char *argv[])
 	unsigned long timeout = 60 * 60 * 60; /* 60h for SPONGE */
 	const char *space = "CARD_RAM";
 	ssize_t size = 1024 * 1024;
+	uint32_t chunk = 0;
 	uint8_t *ibuff = NULL;
 	unsigned int page_size = sysconf(_SC_PAGESIZE);
 	uint8_t type_in = SNAP_ADDRTYPE_HOST_DRAM;
@@ -330,6 +380,7 @@ int main(int argc, char *argv[])
 			{ "src-type",	 required_argument, NULL, 'A' },
 			{ "src-addr",	 required_argument, NULL, 'a' },
 			{ "size",	 required_argument, NULL, 's' },
+			{ "chunk",	 required_argument, NULL, 'k' },
 			{ "start-value", required_argument, NULL, 'S' },
 			{ "mode",	 required_argument, NULL, 'm' },
 			{ "timeout",	 required_argument, NULL, 't' },
@@ -345,7 +396,7 @@ int main(int argc, char *argv[])
 		};
 
 		ch = getopt_long(argc, argv,
-				 "A:C:i:a:S:Tx:c:n:f:m:s:t:x:VqvhN",
+				 "A:C:i:a:S:Tx:c:n:f:m:s:k:t:x:VqvhN",
 				 long_options, &option_index);
 		if (ch == -1)
 			break;
@@ -363,6 +414,9 @@ int main(int argc, char *argv[])
 		case 's':
 			size = __str_to_num(optarg);
 			break;
+		case 'k':
+			chunk = __str_to_num(optarg);
+			break;
 		case 'S':
 			checksum_start = __str_to_num(optarg);
 			break;
@@ -464,8 +518,8 @@ int main(int argc, char *argv[])
 		if (ibuff == NULL)
 			goto out_error;
 
-		fprintf(stdout, "reading input data %d bytes from %s\n",
-			(int)size, input);
+		fprintf(stdout, "reading input data %lld bytes from %s\n",
+			(long long)size, input);
 
 		rc = file_read(input, ibuff, size);
 		if (rc < 0)
@@ -482,7 +536,7 @@ int main(int argc, char *argv[])
 		}
 	} else {
 		rc = do_checksum(card_no, timeout, threads, addr_in,
-				 type_in, size, checksum_start, mode,
+				 type_in, size, chunk, checksum_start, mode,
 				 test_choice, nb_elmts, freq, NULL, NULL, NULL,
 				 NULL, stderr, action_irq);
 		if (rc != 0)
@@ -19,6 +19,7 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
 #include <snap_types.h>
 
 /**
@@ -91,6 +92,8 @@ extern "C" {
 #define SNAP_EINVAL			-7 /* Invalid parameters */
 #define SNAP_EATTACH                    -8 /* Attach error */
 #define SNAP_EDETACH                    -9 /* Detach error */
+#define SNAP_ENOMEM                     -10 /* Out of memory */
+#define SNAP_ECANCELED                  -11 /* Job got aborted */
 
 /**********************************************************************
  * SNAP Common Definitions
@@ -257,24 +260,76 @@ int snap_mmio_write32(struct snap_card *card, uint64_t offset,
 int snap_mmio_read32(struct snap_card *card, uint64_t offset,
 			uint32_t *data);
 
-int snap_mmio_read32_nohwsync(struct snap_card *card,
-		uint64_t offset, uint32_t *data);
-
 int snap_mmio_write64(struct snap_card *card, uint64_t offset,
 			uint64_t data);
 int snap_mmio_read64(struct snap_card *card, uint64_t offset,
 			uint64_t *data);
 
+/*
+ * MMIO Access functions without ordering
+ *
+ * The functions above go through libcxl, which puts a hwsync in front
+ * of each access. These access the mapped register space directly and
+ * leave ordering to the caller: write a batch of registers, then call
+ * snap_mmio_hwsync() once before the write which lets the card act on
+ * them, or poll a status register and call snap_mmio_hwsync() once it
+ * tells that the card is done, before reading the host memory it
+ * wrote. Registers of one card are accessed in program order.
+ *
+ * If the registers are not mapped, e.g. in simulation or with software
+ * actions, they fall back to the functions above.
+ */
+int snap_mmio_write32_nohwsync(struct snap_card *card, uint64_t offset,
+			       uint32_t data);
+int snap_mmio_read32_nohwsync(struct snap_card *card, uint64_t offset,
+			      uint32_t *data);
+int snap_mmio_write64_nohwsync(struct snap_card *card, uint64_t offset,
+			       uint64_t data);
+int snap_mmio_read64_nohwsync(struct snap_card *card, uint64_t offset,
+			      uint64_t *data);
+void snap_mmio_hwsync(struct snap_card *card);
+
+/*
+ * How the job functions access the action registers.
+ *
+ * @SNAP_MMIO_HWSYNC      Each access through libcxl with its hwsync.
+ * @SNAP_MMIO_BATCH       Job parameters, results and ACTION_CONTROL
+ *                        polling use direct access. The ACTION_CONTROL
+ *                        start write orders the parameters, one
+ *                        snap_mmio_hwsync() follows when the action was
+ *                        seen done.
+ *
+ * SNAP_MMIO_HWSYNC is the default, SNAP_MMIO=batch in the environment
+ * selects SNAP_MMIO_BATCH for all cards. Contexts opened for further
+ * threads inherit the policy of the card.
+ *
+ * @card        snap_card device handle.
+ * @policy      see above.
+ * @return      SNAP_OK, else error.
+ */
+typedef enum snap_mmio_policy {
+	SNAP_MMIO_HWSYNC = 0,
+	SNAP_MMIO_BATCH,
+} snap_mmio_policy_t;
+
+int snap_card_set_mmio_policy(struct snap_card *card,
+			      snap_mmio_policy_t policy);
+
 /*
  * Settings for action attachement and Action completion.
  *
  * @SNAP_ACTION_DONE_IRQ  Enables Action Done Interrupt.
  *
+ * @SNAP_ACTION_MMIO64    Pass job parameters and results using 64-bit MMIO
+ *                        instead of 32-bit MMIO. The action must accept
+ *                        64-bit accesses to its register space.
+ *
  * @SNAP_ATTACH_IRQ       Use interrupt to determine if action got attached
  *                        from Job Manager.
  */
 typedef enum snap_action_flag  {
 	SNAP_ACTION_DONE_IRQ = 0x01,   /* Enable Action Done Interrupt */
+	SNAP_ACTION_MMIO64 = 0x02,     /* Use 64-bit MMIO for job parameters */
 	SNAP_ATTACH_IRQ = 0x10000      /* Enable Attach IRQ from Job Manager */
 } snap_action_flag_t;
 
@@ -287,6 +342,12 @@ typedef enum snap_action_flag  {
  *   snap_action_sync_execute_job()
  *   snap_detatch_action()
  *
+ * The function may be called from multiple threads using the same card
+ * handle. Each calling thread gets its own context on the same device,
+ * which is opened on first use and released when the thread exits or
+ * by snap_card_free(). Contexts are looked up without locking, so
+ * threads do not contend on the card handle.
+ *
  * @card          snap_card device handle.
  * @action_type   long SNAP action type. This is a unique value identifying the
  *                SNAP action. See ActionTypes.md for exising ids and how to
@@ -295,7 +356,11 @@ typedef enum snap_action_flag  {
  *                polling for completion of a job.
  * @cjob          SNAP job description.
  * @attach_timeout_sec Timeout for action attachement. Select larger value if
- *                multiple users compete for the action resource.
+ *                multiple users compete for the action resource. 0 or
+ *                less does not wait, the job only runs if an action slot
+ *                is free, else SNAP_EATTACH. If the card uses job
+ *                priorities, this is also the time to wait for a slot
+ *                of the admission gate, see snap_prio_execute_job().
  * @timout_sec    Job execution timeout. Use larger value if there are multiple
  *                potential users.
  * @return        SNAP_OK, else error.
@@ -309,6 +374,104 @@ int snap_sync_execute_job(struct snap_card *card,
 			  int attach_timeout_sec,
 			  int timeout_sec);
 
+typedef enum snap_cancel_mode {
+	SNAP_CANCEL_ABORT = 0,         /* Abort right away */
+	SNAP_CANCEL_CHECKPOINT,        /* Stop at a checkpoint, else abort */
+} snap_cancel_mode_t;
+
+/*
+ * Cancel a job which another thread executes on the card, e.g. one
+ * which runs into its timeout. The executing call returns early:
+ *
+ * SNAP_CANCEL_CHECKPOINT asks the action to stop at its next
+ * checkpoint. Actions which support it return SNAP_OK with cjob->retc
+ * SNAP_RETC_STOPPED, the job data tells how far they got. If the
+ * action does not stop within a grace period, the job is aborted.
+ *
+ * SNAP_CANCEL_ABORT aborts the job. The call returns SNAP_ECANCELED
+ * and the action gets detached, the next job attaches it again.
+ * Emulated actions cannot be interrupted, they finish in the
+ * background while the card continues with a new instance.
+ *
+ * @card          snap_card device handle the job was submitted to.
+ * @cjob          the job, as passed to the executing call.
+ * @mode          how to stop it.
+ * @return        SNAP_OK if the job got the request, SNAP_ENOENT if it
+ *                is not running.
+ */
+int snap_job_cancel(struct snap_card *card, struct snap_job *cjob,
+		    snap_cancel_mode_t mode);
+
+/*
+ * Keep the action attached after snap_sync_execute_job() or
+ * snap_queue_free(). The next job for the same action type and flags
+ * reuses it without attach and detach. If the action stays unused for
+ * idle_ms, it gets detached such that other contexts can use it.
+ * The default is taken from the environment variable SNAP_LEASE_MS,
+ * 0 switches it off.
+ *
+ * @card          snap_card device handle.
+ * @idle_ms       Time in msec to keep an unused action attached.
+ * @return        SNAP_OK, else error.
+ */
+int snap_card_set_lease(struct snap_card *card, unsigned int idle_ms);
+
+/*
+ * Offload decision. With SNAP_CONFIG=HYBRID and a registered software
+ * action, the library learns how long jobs of an action type take on
+ * the card and on the CPU, by power of two job size, and runs each job
+ * where it is expected to finish first. Small jobs often finish faster
+ * on the CPU, since attach and passing the job to the card cost more
+ * than the work. The learned times include attach and detach. Without
+ * HYBRID the configured side is used and only its times are learned.
+ */
+typedef enum snap_offload_target {
+	SNAP_OFFLOAD_FPGA = 0,
+	SNAP_OFFLOAD_CPU,
+	SNAP_OFFLOAD_TARGETS
+} snap_offload_target_t;
+
+struct snap_offload {
+	snap_offload_target_t target;	/* Where the job runs */
+	uint64_t expected_ns;		/* On target, 0 if not known yet */
+	uint64_t fpga_ns;		/* Learned so far, 0 if not known */
+	uint64_t cpu_ns;
+};
+
+/**
+ * Tell where a job would run and how long it is expected to take.
+ * Asking changes nothing. A job run with snap_offload_execute_job()
+ * may still go to the slower side now and then, to keep both times
+ * up to date.
+ *
+ * @card          snap_card device handle.
+ * @action_type   long SNAP action type.
+ * @size          job size in bytes, e.g. the bytes the action reads.
+ *                Only jobs of similar size are compared.
+ * @offload       filled with the decision.
+ * @return        SNAP_OK, else error.
+ */
+int snap_offload_decide(struct snap_card *card,
+			snap_action_type_t action_type,
+			uint64_t size,
+			struct snap_offload *offload);
+
+/**
+ * Like snap_sync_execute_job(), but the job runs where the offload
+ * decision says, and its time is learned.
+ *
+ * @size          job size in bytes, as for snap_offload_decide().
+ * @offload       if not NULL, gets the decision made for the job.
+ */
+int snap_offload_execute_job(struct snap_card *card,
+			     snap_action_type_t action_type,
+			     snap_action_flag_t action_flags,
+			     struct snap_job *cjob,
+			     uint64_t size,
+			     int attach_timeout_sec,
+			     int timeout_sec,
+			     struct snap_offload *offload);
+
 /******************************************************************************
  * SNAP Action Access
  *****************************************************************************/
@@ -324,7 +487,8 @@ int snap_sync_execute_job(struct snap_card *card,
  * @action_flags  Define special behavior, e.g. if interrupts should be used or
  *                polling for completion of a job.
  * @attach_timeout_sec Timeout for action attachement. Select larger value if
- *                multiple users compete for the action resource.
+ *                multiple users compete for the action resource. 0 does
+ *                not wait, it only takes an action slot which is free.
  * @return        SNAP_OK, else error.
  *
  * Only works with slave contexts
@@ -368,11 +532,79 @@ int snap_action_read32(struct snap_action *action, uint64_t offset,
  * sufficient, consider using the following low-level functions.
  */
 int snap_action_start(struct snap_action *action);
+
+/*
+ * Stop the running job. The action is asked to stop at its next
+ * checkpoint, see ACTION_CONTROL_STOP, actions which get there return
+ * SNAP_RETC_STOPPED. If it is still busy after a grace period the job
+ * is aborted, which detaches the action.
+ *
+ * @action      snap_action handle.
+ * @return      SNAP_OK if the action is idle, SNAP_ECANCELED if the job
+ *              got aborted and the action must be attached again.
+ */
 int snap_action_stop(struct snap_action *action);
 int snap_action_is_idle(struct snap_action *action, int *rc);
 int snap_action_completed(struct snap_action *action, int *rc,
 			  int timeout_sec);
 
+/*
+ * Register a host completion record for the action. For all following
+ * jobs the action is asked to write its output registers into this
+ * record when it is done. Completion is then detected by polling host
+ * memory and retc plus the job results are taken from the record,
+ * instead of reading them through MMIO. The action must support
+ * SNAP_JOBFLAG_COMPLETION, see snap_types.h.
+ *
+ * @action      snap_action handle.
+ * @crec        128 bytes aligned record, NULL to use MMIO readback again.
+ * @return      SNAP_OK, else error.
+ */
+int snap_action_set_completion(struct snap_action *action,
+			       struct snap_completion *crec);
+
+/*
+ * Policy to wait for job completion in snap_action_completed().
+ *
+ * @SNAP_WAIT_DEFAULT     Wait for the interrupt if SNAP_ACTION_DONE_IRQ was
+ *                        set on attach, else poll ACTION_CONTROL.
+ * @SNAP_WAIT_POLL        Poll ACTION_CONTROL until the job is done.
+ * @SNAP_WAIT_IRQ         Block on the action done interrupt.
+ * @SNAP_WAIT_ADAPTIVE    Poll for a while, based on the durations of the
+ *                        recent jobs, then block on the interrupt.
+ *
+ * Software actions emulate the done interrupt, the worker running the
+ * job wakes up the waiter. So the policies work the same way there.
+ */
+typedef enum snap_wait_policy {
+	SNAP_WAIT_DEFAULT = 0,
+	SNAP_WAIT_POLL,
+	SNAP_WAIT_IRQ,
+	SNAP_WAIT_ADAPTIVE,
+} snap_wait_policy_t;
+
+/*
+ * Counters which tell how jobs got completed.
+ *
+ * @poll_done       # jobs seen done by polling
+ * @irq_done        # jobs seen done after the interrupt
+ * @timeouts        # waits which ended without the job being done
+ * @job_avg_usec    moving average of the job duration
+ * @spin_usec       current adaptive polling window
+ */
+struct snap_wait_stats {
+	uint64_t poll_done;
+	uint64_t irq_done;
+	uint64_t timeouts;
+	uint64_t job_avg_usec;
+	uint64_t spin_usec;
+};
+
+int snap_action_set_wait_policy(struct snap_action *action,
+				snap_wait_policy_t policy);
+int snap_action_get_wait_stats(struct snap_action *action,
+			       struct snap_wait_stats *stats);
+
 /**
  * Synchronous way to send a job away.  First step : set registers
  * This function writes through MMIO interface the registers
@@ -429,6 +661,28 @@ int snap_action_sync_execute_job(struct snap_action *action,
                                  struct snap_job *cjob,
                                  unsigned int timeout_sec);
 
+/**
+ * Synchronous execution of a workitem the caller built already, see
+ * snap_queue.h. short_action and seq are filled in, the first mmio_in
+ * 32-bit words are passed to the action. Results are returned like
+ * for snap_action_sync_execute_job(), cjob describes where they go.
+ * snap::Job<> in snap_job.hpp builds the workitem at compile time.
+ *
+ * @action      handle to streaming framework action
+ * @job         workitem, flags and priv_data as the caller set them
+ * @mmio_in     number of 32-bit words to pass, 4 to 32
+ * @cjob        job input and output, as for snap_job_set()
+ * @timeout_sec timeout used if polling mode
+ * @return      SNAP_OK in case of success, else error.
+ */
+struct snap_queue_workitem;
+
+int snap_action_sync_execute_workitem(struct snap_action *action,
+                                      struct snap_queue_workitem *job,
+                                      unsigned int mmio_in,
+                                      struct snap_job *cjob,
+                                      unsigned int timeout_sec);
+
 #if 0 /* FIXME Discuss how this must be done correctly */
 /**
  * Allow the action to use interrupts to signal results back to the
@@ -464,16 +718,121 @@ int snap_action_free_irq(struct snap_action *action, int irq);
 
 int snap_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long parm);
 
+/******************************************************************************
+ * SNAP DMA Buffers
+ *****************************************************************************/
+
+#define SNAP_BUF_HUGE		0x01	/* Use 2 MiB pages for >= 2 MiB */
+#define SNAP_BUF_PREFAULT	0x02	/* Fault in all pages before return */
+
+/**
+ * Get a page aligned buffer for the card to read or write. Buffers are
+ * mapped on the NUMA node of the card, if known, and go back into a
+ * pool on snap_buf_free(), such that the next job of the same size can
+ * use them again without new page faults. The environment variable
+ * SNAP_BUF_CACHE limits the bytes kept in the pool, default 256 MiB.
+ * Content is undefined, like for malloc().
+ *
+ * @card          card to place the buffer near to, or NULL.
+ * @size          size in bytes, rounded up to one of 4 size classes
+ *                per power of two.
+ * @flags         SNAP_BUF_HUGE, SNAP_BUF_PREFAULT.
+ * @return        buffer or NULL with errno set.
+ */
+void *snap_buf_alloc(struct snap_card *card, size_t size, unsigned int flags);
+
+/* Give back a buffer from snap_buf_alloc(), NULL is ignored */
+void snap_buf_free(void *buf);
+
+/* Unmap all pooled buffers which are not in use */
+void snap_buf_trim(void);
+
+/******************************************************************************
+ * SNAP Scatter-Gather Lists, see snap_types.h for the format
+ *****************************************************************************/
+
+struct snap_sg;
+
+/**
+ * Get an empty scatter-gather list.
+ *
+ * @num           entries per array, further arrays are linked when
+ *                the list grows. 0 for a default.
+ * @return        list or NULL with errno set.
+ */
+struct snap_sg *snap_sg_alloc(unsigned int num);
+
+/**
+ * Append a data fragment. The list references the memory, it is not
+ * copied.
+ *
+ * @return        0 on success, SNAP_EINVAL if the total size would
+ *                exceed 32 bits, SNAP_ENOMEM.
+ */
+int snap_sg_add(struct snap_sg *sg, const void *addr, uint32_t size,
+		snap_addrtype_t type);
+
+/* Number of fragments and total bytes in the list */
+unsigned int snap_sg_entries(const struct snap_sg *sg);
+uint64_t snap_sg_total(const struct snap_sg *sg);
+
+/**
+ * Let a job buffer refer to the list. The list must not change until
+ * the job is done.
+ *
+ * @da            job buffer to set.
+ * @flags         e.g. SNAP_ADDRFLAG_SRC, SNAP_ADDRFLAG_EXT is added.
+ */
+void snap_sg_addr_set(struct snap_addr *da, const struct snap_sg *sg,
+		      snap_addrflag_t flags);
+
+/* Drop all fragments, to build a new list */
+void snap_sg_reset(struct snap_sg *sg);
+void snap_sg_free(struct snap_sg *sg);
+
+/*
+ * Walk the fragments of a job buffer, scatter-gather list or not.
+ * For use in actions:
+ *
+ *	snap_sg_iter_init(&it, &job->in);
+ *	while ((e = snap_sg_next(&it)) != NULL)
+ *		process(e->addr, e->size);
+ */
+struct snap_sg_iter {
+	const struct snap_addr *ent;	/* Next entry to look at */
+	struct snap_addr one;		/* For buffers without list */
+};
+
+void snap_sg_iter_init(struct snap_sg_iter *it, const struct snap_addr *da);
+const struct snap_addr *snap_sg_next(struct snap_sg_iter *it);
+
+/**
+ * Copy the data of host memory job buffers, scatter-gather list or
+ * not. Fragments need not be aligned to each other. Stops at the
+ * first fragment which is not in host memory.
+ *
+ * @return        bytes copied, the smaller of both sizes if all went
+ *                well.
+ */
+uint64_t snap_sg_copy(const struct snap_addr *dst,
+		      const struct snap_addr *src);
+
 /******************************************************************************
  * SNAP Queue Operations
  *****************************************************************************/
 
 /**
- * Get a streaming framework queue handle.
+ * Get a streaming framework queue handle. The action is attached on
+ * the first job and stays attached until the queue is freed. Up to
+ * queue_length jobs can be staged, the next job is passed to the
+ * action as soon as the previous one is done.
+ *
  * @card          Valid SNAP card handle
  * @action_type   Use special action_type for the queue.
- * @return        0 success
- *                SNAP_ENODEV no matching capi device found
+ * @action_flags  Define special behavior, e.g. if interrupts should be used.
+ * @queue_length  Number of jobs which can be staged (0 is treated as 1).
+ * @attach_timeout_sec Timeout for action attachement.
+ * @return        queue handle or NULL in case of error.
  */
 
 struct snap_queue *snap_queue_alloc(struct snap_card *card,
@@ -486,8 +845,12 @@ void snap_queue_free(struct snap_queue *queue);
 
 /**
  * Synchronous way to send a job away. Blocks until job is done.
+ * Multiple threads can submit to the same queue, jobs are executed
+ * in the order they got staged.
+ *
  * @queue         handle to streaming framework queue
  * @cjob          streaming framework job
+ * @timeout_sec   job execution timeout
  * @return        0 on success.
  */
 int snap_queue_sync_execute_job(struct snap_queue *queue,
@@ -495,13 +858,22 @@ int snap_queue_sync_execute_job(struct snap_queue *queue,
 			  unsigned int timeout_sec);
 
 /**
- * Asynchronous way to send a job away.
+ * Asynchronous way to send a job away. Returns as soon as the job is
+ * staged, it only blocks if all queue_length slots are in use. The
+ * finished callback is called from a library owned completion thread,
+ * once the job is done. retc and the output registers are filled in
+ * at that time. If the library fails to execute the job, retc is set
+ * to SNAP_RETC_TIMEOUT or SNAP_RETC_FAILURE. cjob and the memory it
+ * refers to must stay valid until the callback was called.
+ * snap_queue_free() waits for all outstanding jobs. The job timeout is
+ * the one of the queue, see snap_queue_set_timeout().
+ *
  * @queue         handle to streaming framework queue
  * @cjob          streaming framework job
  * @finished      callback function which is called once job is done
- * @return        0 on success.
+ * @return        0 on success, SNAP_ENOMEM if the request or the
+ *                completion thread could not be allocated.
  */
-/* NOTE: Discuss if such a construct as suggested below really works ok */
 typedef int (*snap_job_finished_t)(struct snap_queue *queue,
 			struct snap_job *cjob);
 
@@ -509,6 +881,426 @@ int snap_async_execute_job(struct snap_queue *queue,
 			struct snap_job *cjob,
 			snap_job_finished_t finished);
 
+/**
+ * Set the execution timeout for jobs passed to snap_async_execute_job()
+ * from now on. Defaults to 3600 seconds.
+ *
+ * @queue         handle to streaming framework queue
+ * @timeout_sec   job execution timeout, must not be 0
+ * @return        0 on success.
+ */
+int snap_queue_set_timeout(struct snap_queue *queue,
+			   unsigned int timeout_sec);
+
+/*
+ * Large transfers. A job buffer holds at most 4 GiB, see struct
+ * snap_addr. snap_chain_execute_job() runs one operation over up to
+ * 2^64 bytes as a chain of jobs, each working on a piece of at most
+ * chunk_size bytes.
+ *
+ * Every piece starts with a copy of the input and output data of the
+ * job passed in. prepare() then points the job buffers at the piece
+ * [offs, offs + len). complete() is called in piece order and can
+ * carry state into the next piece via priv, e.g. chk_out to chk_in
+ * for a checksum. It returns the bytes of the piece the action got
+ * through. If that is less than len, e.g. because a search result
+ * buffer ran full, the chain goes on at offs plus the returned value.
+ *
+ * With depth 1 a piece is prepared after the previous one completed.
+ * Pieces which do not depend on each other, like for a copy, can use
+ * a depth up to the queue length: the next pieces are staged while the
+ * action works on the current one. prepare() and complete() then can
+ * run at the same time, from different threads.
+ *
+ * @size          total bytes.
+ * @chunk_size    bytes per piece, 0 for 1 GiB.
+ * @depth         pieces in flight, 0 is treated as 1.
+ * @prepare       set up the job for a piece, returns 0 on success.
+ * @complete      piece is done, NULL if there is nothing to do.
+ *                Returns bytes done or a negative error code.
+ * @priv          passed to prepare() and complete().
+ */
+struct snap_chain {
+	uint64_t size;
+	uint32_t chunk_size;
+	unsigned int depth;
+	int (*prepare)(struct snap_job *cjob, uint64_t offs, uint32_t len,
+		       void *priv);
+	int64_t (*complete)(struct snap_job *cjob, uint64_t offs,
+			    uint32_t len, void *priv);
+	void *priv;
+};
+
+/**
+ * Run a chain of jobs and wait until all pieces are done. The chain
+ * stops at the first piece the action does not report success for.
+ * On return cjob holds retc and output data of the last piece which
+ * was executed.
+ *
+ * @queue         handle to streaming framework queue
+ * @cjob          job to copy for each piece
+ * @chain         how to cut the operation into pieces
+ * @timeout_sec   execution timeout per piece
+ * @return        0 on success, SNAP_ETIMEDOUT, SNAP_EINVAL or the
+ *                error prepare() or complete() returned.
+ */
+int snap_chain_execute_job(struct snap_queue *queue,
+			   struct snap_job *cjob,
+			   const struct snap_chain *chain,
+			   unsigned int timeout_sec);
+
+/******************************************************************************
+ * SNAP Card Groups
+ *****************************************************************************/
+
+/*
+ * A group runs jobs for one action type on several cards. Each card
+ * gets its own job list and a thread which executes the jobs through
+ * a snap_queue. A new job goes to the card with the least work. A card
+ * which has no jobs left takes the oldest waiting job from the busiest
+ * other card. Only cards which have the action in their action type
+ * table join the group.
+ */
+struct snap_group;
+
+/**
+ * Open the cards and start a thread per card which has the action.
+ *
+ * @card_no       card numbers as for -C, i.e. /dev/cxl/afu<n>.0s
+ * @num_cards     number of entries in card_no
+ * @action_type   action the jobs are for
+ * @action_flags  as for snap_queue_alloc()
+ * @attach_timeout_sec Timeout for action attachement.
+ * @return        group handle or NULL with errno set, ENODEV if no
+ *                card has the action.
+ */
+struct snap_group *snap_group_alloc(const unsigned int *card_no,
+				    unsigned int num_cards,
+				    snap_action_type_t action_type,
+				    snap_action_flag_t action_flags,
+				    unsigned int attach_timeout_sec);
+
+/* Waits for outstanding jobs, then closes the cards */
+void snap_group_free(struct snap_group *group);
+
+/* Number of cards in the group */
+unsigned int snap_group_cards(struct snap_group *group);
+
+/**
+ * Jobs done by a card of the group, and how many of those it took
+ * over from other cards.
+ *
+ * @idx           0 to snap_group_cards() - 1
+ * @return        card number of the card.
+ */
+unsigned int snap_group_stats(struct snap_group *group, unsigned int idx,
+			      unsigned long *jobs, unsigned long *stolen);
+
+/**
+ * Execute the job on the next free card and wait until it is done.
+ *
+ * @return        0 on success.
+ */
+int snap_group_sync_execute_job(struct snap_group *group,
+				struct snap_job *cjob,
+				unsigned int timeout_sec);
+
+/**
+ * Queue the job and return. The finished callback is called from the
+ * thread of the card which executed the job, see
+ * snap_async_execute_job() for retc and the lifetime of cjob.
+ *
+ * @return        0 on success.
+ */
+typedef int (*snap_group_finished_t)(struct snap_group *group,
+				     struct snap_job *cjob);
+
+int snap_group_async_execute_job(struct snap_group *group,
+				 struct snap_job *cjob,
+				 snap_group_finished_t finished);
+
+/* As snap_queue_set_timeout(), for snap_group_async_execute_job() */
+int snap_group_set_timeout(struct snap_group *group,
+			   unsigned int timeout_sec);
+
+/*
+ * Streaming mode. The action is attached and started once and stays
+ * resident. Jobs are posted into a ring in host memory and completions
+ * are polled from a second ring, without MMIO, attach or interrupt per
+ * job. The action must support it, see struct snap_stream_job in
+ * snap_types.h. Software actions support it through the emulation.
+ */
+struct snap_stream;
+
+/**
+ * Start a streaming action on its own context of the card.
+ *
+ * @card          snap_card device handle.
+ * @action_type   long SNAP action type.
+ * @action_flags  as for snap_attach_action(), used for the final stop.
+ * @entries       ring size, power of 2 up to 65536, 0 for 256. At most
+ *                that many jobs can be in flight.
+ * @attach_timeout_sec timeout to attach the action.
+ * @return        stream handle or NULL with errno set.
+ */
+struct snap_stream *snap_stream_alloc(struct snap_card *card,
+				      snap_action_type_t action_type,
+				      snap_action_flag_t action_flags,
+				      unsigned int entries,
+				      int attach_timeout_sec);
+
+/**
+ * Post a job. Does not wait, may be called from several threads.
+ *
+ * @job           job data, copied into the ring.
+ * @job_size      at most 112 bytes.
+ * @tag           returned as priv_data of the completion.
+ * @return        SNAP_OK, SNAP_EBUSY if entries jobs are in flight,
+ *                else error.
+ */
+int snap_stream_post(struct snap_stream *stream, const void *job,
+		     unsigned int job_size, uint64_t tag);
+
+/**
+ * Take completions in the order the jobs were posted. Each one holds
+ * retc, the tag in priv_data and the output data of the action.
+ *
+ * @done          array to fill.
+ * @num           entries in done.
+ * @timeout_ms    time to wait for the first completion, 0 not to wait.
+ * @return        number of completions taken, or error.
+ */
+int snap_stream_poll(struct snap_stream *stream,
+		     struct snap_completion *done, unsigned int num,
+		     unsigned int timeout_ms);
+
+/**
+ * Let the action finish the posted jobs, stop it and release the
+ * stream. Completions not taken by then are lost.
+ *
+ * @timeout_sec   time to wait for the action to stop.
+ * @return        SNAP_OK, else error.
+ */
+int snap_stream_free(struct snap_stream *stream, int timeout_sec);
+
+/*
+ * Daemon client. Instead of opening the card, processes pass their
+ * jobs to snapd (tools/snapd.c), which shares the card among them,
+ * keeps the actions attached and schedules the clients fairly. Jobs
+ * and completions go through rings in memory shared with the daemon.
+ * Addresses in jobs must point into the data area of the client,
+ * which the daemon maps at the same address.
+ */
+struct snap_client;
+
+/**
+ * Connect to snapd.
+ *
+ * @path          socket of the daemon, NULL for the environment
+ *                variable SNAPD_SOCKET or /tmp/snapd.sock.
+ * @entries       ring size, power of 2 up to 65536, 0 for 256.
+ * @data_size     bytes of the shared data area for job buffers.
+ * @return        client handle or NULL with errno set.
+ */
+struct snap_client *snap_client_open(const char *path,
+				     unsigned int entries,
+				     size_t data_size);
+
+/**
+ * Shared data area, page aligned. Buffers passed to the action must
+ * be located here.
+ *
+ * @size          returns the size of the area if not NULL.
+ */
+void *snap_client_data(struct snap_client *client, size_t *size);
+
+/**
+ * Post a job. Does not wait, may be called from several threads.
+ *
+ * @action_type   action to execute the job.
+ * @job           job data, copied into the ring.
+ * @job_size      at most 112 bytes.
+ * @out_size      result bytes returned in the completion, at most
+ *                SNAP_JOBSIZE.
+ * @tag           returned as priv_data of the completion.
+ * @return        SNAP_OK, SNAP_EBUSY if entries jobs are in flight,
+ *                else error.
+ */
+int snap_client_post(struct snap_client *client,
+		     snap_action_type_t action_type,
+		     const void *job, unsigned int job_size,
+		     unsigned int out_size, uint64_t tag);
+
+/**
+ * Take completions in the order the jobs were posted, as for
+ * snap_stream_poll(). retc is SNAP_RETC_TIMEOUT or SNAP_RETC_FAILURE
+ * if the daemon could not execute the job.
+ *
+ * @return        number of completions taken, SNAP_EIO if the daemon
+ *                is gone, or error.
+ */
+int snap_client_poll(struct snap_client *client,
+		     struct snap_completion *done, unsigned int num,
+		     unsigned int timeout_ms);
+
+/**
+ * Disconnect. The daemon finishes jobs in flight before it releases
+ * the shared memory, their completions are lost.
+ */
+void snap_client_close(struct snap_client *client);
+
+/*
+ * Job latency statistics. The library records the duration of each
+ * phase of a job in a histogram per action type. Recording is cheap,
+ * each thread counts into its own histograms. If the environment
+ * variable SNAP_STATS is set to a file name, or to "-" for stderr,
+ * the statistics are written in JSON format at program exit.
+ *
+ * @SNAP_STATS_ATTACH       snap_attach_action(), not for reused leases.
+ * @SNAP_STATS_PARAM_WRITE  Passing the job parameters via MMIO.
+ * @SNAP_STATS_EXECUTE      Action start until completion was seen.
+ * @SNAP_STATS_IRQ_WAKEUP   Waiting for the action done interrupt.
+ * @SNAP_STATS_RESULT_READ  Reading back RETC and the job results.
+ * @SNAP_STATS_DETACH       snap_detach_action().
+ */
+typedef enum snap_stats_phase {
+	SNAP_STATS_ATTACH = 0,
+	SNAP_STATS_PARAM_WRITE,
+	SNAP_STATS_EXECUTE,
+	SNAP_STATS_IRQ_WAKEUP,
+	SNAP_STATS_RESULT_READ,
+	SNAP_STATS_DETACH,
+	SNAP_STATS_PHASES
+} snap_stats_phase_t;
+
+/*
+ * Values below 4 ns have their own bucket. Above, each power of two
+ * is split into 4 buckets, the last one collects all above ~2200 sec.
+ */
+#define SNAP_STATS_BUCKETS	160
+
+struct snap_stats_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t bucket[SNAP_STATS_BUCKETS];
+};
+
+struct snap_stats {
+	snap_action_type_t action_type;
+	struct snap_stats_hist phase[SNAP_STATS_PHASES];
+};
+
+/**
+ * Get the statistics of all threads summed up by action type.
+ *
+ * @stats         array to fill, can be NULL if num is 0.
+ * @num           number of entries in stats.
+ * @return        number of action types with statistics, can be
+ *                larger than num, or error code.
+ */
+int snap_stats_snapshot(struct snap_stats *stats, unsigned int num);
+
+/* Clear all statistics. Samples recorded concurrently might get lost. */
+void snap_stats_reset(void);
+
+/**
+ * Get the percentile of a histogram, e.g. 99.9 for p999.
+ *
+ * @return        upper bound of the bucket in ns, 0 if empty.
+ */
+uint64_t snap_stats_percentile(const struct snap_stats_hist *hist,
+			       double percentile);
+
+const char *snap_stats_phase_name(snap_stats_phase_t phase);
+
+/* Write the statistics in JSON format, like at exit with SNAP_STATS */
+int snap_stats_dump(FILE *fp);
+
+/*
+ * Job priorities. Once a card is used with snap_prio_execute_job(),
+ * jobs pass an admission gate: at most slots jobs run on the card at
+ * once, and each class can be limited to fewer. Jobs which can not run
+ * yet wait ordered by class, within a class by deadline, then in order
+ * of arrival. snap_sync_execute_job() then passes the gate as
+ * SNAP_PRIO_NORMAL without deadline, which costs each job the gate lock
+ * on entry and exit. Cards which never use priorities have no gate.
+ * Job queues keep their action and are not gated. With SNAP_CONFIG=HYBRID
+ * a job which finds no free slot runs on the CPU at once.
+ *
+ * @SNAP_PRIO_HIGH      latency critical jobs, run first.
+ * @SNAP_PRIO_NORMAL    snap_sync_execute_job().
+ * @SNAP_PRIO_BULK      batch work, runs if nothing else waits.
+ */
+typedef enum snap_prio {
+	SNAP_PRIO_HIGH = 0,
+	SNAP_PRIO_NORMAL,
+	SNAP_PRIO_BULK,
+	SNAP_PRIO_CLASSES
+} snap_prio_t;
+
+/**
+ * Set the number of jobs running on the card at once.
+ *
+ * @card          snap_card device handle.
+ * @slots         0 for the number of actions of the card, or of CPUs
+ *                in software mode.
+ * @return        SNAP_OK, else error.
+ */
+int snap_card_set_slots(struct snap_card *card, unsigned int slots);
+
+/**
+ * Limit the jobs of one class running at once, e.g. such that bulk
+ * jobs do not occupy every slot when a latency critical job arrives.
+ *
+ * @max_jobs      0 for no limit but the slots, the default.
+ * @return        SNAP_OK, else error.
+ */
+int snap_card_set_prio_limit(struct snap_card *card, snap_prio_t prio,
+			     unsigned int max_jobs);
+
+/**
+ * Execute a job like snap_sync_execute_job(), with priority.
+ *
+ * @prio          class of the job.
+ * @deadline_us   time from now the job should be done in, 0 for none.
+ *                Orders the jobs within the class and counts in the
+ *                statistics, late jobs still run.
+ * @attach_timeout_sec time to wait for a slot, then for the action.
+ *                0 or less does not wait, the job is rejected unless a
+ *                slot is free at once.
+ * @return        as snap_sync_execute_job(), SNAP_EATTACH if no slot
+ *                got free within attach_timeout_sec.
+ */
+int snap_prio_execute_job(struct snap_card *card,
+			  snap_action_type_t action_type,
+			  snap_action_flag_t action_flags,
+			  struct snap_job *cjob,
+			  snap_prio_t prio,
+			  unsigned int deadline_us,
+			  int attach_timeout_sec,
+			  int timeout_sec);
+
+struct snap_prio_stats {
+	struct snap_stats_hist wait;	/* Submission until admitted */
+	struct snap_stats_hist total;	/* Submission until done */
+	uint64_t deadline_met;
+	uint64_t deadline_missed;
+	uint64_t rejected;		/* No slot within attach timeout */
+	uint32_t queued;		/* Jobs waiting now */
+	uint32_t running;		/* Jobs running now */
+};
+
+/**
+ * Get the statistics of a class on this card, e.g. to check its
+ * latency objectives with snap_stats_percentile().
+ *
+ * @return        SNAP_OK, else error.
+ */
+int snap_prio_stats_get(struct snap_card *card, snap_prio_t prio,
+			struct snap_prio_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
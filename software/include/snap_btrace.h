@@ -0,0 +1,113 @@
+#ifndef __SNAP_BTRACE_H__
+#define __SNAP_BTRACE_H__
+
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Binary trace. Unlike the text traces in snap_internal.h, recording
+ * an event only stores a timestamp, the event id and three arguments
+ * into a ring buffer owned by the calling thread. No lock, no system
+ * call and no formatting is done, such that it can stay enabled while
+ * measuring. Once the ring is full, the oldest events get overwritten.
+ *
+ * SNAP_BTRACE=<file> enables it and writes the rings at program exit,
+ * SNAP_BTRACE_SIZE=<n> sets the number of events kept per thread.
+ * Use the snap_btrace tool to turn the file into text or into Chrome
+ * trace JSON (chrome://tracing).
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum snap_btrace_event {
+	SNAP_BT_NONE = 0,
+
+	/* libsnap, a0 is the card handle unless noted otherwise */
+	SNAP_BT_MMIO_WRITE32 = 0x0001,	/* a1: offset, a2: data */
+	SNAP_BT_MMIO_READ32,		/* a1: offset, a2: data */
+	SNAP_BT_MMIO_WRITE64,		/* a1: offset, a2: data */
+	SNAP_BT_MMIO_READ64,		/* a1: offset, a2: data */
+	SNAP_BT_IRQ_WAIT,		/* a1: irq, a2: timeout sec */
+	SNAP_BT_IRQ_DONE,		/* a1: irq, a2: rc */
+	SNAP_BT_ATTACH,			/* a1: action type, a2: flags */
+	SNAP_BT_DETACH,			/* a1: action type, a2: rc */
+	SNAP_BT_JOB_START,		/* a1: action type, a2: seq */
+	SNAP_BT_JOB_DONE,		/* a1: rc, a2: retc */
+
+	/* snapblock, a0 is the request slot */
+	SNAP_BT_BLOCK_STATUS = 0x0100,	/* a1: status, a2: lba */
+	SNAP_BT_BLOCK_START,		/* a1: action, a2: lba */
+	SNAP_BT_BLOCK_DONE,		/* a1: action, a2: lba */
+
+	/* Applications and actions can use ids starting here */
+	SNAP_BT_USER = 0x1000,
+};
+
+/* One event, written to the dump file as is */
+struct snap_btrace_rec {
+	uint64_t ts;			/* CLOCK_MONOTONIC in ns */
+	uint32_t event;
+	uint32_t seq;			/* Lower bits of the event number */
+	uint64_t arg[3];
+};
+
+/*
+ * Dump file: struct snap_btrace_hdr, followed by nthreads times a
+ * struct snap_btrace_thread and its events, oldest first. All values
+ * are in host byte order.
+ */
+#define SNAP_BTRACE_MAGIC	"SNAPBTR1"
+
+struct snap_btrace_hdr {
+	char magic[8];
+	uint32_t rec_size;		/* sizeof(struct snap_btrace_rec) */
+	uint32_t pid;
+	uint32_t nthreads;
+	uint32_t reserved;
+};
+
+struct snap_btrace_thread {
+	uint32_t tid;
+	uint32_t count;			/* Events which follow */
+	uint64_t lost;			/* Events overwritten before the dump */
+};
+
+int snap_btrace_enabled(void);
+void __snap_btrace(uint32_t event, uint64_t a0, uint64_t a1, uint64_t a2);
+
+#define snap_btrace(event, a0, a1, a2) do {				\
+		if (snap_btrace_enabled())				\
+			__snap_btrace((event), (uint64_t)(a0),		\
+				      (uint64_t)(a1), (uint64_t)(a2));	\
+	} while (0)
+
+/**
+ * Write the events recorded so far, the rings are not cleared.
+ *
+ * @fname         file to write to.
+ * @return        0 on success, else error.
+ */
+int snap_btrace_dump(const char *fname);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_BTRACE_H__ */
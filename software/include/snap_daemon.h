@@ -0,0 +1,99 @@
+#ifndef __SNAP_DAEMON_H__
+#define __SNAP_DAEMON_H__
+
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Protocol between snapd and its clients, private to libsnap and
+ * tools/snapd.c. Applications use snap_client_open() in libsnap.h.
+ *
+ * A client connects to the Unix socket of the daemon and sends a
+ * struct snapd_hello together with three file descriptors: a memfd
+ * holding its rings and data buffers, an eventfd to wake the daemon
+ * and an eventfd the daemon uses to wake the client. The daemon maps
+ * the memfd at the same address as the client, such that addresses in
+ * jobs are valid for the card, and answers with a struct snapd_reply.
+ * The socket stays open, the daemon drops the client when it closes.
+ *
+ * Shared memory layout: struct snapd_ctrl, entries struct snapd_job
+ * (submission ring), entries struct snap_completion (completion ring),
+ * then the data buffers. Indices are free running, slot n % entries.
+ * The client writes job n, then sets sq_tail to n + 1. The daemon
+ * writes the completion of job n into slot n with SNAP_JOBFLAG_DONE
+ * set last and seq = (uint16_t)n, in any order. The client has at
+ * most entries jobs in flight.
+ *
+ * Wakeups only cost a syscall if the other side sleeps: whoever goes
+ * to sleep sets its wait flag and checks the ring again before it
+ * blocks on its eventfd, whoever posts checks the flag after posting.
+ */
+
+#include <stdint.h>
+#include <snap_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAPD_VERSION		1
+#define SNAPD_SOCKET		"/tmp/snapd.sock"	/* or SNAPD_SOCKET */
+#define SNAPD_FDS		3	/* memfd, doorbell, completion */
+
+struct snapd_hello {
+	uint32_t version;		/* SNAPD_VERSION */
+	uint32_t entries;		/* Power of 2 */
+	uint64_t addr;			/* Client address of the memfd */
+	uint64_t size;			/* Bytes of the memfd */
+};
+
+struct snapd_reply {
+	int32_t rc;			/* 0 or negative errno */
+	uint32_t client_id;
+};
+
+struct snapd_ctrl {
+	/* Written by the client */
+	uint32_t sq_tail;
+	uint32_t client_wait;		/* Client sleeps on its eventfd */
+	uint8_t reserved0[120];
+	/* Written by the daemon */
+	uint32_t sq_head;		/* Jobs taken */
+	uint32_t daemon_wait;		/* Daemon sleeps, ring the doorbell */
+	uint8_t reserved1[120];
+} __attribute__((aligned(128)));
+
+struct snapd_job {
+	uint32_t action_type;
+	uint16_t win_size;		/* Bytes of job data */
+	uint16_t wout_size;		/* Result bytes into the completion */
+	uint64_t tag;			/* Returned as priv_data */
+	uint8_t data[112];
+} __attribute__((aligned(128)));
+
+/* Bytes of ctrl and both rings, data buffers follow */
+static inline uint64_t snapd_rings_size(uint32_t entries)
+{
+	return sizeof(struct snapd_ctrl) +
+		(uint64_t)entries * (sizeof(struct snapd_job) +
+				     sizeof(struct snap_completion));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SNAP_DAEMON_H__ */
@@ -28,6 +28,7 @@ extern "C" {
 #define ACTION_CONTROL_DONE	0x00000002	/* ap_done (Clear on Read) */
 #define ACTION_CONTROL_IDLE	0x00000004	/* ap_idle (Read Only) */
 #define ACTION_CONTROL_RUN	0x00000008	/* ap_ready (Read Only) */
+#define ACTION_CONTROL_STOP	0x00000010	/* Stop at next checkpoint (Write Only) */
 
 #define ACTION_IRQ_CONTROL	0x04		/* Global Interrupt Enable Register */
 #define ACTION_IRQ_CONTROL_ON	0x00000001	/* Global Interrupt Enable (Read/Write) */
@@ -57,6 +58,10 @@ extern "C" {
 #define SNAP_MEMBUS_WIDTH	64		/* bytes */
 #define SNAP_ROUND_UP(x, width) (((x) + (width) - 1) & ~((width) - 1))
 
+/*
+ * Release with free(). For large buffers or buffers used for many jobs
+ * snap_buf_alloc() in libsnap.h is the better choice.
+ */
 static inline void *snap_malloc(size_t size)
 {
 	unsigned int page_size = sysconf(_SC_PAGESIZE);
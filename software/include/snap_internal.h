@@ -20,6 +20,7 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <libsnap.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -68,6 +69,7 @@ struct snap_funcs {
 					      snap_action_flag_t action_flags,
 					      int timeout_sec);
 	int (* detach_action)(struct snap_action *action);
+	int (* abort_action)(struct snap_action *action);
 
 	int (* mmio_write32)(struct snap_card *card, uint64_t offset, uint32_t data);
 	int (* mmio_read32)(struct snap_card *card, uint64_t offset, uint32_t *data);
@@ -75,6 +77,8 @@ struct snap_funcs {
 	int (* mmio_read64)(struct snap_card *card, uint64_t offset, uint64_t *data);
 	void (* card_free)(struct snap_card *card);
 	int (* card_ioctl)(struct snap_card *card, unsigned int cmd, unsigned long arg);
+	int (* wait_irq)(struct snap_card *card, int timeout_sec, int expect_irq);
+	int (* has_action)(struct snap_card *card, snap_action_type_t action_type);
 };
 
 static inline pid_t __gettid(void)
@@ -137,6 +141,12 @@ int pp_trace_enabled(void);
  * simulating high-level behavior of the same and allowing us to
  * implement the host applications even before the real hardware
  * implementation is completely working.
+ *
+ * The registered struct is a template. Each card attaching to the
+ * action gets its own copy, with its own job and state, such that
+ * multiple cards and threads can use the same action type. If the
+ * action needs more state per copy, it can allocate it in init()
+ * and keep it in priv_data, exit() is called before the copy is freed.
  */
 enum snap_action_state {
 	ACTION_IDLE = 0,
@@ -156,6 +166,7 @@ struct snap_sim_action {
 
 	enum snap_action_state state;
 	void *priv_data;
+	struct snap_sim_ctl *ctl;	/* Emulated control, set by libsnap */
 
 	struct snap_queue_workitem job;
 	snap_action_main_t main;
@@ -169,6 +180,9 @@ struct snap_sim_action {
 	int (* mmio_read64) (struct snap_card *card,
 			     uint64_t offset, uint64_t *data);
 
+	int (* init)(struct snap_sim_action *action);
+	void (* exit)(struct snap_sim_action *action);
+
 	struct snap_sim_action *next;
 };
 
@@ -176,6 +190,27 @@ int snap_action_register(struct snap_sim_action *action);
 
 struct snap_sim_action *snap_card_to_sim_action(struct snap_card *card);
 
+/*
+ * Nonzero once the host asked the running job to stop at a checkpoint,
+ * see ACTION_CONTROL_STOP. Long running actions check it between
+ * pieces of work, store how far they got in the job and return with
+ * SNAP_RETC_STOPPED.
+ */
+int snap_sim_action_stopping(struct snap_sim_action *action);
+
+/*
+ * Emulated streaming action, see struct snap_stream_job. Calls run for
+ * a copy of each posted workitem, which sets retc and the output data,
+ * and passes the result back through the completion ring. Returns
+ * once the host asked to stop and all posted work is done. Hardware
+ * polls sq_tail, the emulation backs off when idle to leave the CPU
+ * to the host.
+ */
+typedef void (*snap_stream_run_t)(struct snap_queue_workitem *w, void *priv);
+
+void snap_stream_serve(const struct snap_stream_job *sj,
+		       snap_stream_run_t run, void *priv);
+
 
 #ifdef __cplusplus
 }
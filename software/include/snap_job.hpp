@@ -0,0 +1,170 @@
+#ifndef __SNAP_JOB_HPP__
+#define __SNAP_JOB_HPP__
+
+/**
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Typed jobs for C++ applications, header only, C++11.
+ *
+ * snap::Job<In> keeps the job data of an action directly in the 128
+ * bytes workitem which is passed to the action. Whether the data fits
+ * into the workitem or is passed by extension pointer, and how many
+ * MMIO words go to the action, is decided at compile time. Results
+ * are read back as for snap_job_set() with the same sizes. Job data
+ * which can not work, e.g. results larger than the output registers,
+ * does not compile.
+ *
+ *	snap::Job<memcopy_job> job;
+ *
+ *	snap_addr_set(&job->in, src, size, SNAP_ADDRTYPE_HOST_DRAM,
+ *		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+ *	...
+ *	rc = job.execute(action, timeout);
+ *	if ((rc == 0) && (job.retc() == SNAP_RETC_SUCCESS))
+ *		...
+ *
+ * Without Out, results come back into the job data, like for
+ * snap_job_set() without wout_addr. snap::Job<In, Out> returns them
+ * in a separate struct, see out().
+ *
+ * A job is built once and can be executed many times, only changed
+ * fields need to be set again. It can not be copied, since the
+ * workitem refers to the job itself.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#include <libsnap.h>
+#include <snap_queue.h>
+
+namespace snap {
+
+namespace detail {
+
+/* Job data behind the extension pointer, nothing if inline */
+template <typename In, bool is_inline>
+struct ext_data {
+	In *get(struct snap_queue_workitem *) { return &data; }
+	In data;
+};
+
+template <typename In>
+struct ext_data<In, true> {
+	In *get(struct snap_queue_workitem *wi) {
+		return reinterpret_cast<In *>(wi->user.data);
+	}
+};
+
+template <typename Out>
+struct out_data {
+	static constexpr uint32_t size = sizeof(Out);
+	Out *get() { return &data; }
+	Out data;
+};
+
+template <>
+struct out_data<void> {
+	static constexpr uint32_t size = 0;
+	void *get() { return NULL; }
+};
+
+} /* namespace detail */
+
+template <typename In, typename Out = void>
+class Job {
+	static_assert(std::is_trivially_copyable<In>::value,
+		      "job data is passed to the card as is");
+	static_assert(sizeof(In) % sizeof(uint32_t) == 0,
+		      "job data is passed in 32-bit MMIO words");
+	static_assert(alignof(In) <= 16,
+		      "job data is placed at offset 16 of the workitem");
+	static_assert(std::is_void<Out>::value ||
+		      std::is_trivially_copyable<Out>::value,
+		      "results are read back from the card as is");
+	static_assert(detail::out_data<Out>::size <= SNAP_JOBSIZE,
+		      "results must fit into the output registers");
+	static_assert(detail::out_data<Out>::size % sizeof(uint32_t) == 0,
+		      "results are read in 32-bit MMIO words");
+
+public:
+	/* Job data is passed in the workitem, else by extension pointer */
+	static constexpr bool is_inline = sizeof(In) <= 6 * 16;
+
+	/* Workitem header plus job data or extension pointer */
+	static constexpr unsigned int mmio_in = 16 / sizeof(uint32_t) +
+		(is_inline ? sizeof(In) : sizeof(struct snap_addr)) /
+		sizeof(uint32_t);
+
+	Job() {
+		memset(&wi_, 0, sizeof(wi_));
+		wi_.flags = SNAP_JOBFLAG_EXECUTE;
+		wi_.priv_data = 0xdeadbeefc0febabeull;
+		memset(in(), 0, sizeof(In));
+
+		if (!is_inline) {
+			wi_.user.ext.addr = (unsigned long)in();
+			wi_.user.ext.size = sizeof(In);
+			wi_.user.ext.type = SNAP_ADDRTYPE_HOST_DRAM;
+			wi_.user.ext.flags = (SNAP_ADDRFLAG_EXT |
+					      SNAP_ADDRFLAG_END);
+		}
+		snap_job_set(&cjob_, in(), sizeof(In), out_.get(),
+			     detail::out_data<Out>::size);
+	}
+
+	Job(const Job &) = delete;
+	Job &operator=(const Job &) = delete;
+
+	In *in() { return ext_.get(&wi_); }
+	In *operator->() { return in(); }
+	In &operator*() { return *in(); }
+
+	template <typename O = Out>
+	typename std::enable_if<!std::is_void<O>::value, O &>::type out() {
+		return *out_.get();
+	}
+
+	uint32_t retc() const { return cjob_.retc; }
+
+	/**
+	 * Pass the workitem to an attached action and wait until it is
+	 * done, see snap_action_sync_execute_job().
+	 */
+	int execute(struct snap_action *action, unsigned int timeout_sec) {
+		wi_.flags = SNAP_JOBFLAG_EXECUTE;
+		wi_.retc = 0;
+		cjob_.retc = 0;
+		return snap_action_sync_execute_workitem(action, &wi_,
+				mmio_in, &cjob_, timeout_sec);
+	}
+
+	/* For the C interfaces, e.g. snap_queue_sync_execute_job() */
+	struct snap_job *job() { return &cjob_; }
+
+private:
+	struct snap_queue_workitem wi_ __attribute__((aligned(128)));
+	detail::ext_data<In, is_inline> ext_;
+	detail::out_data<Out> out_;
+	struct snap_job cjob_;
+};
+
+} /* namespace snap */
+
+#endif /* __SNAP_JOB_HPP__ */
@@ -32,6 +32,10 @@ extern "C" {
 #define SNAP_RETC_SUCCESS		0x0102
 #define SNAP_RETC_TIMEOUT		0x0103
 #define SNAP_RETC_FAILURE		0x0104
+#define SNAP_RETC_STOPPED		0x0105 /* Stopped at a checkpoint on
+						  request, the job data tells
+						  how far it got. Submitting it
+						  again resumes the work. */
 
 /* FIXME Constants are too long, I like to type less */
 #define SNAP_ADDRTYPE_UNUSED		0xffff
@@ -69,6 +73,88 @@ static inline void snap_addr_set(struct snap_addr *da,
         da->flags = flags;
 }
 
+/*
+ * Scatter-gather lists
+ *
+ * A struct snap_addr with SNAP_ADDRFLAG_EXT set does not point to the
+ * data itself, but to an array of struct snap_addr in host memory, one
+ * per data fragment. Its size is the total number of data bytes. In
+ * the array, fragments have SNAP_ADDRFLAG_ADDR set, the last fragment
+ * of the list SNAP_ADDRFLAG_END. An entry with SNAP_ADDRFLAG_EXT links
+ * to the next array, such that lists can grow without limit.
+ *
+ * Only actions which check for SNAP_ADDRFLAG_EXT accept such lists.
+ * See snap_sg_alloc() in libsnap.h to build them.
+ */
+
+/*
+ * Completion record
+ *
+ * If a completion record is registered for an action, libsnap sets
+ * SNAP_JOBFLAG_COMPLETION in the workitem flags and passes the host
+ * address of the record in priv_data. Once the job is done, the action
+ * writes its output registers (ACTION_PARAMS_OUT, 128 bytes) to that
+ * address, with SNAP_JOBFLAG_DONE set in flags. libsnap then takes
+ * retc and the job results from host memory instead of reading them
+ * back through MMIO.
+ */
+#define SNAP_JOBFLAG_EXECUTE		0x01 /* Execute the job */
+#define SNAP_JOBFLAG_COMPLETION		0x02 /* priv_data: completion record */
+#define SNAP_JOBFLAG_STREAM		0x04 /* Job is a struct snap_stream_job */
+#define SNAP_JOBFLAG_DONE		0x80 /* Completion record is valid */
+
+typedef struct snap_completion {
+	uint8_t short_action;
+	uint8_t flags;			/* SNAP_JOBFLAG_DONE */
+	uint16_t seq;			/* Seq of the completed job */
+	uint32_t retc;			/* Return code from action */
+	uint64_t priv_data;
+	uint8_t data[112];		/* Job results */
+} __attribute__((aligned(128))) snap_completion_t; /* 128 bytes */
+
+/*
+ * Streaming mode
+ *
+ * A streaming action is started once with SNAP_JOBFLAG_STREAM set and
+ * a struct snap_stream_job as job. It keeps running and takes its work
+ * from a submission ring in host memory, instead of one job per MMIO
+ * start. Each ring entry is a 128 bytes workitem, see struct
+ * snap_queue_workitem, with seq set to the lower 16 bits of its index.
+ *
+ * The host writes entry n to slot n % entries and then sets sq_tail
+ * to n + 1. The action polls sq_tail, runs the entries in order and
+ * writes the output registers of each one into the completion ring
+ * slot of the same index, as a struct snap_completion with
+ * SNAP_JOBFLAG_DONE set last. It sets sq_head to the number of
+ * entries it finished. The host never has more than entries jobs in
+ * flight, so a completion slot is always free when the action needs it.
+ *
+ * Once the host sets SNAP_STREAM_STOP and all entries are done, the
+ * action sets SNAP_STREAM_STOPPED and completes its own job as usual.
+ * The indices are free running 32-bit counters.
+ */
+#define SNAP_STREAM_STOP		0x0001 /* Host: finish and stop */
+#define SNAP_STREAM_STOPPED		0x0001 /* Action: stopped */
+
+typedef struct snap_stream_ctrl {
+	/* Written by the host */
+	uint32_t sq_tail;
+	uint32_t flags;			/* SNAP_STREAM_STOP */
+	uint8_t reserved0[120];
+	/* Written by the action */
+	uint32_t sq_head;
+	uint32_t status;		/* SNAP_STREAM_STOPPED */
+	uint8_t reserved1[120];
+} __attribute__((aligned(128))) snap_stream_ctrl_t; /* 256 bytes */
+
+typedef struct snap_stream_job {
+	uint64_t ctrl_addr;		/* struct snap_stream_ctrl */
+	uint64_t sq_addr;		/* entries * 128 bytes workitems */
+	uint64_t cq_addr;		/* entries * struct snap_completion */
+	uint32_t entries;		/* Power of 2, at most 65536 */
+	uint32_t reserved;
+} snap_stream_job_t;
+
 /*
  * Maximum size of a SNAP job without addr extension, this size is required
  * such that the output MMIO registers will end up at the correct address offset.
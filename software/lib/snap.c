@@ -24,19 +24,36 @@
 #include <errno.h>
 #include <endian.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include <libsnap.h>
 #include <libcxl.h>
 #include <snap_tools.h>
 #include <snap_internal.h>
+#include <snap_btrace.h>
 #include <snap_queue.h>
 #include <snap_s_regs.h>    /* Include SNAP Slave Regs */
 #include <snap_hls_if.h>    /* Include SNAP -> HLS */
+#include <snap_daemon.h>
 
 
 /* Trace hardware implementation */
 static unsigned int snap_trace = 0x0;
 static unsigned int snap_config = 0x0;
+static unsigned int snap_lease_ms = 0;	/* Default idle time for leases */
+static snap_mmio_policy_t snap_mmio_policy = SNAP_MMIO_HWSYNC;
+static unsigned long snap_ctx_gen = 0;	/* Last card context id */
+static pthread_mutex_t snap_cards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_card *snap_cards = NULL;	/* Open cards */
 static struct snap_sim_action *actions = NULL;
 
 #define snap_trace_enabled()  (snap_trace & 0x0001)
@@ -70,6 +87,7 @@ int pp_trace_enabled(void)
 }
 
 #define software_action_enabled()  (snap_config & 0x01)
+#define hybrid_enabled()           (snap_config & 0x02)
 
 #define snap_trace(fmt, ...) do { \
 		if (snap_trace_enabled()) \
@@ -92,6 +110,14 @@ int pp_trace_enabled(void)
 	} while (0)
 
 #define	INVALID_SAT 0x0ffffffff
+#define	SNAP_ATTACH_PROBE_US	1000	/* Attach timeout 0: slot free now? */
+
+enum snap_lease_state {
+	LEASE_NONE = 0,                 /* No lease, action not kept */
+	LEASE_BUSY,                     /* Attached, job in progress */
+	LEASE_IDLE,                     /* Attached, waiting for reuse */
+	LEASE_REAPING,                  /* Being detached, see snap_lease_drop() */
+};
 
 struct snap_card {
 	void *priv;
@@ -103,24 +129,75 @@ struct snap_card {
 	uint16_t vendor_id;
 	uint16_t device_id;
 	snap_action_type_t action_type;	/* Action Type for attach */
-	snap_action_type_t action_typeq;/* Action Type i like to have for q */
-	snap_action_flag_t action_flags;
 	uint32_t sat;                   /* Short Action Type */
 	bool start_attach;
 	snap_action_flag_t flags;       /* Flags from Application */
 	uint16_t seq;                   /* Seq Number */
 	int afu_fd;
 
+	struct snap_funcs *funcs;       /* Hardware or software emulation */
+	struct snap_card *overflow;     /* Software twin, see HYBRID MODE */
+	struct snap_sched *sched;       /* See JOB PRIORITIES, NULL if unused */
 	struct snap_sim_action *action; /* software simulation mode */
 	size_t errinfo_size;            /* Size of errinfo */
 	void *errinfo;                  /* Err info Buffer */
 	struct cxl_event event;         /* Buffer to keep event from IRQ */
 	unsigned int attach_timeout_sec;
-	unsigned int queue_length;      /* unused */
 	uint64_t cap_reg;               /* Capability Register */
 	const char *name;               /* Card name */
+	char *path;                     /* Device path to open more contexts */
+	int numa_node;                  /* Node the card is attached to or -1 */
+
+	/*
+	 * Each thread submitting through snap_sync_execute_job() gets its
+	 * own context, opened on the same device. The card itself is left
+	 * to the job queues, streams and snap_attach_action() users.
+	 */
+	unsigned long ctx_gen;          /* Unique id to validate thread records */
+	pthread_mutex_t ctx_lock;       /* Protects ctx_list */
+	struct snap_card *ctx_list;     /* Contexts of the threads */
+	struct snap_card *ctx_next;
+	struct snap_card *card_next;    /* Open cards, see snap_cards */
+
+	/* Last words written to ACTION_PARAMS_IN, valid while attached */
+	uint32_t param_image[CACHELINE_BYTES / sizeof(uint32_t)];
+	uint32_t param_valid;           /* Bit i set if param_image[i] valid */
+
+	struct snap_completion *crec;   /* Host completion record or NULL */
+	uint16_t crec_seq;              /* Seq of the job using crec */
+
+	/* Job in flight and a request to cancel it, see snap_job_cancel() */
+	struct snap_job *cur_job;
+	struct snap_job *cancel_job;
+	snap_cancel_mode_t cancel_mode;
+	int cancel_fd;                  /* Wakes up hw_wait_irq(), or -1 */
+
+	/* Action kept attached between jobs, see ACTION LEASES */
+	enum snap_lease_state lease_state;
+	unsigned int lease_ms;          /* Idle time before detach, 0: off */
+	snap_action_type_t lease_type;
+	snap_action_flag_t lease_flags;
+	unsigned long long lease_idle_us;
+	bool lease_listed;              /* On the list of the reaper */
+	struct snap_card *lease_next;
+
+	snap_wait_policy_t wait_policy; /* How to wait for job completion */
+	snap_mmio_policy_t mmio_policy; /* Register access of job functions */
+	unsigned long long job_start_us;/* Time the last job got started */
+	unsigned long long job_start_ns;
+	unsigned long long job_avg_us;  /* Moving average of job duration */
+	struct snap_wait_stats wait_stats;
 };
 
+/* Another thread asked to cancel the job this context waits for */
+static inline bool snap_cancel_pending(struct snap_card *card)
+{
+	struct snap_job *cjob = __atomic_load_n(&card->cancel_job,
+						__ATOMIC_ACQUIRE);
+
+	return (cjob != NULL) && (cjob == card->cur_job);
+}
+
 /* Translate Card ID to Name */
 struct card_2_name {
 	const int card_id;
@@ -156,6 +233,9 @@ static const char* snap_card_id_2_name(int card_id)
 /* To be used for software simulation, use funcs provided by action */
 static int snap_map_funcs(struct snap_card *card,
 			  snap_action_type_t action_type);
+static struct snap_funcs software_funcs;
+static struct snap_sim_action *find_action(snap_action_type_t action_type);
+static void sw_cancel_kick(struct snap_card *card);
 
 /*	Get Time in msec */
 static unsigned long tget_ms(void)
@@ -169,264 +249,1271 @@ static unsigned long tget_ms(void)
 	return tms;
 }
 
-static void *hw_snap_card_alloc_dev(const char *path,
-				    uint16_t vendor_id,
-				    uint16_t device_id)
+/*	Get monotonic Time in usec, cheap enough for polling loops */
+static unsigned long long tget_us(void)
 {
-	struct snap_card *dn;
-	struct cxl_afu_h *afu_h = NULL;
-	uint64_t reg;
-	int rc;
-	long id = 0;
-
-	dn = calloc(1, sizeof(*dn));
-	if (NULL == dn)
-		goto __snap_alloc_err;
-
-	dn->priv = NULL;
+	struct timespec now;
 
-	/* Create Err Buffer, If we cannot get it, continue with warning ... */
-	dn->errinfo_size = 0;
-	dn->errinfo = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000ull +
+		(unsigned long long)(now.tv_nsec / 1000);
+}
 
-	snap_trace("%s Enter %s\n", __func__, path);
-	afu_h = cxl_afu_open_dev((char*)path);
-	if (NULL == afu_h)
-		goto __snap_alloc_err;
+/*	Get monotonic Time in nsec, used for latency statistics */
+static unsigned long long tget_ns(void)
+{
+	struct timespec now;
 
-	dn->sat = INVALID_SAT;	/* Invalid Short Action Type stands for not attached */
-	dn->action_type = 0xffffffff;
-	dn->vendor_id = vendor_id;
-	/* Read and check Vendor id if it was given by caller */
-	if (0xffff != vendor_id) {
-		rc = cxl_get_cr_vendor(afu_h, 0, &id);
-		if ((0 != rc) || ((uint16_t)id != vendor_id)) {
-			snap_trace("  %s: ERR Vendor 0x%x Invalid Expect 0x%x\n",
-				__func__, (int)id, (int)vendor_id);
-			goto __snap_alloc_err; }
-		dn->vendor_id = (uint16_t)id;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ull +
+		(unsigned long long)now.tv_nsec;
+}
 
-	dn->device_id = device_id;
-	/* Read and check Device id if it was given by caller */
-	if (0xffff != device_id) {
-		rc = cxl_get_cr_device(afu_h, 0, &id);
-		if ((0 != rc) || ((uint16_t)id != device_id)) {
-			snap_trace("  %s: ERR Device 0x%x Invalid Expect 0x%x\n",
-				__func__, (int)id, (int)device_id);
-			goto __snap_alloc_err;
-		}
-		dn->device_id = (uint16_t)id;
-	}
+/*****************************************************************************
+ * LATENCY STATISTICS
+ * Each thread counts into its own histograms, so recording a sample
+ * takes no lock and no atomic read-modify-write. Readers sum up the
+ * histograms of all threads. When a thread ends, its histograms are
+ * added to the ones of all ended threads and its block is freed.
+ * Buckets are log2 based with 4 linear steps in between, which gives
+ * at most 25% error for percentiles.
+ ****************************************************************************/
 
-	rc = cxl_errinfo_size(afu_h, &dn->errinfo_size);
-	if (0 == rc) {
-		dn->errinfo = malloc(dn->errinfo_size);
-			if (NULL == dn->errinfo) {
-				perror("malloc");
-				goto __snap_alloc_err;
-			}
-	} else
-		snap_trace("  %s: WARN Can not detect Err buffer\n", __func__);
+#define SNAP_STATS_ACTIONS	16	/* Different action types counted */
 
-	snap_trace("  %s: errinfo_size: %d VendorID: %x DeviceID: %x\n", __func__,
-		(int)dn->errinfo_size, (int)vendor_id, (int)device_id);
-	dn->afu_fd = cxl_afu_fd(afu_h);
-	rc = cxl_afu_attach(afu_h, 0);
-	if (0 != rc)
-		goto __snap_alloc_err;
+struct snap_stats_tls {
+	struct snap_stats_tls *next;
+	unsigned int last;		/* Slot used last, likely used again */
+	struct snap_stats stats[SNAP_STATS_ACTIONS];
+};
 
-	if (cxl_mmio_map(afu_h, CXL_MMIO_BIG_ENDIAN) == -1) {
-		snap_trace("  %s: Error Can not mmap\n", __func__);
-		goto __snap_alloc_err;
-	}
+/* Slot i of each thread counts for action type stats_types[i] */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static snap_action_type_t stats_types[SNAP_STATS_ACTIONS];
+static unsigned int stats_ntypes = 0;
+static struct snap_stats_tls *stats_list = NULL;
+static struct snap_stats_hist stats_gone[SNAP_STATS_ACTIONS][SNAP_STATS_PHASES];
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static bool stats_key_ok = false;
+static __thread struct snap_stats_tls *tls_stats = NULL;
+static const char *stats_fname = NULL;
+
+static const char *snap_stats_phase_names[SNAP_STATS_PHASES] = {
+	[SNAP_STATS_ATTACH]	 = "attach",
+	[SNAP_STATS_PARAM_WRITE] = "param_write",
+	[SNAP_STATS_EXECUTE]	 = "execute",
+	[SNAP_STATS_IRQ_WAKEUP]	 = "irq_wakeup",
+	[SNAP_STATS_RESULT_READ] = "result_read",
+	[SNAP_STATS_DETACH]	 = "detach",
+};
 
-#if !defined(_SIM_)
-	rc = cxl_mmio_ptr(afu_h, &dn->mmio_ptr);
-	if (rc != 0)
-		fprintf(stderr, "[%s] cannot get mmio_ptr rc=%d %s\n",
-			__func__, rc, strerror(errno));
-#endif
+const char *snap_stats_phase_name(snap_stats_phase_t phase)
+{
+	if ((unsigned int)phase >= SNAP_STATS_PHASES)
+		return "unknown";
+	return snap_stats_phase_names[phase];
+}
 
-	dn->action_base = 0;
-	cxl_mmio_read64(afu_h, SNAP_S_CIR, &reg);
-	if (0x8000000000000000 & reg)
-		dn->master = true;
-	else	dn->master = false;
-	dn->cir = (int)(reg & 0xffff);
+static inline unsigned int snap_stats_bucket(uint64_t ns)
+{
+	unsigned int msb, idx;
 
-	/* Read and save Capability reg */
-	cxl_mmio_read64(afu_h, SNAP_S_CAP, &reg);
-	dn->cap_reg = reg;
-	/* Get SNAP Card Name */
-	dn->name = snap_card_id_2_name((int)(reg&0xff));
+	if (ns < 4)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	idx = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+	return (idx < SNAP_STATS_BUCKETS) ? idx : SNAP_STATS_BUCKETS - 1;
+}
 
-	dn->afu_h = afu_h;
-	snap_trace("%s Exit %p OK Context: %d Master: %d Card: %s\n", __func__,
-		dn, dn->cir, dn->master, dn->name);
-	return (struct snap_card *)dn;
+/* Largest value counted into bucket idx */
+static uint64_t snap_stats_bucket_max(unsigned int idx)
+{
+	unsigned int msb = idx / 4 + 1;
 
- __snap_alloc_err:
-	if (dn->errinfo)
-		free(dn->errinfo);
-	if (afu_h)
-		cxl_afu_free(afu_h);
-	if (dn)
-		free(dn);
-	snap_trace("%s Exit Err\n", __func__);
-	return NULL;
+	if (idx < 4)
+		return idx;
+	return ((uint64_t)(4 + idx % 4 + 1) << (msb - 2)) - 1;
 }
 
-static int hw_snap_mmio_write32(struct snap_card *card,
-		uint64_t offset, uint32_t data)
+static void snap_stats_merge(struct snap_stats_hist *to,
+			     const struct snap_stats_hist *from);
+
+/* Thread exit, keep the samples of the thread and free its block */
+static void snap_stats_thread_exit(void *arg)
 {
-	int rc = -1;
+	struct snap_stats_tls *t = arg, **pt;
+	unsigned int i, p;
 
-	if ((card) && (card->afu_h)) {
-		offset += card->action_base; /* FIXME use action_*32 instead */
+	/* Later samples of this thread, e.g. detach, get a new block */
+	tls_stats = NULL;
 
-		reg_trace("  %s(%p, %llx, %lx)\n", __func__, card,
-			(long long)offset, (long)data);
-		rc = cxl_mmio_write32(card->afu_h, offset, data);
-	} else {
-		reg_trace("  %s Error\n", __func__);
-		errno = EINVAL;
+	pthread_mutex_lock(&stats_lock);
+	for (pt = &stats_list; *pt != NULL; pt = &(*pt)->next) {
+		if (*pt == t) {
+			*pt = t->next;
+			break;
+		}
 	}
+	for (i = 0; i < stats_ntypes; i++)
+		for (p = 0; p < SNAP_STATS_PHASES; p++)
+			snap_stats_merge(&stats_gone[i][p],
+					 &t->stats[i].phase[p]);
+	pthread_mutex_unlock(&stats_lock);
+	free(t);
+}
 
-	return rc;
+static void snap_stats_key_init(void)
+{
+	int rc = pthread_key_create(&stats_key, snap_stats_thread_exit);
+
+	if (rc != 0)
+		snap_trace("%s: Error %s, statistics of ended threads "
+			   "are kept until exit\n", __func__, strerror(rc));
+	stats_key_ok = (rc == 0);
 }
 
-static int hw_snap_mmio_read32(struct snap_card *card,
-		uint64_t offset, uint32_t *data)
+static struct snap_stats *snap_stats_get(snap_action_type_t action_type)
 {
-	int rc = -1;
+	struct snap_stats_tls *t = tls_stats;
+	unsigned int i, n;
 
-	if ((card) && (card->afu_h)) {
-		offset += card->action_base; /* FIXME use action_*32 instead */
+	if (t == NULL) {
+		pthread_once(&stats_once, snap_stats_key_init);
+		t = calloc(1, sizeof(*t));
+		if (t == NULL)
+			return NULL;
+		pthread_mutex_lock(&stats_lock);
+		t->next = stats_list;
+		stats_list = t;
+		pthread_mutex_unlock(&stats_lock);
+		tls_stats = t;
+		if (stats_key_ok)
+			pthread_setspecific(stats_key, t);
+	}
 
-		rc = cxl_mmio_read32(card->afu_h, offset, data);
-		reg_trace("  %s(%p, %llx, %lx) %d\n", __func__, card,
-			(long long)offset, (long)*data, rc);
-	} else {
-		reg_trace("  %s Error\n", __func__);
-		errno = EINVAL;
+	if (t->stats[t->last].action_type == action_type)
+		return &t->stats[t->last];
+
+	n = __atomic_load_n(&stats_ntypes, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++)
+		if (stats_types[i] == action_type)
+			goto found;
+
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < stats_ntypes; i++)
+		if (stats_types[i] == action_type)
+			break;
+	if ((i == stats_ntypes) && (i < SNAP_STATS_ACTIONS)) {
+		stats_types[i] = action_type;
+		__atomic_store_n(&stats_ntypes, i + 1, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&stats_lock);
+	if (i == SNAP_STATS_ACTIONS)
+		return NULL;		/* Too many action types, drop it */
+ found:
+	t->stats[i].action_type = action_type;
+	t->last = i;
+	return &t->stats[i];
+}
 
-	return rc;
+/* Only the owning thread writes, so plain stores are good enough */
+#define stats_add(x, v) __atomic_store_n(&(x), (x) + (v), __ATOMIC_RELAXED)
+#define stats_set(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static void snap_stats_hist_add(struct snap_stats_hist *h, uint64_t ns)
+{
+	stats_add(h->bucket[snap_stats_bucket(ns)], 1);
+	stats_add(h->sum_ns, ns);
+	if ((h->count == 0) || (ns < h->min_ns))
+		stats_set(h->min_ns, ns);
+	if (ns > h->max_ns)
+		stats_set(h->max_ns, ns);
+	stats_add(h->count, 1);
 }
 
-#if !defined(_SIM_)
-/**
- * FIXME Currently experimental use. We like to figure out if extensive
- *       use of hwsync has negative impact on performance when # threads
- *       raises up.
- */
-int snap_mmio_read32_nohwsync(struct snap_card *card,
-		uint64_t offset, uint32_t *data)
+static void snap_stats_record(snap_action_type_t action_type,
+			      snap_stats_phase_t phase,
+			      unsigned long long t0)
 {
-	int rc = -1;
+	struct snap_stats *s;
+	uint64_t ns = tget_ns() - t0;
 
-	if ((!card) || (!card->afu_h)) {
-		reg_trace("  %s Error\n", __func__);
-		errno = EINVAL;
-		return -1;
-	}
+	if ((action_type == 0) || (action_type == 0xffffffff))
+		return;
+	s = snap_stats_get(action_type);
+	if (s == NULL)
+		return;
 
-	offset += card->action_base; /* FIXME use action_*32 instead */
-	*data = be32toh(*(uint32_t *)(card->mmio_ptr + offset));
+	snap_stats_hist_add(&s->phase[phase], ns);
+}
 
-	reg_trace("  %s(%p, %llx, %lx) %d\n", __func__, card,
-		(long long)offset, (long)*data, rc);
+static void snap_stats_merge(struct snap_stats_hist *to,
+			     const struct snap_stats_hist *from)
+{
+	uint64_t count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	unsigned int i;
 
-	return 0;
+	if (count == 0)
+		return;
+	if ((to->count == 0) || (from->min_ns < to->min_ns))
+		to->min_ns = from->min_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+	to->count += count;
+	to->sum_ns += from->sum_ns;
+	for (i = 0; i < SNAP_STATS_BUCKETS; i++)
+		to->bucket[i] += from->bucket[i];
 }
-#endif
 
-static int hw_snap_mmio_write64(struct snap_card *card,
-				uint64_t offset, uint64_t data)
+int snap_stats_snapshot(struct snap_stats *stats, unsigned int num)
 {
-	int rc = -1;
+	struct snap_stats_tls *t;
+	unsigned int i, p, n;
 
-	reg_trace("  %s(%p, %llx, %llx)\n", __func__, card,
-		  (long long)offset, (long long)data);
-	if ((card) && (card->afu_h)) {
-		rc = cxl_mmio_write64(card->afu_h, offset, data);
-	} else {
+	if ((stats == NULL) && (num != 0)) {
 		errno = EINVAL;
+		return SNAP_EINVAL;
 	}
-	return rc;
+
+	pthread_mutex_lock(&stats_lock);
+	n = stats_ntypes;
+	if (num > n)
+		num = n;
+	if (num)
+		memset(stats, 0, num * sizeof(*stats));
+	for (i = 0; i < num; i++) {
+		stats[i].action_type = stats_types[i];
+		for (p = 0; p < SNAP_STATS_PHASES; p++)
+			snap_stats_merge(&stats[i].phase[p],
+					 &stats_gone[i][p]);
+	}
+
+	for (t = stats_list; t != NULL; t = t->next)
+		for (i = 0; i < num; i++)
+			for (p = 0; p < SNAP_STATS_PHASES; p++)
+				snap_stats_merge(&stats[i].phase[p],
+						 &t->stats[i].phase[p]);
+	pthread_mutex_unlock(&stats_lock);
+	return n;
 }
 
-static int hw_snap_mmio_read64(struct snap_card *card,
-			       uint64_t offset, uint64_t *data)
+void snap_stats_reset(void)
 {
-	int rc = -1;
+	struct snap_stats_tls *t;
+	struct snap_stats_hist *h;
+	unsigned int i, p, b;
+
+	/* Samples recorded while we clear might get lost, that is fine */
+	pthread_mutex_lock(&stats_lock);
+	memset(stats_gone, 0, sizeof(stats_gone));
+	for (t = stats_list; t != NULL; t = t->next) {
+		for (i = 0; i < SNAP_STATS_ACTIONS; i++) {
+			for (p = 0; p < SNAP_STATS_PHASES; p++) {
+				h = &t->stats[i].phase[p];
+				stats_set(h->count, 0);
+				stats_set(h->sum_ns, 0);
+				stats_set(h->min_ns, 0);
+				stats_set(h->max_ns, 0);
+				for (b = 0; b < SNAP_STATS_BUCKETS; b++)
+					stats_set(h->bucket[b], 0);
+			}
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
 
-	if ((card) && (card->afu_h)) {
-		rc = cxl_mmio_read64(card->afu_h, offset, data);
-	} else {
-		errno = EINVAL;
+uint64_t snap_stats_percentile(const struct snap_stats_hist *hist,
+			       double percentile)
+{
+	uint64_t rank, sum = 0, val;
+	unsigned int i;
+
+	if ((hist == NULL) || (hist->count == 0))
+		return 0;
+
+	rank = (uint64_t)(hist->count * percentile / 100.0 + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < SNAP_STATS_BUCKETS; i++) {
+		sum += hist->bucket[i];
+		if (sum >= rank)
+			break;
 	}
-	reg_trace("  %s(%p, %llx, %llx) %d\n", __func__, card,
-		  (long long)offset, (long long)*data, rc);
+	if (i == SNAP_STATS_BUCKETS)
+		return hist->max_ns;
+	val = snap_stats_bucket_max(i);
+	if (val > hist->max_ns)
+		val = hist->max_ns;
+	if (val < hist->min_ns)
+		val = hist->min_ns;
+	return val;
+}
 
-	return rc;
+int snap_stats_dump(FILE *fp)
+{
+	struct snap_stats *stats;
+	struct snap_stats_hist *h;
+	int i, n;
+	unsigned int p;
+
+	/* Action types do not go away, more might show up in between */
+	stats = calloc(SNAP_STATS_ACTIONS, sizeof(*stats));
+	if (stats == NULL) {
+		errno = ENOMEM;
+		return SNAP_ENOMEM;
+	}
+	n = snap_stats_snapshot(stats, SNAP_STATS_ACTIONS);
+
+	fprintf(fp, "{\n  \"unit\": \"ns\",\n  \"actions\": [");
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s\n    { \"action_type\": \"0x%08x\",\n",
+			i ? "," : "", stats[i].action_type);
+		fprintf(fp, "      \"phases\": {");
+		for (p = 0; p < SNAP_STATS_PHASES; p++) {
+			h = &stats[i].phase[p];
+			fprintf(fp, "%s\n        \"%s\": { \"count\": %llu, "
+				"\"min\": %llu, \"avg\": %llu, "
+				"\"p50\": %llu, \"p99\": %llu, "
+				"\"p999\": %llu, \"max\": %llu }",
+				p ? "," : "", snap_stats_phase_name(p),
+				(unsigned long long)h->count,
+				(unsigned long long)h->min_ns,
+				(unsigned long long)(h->count ?
+					h->sum_ns / h->count : 0),
+				(unsigned long long)snap_stats_percentile(h, 50.0),
+				(unsigned long long)snap_stats_percentile(h, 99.0),
+				(unsigned long long)snap_stats_percentile(h, 99.9),
+				(unsigned long long)h->max_ns);
+		}
+		fprintf(fp, "\n      }\n    }");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+	free(stats);
+	return SNAP_OK;
 }
 
-static void hw_snap_card_free(struct snap_card *card)
+/* Registered with atexit() if SNAP_STATS is set */
+static void snap_stats_exit(void)
 {
-	if (!card)
-		return;
+	FILE *fp;
 
-	if (card->errinfo) {
-		__free(card->errinfo);
-		card->errinfo = NULL;
+	if ((strcmp(stats_fname, "-") == 0) ||
+	    (strcmp(stats_fname, "stderr") == 0)) {
+		snap_stats_dump(stderr);
+		return;
 	}
-	if (card->afu_h) {
-		cxl_afu_free(card->afu_h);
-		card->afu_h = NULL;
+	fp = fopen(stats_fname, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "err: Can not write stats to %s: %s\n",
+			stats_fname, strerror(errno));
+		return;
 	}
-	__free(card);
+	snap_stats_dump(fp);
+	fclose(fp);
 }
 
-static int hw_wait_irq(struct snap_card *card, int timeout_sec, int expect_irq)
-{
-	fd_set  set;
-	struct  timeval timeout;
-	int rc = 0;
+/*****************************************************************************
+ * BINARY TRACE
+ * Each thread records into its own ring, see snap_btrace.h. The writer
+ * publishes an event by advancing head, the event number is stored in
+ * the record too, such that a dump can skip events overwritten while
+ * it was copying them.
+ ****************************************************************************/
 
-	snap_trace("  %s: Enter fd: %d Flags: 0x%x Expect irq: %d Timeout: %d sec\n",
-		__func__, card->afu_fd,
-		card->flags, expect_irq, timeout_sec);
+#define SNAP_BTRACE_DEFAULT	16384	/* Events per thread */
 
-__hw_wait_irq_retry:
-	if (!cxl_event_pending(card->afu_h)) {
-		timeout.tv_sec = timeout_sec;
-		timeout.tv_usec = 0;
-		FD_ZERO(&set);
-		FD_SET(card->afu_fd, &set);
+struct snap_btrace_ring {
+	struct snap_btrace_ring *next;
+	pid_t tid;
+	uint32_t mask;			/* Number of events - 1 */
+	uint64_t head;			/* Events recorded so far */
+	struct snap_btrace_rec rec[];
+};
 
-		/* retry_select: */
-		rc = select(card->afu_fd + 1, &set, NULL, NULL, &timeout);
-		if (0 == rc) {
-			snap_trace("    Timeout......\n");
-			rc = EBUSY;
-		} else if ((rc == -1) && (errno == EINTR))
-			/* FIXME I think we should goto retry_select here */
-			rc = EINTR;
-		else rc = 0;
-	} else
-		snap_trace("    Event is Pending ......\n");
+static unsigned int btrace_size = 0;	/* 0: disabled, else power of 2 */
+static const char *btrace_fname = NULL;
+static pthread_mutex_t btrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_btrace_ring *btrace_list = NULL;
+static __thread struct snap_btrace_ring *tls_btrace = NULL;
+static __thread bool tls_btrace_failed = false;
 
-	if (0 == rc) {
-		rc = cxl_read_event(card->afu_h, &card->event);
-		//cxl_fprint_event(stdout, card->event);
-		if (rc < 0) {
-			snap_trace("  %s: cxl_read_event returned %d\n", __func__, rc);
-			goto err_out;
-		}
+int snap_btrace_enabled(void)
+{
+	return btrace_size != 0;
+}
 
-		switch (card->event.header.type) {
+static struct snap_btrace_ring *snap_btrace_ring(void)
+{
+	struct snap_btrace_ring *r;
+
+	if (tls_btrace_failed)
+		return NULL;
+
+	r = calloc(1, sizeof(*r) + btrace_size * sizeof(r->rec[0]));
+	if (r == NULL) {
+		tls_btrace_failed = true;
+		return NULL;
+	}
+	r->tid = __gettid();
+	r->mask = btrace_size - 1;
+
+	/* Stays on the list after the thread ended, to get dumped */
+	pthread_mutex_lock(&btrace_lock);
+	r->next = btrace_list;
+	btrace_list = r;
+	pthread_mutex_unlock(&btrace_lock);
+	tls_btrace = r;
+	return r;
+}
+
+void __snap_btrace(uint32_t event, uint64_t a0, uint64_t a1, uint64_t a2)
+{
+	struct snap_btrace_ring *r = tls_btrace;
+	struct snap_btrace_rec *e;
+	uint64_t head;
+
+	if ((r == NULL) && ((r = snap_btrace_ring()) == NULL))
+		return;
+
+	head = r->head;
+	e = &r->rec[head & r->mask];
+	/* Invalidate first, a concurrent dump must not take half of it */
+	__atomic_store_n(&e->seq, 0xffffffff, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->ts = tget_ns();
+	e->event = event;
+	e->arg[0] = a0;
+	e->arg[1] = a1;
+	e->arg[2] = a2;
+	__atomic_store_n(&e->seq, (uint32_t)head, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy the events of one ring oldest first, returns the number copied */
+static uint32_t snap_btrace_copy(struct snap_btrace_ring *r,
+				 struct snap_btrace_rec *to, uint64_t *lost)
+{
+	uint64_t head, first, i;
+	uint32_t n = 0;
+	struct snap_btrace_rec *e;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = (head > (uint64_t)r->mask + 1) ? head - r->mask - 1 : 0;
+	for (i = first; i < head; i++) {
+		e = &r->rec[i & r->mask];
+		to[n] = *e;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* The writer might have wrapped around in the meantime */
+		if ((to[n].seq != (uint32_t)i) ||
+		    (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) !=
+		     (uint32_t)i))
+			continue;
+		n++;
+	}
+	*lost = head - n;
+	return n;
+}
+
+int snap_btrace_dump(const char *fname)
+{
+	FILE *fp;
+	struct snap_btrace_ring *r;
+	struct snap_btrace_hdr hdr;
+	struct snap_btrace_thread th;
+	struct snap_btrace_rec *rec;
+	int rc = SNAP_OK;
+
+	if ((fname == NULL) || (btrace_size == 0)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	rec = malloc(btrace_size * sizeof(*rec));
+	if (rec == NULL) {
+		errno = ENOMEM;
+		return SNAP_ENOMEM;
+	}
+	fp = fopen(fname, "w");
+	if (fp == NULL) {
+		free(rec);
+		return SNAP_EIO;
+	}
+
+	pthread_mutex_lock(&btrace_lock);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_BTRACE_MAGIC, sizeof(hdr.magic));
+	hdr.rec_size = sizeof(struct snap_btrace_rec);
+	hdr.pid = getpid();
+	for (r = btrace_list; r != NULL; r = r->next)
+		hdr.nthreads++;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		rc = SNAP_EIO;
+
+	for (r = btrace_list; (r != NULL) && (rc == SNAP_OK); r = r->next) {
+		memset(&th, 0, sizeof(th));
+		th.tid = r->tid;
+		th.count = snap_btrace_copy(r, rec, &th.lost);
+		if ((fwrite(&th, sizeof(th), 1, fp) != 1) ||
+		    (fwrite(rec, sizeof(*rec), th.count, fp) != th.count))
+			rc = SNAP_EIO;
+	}
+	pthread_mutex_unlock(&btrace_lock);
+
+	if (fclose(fp) != 0)
+		rc = SNAP_EIO;
+	free(rec);
+	return rc;
+}
+
+/* Registered with atexit() if SNAP_BTRACE is set */
+static void snap_btrace_exit(void)
+{
+	if (snap_btrace_dump(btrace_fname) != SNAP_OK)
+		fprintf(stderr, "err: Can not write trace to %s: %s\n",
+			btrace_fname, strerror(errno));
+}
+
+/*****************************************************************************
+ * DMA BUFFERS
+ * Buffers are mmap()ed in size classes and kept in a pool when freed,
+ * such that jobs working on buffers of similar size do not pay for the
+ * mapping and the page faults again. Live buffers are found by address
+ * in buf_used, free ones by size in buf_free.
+ ****************************************************************************/
+
+#define SNAP_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+#define SNAP_BUF_HASH		256
+#define SNAP_BUF_CACHE_DEFAULT	(256 * 1024 * 1024)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED		1
+#endif
+
+struct snap_buf {
+	void *addr;
+	size_t size;			/* Mapped size, the size class */
+	int node;			/* NUMA node or -1 */
+	unsigned int flags;		/* SNAP_BUF_HUGE: on huge pages,
+					   SNAP_BUF_PREFAULT: pages touched */
+	struct snap_buf *next;
+};
+
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_buf *buf_used[SNAP_BUF_HASH];
+static struct snap_buf *buf_free[64];	/* By msb of the size */
+static size_t buf_cached = 0;
+static size_t buf_cache_max = SNAP_BUF_CACHE_DEFAULT;
+
+/*
+ * The cxl device is below the PCI device of the card in sysfs, go up
+ * until a numa_node attribute is found.
+ */
+static int snap_card_numa_node(const char *path)
+{
+	char sysfs[PATH_MAX], dev[PATH_MAX], fname[PATH_MAX + 16];
+	const char *name = strrchr(path, '/');
+	char *p;
+	FILE *fp;
+	int node = -1;
+
+	snprintf(sysfs, sizeof(sysfs), "/sys/class/cxl/%s",
+		 name ? name + 1 : path);
+	if (realpath(sysfs, dev) == NULL)
+		return -1;
+
+	while ((p = strrchr(dev, '/')) != NULL && p != dev) {
+		snprintf(fname, sizeof(fname), "%s/numa_node", dev);
+		fp = fopen(fname, "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%d", &node) != 1)
+				node = -1;
+			fclose(fp);
+			break;
+		}
+		*p = '\0';
+	}
+	snap_trace("  %s: %s node: %d\n", __func__, dev, node);
+	return node;
+}
+
+static unsigned int snap_buf_hash(void *addr)
+{
+	return ((unsigned long)addr >> 12) % SNAP_BUF_HASH;
+}
+
+static int snap_buf_msb(size_t size)
+{
+	return 63 - __builtin_clzll((unsigned long long)size);
+}
+
+/* Round up to one of 4 classes per power of two, at least to unit */
+static size_t snap_buf_class(size_t size, size_t unit)
+{
+	size_t step;
+	int msb;
+
+	size = SNAP_ROUND_UP(size, unit);
+	msb = snap_buf_msb(size);
+	step = (msb >= 2) ? ((size_t)1 << (msb - 2)) : 1;
+	if ((size & (size - 1)) == 0)
+		return size;
+	if (step < unit)
+		step = unit;
+	return SNAP_ROUND_UP(size, step);
+}
+
+static void snap_buf_prefault(struct snap_buf *b)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	volatile uint8_t *p = b->addr;
+	size_t offs;
+
+	for (offs = 0; offs < b->size; offs += page)
+		p[offs] = 0;
+	b->flags |= SNAP_BUF_PREFAULT;
+}
+
+static int snap_buf_map(struct snap_buf *b)
+{
+	uint8_t *p, *a;
+	size_t extra = 0;
+	unsigned long mask;
+
+	if (b->flags & SNAP_BUF_HUGE) {
+		/* Reserved huge pages first, else transparent huge pages */
+		p = mmap(NULL, b->size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			goto mapped;
+		extra = SNAP_HUGE_PAGE_SIZE;
+	}
+
+	p = mmap(NULL, b->size + extra, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	if (extra) {
+		a = (uint8_t *)SNAP_ROUND_UP((unsigned long)p,
+					     SNAP_HUGE_PAGE_SIZE);
+		if (a != p)
+			munmap(p, a - p);
+		if (a + b->size != p + b->size + extra)
+			munmap(a + b->size, (p + extra) - a);
+		p = a;
+		madvise(p, b->size, MADV_HUGEPAGE);
+	}
+
+ mapped:
+	/* Only a preference, must not fail if the node is full */
+	if ((b->node >= 0) && (b->node < (int)(8 * sizeof(mask)))) {
+		mask = 1ul << b->node;
+		if (syscall(SYS_mbind, p, b->size, MPOL_PREFERRED, &mask,
+			    8 * sizeof(mask) + 1, 0) != 0)
+			snap_trace("  %s: mbind node %d failed: %s\n",
+				   __func__, b->node, strerror(errno));
+	}
+	b->addr = p;
+	return 0;
+}
+
+void *snap_buf_alloc(struct snap_card *card, size_t size, unsigned int flags)
+{
+	struct snap_buf *b, **pb;
+	size_t unit = sysconf(_SC_PAGESIZE);
+	unsigned int huge = 0;
+	int node = card ? card->numa_node : -1;
+
+	if (size == 0)
+		size = 1;		/* Like malloc(0), a unique pointer */
+	if ((flags & SNAP_BUF_HUGE) && (size >= SNAP_HUGE_PAGE_SIZE)) {
+		huge = SNAP_BUF_HUGE;
+		unit = SNAP_HUGE_PAGE_SIZE;
+	}
+	size = snap_buf_class(size, unit);
+
+	pthread_mutex_lock(&buf_lock);
+	for (pb = &buf_free[snap_buf_msb(size)]; *pb; pb = &(*pb)->next) {
+		b = *pb;
+		if ((b->size == size) && (b->node == node) &&
+		    ((b->flags & SNAP_BUF_HUGE) == huge)) {
+			*pb = b->next;
+			buf_cached -= size;
+			goto found;
+		}
+	}
+	pthread_mutex_unlock(&buf_lock);
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	b->size = size;
+	b->node = node;
+	b->flags = huge;
+	if (snap_buf_map(b) != 0) {
+		free(b);
+		errno = ENOMEM;
+		return NULL;
+	}
+	snap_trace("%s: mapped %p size: %zu node: %d flags: 0x%x\n",
+		   __func__, b->addr, b->size, b->node, b->flags);
+	pthread_mutex_lock(&buf_lock);
+
+ found:
+	b->next = buf_used[snap_buf_hash(b->addr)];
+	buf_used[snap_buf_hash(b->addr)] = b;
+	pthread_mutex_unlock(&buf_lock);
+
+	if ((flags & SNAP_BUF_PREFAULT) && !(b->flags & SNAP_BUF_PREFAULT))
+		snap_buf_prefault(b);
+	return b->addr;
+}
+
+void snap_buf_free(void *buf)
+{
+	struct snap_buf *b, **pb;
+
+	if (buf == NULL)
+		return;
+
+	pthread_mutex_lock(&buf_lock);
+	for (pb = &buf_used[snap_buf_hash(buf)]; *pb; pb = &(*pb)->next)
+		if ((*pb)->addr == buf)
+			break;
+	b = *pb;
+	if (b == NULL) {
+		pthread_mutex_unlock(&buf_lock);
+		snap_trace("%s: %p is no snap buffer\n", __func__, buf);
+		return;
+	}
+	*pb = b->next;
+
+	if (buf_cached + b->size <= buf_cache_max) {
+		b->next = buf_free[snap_buf_msb(b->size)];
+		buf_free[snap_buf_msb(b->size)] = b;
+		buf_cached += b->size;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&buf_lock);
+
+	if (b) {
+		munmap(b->addr, b->size);
+		free(b);
+	}
+}
+
+void snap_buf_trim(void)
+{
+	struct snap_buf *b, *list = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&buf_lock);
+	for (i = 0; i < ARRAY_SIZE(buf_free); i++) {
+		while ((b = buf_free[i]) != NULL) {
+			buf_free[i] = b->next;
+			b->next = list;
+			list = b;
+		}
+	}
+	buf_cached = 0;
+	pthread_mutex_unlock(&buf_lock);
+
+	while ((b = list) != NULL) {
+		list = b->next;
+		munmap(b->addr, b->size);
+		free(b);
+	}
+}
+
+/*****************************************************************************
+ * SCATTER-GATHER LISTS
+ * The list is built in arrays of num entries. The last entry of each
+ * array is kept free, it becomes the link once the next array is needed.
+ ****************************************************************************/
+
+#define SNAP_SG_ENTRIES_DEFAULT	256	/* 4 KiB arrays */
+
+struct snap_sg {
+	struct snap_addr *head;		/* First array */
+	struct snap_addr *cur;		/* Array being filled */
+	struct snap_addr *last;		/* Last fragment, has END set */
+	unsigned int n;			/* Used entries in cur */
+	unsigned int num;		/* Entries per array */
+	unsigned int entries;		/* Fragments in total */
+	uint64_t total;			/* Bytes in total */
+};
+
+static struct snap_addr *snap_sg_array(unsigned int num)
+{
+	struct snap_addr *a = NULL;
+
+	if (posix_memalign((void **)&a, CACHELINE_BYTES, num * sizeof(*a)))
+		return NULL;
+	memset(a, 0, num * sizeof(*a));
+	a[0].type = SNAP_ADDRTYPE_UNUSED;
+	a[0].flags = SNAP_ADDRFLAG_END;	/* Empty list */
+	return a;
+}
+
+/* Free the arrays linked after the first one */
+static void snap_sg_free_next(struct snap_sg *sg)
+{
+	struct snap_addr *a = sg->head, *next;
+
+	while (a[sg->num - 1].flags & SNAP_ADDRFLAG_EXT) {
+		next = (struct snap_addr *)(unsigned long)a[sg->num - 1].addr;
+		if (a != sg->head)
+			free(a);
+		else
+			memset(&a[sg->num - 1], 0, sizeof(*a));
+		a = next;
+	}
+	if (a != sg->head)
+		free(a);
+}
+
+struct snap_sg *snap_sg_alloc(unsigned int num)
+{
+	struct snap_sg *sg;
+
+	if (num == 0)
+		num = SNAP_SG_ENTRIES_DEFAULT;
+	if (num < 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+	sg = calloc(1, sizeof(*sg));
+	if (sg == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	sg->num = num;
+	sg->head = snap_sg_array(num);
+	if (sg->head == NULL) {
+		free(sg);
+		errno = ENOMEM;
+		return NULL;
+	}
+	sg->cur = sg->head;
+	return sg;
+}
+
+int snap_sg_add(struct snap_sg *sg, const void *addr, uint32_t size,
+		snap_addrtype_t type)
+{
+	struct snap_addr *next, *e;
+
+	if ((sg == NULL) || (sg->total + size > UINT32_MAX))
+		return SNAP_EINVAL;
+
+	if (sg->n == sg->num - 1) {
+		next = snap_sg_array(sg->num);
+		if (next == NULL)
+			return SNAP_ENOMEM;
+		snap_addr_set(&sg->cur[sg->n], next, sg->num * sizeof(*next),
+			      SNAP_ADDRTYPE_HOST_DRAM, SNAP_ADDRFLAG_EXT);
+		sg->cur = next;
+		sg->n = 0;
+	}
+	e = &sg->cur[sg->n++];
+	snap_addr_set(e, addr, size, type,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_END);
+	if (sg->last)
+		sg->last->flags &= ~SNAP_ADDRFLAG_END;
+	sg->last = e;
+	sg->entries++;
+	sg->total += size;
+	return SNAP_OK;
+}
+
+unsigned int snap_sg_entries(const struct snap_sg *sg)
+{
+	return sg->entries;
+}
+
+uint64_t snap_sg_total(const struct snap_sg *sg)
+{
+	return sg->total;
+}
+
+void snap_sg_addr_set(struct snap_addr *da, const struct snap_sg *sg,
+		      snap_addrflag_t flags)
+{
+	snap_addr_set(da, sg->head, (uint32_t)sg->total,
+		      SNAP_ADDRTYPE_HOST_DRAM, flags | SNAP_ADDRFLAG_EXT);
+}
+
+void snap_sg_reset(struct snap_sg *sg)
+{
+	snap_sg_free_next(sg);
+	memset(sg->head, 0, sg->num * sizeof(*sg->head));
+	sg->head[0].type = SNAP_ADDRTYPE_UNUSED;
+	sg->head[0].flags = SNAP_ADDRFLAG_END;
+	sg->cur = sg->head;
+	sg->last = NULL;
+	sg->n = 0;
+	sg->entries = 0;
+	sg->total = 0;
+}
+
+void snap_sg_free(struct snap_sg *sg)
+{
+	if (sg == NULL)
+		return;
+	snap_sg_free_next(sg);
+	free(sg->head);
+	free(sg);
+}
+
+void snap_sg_iter_init(struct snap_sg_iter *it, const struct snap_addr *da)
+{
+	if (da->flags & SNAP_ADDRFLAG_EXT) {
+		it->ent = (const struct snap_addr *)(unsigned long)da->addr;
+		return;
+	}
+	it->one = *da;
+	it->one.flags |= SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_END;
+	it->ent = &it->one;
+}
+
+const struct snap_addr *snap_sg_next(struct snap_sg_iter *it)
+{
+	const struct snap_addr *e;
+
+	while ((e = it->ent) != NULL) {
+		if (e->flags & SNAP_ADDRFLAG_EXT) {
+			it->ent = (const struct snap_addr *)
+				(unsigned long)e->addr;
+			continue;
+		}
+		it->ent = (e->flags & SNAP_ADDRFLAG_END) ? NULL : e + 1;
+		if ((e->flags & SNAP_ADDRFLAG_ADDR) && (e->size != 0))
+			return e;
+	}
+	return NULL;
+}
+
+uint64_t snap_sg_copy(const struct snap_addr *dst,
+		      const struct snap_addr *src)
+{
+	struct snap_sg_iter di, si;
+	const struct snap_addr *d, *s;
+	uint64_t doffs = 0, soffs = 0, copied = 0, n;
+
+	snap_sg_iter_init(&di, dst);
+	snap_sg_iter_init(&si, src);
+	d = snap_sg_next(&di);
+	s = snap_sg_next(&si);
+	while ((d != NULL) && (s != NULL)) {
+		if ((d->type != SNAP_ADDRTYPE_HOST_DRAM) ||
+		    (s->type != SNAP_ADDRTYPE_HOST_DRAM))
+			break;
+		n = MIN(d->size - doffs, s->size - soffs);
+		memcpy((uint8_t *)(unsigned long)d->addr + doffs,
+		       (uint8_t *)(unsigned long)s->addr + soffs, n);
+		copied += n;
+		doffs += n;
+		soffs += n;
+		if (doffs == d->size) {
+			d = snap_sg_next(&di);
+			doffs = 0;
+		}
+		if (soffs == s->size) {
+			s = snap_sg_next(&si);
+			soffs = 0;
+		}
+	}
+	return copied;
+}
+
+static void *hw_snap_card_alloc_dev(const char *path,
+				    uint16_t vendor_id,
+				    uint16_t device_id)
+{
+	struct snap_card *dn;
+	struct cxl_afu_h *afu_h = NULL;
+	uint64_t reg;
+	int rc;
+	long id = 0;
+
+	dn = calloc(1, sizeof(*dn));
+	if (NULL == dn)
+		goto __snap_alloc_err;
+
+	dn->priv = NULL;
+	dn->cancel_fd = -1;
+
+	/* Create Err Buffer, If we cannot get it, continue with warning ... */
+	dn->errinfo_size = 0;
+	dn->errinfo = NULL;
+
+	snap_trace("%s Enter %s\n", __func__, path);
+	afu_h = cxl_afu_open_dev((char*)path);
+	if (NULL == afu_h)
+		goto __snap_alloc_err;
+
+	dn->sat = INVALID_SAT;	/* Invalid Short Action Type stands for not attached */
+	dn->action_type = 0xffffffff;
+	dn->vendor_id = vendor_id;
+	/* Read and check Vendor id if it was given by caller */
+	if (0xffff != vendor_id) {
+		rc = cxl_get_cr_vendor(afu_h, 0, &id);
+		if ((0 != rc) || ((uint16_t)id != vendor_id)) {
+			snap_trace("  %s: ERR Vendor 0x%x Invalid Expect 0x%x\n",
+				__func__, (int)id, (int)vendor_id);
+			goto __snap_alloc_err; }
+		dn->vendor_id = (uint16_t)id;
+	}
+
+	dn->device_id = device_id;
+	/* Read and check Device id if it was given by caller */
+	if (0xffff != device_id) {
+		rc = cxl_get_cr_device(afu_h, 0, &id);
+		if ((0 != rc) || ((uint16_t)id != device_id)) {
+			snap_trace("  %s: ERR Device 0x%x Invalid Expect 0x%x\n",
+				__func__, (int)id, (int)device_id);
+			goto __snap_alloc_err;
+		}
+		dn->device_id = (uint16_t)id;
+	}
+
+	rc = cxl_errinfo_size(afu_h, &dn->errinfo_size);
+	if (0 == rc) {
+		dn->errinfo = malloc(dn->errinfo_size);
+			if (NULL == dn->errinfo) {
+				perror("malloc");
+				goto __snap_alloc_err;
+			}
+	} else
+		snap_trace("  %s: WARN Can not detect Err buffer\n", __func__);
+
+	snap_trace("  %s: errinfo_size: %d VendorID: %x DeviceID: %x\n", __func__,
+		(int)dn->errinfo_size, (int)vendor_id, (int)device_id);
+	dn->afu_fd = cxl_afu_fd(afu_h);
+	/* Without it snap_job_cancel() waits for the next interrupt */
+	dn->cancel_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	rc = cxl_afu_attach(afu_h, 0);
+	if (0 != rc)
+		goto __snap_alloc_err;
+
+	if (cxl_mmio_map(afu_h, CXL_MMIO_BIG_ENDIAN) == -1) {
+		snap_trace("  %s: Error Can not mmap\n", __func__);
+		goto __snap_alloc_err;
+	}
+
+#if !defined(_SIM_)
+	rc = cxl_mmio_ptr(afu_h, &dn->mmio_ptr);
+	if (rc != 0)
+		fprintf(stderr, "[%s] cannot get mmio_ptr rc=%d %s\n",
+			__func__, rc, strerror(errno));
+#endif
+
+	dn->action_base = 0;
+	dn->numa_node = snap_card_numa_node(path);
+	cxl_mmio_read64(afu_h, SNAP_S_CIR, &reg);
+	if (0x8000000000000000 & reg)
+		dn->master = true;
+	else	dn->master = false;
+	dn->cir = (int)(reg & 0xffff);
+
+	/* Read and save Capability reg */
+	cxl_mmio_read64(afu_h, SNAP_S_CAP, &reg);
+	dn->cap_reg = reg;
+	/* Get SNAP Card Name */
+	dn->name = snap_card_id_2_name((int)(reg&0xff));
+
+	dn->afu_h = afu_h;
+	snap_trace("%s Exit %p OK Context: %d Master: %d Card: %s\n", __func__,
+		dn, dn->cir, dn->master, dn->name);
+	return (struct snap_card *)dn;
+
+ __snap_alloc_err:
+	if (dn->errinfo)
+		free(dn->errinfo);
+	if (dn->cancel_fd >= 0)
+		close(dn->cancel_fd);
+	if (afu_h)
+		cxl_afu_free(afu_h);
+	if (dn)
+		free(dn);
+	snap_trace("%s Exit Err\n", __func__);
+	return NULL;
+}
+
+static int hw_snap_mmio_write32(struct snap_card *card,
+		uint64_t offset, uint32_t data)
+{
+	int rc = -1;
+
+	if ((card) && (card->afu_h)) {
+		offset += card->action_base; /* FIXME use action_*32 instead */
+
+		reg_trace("  %s(%p, %llx, %lx)\n", __func__, card,
+			(long long)offset, (long)data);
+		rc = cxl_mmio_write32(card->afu_h, offset, data);
+		snap_btrace(SNAP_BT_MMIO_WRITE32, card, offset, data);
+	} else {
+		reg_trace("  %s Error\n", __func__);
+		errno = EINVAL;
+	}
+
+	return rc;
+}
+
+static int hw_snap_mmio_read32(struct snap_card *card,
+		uint64_t offset, uint32_t *data)
+{
+	int rc = -1;
+
+	if ((card) && (card->afu_h)) {
+		offset += card->action_base; /* FIXME use action_*32 instead */
+
+		rc = cxl_mmio_read32(card->afu_h, offset, data);
+		snap_btrace(SNAP_BT_MMIO_READ32, card, offset, *data);
+		reg_trace("  %s(%p, %llx, %lx) %d\n", __func__, card,
+			(long long)offset, (long)*data, rc);
+	} else {
+		reg_trace("  %s Error\n", __func__);
+		errno = EINVAL;
+	}
+
+	return rc;
+}
+
+/*
+ * Direct access to the mapped registers, without ordering. libcxl maps
+ * them CXL_MMIO_BIG_ENDIAN, the byte order is swapped the same way.
+ */
+static inline void mmio_out32(struct snap_card *card, uint64_t offset,
+			      uint32_t data)
+{
+	*(volatile uint32_t *)((uint8_t *)card->mmio_ptr + offset) =
+		htobe32(data);
+}
+
+static inline uint32_t mmio_in32(struct snap_card *card, uint64_t offset)
+{
+	return be32toh(*(volatile uint32_t *)
+		       ((uint8_t *)card->mmio_ptr + offset));
+}
+
+static inline void mmio_out64(struct snap_card *card, uint64_t offset,
+			      uint64_t data)
+{
+	*(volatile uint64_t *)((uint8_t *)card->mmio_ptr + offset) =
+		htobe64(data);
+}
+
+static inline uint64_t mmio_in64(struct snap_card *card, uint64_t offset)
+{
+	return be64toh(*(volatile uint64_t *)
+		       ((uint8_t *)card->mmio_ptr + offset));
+}
+
+static int hw_snap_mmio_write64(struct snap_card *card,
+				uint64_t offset, uint64_t data)
+{
+	int rc = -1;
+
+	reg_trace("  %s(%p, %llx, %llx)\n", __func__, card,
+		  (long long)offset, (long long)data);
+	if ((card) && (card->afu_h)) {
+		rc = cxl_mmio_write64(card->afu_h, offset, data);
+		snap_btrace(SNAP_BT_MMIO_WRITE64, card, offset, data);
+	} else {
+		errno = EINVAL;
+	}
+	return rc;
+}
+
+static int hw_snap_mmio_read64(struct snap_card *card,
+			       uint64_t offset, uint64_t *data)
+{
+	int rc = -1;
+
+	if ((card) && (card->afu_h)) {
+		rc = cxl_mmio_read64(card->afu_h, offset, data);
+		snap_btrace(SNAP_BT_MMIO_READ64, card, offset, *data);
+	} else {
+		errno = EINVAL;
+	}
+	reg_trace("  %s(%p, %llx, %llx) %d\n", __func__, card,
+		  (long long)offset, (long long)*data, rc);
+
+	return rc;
+}
+
+static void hw_snap_card_free(struct snap_card *card)
+{
+	if (!card)
+		return;
+
+	if (card->errinfo) {
+		__free(card->errinfo);
+		card->errinfo = NULL;
+	}
+	if (card->afu_h) {
+		cxl_afu_free(card->afu_h);
+		card->afu_h = NULL;
+	}
+	if (card->cancel_fd >= 0)
+		close(card->cancel_fd);
+	__free(card);
+}
+
+static int hw_wait_irq(struct snap_card *card, int timeout_sec, int expect_irq)
+{
+	fd_set  set;
+	struct  timeval timeout;
+	int rc = 0, nfds;
+	uint64_t kick;
+
+	snap_trace("  %s: Enter fd: %d Flags: 0x%x Expect irq: %d Timeout: %d sec\n",
+		__func__, card->afu_fd,
+		card->flags, expect_irq, timeout_sec);
+	snap_btrace(SNAP_BT_IRQ_WAIT, card, expect_irq, timeout_sec);
+
+__hw_wait_irq_retry:
+	if (!cxl_event_pending(card->afu_h)) {
+		timeout.tv_sec = timeout_sec;
+		timeout.tv_usec = 0;
+		FD_ZERO(&set);
+		FD_SET(card->afu_fd, &set);
+		nfds = card->afu_fd + 1;
+		if (card->cancel_fd >= 0) {
+			FD_SET(card->cancel_fd, &set);
+			nfds = MAX(nfds, card->cancel_fd + 1);
+		}
+
+		/* retry_select: */
+		rc = select(nfds, &set, NULL, NULL, &timeout);
+		if (0 == rc) {
+			snap_trace("    Timeout......\n");
+			rc = EBUSY;
+		} else if ((rc == -1) && (errno == EINTR))
+			/* FIXME I think we should goto retry_select here */
+			rc = EINTR;
+		else if ((card->cancel_fd >= 0) &&
+			 FD_ISSET(card->cancel_fd, &set) &&
+			 !FD_ISSET(card->afu_fd, &set)) {
+			/* Woken up by snap_job_cancel() */
+			if (read(card->cancel_fd, &kick, sizeof(kick)) < 0)
+				snap_trace("    Cancel fd: %s\n", strerror(errno));
+			rc = ECANCELED;
+		} else rc = 0;
+	} else
+		snap_trace("    Event is Pending ......\n");
+
+	if (0 == rc) {
+		rc = cxl_read_event(card->afu_h, &card->event);
+		//cxl_fprint_event(stdout, card->event);
+		if (rc < 0) {
+			snap_trace("  %s: cxl_read_event returned %d\n", __func__, rc);
+			goto err_out;
+		}
+
+		switch (card->event.header.type) {
 
 		case CXL_EVENT_AFU_INTERRUPT:
 			snap_trace("  %s:     Got Event flags: %d irq: %d\n", __func__,
@@ -436,734 +1523,4104 @@ __hw_wait_irq_retry:
 				snap_trace("  %s:     Wrong IRQ.. Retry !\n", __func__);
 				goto __hw_wait_irq_retry;
 			}
-			rc = 0;
+			rc = 0;
+			break;
+
+		case CXL_EVENT_DATA_STORAGE:  {
+			struct cxl_event_data_storage *ds = &card->event.fault;
+
+			snap_trace("  %s: CXL_EVENT_DATA_STORAGE\n", __func__);
+			snap_trace("      flags=%04x addr=%08llx dsisr=%08llx\n",
+				ds->flags, (long long)ds->addr, (long long)ds->dsisr);
+			rc = EFAULT;
+			break;
+		}
+
+		case CXL_EVENT_AFU_ERROR:
+		//case CXL_EVENT_READ_FAIL:
+		default:
+			snap_trace("  %s: AFU_ERROR %d flags: 0x%x error: 0x%016llx\n",
+				__func__, card->event.header.type,
+				card->event.afu_error.flags,
+				(long long)card->event.afu_error.error);
+			rc = EINTR;
+			break;
+		}
+	}
+
+ err_out:
+	snap_btrace(SNAP_BT_IRQ_DONE, card, expect_irq, rc);
+	snap_trace("  %s: Exit fd: %d rc: %d\n", __func__,
+		card->afu_fd, rc);
+	return rc;
+}
+
+/* Throw away events which arrived after we saw the action done by polling */
+static void hw_drain_irq(struct snap_card *card)
+{
+	if (card->afu_h == NULL)
+		return;
+
+	while (cxl_event_pending(card->afu_h)) {
+		if (cxl_read_event(card->afu_h, &card->event) < 0)
+			break;
+		snap_trace("  %s: dropped event type %d\n", __func__,
+			   card->event.header.type);
+	}
+}
+
+/* Search the Action Type Register Index for the short action type */
+static uint32_t hw_find_sat(struct snap_card *card,
+			    snap_action_type_t action_type)
+{
+	int i;
+	uint64_t data;
+	int maid;                       /* Max Acition Id's */
+
+	hw_snap_mmio_read64(card, SNAP_S_SSR, &data);
+	/* Check if configure Slave s done */
+	if (0x100 != (data & 0x100)) {
+		snap_trace("%s Error AFU SLAVE need's setup\n", __func__);
+		return INVALID_SAT;
+	}
+	maid = (int)(data & 0xf) + 1;	/* Max Actions */
+
+	for (i = 0; i < maid; i++) {
+		hw_snap_mmio_read64(card, SNAP_S_ATRI + i*8, &data);
+		if (action_type == (snap_action_type_t)(data & 0xffffffff))
+			return (uint32_t)(data >>  32ll);
+	}
+	return INVALID_SAT;
+}
+
+static int hw_has_action(struct snap_card *card,
+			 snap_action_type_t action_type)
+{
+	return hw_find_sat(card, action_type) != INVALID_SAT;
+}
+
+/*
+ * Take back an attach request which did not complete in time. Else the
+ * job manager would still attach the action once a slot gets free, to
+ * a context which no longer waits for it, and nobody else could use it.
+ */
+static void hw_attach_withdraw(struct snap_card *card)
+{
+	uint64_t data;
+	unsigned long long t0 = tget_us();
+
+	hw_snap_mmio_write64(card, SNAP_S_JCR, SNAP_JCR_STOP);
+	card->start_attach = true;      /* Ask again on the next attach */
+	do {
+		/* Attached in the meantime, wait for the stop */
+		hw_snap_mmio_read64(card, SNAP_S_CSR, &data);
+		if (0 == (data & SNAP_CSR_ATT))
+			break;
+	} while (tget_us() - t0 < SNAP_ATTACH_PROBE_US);
+	snap_trace("%s: CSR 0x%llx\n", __func__, (long long)data);
+}
+
+static struct snap_action *hw_attach_action(struct snap_card *card,
+				snap_action_type_t action_type,
+				snap_action_flag_t action_flags,
+				int timeout_sec)
+{
+	int rc = 0;
+	uint64_t data;
+	uint32_t mode;
+	uint32_t sat = INVALID_SAT;     /* Invalid short Action type */
+	unsigned long long t0, limit_us;
+	struct snap_action *action = NULL;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	snap_trace("%s Enter Action: 0x%x Old Action: %x "
+		   "Flags: 0x%x Base: %x timeout: %d sec Seq: %x\n",
+		   __func__, action_type, card->action_type, action_flags,
+		   card->action_base, timeout_sec, card->seq);
+
+	if (card->master) {
+		snap_trace("%s Exit Error Master is not allowed to use "
+			   "Action\n",  __func__);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	/* The attach interrupt is set up in CCR, with the action type */
+	if ((action_type != card->action_type) ||
+	    ((action_flags ^ card->flags) & SNAP_ATTACH_IRQ)) {
+		/* Search action to get Short Action type */
+		sat = hw_find_sat(card, action_type);
+		if (INVALID_SAT == sat) {
+			snap_trace("%s Exit Error Can not find Action\n",
+				   __func__);
+			errno = ENODEV;
+			return NULL;
+		}
+
+		/* Make Mode bits 0, 1, 2 for Job Manager for CCR Register */
+		mode = SNAP_CCR_DIRECT_MODE;   /* Set Job manager bit to access Action */
+		/* This interrupt is generated by the job-manager in both modes */
+		if (action_flags & SNAP_ATTACH_IRQ)
+			mode |= SNAP_CCR_IRQ_ATTACH;
+		card->sat = sat;            /* Save short Action Type */
+		card->seq = 0xf000;
+		card->action_type = action_type;
+		data = ((uint64_t)card->seq << 48ll);
+		data |= (card->sat << 12) | mode;
+
+		/* Short Action Type and Direct Access */
+		hw_snap_mmio_write64(card, SNAP_S_CCR, data);
+		card->start_attach = true;
+		if (timeout_sec > 0)
+			card->attach_timeout_sec = timeout_sec; /* Save timeout */
+	}
+	/* MMIO width and done interrupt can change for the same action */
+	card->flags = action_flags;    /* Save Flags */
+
+	if (card->start_attach) {
+		card->start_attach = false;
+		data = ((uint64_t)card->seq << 48ll) | 1;
+
+		/* Start: Attach action to context */
+		hw_snap_mmio_write64(card, SNAP_S_JCR, data);
+		card->seq++;
+	}
+
+	if ((SNAP_ATTACH_IRQ & card->flags) && (timeout_sec > 0))
+		rc = hw_wait_irq(card, timeout_sec, SNAP_ATTACH_IRQ_NUM);
+	else {
+		/* Without a timeout only take an action slot which is free */
+		limit_us = (timeout_sec > 0) ? timeout_sec * 1000000ull :
+			SNAP_ATTACH_PROBE_US;
+		t0 = tget_us();
+		rc = EBUSY;
+		do {
+			hw_snap_mmio_read64(card, SNAP_S_CSR, &data);
+			if (SNAP_CSR_ATTACHED == (data & SNAP_CSR_ATTACHED)) {
+				rc = 0;
+				break;
+			}
+		} while (tget_us() - t0 < limit_us);
+	}
+	/* Return Pointer if all went well */
+	if (0 == rc) {
+		card->action_base = ACTION_BASE_S;
+		action = (struct snap_action *)card;
+	} else
+		hw_attach_withdraw(card);
+	snap_trace("%s Exit rc: %d Action: %p Base: 0x%x\n", __func__,
+		rc, action, card->action_base);
+
+	return action;
+}
+
+static int hw_detach_action(struct snap_action *action)
+{
+	int rc = 0;
+	uint64_t data = 0;
+	uint32_t action_control = 0;
+	struct snap_card *card;
+	unsigned long t0;
+	unsigned int dt = 0, delay_us = 1;
+
+	if (action == NULL) {
+		snap_trace("%s Error NULL Action\n", __func__);
+		errno = EINVAL;
+		return -1;
+	}
+	card = (struct snap_card *)action;
+	snap_trace("%s Enter Action: 0x%x "
+		   "Base: %x timeout: %d sec Seq: 0x%x\n",
+		   __func__, card->action_type, card->action_base,
+		   card->attach_timeout_sec, card->seq);
+
+	card->start_attach = true;              /* Set Flag to Attach next Time again */
+
+	/* Read Action Control and check Action Status */
+	hw_snap_mmio_read32(card, ACTION_CONTROL, &action_control);
+	if (ACTION_CONTROL_IDLE & action_control)
+		data = SNAP_JCR_STOP;           /* Action is IDLE, send Stop */
+	else    data = SNAP_JCR_ABORT;          /* Action is not IDLE, send Abort */
+	hw_snap_mmio_write64(card, SNAP_S_JCR, data);
+
+	/*
+	 * Wait until Action gets detached. Stop mostly takes a few
+	 * microseconds, ABORT can take a while, so back off up to 1 msec.
+	 */
+	rc = SNAP_EDETACH;
+	t0 = tget_ms();
+	while (dt < (MAX(card->attach_timeout_sec, 1u) * 1000)) {
+		/* Check if Action is detached */
+		hw_snap_mmio_read64(card, SNAP_S_CSR, &data);
+		if (0 == (data & SNAP_CSR_ATT)) {
+			rc = 0;             /* Ok */
+			break;              /* Detached */
+		}
+		usleep(delay_us);
+		delay_us = MIN(2 * delay_us, 1000u);
+		dt = (unsigned int)(tget_ms() - t0);
+	}
+
+	card->action_base = 0;              /* FIXME use action_*32 instead */
+	snap_trace("%s Exit: rc: %d CSR 0x%llx after: %d msec\n",
+		   __func__, rc, (long long)data, dt);
+	return rc;
+}
+
+static int hw_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long parm)
+{
+	int rc = 0;
+	unsigned long rc_val = 0;
+	unsigned long *arg = (unsigned long *)parm;
+
+	if (NULL == arg) {
+		snap_trace("  %s Error Missing parm\n", __func__);
+		return -1;
+	}	
+	switch (cmd) {
+	case GET_CARD_TYPE:
+		rc_val = (unsigned long)(card->cap_reg & 0xff);
+		snap_trace("  %s GET CARD_TYPE: %d\n", __func__, (int)rc_val);
+		*arg = rc_val;
+		break;
+	case GET_NVME_ENABLED:
+		if (card->cap_reg & SNAP_NVME_ENA)
+			rc_val = 1;
+		else rc_val = 0;
+		snap_trace("  %s GET NVME: %d\n", __func__, (int)rc_val);
+		*arg = rc_val;
+		break;
+	case GET_SDRAM_SIZE:
+		rc_val = (unsigned long)(card->cap_reg >> 16);   /* in MB */
+		rc_val = rc_val & 0xffff;    /* Mask bits 16 ... 31 */
+		snap_trace("  %s Get MEM: %d MB\n", __func__, (int)rc_val);
+		*arg = rc_val;
+		break;
+	case GET_DMA_ALIGN:
+		/* Data alignment for DMA transfers to/from Host */
+		/* Value a means that transfers need to be 2^a B aligned */
+		rc_val = (unsigned long)(card->cap_reg >> 32)&0xf;   /* Get Bits 32 .. 35 */
+		rc_val = 1 << rc_val;
+		snap_trace("  %s Get DMA align: %d Bytes\n", __func__, (int)rc_val);
+		*arg = rc_val;
+		break;
+	case GET_DMA_MIN_SIZE:
+		/* Minimum size for DMA transfers to/from Host */
+		/* Value t means that minimum transfer size is 2^t B */ 
+		rc_val = (unsigned long)(card->cap_reg >> 36)&0xf;   /* Get Bits 36 .. 39 */
+		rc_val = 1 << rc_val;
+		snap_trace("  %s Get DMA Min Size: %d Bytes\n", __func__, (int)rc_val);
+		*arg = rc_val;
+		break;
+	case GET_CARD_NAME:
+		snap_trace("  %s Get Card name: %s\n", __func__, card->name);
+		strcpy((char*)parm, card->name);
+		break;
+	case SET_SDRAM_SIZE:
+		card->cap_reg = (card->cap_reg & 0xffff) | (parm << 16);
+		snap_trace("  %s Set MEM: %d MB\n", __func__, (int)parm);
+		break;
+	default:
+		snap_trace("  %s Invalid CMD %d Error\n", __func__, cmd);
+		*arg = 0;
+		rc = -1;
+		break;
+	}
+	return rc;
+}
+
+/* Hardware version of the lowlevel functions */
+static struct snap_funcs hardware_funcs = {
+	.card_alloc_dev = hw_snap_card_alloc_dev,
+	.attach_action = hw_attach_action,       /* attach Action */
+	.detach_action = hw_detach_action,       /* detach Action */
+	.abort_action = hw_detach_action,        /* JCR ABORT if busy */
+	.mmio_write32 = hw_snap_mmio_write32,
+	.mmio_read32 = hw_snap_mmio_read32,
+	.mmio_write64 = hw_snap_mmio_write64,
+	.mmio_read64 = hw_snap_mmio_read64,
+	.card_free = hw_snap_card_free,
+	.card_ioctl = hw_card_ioctl,
+	.wait_irq = hw_wait_irq,
+	.has_action = hw_has_action,
+};
+
+/* We access the hardware via this function pointer struct */
+static struct snap_funcs *df = &hardware_funcs;
+
+struct snap_card *snap_card_alloc_dev(const char *path,
+				      uint16_t vendor_id,
+				      uint16_t device_id)
+{
+	struct snap_card *card;
+
+	card = df->card_alloc_dev(path, vendor_id, device_id);
+	if (card == NULL)
+		return NULL;
+
+	card->funcs = df;
+	card->lease_ms = snap_lease_ms;
+	card->mmio_policy = snap_mmio_policy;
+	card->ctx_gen = __atomic_add_fetch(&snap_ctx_gen, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&card->ctx_lock, NULL);
+	if (path) {
+		card->path = strdup(path);
+		if (card->path == NULL) {
+			card->funcs->card_free(card);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&snap_cards_lock);
+	card->card_next = snap_cards;
+	snap_cards = card;
+	pthread_mutex_unlock(&snap_cards_lock);
+	return card;
+}
+
+/*
+ * Each thread keeps a record of the contexts it opened, which is also
+ * its lookup cache. Only the thread itself walks its records, so it
+ * finds its context without a lock, for any number of cards. When the
+ * thread exits, snap_ctx_exit() closes the contexts of the cards which
+ * are still open, snap_card_free() closes the others.
+ */
+struct snap_ctx_rec {
+	struct snap_card *card;
+	unsigned long ctx_gen;          /* Of card, it might be gone already */
+	struct snap_card *ctx;
+	struct snap_ctx_rec *next;
+};
+
+static pthread_key_t snap_ctx_key;
+static pthread_once_t snap_ctx_once = PTHREAD_ONCE_INIT;
+static __thread struct snap_ctx_rec *tls_ctx_recs = NULL;
+
+static void snap_lease_drop(struct snap_card *card);
+static void snap_lease_reaper_stop(void);
+static void snap_card_overflow_free(struct snap_card *card);
+
+/* Called with snap_cards_lock held */
+static bool snap_card_open(struct snap_card *card, unsigned long ctx_gen)
+{
+	struct snap_card *c;
+
+	for (c = snap_cards; c != NULL; c = c->card_next)
+		if ((c == card) && (c->ctx_gen == ctx_gen))
+			return true;
+	return false;
+}
+
+static void snap_ctx_free(struct snap_card *ctx)
+{
+	snap_lease_drop(ctx);
+	snap_card_overflow_free(ctx);
+	ctx->funcs->card_free(ctx);
+}
+
+/* Thread exit, close the contexts of the thread */
+static void snap_ctx_exit(void *arg)
+{
+	struct snap_ctx_rec *rec = arg, *next;
+	struct snap_card **pc;
+	bool owned;
+
+	for (; rec != NULL; rec = next) {
+		next = rec->next;
+		owned = false;
+		pthread_mutex_lock(&snap_cards_lock);
+		if (snap_card_open(rec->card, rec->ctx_gen)) {
+			pthread_mutex_lock(&rec->card->ctx_lock);
+			for (pc = &rec->card->ctx_list; *pc != NULL;
+			     pc = &(*pc)->ctx_next) {
+				if (*pc == rec->ctx) {
+					*pc = rec->ctx->ctx_next;
+					owned = true;
+					break;
+				}
+			}
+			pthread_mutex_unlock(&rec->card->ctx_lock);
+		}
+		pthread_mutex_unlock(&snap_cards_lock);
+
+		if (owned)
+			snap_ctx_free(rec->ctx);
+		free(rec);
+	}
+}
+
+static void snap_ctx_key_init(void)
+{
+	int rc = pthread_key_create(&snap_ctx_key, snap_ctx_exit);
+
+	if (rc != 0)
+		snap_trace("%s: Error %s, contexts stay open until "
+			   "snap_card_free()\n", __func__, strerror(rc));
+}
+
+/* Open a context for the calling thread, takes the card lock */
+static struct snap_card *snap_ctx_open(struct snap_card *card)
+{
+	struct snap_ctx_rec *rec, **pr;
+	struct snap_card *ctx;
+
+	pthread_once(&snap_ctx_once, snap_ctx_key_init);
+	rec = calloc(1, sizeof(*rec));
+	if (rec == NULL)
+		return NULL;
+
+	/* Forget about contexts of cards freed in the meantime */
+	pthread_mutex_lock(&snap_cards_lock);
+	for (pr = &tls_ctx_recs; *pr != NULL; ) {
+		struct snap_ctx_rec *old = *pr;
+
+		if (snap_card_open(old->card, old->ctx_gen)) {
+			pr = &old->next;
+			continue;
+		}
+		*pr = old->next;
+		free(old);
+	}
+	pthread_mutex_unlock(&snap_cards_lock);
+
+	ctx = card->funcs->card_alloc_dev(card->path, card->vendor_id,
+					  card->device_id);
+	if (ctx == NULL) {
+		free(rec);
+		snap_trace("%s: Error Can not open context for %s\n",
+			   __func__, card->path);
+		return NULL;
+	}
+	ctx->funcs = card->funcs;
+	ctx->wait_policy = card->wait_policy;
+
+	pthread_mutex_lock(&card->ctx_lock);
+	ctx->lease_ms = card->lease_ms;
+	ctx->mmio_policy = card->mmio_policy;
+	ctx->ctx_next = card->ctx_list;
+	card->ctx_list = ctx;
+	pthread_mutex_unlock(&card->ctx_lock);
+
+	rec->card = card;
+	rec->ctx_gen = card->ctx_gen;
+	rec->ctx = ctx;
+	rec->next = tls_ctx_recs;
+	tls_ctx_recs = rec;
+	pthread_setspecific(snap_ctx_key, rec);
+
+	snap_trace("%s: Card %p Thread %d Context %p\n", __func__,
+		   card, __gettid(), ctx);
+	return ctx;
+}
+
+/**
+ * Get the context of the calling thread for this card. Looking it up
+ * is lock free once a thread used the card. Only opening a new context
+ * takes the card lock.
+ */
+static struct snap_card *snap_card_context(struct snap_card *card)
+{
+	struct snap_ctx_rec *rec;
+
+	for (rec = tls_ctx_recs; rec != NULL; rec = rec->next)
+		if (rec->ctx_gen == card->ctx_gen)
+			return rec->ctx;
+	return snap_ctx_open(card);
+}
+
+struct snap_action *snap_attach_action(struct snap_card *card,
+				       snap_action_type_t action_type,
+				       snap_action_flag_t action_flags,
+				       int timeout_ms)
+{
+	struct snap_action *action;
+	unsigned long long t0 = tget_ns();
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (card->funcs == &software_funcs)
+		snap_map_funcs(card, action_type);
+
+	/* Someone else might have used the action in the meantime */
+	card->param_valid = 0;
+
+	action = card->funcs->attach_action(card, action_type, action_flags,
+					    timeout_ms);
+	snap_btrace(SNAP_BT_ATTACH, card, action_type, action_flags);
+	if (action)
+		snap_stats_record(action_type, SNAP_STATS_ATTACH, t0);
+	return action;
+}
+
+int snap_detach_action(struct snap_action *action)
+{
+	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+	snap_action_type_t action_type = card ? card->action_type : 0;
+	unsigned long long t0 = tget_ns();
+
+	snap_trace("%s Enter\n", __func__);
+	rc = card ? card->funcs->detach_action(action) : SNAP_EINVAL;
+	snap_trace("%s Exit rc: %d\n", __func__, rc);
+	snap_btrace(SNAP_BT_DETACH, card, action_type, rc);
+	if (rc == 0)
+		snap_stats_record(action_type, SNAP_STATS_DETACH, t0);
+	return rc;
+}
+
+/* Forget about parameters written behind the back of the job functions */
+static inline void snap_param_invalidate(struct snap_card *card,
+					 uint64_t offset)
+{
+	if ((card) && (offset >= ACTION_PARAMS_IN) &&
+	    (offset < ACTION_PARAMS_IN + CACHELINE_BYTES))
+		card->param_valid = 0;
+}
+
+int snap_mmio_write32(struct snap_card *_card,
+		      uint64_t offset, uint32_t data)
+{
+	int rc;
+
+	snap_param_invalidate(_card, offset);
+	rc = _card->funcs->mmio_write32(_card, offset, data);
+	return rc;
+}
+
+int snap_mmio_read32(struct snap_card *_card,
+		     uint64_t offset, uint32_t *data)
+{
+	int rc;
+	rc = _card->funcs->mmio_read32(_card, offset, data);
+	return rc;
+}
+
+/*
+ * FIXME Remove adding action_base in plain mmio_read32/write32.
+ */
+int snap_action_write32(struct snap_action *action,
+		      uint64_t offset, uint32_t data)
+{
+	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+
+	if (card->action_base == 0) /* must be attached to make this work */
+		return SNAP_EATTACH;
+
+	snap_param_invalidate(card, offset);
+	rc = card->funcs->mmio_write32(card, card->action_base + offset,
+				       data);
+	return rc;
+}
+
+int snap_action_read32(struct snap_action *action,
+		     uint64_t offset, uint32_t *data)
+{
+	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+
+	if (card->action_base == 0) /* must be attached to make this work */
+		return SNAP_EATTACH;
+
+	rc = card->funcs->mmio_read32(card, card->action_base + offset,
+				      data);
+	return rc;
+}
+
+int snap_mmio_write64(struct snap_card *_card,
+			uint64_t offset, uint64_t data)
+{
+	int rc;
+
+	snap_param_invalidate(_card, offset);
+	rc = _card->funcs->mmio_write64(_card, offset, data);
+	return rc;
+}
+
+int snap_mmio_read64(struct snap_card *_card,
+		       uint64_t offset, uint64_t *data)
+{
+	int rc;
+
+	rc = _card->funcs->mmio_read64(_card, offset, data);
+	return rc;
+}
+
+/*
+ * Offsets as for the functions above, the 32-bit ones are relative to
+ * the attached action, like hw_snap_mmio_write32().
+ */
+int snap_mmio_write32_nohwsync(struct snap_card *card,
+			       uint64_t offset, uint32_t data)
+{
+	if (card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (card->mmio_ptr == NULL)
+		return snap_mmio_write32(card, offset, data);
+
+	snap_param_invalidate(card, offset);
+	offset += card->action_base;
+	mmio_out32(card, offset, data);
+	snap_btrace(SNAP_BT_MMIO_WRITE32, card, offset, data);
+	reg_trace("  %s(%p, %llx, %lx)\n", __func__, card,
+		  (long long)offset, (long)data);
+	return 0;
+}
+
+int snap_mmio_read32_nohwsync(struct snap_card *card,
+			      uint64_t offset, uint32_t *data)
+{
+	if (card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (card->mmio_ptr == NULL)
+		return snap_mmio_read32(card, offset, data);
+
+	offset += card->action_base;
+	*data = mmio_in32(card, offset);
+	snap_btrace(SNAP_BT_MMIO_READ32, card, offset, *data);
+	reg_trace("  %s(%p, %llx, %lx)\n", __func__, card,
+		  (long long)offset, (long)*data);
+	return 0;
+}
+
+int snap_mmio_write64_nohwsync(struct snap_card *card,
+			       uint64_t offset, uint64_t data)
+{
+	if (card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (card->mmio_ptr == NULL)
+		return snap_mmio_write64(card, offset, data);
+
+	snap_param_invalidate(card, offset);
+	mmio_out64(card, offset, data);
+	snap_btrace(SNAP_BT_MMIO_WRITE64, card, offset, data);
+	reg_trace("  %s(%p, %llx, %llx)\n", __func__, card,
+		  (long long)offset, (long long)data);
+	return 0;
+}
+
+int snap_mmio_read64_nohwsync(struct snap_card *card,
+			      uint64_t offset, uint64_t *data)
+{
+	if (card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (card->mmio_ptr == NULL)
+		return snap_mmio_read64(card, offset, data);
+
+	*data = mmio_in64(card, offset);
+	snap_btrace(SNAP_BT_MMIO_READ64, card, offset, *data);
+	reg_trace("  %s(%p, %llx, %llx)\n", __func__, card,
+		  (long long)offset, (long long)*data);
+	return 0;
+}
+
+/* A full barrier, sync (hwsync) on POWER like libcxl uses it */
+void snap_mmio_hwsync(struct snap_card *card __unused)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+int snap_card_set_mmio_policy(struct snap_card *card,
+			      snap_mmio_policy_t policy)
+{
+	struct snap_card *ctx;
+
+	if ((card == NULL) || (policy > SNAP_MMIO_BATCH)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	pthread_mutex_lock(&card->ctx_lock);
+	card->mmio_policy = policy;
+	for (ctx = card->ctx_list; ctx != NULL; ctx = ctx->ctx_next)
+		ctx->mmio_policy = policy;
+	pthread_mutex_unlock(&card->ctx_lock);
+	return SNAP_OK;
+}
+
+/*
+ * Access to the action registers from the job functions, direct with
+ * SNAP_MMIO_BATCH. Offsets are relative to the action.
+ */
+static inline bool snap_mmio_batch(struct snap_card *card)
+{
+	return (card->mmio_policy == SNAP_MMIO_BATCH) &&
+		(card->mmio_ptr != NULL);
+}
+
+static inline int snap_job_write32(struct snap_card *card,
+				   uint32_t offset, uint32_t data)
+{
+	if (!snap_mmio_batch(card))
+		return card->funcs->mmio_write32(card, offset, data);
+	mmio_out32(card, card->action_base + offset, data);
+	snap_btrace(SNAP_BT_MMIO_WRITE32, card, card->action_base + offset,
+		    data);
+	return 0;
+}
+
+static inline int snap_job_read32(struct snap_card *card,
+				  uint32_t offset, uint32_t *data)
+{
+	if (!snap_mmio_batch(card))
+		return card->funcs->mmio_read32(card, offset, data);
+	*data = mmio_in32(card, card->action_base + offset);
+	snap_btrace(SNAP_BT_MMIO_READ32, card, card->action_base + offset,
+		    *data);
+	return 0;
+}
+
+static inline int snap_job_write64(struct snap_card *card,
+				   uint32_t offset, uint64_t data)
+{
+	if (!snap_mmio_batch(card))
+		return card->funcs->mmio_write64(card,
+				card->action_base + offset, data);
+	mmio_out64(card, card->action_base + offset, data);
+	snap_btrace(SNAP_BT_MMIO_WRITE64, card, card->action_base + offset,
+		    data);
+	return 0;
+}
+
+static inline int snap_job_read64(struct snap_card *card,
+				  uint32_t offset, uint64_t *data)
+{
+	if (!snap_mmio_batch(card))
+		return card->funcs->mmio_read64(card,
+				card->action_base + offset, data);
+	*data = mmio_in64(card, card->action_base + offset);
+	snap_btrace(SNAP_BT_MMIO_READ64, card, card->action_base + offset,
+		    *data);
+	return 0;
+}
+
+
+static void snap_card_sched_free(struct snap_card *card);
+
+void snap_card_free(struct snap_card *_card)
+{
+	struct snap_card *ctx, **pc;
+
+	if (_card == NULL)
+		return;
+
+	/* Exiting threads leave the contexts to us from now on */
+	pthread_mutex_lock(&snap_cards_lock);
+	for (pc = &snap_cards; *pc != NULL; pc = &(*pc)->card_next) {
+		if (*pc == _card) {
+			*pc = _card->card_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&snap_cards_lock);
+
+	while (_card->ctx_list) {
+		ctx = _card->ctx_list;
+		_card->ctx_list = ctx->ctx_next;
+		snap_ctx_free(ctx);
+	}
+	snap_lease_drop(_card);
+	snap_lease_reaper_stop();
+	snap_card_overflow_free(_card);
+	snap_card_sched_free(_card);
+	pthread_mutex_destroy(&_card->ctx_lock);
+	__free(_card->path);
+	_card->funcs->card_free(_card);
+}
+
+int snap_card_ioctl(struct snap_card *_card, unsigned int cmd, unsigned long arg)
+{
+	return _card->funcs->card_ioctl(_card, cmd, arg);
+}
+
+/*****************************************************************************
+ * ACTION LEASES
+ * Attach and detach are expensive. If a lease time is set for the card,
+ * snap_sync_execute_job() and the job queues keep the action attached
+ * after use. The next job for the same action type and flags reuses it.
+ * A reaper thread detaches actions which stay unused for longer than
+ * the lease time, such that other contexts can get them.
+ ****************************************************************************/
+
+/*
+ * The lease state of a context only changes with atomic operations, so
+ * reusing and giving back a leased action takes no lock. Neither does
+ * a context with leases off. lease_lock protects the list the reaper
+ * looks at. A context is put on it when it attaches an action for a
+ * lease and taken off before the action gets detached, which is
+ * expensive anyway. Whoever moves an idle lease to LEASE_REAPING
+ * detaches the action, others wait until it is done.
+ */
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lease_cond = PTHREAD_COND_INITIALIZER;
+static struct snap_card *leases = NULL;  /* Cards holding a lease */
+static bool lease_reaper_started = false;
+static pthread_t lease_reaper;
+static unsigned long lease_reaper_gen = 0; /* Reapers of older ones exit */
+
+static inline enum snap_lease_state snap_lease_state(struct snap_card *card)
+{
+	return __atomic_load_n(&card->lease_state, __ATOMIC_ACQUIRE);
+}
+
+static inline void snap_lease_set(struct snap_card *card,
+				  enum snap_lease_state state)
+{
+	__atomic_store_n(&card->lease_state, state, __ATOMIC_RELEASE);
+}
+
+static inline bool snap_lease_move(struct snap_card *card,
+				   enum snap_lease_state from,
+				   enum snap_lease_state to)
+{
+	return __atomic_compare_exchange_n(&card->lease_state, &from, to,
+					   false, __ATOMIC_ACQ_REL,
+					   __ATOMIC_ACQUIRE);
+}
+
+/* Called with lease_lock held */
+static void snap_lease_unlink(struct snap_card *card)
+{
+	struct snap_card **pc;
+
+	if (!card->lease_listed)
+		return;
+	for (pc = &leases; *pc != NULL; pc = &(*pc)->lease_next) {
+		if (*pc == card) {
+			*pc = card->lease_next;
+			break;
+		}
+	}
+	card->lease_next = NULL;
+	card->lease_listed = false;
+}
+
+/* Take the card off the reaper list, before its action gets detached */
+static void snap_lease_forget(struct snap_card *card)
+{
+	pthread_mutex_lock(&lease_lock);
+	snap_lease_unlink(card);
+	pthread_mutex_unlock(&lease_lock);
+}
+
+/* Detach the action of an idle lease, we own it in LEASE_REAPING */
+static void snap_lease_reap(struct snap_card *card)
+{
+	snap_trace("%s: Card %p Action 0x%x\n", __func__, card,
+		   card->lease_type);
+	snap_detach_action((struct snap_action *)card);
+	snap_lease_set(card, LEASE_NONE);
+}
+
+static void *snap_lease_reaper(void *arg __unused);
+
+static void snap_lease_link(struct snap_card *card)
+{
+	pthread_mutex_lock(&lease_lock);
+	if (!card->lease_listed) {
+		card->lease_next = leases;
+		leases = card;
+		card->lease_listed = true;
+	}
+	if (!lease_reaper_started &&
+	    (pthread_create(&lease_reaper, NULL, snap_lease_reaper,
+			    (void *)lease_reaper_gen) == 0))
+		lease_reaper_started = true;
+	pthread_cond_signal(&lease_cond);
+	pthread_mutex_unlock(&lease_lock);
+}
+
+/*
+ * Stop the reaper once no card holds a lease, the next lease starts a
+ * new one. A reaper started meanwhile has a newer generation and keeps
+ * running.
+ */
+static void snap_lease_reaper_stop(void)
+{
+	pthread_t reaper;
+
+	pthread_mutex_lock(&lease_lock);
+	if (!lease_reaper_started || (leases != NULL)) {
+		pthread_mutex_unlock(&lease_lock);
+		return;
+	}
+	reaper = lease_reaper;
+	lease_reaper_started = false;
+	lease_reaper_gen++;
+	pthread_cond_broadcast(&lease_cond);
+	pthread_mutex_unlock(&lease_lock);
+
+	pthread_join(reaper, NULL);
+}
+
+static void *snap_lease_reaper(void *arg)
+{
+	unsigned long gen = (unsigned long)arg;
+	struct snap_card *card, *next, *reap;
+	unsigned long long now, expire, wait_us;
+	struct timespec ts;
+
+	pthread_mutex_lock(&lease_lock);
+	while (gen == lease_reaper_gen) {
+		now = tget_us();
+		wait_us = 1000000;
+		reap = NULL;
+		for (card = leases; card != NULL; card = next) {
+			next = card->lease_next;
+			if (!snap_lease_move(card, LEASE_IDLE, LEASE_REAPING)) {
+				/* In use, it expires lease_ms after the job */
+				wait_us = MIN(wait_us,
+					      MAX(card->lease_ms, 1u) * 1000ull);
+				continue;
+			}
+			expire = card->lease_idle_us + card->lease_ms * 1000ull;
+			if (now < expire) {
+				snap_lease_set(card, LEASE_IDLE);
+				wait_us = MIN(wait_us, expire - now);
+				continue;
+			}
+			snap_lease_unlink(card);
+			card->lease_next = reap;
+			reap = card;
+		}
+
+		if (reap != NULL) {
+			/* Detach polls the card, do not keep others waiting */
+			pthread_mutex_unlock(&lease_lock);
+			for (card = reap; card != NULL; card = next) {
+				next = card->lease_next;
+				card->lease_next = NULL;
+				snap_lease_reap(card);
+			}
+			pthread_mutex_lock(&lease_lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += wait_us / 1000000;
+		ts.tv_nsec += (wait_us % 1000000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&lease_cond, &lease_lock, &ts);
+	}
+	pthread_mutex_unlock(&lease_lock);
+	return NULL;
+}
+
+int snap_card_set_lease(struct snap_card *card, unsigned int idle_ms)
+{
+	struct snap_card *ctx, *next, *reap = NULL;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	/*
+	 * Detach polls the card, do not hold ctx_lock for it. The idle
+	 * leases we move to LEASE_REAPING are ours, a context is not freed
+	 * before its lease is back in LEASE_NONE, see snap_lease_drop().
+	 * Busy ones are dropped by snap_lease_put(), reaping ones by whoever
+	 * reaps them.
+	 */
+	pthread_mutex_lock(&card->ctx_lock);
+	for (ctx = card; ctx != NULL;
+	     ctx = (ctx == card) ? card->ctx_list : ctx->ctx_next) {
+		ctx->lease_ms = idle_ms;
+		if ((idle_ms == 0) &&
+		    snap_lease_move(ctx, LEASE_IDLE, LEASE_REAPING)) {
+			snap_lease_forget(ctx);
+			ctx->lease_next = reap;
+			reap = ctx;
+		}
+	}
+	pthread_mutex_unlock(&card->ctx_lock);
+
+	for (ctx = reap; ctx != NULL; ctx = next) {
+		next = ctx->lease_next;
+		ctx->lease_next = NULL;
+		snap_lease_reap(ctx);
+	}
+	return SNAP_OK;
+}
+
+/* Get the attached action, reuse it if we still hold a matching lease */
+static struct snap_action *snap_lease_get(struct snap_card *card,
+					  snap_action_type_t action_type,
+					  snap_action_flag_t action_flags,
+					  int attach_timeout_sec)
+{
+	struct snap_action *action;
+	enum snap_lease_state state;
+
+	while ((state = snap_lease_state(card)) != LEASE_NONE) {
+		if (state == LEASE_REAPING) {
+			usleep(10);
+			continue;
+		}
+		if ((card->lease_type == action_type) &&
+		    (card->lease_flags == action_flags)) {
+			if (!snap_lease_move(card, LEASE_IDLE, LEASE_BUSY))
+				continue;       /* The reaper was faster */
+			snap_trace("%s: Reuse Action 0x%x\n", __func__,
+				   action_type);
+			return (struct snap_action *)card;
+		}
+		if (snap_lease_move(card, LEASE_IDLE, LEASE_REAPING)) {
+			snap_lease_forget(card);
+			snap_lease_reap(card);
+		}
+	}
+
+	action = snap_attach_action(card, action_type, action_flags,
+				    attach_timeout_sec);
+	if ((action == NULL) || (card->lease_ms == 0))
+		return action;
+
+	card->lease_type = action_type;
+	card->lease_flags = action_flags;
+	snap_lease_set(card, LEASE_BUSY);
+	snap_lease_link(card);
+	return action;
+}
+
+/*
+ * Give the action back after use. It stays attached if leases are
+ * enabled and the last job went fine, else it gets detached.
+ *
+ * @return	true if the action is still attached
+ */
+static bool snap_lease_put(struct snap_card *card,
+			   struct snap_action *action, int rc)
+{
+	bool leased = (snap_lease_state(card) == LEASE_BUSY);
+
+	if (leased && (card->lease_ms != 0) &&
+	    (rc != SNAP_ETIMEDOUT) && (rc != SNAP_EIO) &&
+	    (rc != SNAP_ECANCELED)) {
+		card->lease_idle_us = tget_us();
+		snap_lease_set(card, LEASE_IDLE);
+		return true;
+	}
+	if (leased)
+		snap_lease_forget(card);
+	snap_detach_action(action);
+	if (leased)
+		snap_lease_set(card, LEASE_NONE);
+	return false;
+}
+
+/* Detach the action if it is only kept for reuse */
+static void snap_lease_drop(struct snap_card *card)
+{
+	enum snap_lease_state state;
+
+	if (card == NULL)
+		return;
+
+	while ((state = snap_lease_state(card)) != LEASE_NONE) {
+		if (state == LEASE_BUSY)
+			return;         /* snap_lease_put() sees lease_ms 0 */
+		if (state == LEASE_REAPING) {
+			usleep(10);
+			continue;
+		}
+		if (snap_lease_move(card, LEASE_IDLE, LEASE_REAPING)) {
+			snap_lease_forget(card);
+			snap_lease_reap(card);
+		}
+	}
+}
+
+/*****************************************************************************
+ * FIXED ACTION ASSIGNMENT MODE
+ * E.g. for data streaming if action must stay alive for the whole
+ *	program runtime.
+ ****************************************************************************/
+
+/*
+ * Spin window for SNAP_WAIT_ADAPTIVE: Jobs which complete within
+ * twice their average duration are caught by polling. Jobs running
+ * longer than SNAP_SPIN_MAX_US on average only get a short spin before
+ * we block on the interrupt.
+ */
+#define SNAP_SPIN_MIN_US	5
+#define SNAP_SPIN_MAX_US	500
+
+/* Resolve the policy to what is possible for this card */
+static snap_wait_policy_t snap_wait_policy(struct snap_card *card)
+{
+	snap_wait_policy_t policy = card->wait_policy;
+
+	if (policy == SNAP_WAIT_DEFAULT)
+		policy = (SNAP_ACTION_DONE_IRQ & card->flags) ?
+			SNAP_WAIT_IRQ : SNAP_WAIT_POLL;
+	return policy;
+}
+
+static unsigned long long snap_spin_window(struct snap_card *card)
+{
+	unsigned long long window = 2 * card->job_avg_us;
+
+	if (window > SNAP_SPIN_MAX_US)
+		return SNAP_SPIN_MIN_US;
+	return MAX(window, (unsigned long long)SNAP_SPIN_MIN_US);
+}
+
+int snap_action_set_wait_policy(struct snap_action *action,
+				snap_wait_policy_t policy)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	if ((card == NULL) || (policy > SNAP_WAIT_ADAPTIVE)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	card->wait_policy = policy;
+	return SNAP_OK;
+}
+
+int snap_action_get_wait_stats(struct snap_action *action,
+			       struct snap_wait_stats *stats)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	if ((card == NULL) || (stats == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	*stats = card->wait_stats;
+	stats->job_avg_usec = card->job_avg_us;
+	stats->spin_usec = snap_spin_window(card);
+	return SNAP_OK;
+}
+
+int snap_action_start(struct snap_action *action)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	snap_trace("%s: START Action 0x%x Flags %x\n", __func__, card->action_type, card->flags);
+	/* Enable Ready IRQ if set by application */
+	if (snap_wait_policy(card) != SNAP_WAIT_POLL) {
+		snap_mmio_write32(card, ACTION_IRQ_APP, ACTION_IRQ_APP_DONE);
+		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_ON);
+	}
+	card->job_start_ns = tget_ns();
+	card->job_start_us = card->job_start_ns / 1000;
+	snap_btrace(SNAP_BT_JOB_START, card, card->action_type, card->seq - 1);
+	/* libcxl syncs first, which orders SNAP_MMIO_BATCH parameters */
+	return snap_mmio_write32(card, ACTION_CONTROL, ACTION_CONTROL_START);
+}
+
+int snap_action_is_idle(struct snap_action *action, int *rc)
+{
+	int _rc = 0;
+	uint32_t action_data = 0;
+	struct snap_card *card = (struct snap_card *)action;
+
+	_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
+	if (rc)
+		*rc = _rc;
+
+	return (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
+}
+
+#define SNAP_STOP_GRACE_US	100000	/* To reach the next checkpoint */
+
+/*
+ * Bring the running job to an end. With SNAP_CANCEL_CHECKPOINT the
+ * action gets ACTION_CONTROL_STOP and a grace period to finish, if it
+ * is still busy after that, or with SNAP_CANCEL_ABORT, the job manager
+ * aborts it, which detaches the action.
+ *
+ * @return	1 if the action is idle, 0 if the job got aborted
+ */
+static int snap_action_halt(struct snap_card *card, snap_cancel_mode_t mode)
+{
+	struct snap_action *action = (struct snap_action *)card;
+	unsigned long long t0;
+	unsigned int delay_us = 1;
+	int rc = 0;
+
+	if (snap_action_is_idle(action, &rc) && (rc == 0))
+		return 1;
+
+	if ((mode == SNAP_CANCEL_CHECKPOINT) && (rc == 0)) {
+		snap_trace("%s: STOP Action 0x%x\n", __func__,
+			   card->action_type);
+		snap_mmio_write32(card, ACTION_CONTROL, ACTION_CONTROL_STOP);
+		t0 = tget_us();
+		do {
+			if (snap_action_is_idle(action, &rc) && (rc == 0))
+				return 1;
+			usleep(delay_us);
+			delay_us = MIN(2 * delay_us, 1000u);
+		} while ((rc == 0) && (tget_us() - t0 < SNAP_STOP_GRACE_US));
+	}
+
+	snap_trace("%s: ABORT Action 0x%x\n", __func__, card->action_type);
+	card->funcs->abort_action(action);
+	card->param_valid = 0;
+	snap_btrace(SNAP_BT_DETACH, card, card->action_type, SNAP_ECANCELED);
+	return 0;
+}
+
+int snap_action_stop(struct snap_action *action)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	if (snap_action_halt(card, SNAP_CANCEL_CHECKPOINT))
+		return SNAP_OK;
+	errno = ECANCELED;
+	return SNAP_ECANCELED;
+}
+
+static inline void snap_irq_done(struct snap_card *card)
+{
+	snap_mmio_write32(card, ACTION_IRQ_STATUS, ACTION_IRQ_STATUS_DONE);
+	snap_mmio_write32(card, ACTION_IRQ_APP, 0);
+	snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_OFF);
+}
+
+int snap_action_completed(struct snap_action *action, int *rc, int timeout)
+{
+	int _rc = 0;
+	uint32_t action_data = 0;
+	struct snap_card *card = (struct snap_card *)action;
+	snap_wait_policy_t policy = snap_wait_policy(card);
+	unsigned long long t0, now, spin_end, deadline, t_irq;
+	int timeout_sec;
+	bool idle = false;
+
+	t0 = tget_us();
+	deadline = t0 + (unsigned long long)timeout * 1000000ull;
+
+	if (policy == SNAP_WAIT_ADAPTIVE) {
+		/* Spin a while, most short jobs are done by then */
+		spin_end = t0 + snap_spin_window(card);
+		do {
+			_rc = snap_job_read32(card, ACTION_CONTROL, &action_data);
+			idle = (action_data & ACTION_CONTROL_IDLE) ==
+				ACTION_CONTROL_IDLE;
+		} while (!idle && (_rc == 0) && (tget_us() < spin_end) &&
+			 !snap_cancel_pending(card));
+
+		if (idle) {
+			card->wait_stats.poll_done++;
+			snap_irq_done(card);
+			hw_drain_irq(card);
+			goto out;
+		}
+	}
+
+	if ((policy != SNAP_WAIT_POLL) && !snap_cancel_pending(card)) {
+		t_irq = tget_ns();
+		while (1) {
+			now = tget_us();
+			timeout_sec = (now < deadline) ?
+				(int)((deadline - now + 999999) / 1000000) : 0;
+			if ((card->funcs->wait_irq(card, timeout_sec,
+						   SNAP_ACTION_IRQ_NUM) ==
+			     ECANCELED) && !snap_cancel_pending(card) &&
+			    (tget_us() < deadline))
+				continue;	/* Kick for an earlier job */
+			snap_irq_done(card);
+			_rc = snap_job_read32(card, ACTION_CONTROL, &action_data);
+			idle = (action_data & ACTION_CONTROL_IDLE) ==
+				ACTION_CONTROL_IDLE;
+			/*
+			 * With adaptive waiting an interrupt of an earlier
+			 * job can arrive late, wait again in that case.
+			 */
+			if (idle || (_rc != 0) || (policy != SNAP_WAIT_ADAPTIVE) ||
+			    (tget_us() >= deadline) || snap_cancel_pending(card))
+				break;
+			snap_mmio_write32(card, ACTION_IRQ_APP, ACTION_IRQ_APP_DONE);
+			snap_mmio_write32(card, ACTION_IRQ_CONTROL,
+					  ACTION_IRQ_CONTROL_ON);
+		}
+		if (idle) {
+			card->wait_stats.irq_done++;
+			snap_stats_record(card->action_type,
+					  SNAP_STATS_IRQ_WAKEUP, t_irq);
+		}
+	} else if (policy == SNAP_WAIT_POLL) {
+		/* Busy poll timout sec */
+		do {
+			_rc = snap_job_read32(card, ACTION_CONTROL, &action_data);
+			idle = (action_data & ACTION_CONTROL_IDLE) ==
+				ACTION_CONTROL_IDLE;
+		} while (!idle && (tget_us() < deadline) &&
+			 !snap_cancel_pending(card));
+		if (idle)
+			card->wait_stats.poll_done++;
+	}
+
+ out:
+	/* Order reads of what the action wrote after the status read */
+	if (idle && snap_mmio_batch(card))
+		snap_mmio_hwsync(card);
+
+	if (idle && card->job_start_us) {
+		/* Moving average with 1/8 weight for the latest job */
+		now = tget_us() - card->job_start_us;
+		if (card->job_avg_us == 0)
+			card->job_avg_us = now;
+		else	card->job_avg_us = (7 * card->job_avg_us + now) / 8;
+	} else if (!idle && !snap_cancel_pending(card))
+		card->wait_stats.timeouts++;
+
+	if (rc)
+		*rc = _rc;
+
+	return idle;
+}
+
+/**
+ * Build the 128 bytes workqueue cacheline for a job. The short action
+ * type and the sequence number are only known after attach and must be
+ * filled in by the caller before the workitem is passed to the action.
+ *
+ * @cjob	streaming framework job
+ * @job		workitem to fill
+ * @mmio_in	number of 32-bit words to transfer to ACTION_PARAMS_IN
+ * @mmio_out	number of 32-bit words to read back from ACTION_PARAMS_OUT
+ * @return	0 on success.
+ */
+static int snap_job_to_workitem(struct snap_job *cjob,
+				struct snap_queue_workitem *job,
+				unsigned int *mmio_in,
+				unsigned int *mmio_out)
+{
+	unsigned int _mmio_out;
+
+	/* Size must be less than addr[6] */
+	if (cjob->wout_size > SNAP_JOBSIZE) {
+		snap_trace("  %s: err: wout_size too large %d > %d\n", __func__,
+			   cjob->wout_size, SNAP_JOBSIZE);
+		snap_trace("      win_addr  = %llx size = %d\n",
+			   (long long)cjob->win_addr, cjob->win_size);
+		snap_trace("      wout_addr = %llx size = %d\n",
+			   (long long)cjob->wout_addr, cjob->wout_size);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	job->short_action = 0x00; /* Set later */
+	job->flags = SNAP_JOBFLAG_EXECUTE;
+	job->seq = 0x0000; /* Set later */
+	job->retc = 0x00000000;
+	job->priv_data = 0xdeadbeefc0febabeull;
+
+	/* Fill workqueue cacheline which we need to transfer to the action */
+	if (cjob->win_size <= (6 * 16)) {
+		memcpy(&job->user, (void *)(unsigned long)cjob->win_addr,
+		       MIN(cjob->win_size, sizeof(job->user)));
+		_mmio_out = cjob->win_size / sizeof(uint32_t);
+	} else {
+		job->user.ext.addr  = cjob->win_addr;
+		job->user.ext.size  = cjob->win_size;
+		job->user.ext.type  = SNAP_ADDRTYPE_HOST_DRAM;
+		job->user.ext.flags = (SNAP_ADDRFLAG_EXT |
+				       SNAP_ADDRFLAG_END);
+		_mmio_out = sizeof(job->user.ext) / sizeof(uint32_t);
+	}
+	if (mmio_in)
+		*mmio_in = 16 / sizeof(uint32_t) + _mmio_out;
+	if (mmio_out)
+		*mmio_out = _mmio_out;
+
+	snap_trace("    win_size: %d wout_size: %d mmio_out: %d\n",
+		   cjob->win_size, cjob->wout_size, _mmio_out);
+	return 0;
+}
+
+/*
+ * Fill in what is only known after attach and announce the completion
+ * record to the action, if there is one.
+ */
+static void snap_workitem_bind(struct snap_card *card,
+			       struct snap_queue_workitem *job)
+{
+	job->short_action = card->sat;
+	job->seq = __atomic_fetch_add(&card->seq, 1, __ATOMIC_RELAXED);
+
+	if (card->crec) {
+		card->crec->flags = 0;
+		card->crec_seq = job->seq;
+		job->flags |= SNAP_JOBFLAG_COMPLETION;
+		job->priv_data = (unsigned long)card->crec;
+	}
+}
+
+static inline bool snap_param_cached(struct snap_card *card,
+				     unsigned int i, uint32_t data)
+{
+	return (card->param_valid & (1u << i)) && (card->param_image[i] == data);
+}
+
+static inline void snap_param_cache(struct snap_card *card,
+				    unsigned int i, uint32_t data)
+{
+	card->param_image[i] = data;
+	card->param_valid |= (1u << i);
+}
+
+/**
+ * Pass action control and job to the action, should be 128 bytes
+ * or a little less. Words which still hold the same value since the
+ * last job are skipped. With SNAP_ACTION_MMIO64 two words are passed
+ * with one 64-bit MMIO.
+ */
+static int snap_workitem_write(struct snap_card *card,
+			       struct snap_queue_workitem *job,
+			       unsigned int mmio_in)
+{
+	int rc = 0;
+	unsigned int i, skipped = 0;
+	uint32_t action_addr;
+	uint32_t *job_data;
+	uint64_t data;
+	unsigned long long t0 = tget_ns();
+
+	snap_trace("%s: PASS PARAMETERS to Short Action %d Seq: %x\n",
+		   __func__, job->short_action, job->seq);
+
+	/* __hexdump(stderr, job, sizeof(*job)); */
+
+	job_data = (uint32_t *)(unsigned long)job;
+	for (i = 0, action_addr = ACTION_PARAMS_IN; i < mmio_in; ) {
+		if ((card->flags & SNAP_ACTION_MMIO64) && (i + 1 < mmio_in)) {
+			if (snap_param_cached(card, i, job_data[i]) &&
+			    snap_param_cached(card, i + 1, job_data[i + 1])) {
+				skipped += 2;
+			} else {
+				/* Lower address is the upper word, big endian */
+				data = ((uint64_t)job_data[i] << 32) |
+					job_data[i + 1];
+				rc = snap_job_write64(card, action_addr, data);
+				if (rc != 0)
+					break;
+				snap_param_cache(card, i, job_data[i]);
+				snap_param_cache(card, i + 1, job_data[i + 1]);
+			}
+			i += 2;
+			action_addr += 2 * sizeof(uint32_t);
+			continue;
+		}
+		if (snap_param_cached(card, i, job_data[i])) {
+			skipped++;
+		} else {
+			rc = snap_job_write32(card, action_addr,
+					      job_data[i]);
+			if (rc != 0)
+				break;
+			snap_param_cache(card, i, job_data[i]);
+		}
+		i++;
+		action_addr += sizeof(uint32_t);
+	}
+	if (rc != 0)
+		card->param_valid = 0;  /* Do not know what got through */
+	else	snap_stats_record(card->action_type,
+				  SNAP_STATS_PARAM_WRITE, t0);
+
+	snap_trace("  %s: %d words %d skipped rc: %d\n", __func__,
+		   mmio_in, skipped, rc);
+	return rc;
+}
+
+/**
+ * Synchronous way to send a job away.  First step : set registers
+ * This function writes through MMIO interface the registers
+ * to the action / in the FPGA internal memory
+ *
+ * @action	handle to streaming framework action/action
+ * @cjob	streaming framework job
+ * @return	0 on success.
+ */
+
+int snap_action_sync_execute_job_set_regs(struct snap_action *action,
+				 struct snap_job *cjob)
+{
+	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+	struct snap_queue_workitem job;
+	unsigned int mmio_in;
+
+	rc = snap_job_to_workitem(cjob, &job, &mmio_in, NULL);
+	if (rc != 0)
+		return rc;
+
+	snap_workitem_bind(card, &job);
+
+	return snap_workitem_write(card, &job, mmio_in);
+}
+/**
+ * Wait until the action wrote the completion record for the current
+ * job. Polls host memory instead of ACTION_CONTROL, if interrupts are
+ * used, the record is checked once the interrupt arrived.
+ *
+ * @return	1 if the job completed, 0 if not, rc is set in case of error
+ */
+static int snap_completion_wait(struct snap_card *card, int *rc,
+				unsigned int timeout_sec)
+{
+	struct snap_completion *crec = card->crec;
+	unsigned long t0, timeout_ms = timeout_sec * 1000;
+	unsigned int i;
+	uint8_t flags;
+
+	*rc = 0;
+	if (snap_wait_policy(card) != SNAP_WAIT_POLL) {
+		if (!snap_action_completed((struct snap_action *)card, rc,
+					   timeout_sec))
+			return 0;
+		/* Record was written before the action got done */
+		timeout_ms = 1000;
+	}
+
+	t0 = tget_ms();
+	for (i = 0; ; i++) {
+		flags = __atomic_load_n(&crec->flags, __ATOMIC_ACQUIRE);
+		if ((flags & SNAP_JOBFLAG_DONE) &&
+		    (crec->seq == card->crec_seq))
 			break;
+		/* Do not ask for the time on each iteration */
+		if (((i & 0xff) == 0xff) && ((tget_ms() - t0 >= timeout_ms) ||
+					     snap_cancel_pending(card)))
+			return 0;
+	}
+
+	/* The action might still finish up after writing the record */
+	while (!snap_action_is_idle((struct snap_action *)card, rc)) {
+		if (*rc != 0)
+			return 0;
+		if (tget_ms() - t0 >= timeout_ms)
+			return 0;
+	}
+	return 1;
+}
+
+int snap_action_set_completion(struct snap_action *action,
+			       struct snap_completion *crec)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	if ((card == NULL) ||
+	    ((unsigned long)crec & (CACHELINE_BYTES - 1))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	snap_trace("%s: Action %p Record %p\n", __func__, action, crec);
+	card->crec = crec;
+	return SNAP_OK;
+}
+
+/**
+ * Synchronous way to send a job away.  Last step : check completion
+ * This function check the completion of the action, manage the IRQ
+ * if needed, and read all action registers through MMIO interface
+ *
+ * @action	handle to streaming framework action/action
+ * @cjob	streaming framework job
+ * timeout_sec  timeout used if polling mode
+ * @return	0 on success.
+ */
+
+int snap_action_sync_execute_job_check_completion(struct snap_action *action,
+				 struct snap_job *cjob,
+				 unsigned int timeout_sec)
+{
+	int rc;
+	unsigned int i;
+	int completed;
+	struct snap_card *card = (struct snap_card *)action;
+	uint32_t action_addr;
+	uint32_t *job_data;
+	unsigned int mmio_out;
+	uint64_t data;
+	unsigned long long t_done = 0;
+
+	/* Make the job visible for snap_job_cancel() */
+	__atomic_store_n(&card->cancel_job, NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&card->cur_job, cjob, __ATOMIC_RELEASE);
+
+	if (card->crec)
+		completed = snap_completion_wait(card, &rc, timeout_sec);
+	else	completed = snap_action_completed(action, &rc, timeout_sec);
+	if ((completed == 0) && (rc == 0) && snap_cancel_pending(card)) {
+		/* Idle if it stopped at a checkpoint or got done meanwhile */
+		completed = snap_action_halt(card, card->cancel_mode);
+		if (completed == 0) {
+			snap_trace("%s: Job canceled\n", __func__);
+			cjob->retc = SNAP_RETC_FAILURE;
+			errno = ECANCELED;
+			rc = SNAP_ECANCELED;
+			goto __snap_action_sync_execute_job_exit;
+		}
+	}
+	/* Issue #360 */
+	if (rc != 0) {
+		snap_trace("%s: EIO rc=%d completed=%d\n", __func__,
+			   rc, completed);
+		rc = SNAP_EIO;
+		goto __snap_action_sync_execute_job_exit;
+	}
+	if (completed == 0) {
+		/* Not done */
+		snap_trace("%s: rc=%d\n", __func__, rc);
+		if (rc == 0) {
+			errno = ETIME;
+			rc = SNAP_ETIMEDOUT;
+		}
+		goto __snap_action_sync_execute_job_exit;
+	}
+	t_done = tget_ns();
+	if (card->job_start_ns)
+		snap_stats_record(card->action_type, SNAP_STATS_EXECUTE,
+				  card->job_start_ns);
+
+	/* Same number of words as we passed in, if there is no wout_addr */
+	if (cjob->win_size <= (6 * 16))
+		mmio_out = cjob->win_size / sizeof(uint32_t);
+	else	mmio_out = sizeof(struct snap_addr) / sizeof(uint32_t);
+
+	/* Completion record is a copy of the output registers */
+	if (card->crec) {
+		cjob->retc = card->crec->retc;
+		if (cjob->wout_addr == 0)
+			memcpy((void *)(unsigned long)cjob->win_addr,
+			       card->crec->data, mmio_out * sizeof(uint32_t));
+		else
+			memcpy((void *)(unsigned long)cjob->wout_addr,
+			       card->crec->data, cjob->wout_size);
+		rc = 0;
+		snap_trace("%s: RETURN RESULTS from %p retc: %x\n", __func__,
+			   card->crec, cjob->retc);
+		goto __snap_action_sync_execute_job_exit;
+	}
+
+	/* Get RETC (0x184) back to the caller */
+	if (card->flags & SNAP_ACTION_MMIO64) {
+		rc = snap_job_read64(card, ACTION_PARAMS_OUT, &data);
+		cjob->retc = (uint32_t)data;
+	} else
+		rc = snap_job_read32(card, ACTION_RETC_OUT, &cjob->retc);
+	if (rc != 0)
+		goto __snap_action_sync_execute_job_exit;
+	snap_trace("%s: RETURN RESULTS %ld bytes (%d)\n", __func__,
+		   mmio_out * sizeof(uint32_t), mmio_out);
+
+	/* Get job results max 6*16 bytes back to the caller */
+	if (cjob->wout_addr == 0) {
+		/* No out Address, mmio_out is set */
+		job_data = (uint32_t *)(unsigned long)cjob->win_addr;
+	} else {
+		job_data = (uint32_t *)(unsigned long)cjob->wout_addr;
+		mmio_out = cjob->wout_size / sizeof(uint32_t);
+	}
+
+	/* No need to read back 0x190, 0x194, 0x198 and 0x19c .... */
+	i = 0;
+	action_addr = ACTION_PARAMS_OUT + 0x10;
+	if (card->flags & SNAP_ACTION_MMIO64) {
+		for (; i + 1 < mmio_out; i += 2, action_addr += sizeof(data)) {
+			rc = snap_job_read64(card, action_addr, &data);
+			if (rc != 0)
+				goto __snap_action_sync_execute_job_exit;
+			job_data[i] = (uint32_t)(data >> 32);
+			job_data[i + 1] = (uint32_t)data;
+		}
+	}
+	for (; i < mmio_out; i++, action_addr += sizeof(uint32_t)) {
+		rc = snap_job_read32(card, action_addr, &job_data[i]);
+		if (rc != 0)
+			goto __snap_action_sync_execute_job_exit;
+		snap_trace("  %s: %d Addr: %x Data: %x\n", __func__, i,
+			   action_addr, job_data[i]);
+	}
+
+__snap_action_sync_execute_job_exit:
+	snap_btrace(SNAP_BT_JOB_DONE, card, rc, cjob->retc);
+	if ((rc == 0) && t_done)
+		snap_stats_record(card->action_type, SNAP_STATS_RESULT_READ,
+				  t_done);
+	__atomic_store_n(&card->cur_job, NULL, __ATOMIC_RELEASE);
+	return rc;
+}
+
+/**
+ * Synchronous way to send a job away. Blocks until job is done.
+ * These 3 steps can be called separately from the application
+ * BUT manage carefully the action timeout
+ *  * 1rst step: write Action registers into the FPGA
+ *  * 2nd  step: start the Action
+ *  *      step: processing - exchange data
+ *  * 3rd  step: check completion and manage IRQ if needed
+ *
+ * @action	handle to streaming framework action/action
+ * @cjob	streaming framework job
+ * @return	0 on success.
+ */
+
+int snap_action_sync_execute_job(struct snap_action *action,
+				 struct snap_job *cjob,
+				 unsigned int timeout_sec)
+{
+	int rc;
+
+	/* Set action registers through MMIO */
+	rc = snap_action_sync_execute_job_set_regs(action, cjob);
+	if (rc != 0)
+		return rc;
+
+	/* Start Action, fails e.g. if the last job is still running */
+	rc = snap_action_start(action);
+	if (rc != 0) {
+		errno = EBUSY;
+		return SNAP_EIO;
+	}
+
+	/* Wait for finish */
+	rc = snap_action_sync_execute_job_check_completion(action, cjob, 
+				timeout_sec);
+	return rc;
+}
+
+int snap_action_sync_execute_workitem(struct snap_action *action,
+				      struct snap_queue_workitem *job,
+				      unsigned int mmio_in,
+				      struct snap_job *cjob,
+				      unsigned int timeout_sec)
+{
+	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+
+	if ((card == NULL) || (job == NULL) || (cjob == NULL) ||
+	    (mmio_in < 16 / sizeof(uint32_t)) ||
+	    (mmio_in > sizeof(*job) / sizeof(uint32_t))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	snap_workitem_bind(card, job);
+	rc = snap_workitem_write(card, job, mmio_in);
+	if (rc != 0)
+		return rc;
+
+	rc = snap_action_start(action);
+	if (rc != 0) {
+		errno = EBUSY;
+		return SNAP_EIO;
+	}
+	return snap_action_sync_execute_job_check_completion(action, cjob,
+				timeout_sec);
+}
+
+/******************************************************************************
+ * HYBRID MODE
+ *
+ * With SNAP_CONFIG=HYBRID the FPGA is used like with SNAP_CONFIG=FPGA.
+ * If a job can not get the hardware action at once, because all action
+ * slots are in use or the card does not answer, the job runs on a CPU
+ * worker with the registered software action instead. It does not wait
+ * for the attach timeout, the attach only takes a slot which is free.
+ * Each hardware context gets a software twin for this when it first
+ * needs one. Callers see the same retc and output data either way.
+ *****************************************************************************/
+
+/*
+ * Jobs of a context run on one thread, but snap_job_cancel() looks at
+ * the twin from others, and a card can be shared by threads. The first
+ * twin which gets published wins, a twin allocated at the same time is
+ * freed again.
+ */
+static struct snap_card *snap_card_overflow(struct snap_card *card)
+{
+	struct snap_card *sw, *old = NULL;
+
+	sw = __atomic_load_n(&card->overflow, __ATOMIC_ACQUIRE);
+	if (sw != NULL)
+		return sw;
+
+	sw = software_funcs.card_alloc_dev(card->path, card->vendor_id,
+					   card->device_id);
+	if (sw == NULL)
+		return NULL;
+	sw->funcs = &software_funcs;
+	sw->wait_policy = card->wait_policy;
+	if (!__atomic_compare_exchange_n(&card->overflow, &old, sw, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		software_funcs.card_free(sw);
+		return old;
+	}
+	snap_trace("%s: Card %p Software %p\n", __func__, card, sw);
+	return sw;
+}
+
+static void snap_card_overflow_free(struct snap_card *card)
+{
+	struct snap_card *sw;
+
+	sw = __atomic_exchange_n(&card->overflow, NULL, __ATOMIC_ACQ_REL);
+	if (sw == NULL)
+		return;
+	sw->funcs->card_free(sw);
+}
+
+/* Run a job with the software action on behalf of a hardware context */
+static int snap_cpu_execute_job(struct snap_card *card,
+				snap_action_type_t action_type,
+				snap_action_flag_t action_flags,
+				struct snap_job *cjob,
+				unsigned int timeout_sec)
+{
+	int rc;
+	struct snap_card *sw;
+	struct snap_action *action;
+
+	sw = snap_card_overflow(card);
+	if (sw == NULL)
+		return SNAP_ENOMEM;
+
+	action = snap_attach_action(sw, action_type, action_flags, 0);
+	if (action == NULL)
+		return SNAP_EATTACH;
+
+	snap_trace("%s: Action 0x%x on CPU\n", __func__, action_type);
+	rc = snap_action_sync_execute_job(action, cjob, timeout_sec);
+	snap_detach_action(action);
+	return rc;
+}
+
+/* Both the hardware and the software action can run the job */
+static bool snap_card_hybrid(struct snap_card *card,
+			     snap_action_type_t action_type)
+{
+	return hybrid_enabled() && (card->funcs != &software_funcs) &&
+		(find_action(action_type) != NULL);
+}
+
+/**
+ * Run a job the hardware could not take with the software action.
+ *
+ * @return	SNAP_EATTACH if hybrid mode is off or there is no
+ *		software action, else as snap_action_sync_execute_job().
+ */
+static int snap_overflow_execute_job(struct snap_card *card,
+				     snap_action_type_t action_type,
+				     snap_action_flag_t action_flags,
+				     struct snap_job *cjob,
+				     unsigned int timeout_sec)
+{
+	if (!snap_card_hybrid(card, action_type))
+		return SNAP_EATTACH;
 
-		case CXL_EVENT_DATA_STORAGE:  {
-			struct cxl_event_data_storage *ds = &card->event.fault;
+	return snap_cpu_execute_job(card, action_type, action_flags,
+				    cjob, timeout_sec);
+}
 
-			snap_trace("  %s: CXL_EVENT_DATA_STORAGE\n", __func__);
-			snap_trace("      flags=%04x addr=%08llx dsisr=%08llx\n",
-				ds->flags, (long long)ds->addr, (long long)ds->dsisr);
-			rc = EFAULT;
+/* Execute the job on the context of the calling thread */
+static int snap_ctx_execute_job(struct snap_card *card,
+				snap_action_type_t action_type,
+				snap_action_flag_t action_flags,
+				struct snap_job *cjob,
+				int attach_timeout_sec,
+				int timeout_sec)
+{
+	int rc = SNAP_OK;
+	struct snap_card *ctx;
+	struct snap_action *action;
+
+	ctx = snap_card_context(card);
+	if (ctx == NULL) {
+		errno = ENODEV;
+		return SNAP_ENODEV;
+	}
+
+	/* Busy hardware sends the job to the CPU, do not wait for it */
+	if (snap_card_hybrid(ctx, action_type))
+		attach_timeout_sec = 0;
+
+	action = snap_lease_get(ctx, action_type, action_flags,
+				attach_timeout_sec);
+	if (NULL == action) {
+		rc = snap_overflow_execute_job(ctx, action_type, action_flags,
+					       cjob, timeout_sec);
+		if (rc != SNAP_EATTACH)
+			return rc;
+		snap_trace("%s: Error Can not attach to Action 0x%x\n",
+			   __func__, ctx->action_type);
+		errno = ETIME;
+		return SNAP_EATTACH;
+	}
+
+	rc = snap_action_sync_execute_job(action, cjob, timeout_sec);
+	snap_lease_put(ctx, action, rc);
+	return rc;
+}
+
+int snap_sync_execute_job(struct snap_card *card,
+			  snap_action_type_t action_type,
+			  snap_action_flag_t action_flags,
+			  struct snap_job *cjob,
+			  int attach_timeout_sec,
+			  int timeout_sec)
+{
+	if ((card != NULL) &&
+	    (__atomic_load_n(&card->sched, __ATOMIC_ACQUIRE) != NULL))
+		return snap_prio_execute_job(card, action_type, action_flags,
+					     cjob, SNAP_PRIO_NORMAL, 0,
+					     attach_timeout_sec, timeout_sec);
+
+	return snap_ctx_execute_job(card, action_type, action_flags, cjob,
+				    attach_timeout_sec, timeout_sec);
+}
+
+/* Post a cancel request if ctx waits for cjob, called with ctx_lock */
+static bool snap_ctx_cancel(struct snap_card *ctx, struct snap_job *cjob,
+			    snap_cancel_mode_t mode)
+{
+	uint64_t kick = 1;
+
+	if (__atomic_load_n(&ctx->cur_job, __ATOMIC_ACQUIRE) != cjob)
+		return false;
+
+	ctx->cancel_mode = mode;
+	__atomic_store_n(&ctx->cancel_job, cjob, __ATOMIC_RELEASE);
+
+	/* Wake up the executing thread if it sleeps on the interrupt */
+	if ((ctx->cancel_fd >= 0) &&
+	    (write(ctx->cancel_fd, &kick, sizeof(kick)) < 0))
+		snap_trace("  %s: %s\n", __func__, strerror(errno));
+	if (ctx->funcs == &software_funcs)
+		sw_cancel_kick(ctx);
+	return true;
+}
+
+int snap_job_cancel(struct snap_card *card, struct snap_job *cjob,
+		    snap_cancel_mode_t mode)
+{
+	struct snap_card *ctx, *sw;
+	int rc = SNAP_ENOENT;
+
+	if ((card == NULL) || (cjob == NULL) ||
+	    ((mode != SNAP_CANCEL_ABORT) && (mode != SNAP_CANCEL_CHECKPOINT))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	pthread_mutex_lock(&card->ctx_lock);
+	for (ctx = card; ctx != NULL;
+	     ctx = (ctx == card) ? card->ctx_list : ctx->ctx_next) {
+		if (snap_ctx_cancel(ctx, cjob, mode) ||
+		    ((sw = __atomic_load_n(&ctx->overflow,
+					   __ATOMIC_ACQUIRE)) != NULL &&
+		     snap_ctx_cancel(sw, cjob, mode))) {
+			rc = SNAP_OK;
 			break;
 		}
+	}
+	pthread_mutex_unlock(&card->ctx_lock);
 
-		case CXL_EVENT_AFU_ERROR:
-		//case CXL_EVENT_READ_FAIL:
-		default:
-			snap_trace("  %s: AFU_ERROR %d flags: 0x%x error: 0x%016llx\n",
-				__func__, card->event.header.type,
-				card->event.afu_error.flags,
-				(long long)card->event.afu_error.error);
-			rc = EINTR;
+	snap_trace("%s: Job %p mode %d rc %d\n", __func__, cjob, mode, rc);
+	if (rc != SNAP_OK)
+		errno = ENOENT;
+	return rc;
+}
+
+/******************************************************************************
+ * JOB PRIORITIES
+ *
+ * Without priorities, jobs get the card in the order they win the
+ * attach race. snap_prio_execute_job() lets jobs pass a gate per card
+ * first. At most slots jobs are admitted at once, and at most limit of
+ * one class. Jobs which can not be admitted wait in a list ordered by
+ * class, deadline and arrival. The job which finishes admits the next
+ * ones. Waiting jobs of a class at its limit do not hold back others.
+ *****************************************************************************/
+
+#define SNAP_DEADLINE_NONE	UINT64_MAX
+
+struct snap_prio_waiter {
+	snap_prio_t prio;
+	uint64_t deadline_ns;		/* Absolute or SNAP_DEADLINE_NONE */
+	uint64_t seq;			/* Arrival */
+	bool admitted;
+	pthread_cond_t cond;
+	struct snap_prio_waiter *next;
+};
+
+struct snap_sched {
+	pthread_mutex_t lock;
+	unsigned int slots;
+	unsigned int running;
+	unsigned int limit[SNAP_PRIO_CLASSES];	/* 0: only slots */
+	uint64_t seq;
+	struct snap_prio_waiter *waiters;	/* In admission order */
+	struct snap_prio_stats stats[SNAP_PRIO_CLASSES];
+};
+
+/* Action slots of the card, CPUs for software actions */
+static unsigned int snap_sched_default_slots(struct snap_card *card)
+{
+	uint64_t data = 0;
+	long cpus;
+
+	if (card->funcs == &software_funcs) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		return (cpus > 0) ? (unsigned int)cpus : 1;
+	}
+	card->funcs->mmio_read64(card, SNAP_S_SSR, &data);
+	return (unsigned int)(data & 0xf) + 1;
+}
+
+static struct snap_sched *snap_card_sched(struct snap_card *card)
+{
+	struct snap_sched *s = __atomic_load_n(&card->sched, __ATOMIC_ACQUIRE);
+
+	if (s != NULL)
+		return s;
+
+	pthread_mutex_lock(&card->ctx_lock);
+	s = card->sched;
+	if (s == NULL) {
+		s = calloc(1, sizeof(*s));
+		if (s != NULL) {
+			pthread_mutex_init(&s->lock, NULL);
+			s->slots = snap_sched_default_slots(card);
+			snap_trace("%s: Card %p Slots %u\n", __func__, card,
+				   s->slots);
+			__atomic_store_n(&card->sched, s, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&card->ctx_lock);
+	return s;
+}
+
+static void snap_card_sched_free(struct snap_card *card)
+{
+	struct snap_sched *s = card->sched;
+
+	if (s == NULL)
+		return;
+	card->sched = NULL;
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+/* True if a waits in front of b */
+static inline bool snap_prio_before(const struct snap_prio_waiter *a,
+				    const struct snap_prio_waiter *b)
+{
+	if (a->prio != b->prio)
+		return a->prio < b->prio;
+	if (a->deadline_ns != b->deadline_ns)
+		return a->deadline_ns < b->deadline_ns;
+	return a->seq < b->seq;
+}
+
+/* Admit waiting jobs while slots are free, called with s->lock held */
+static void snap_sched_dispatch(struct snap_sched *s)
+{
+	struct snap_prio_waiter **pw = &s->waiters, *w;
+	struct snap_prio_stats *st;
+
+	while ((*pw != NULL) && (s->running < s->slots)) {
+		w = *pw;
+		st = &s->stats[w->prio];
+		if (s->limit[w->prio] &&
+		    (st->running >= s->limit[w->prio])) {
+			pw = &w->next;		/* Class is at its limit */
+			continue;
+		}
+		*pw = w->next;
+		w->admitted = true;
+		s->running++;
+		st->running++;
+		st->queued--;
+		pthread_cond_signal(&w->cond);
+	}
+}
+
+/**
+ * Wait until the job may run.
+ *
+ * @return	SNAP_OK, or SNAP_EATTACH if no slot got free in time.
+ */
+static int snap_sched_enter(struct snap_sched *s, snap_prio_t prio,
+			    uint64_t t0, uint64_t deadline_ns,
+			    int timeout_sec)
+{
+	struct snap_prio_waiter w, **pw;
+	struct timespec ts;
+	int rc = 0;
+
+	w.prio = prio;
+	w.deadline_ns = deadline_ns;
+	w.admitted = false;
+	pthread_cond_init(&w.cond, NULL);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += (timeout_sec > 0) ? timeout_sec : 0;
+
+	pthread_mutex_lock(&s->lock);
+	w.seq = s->seq++;
+	for (pw = &s->waiters; *pw != NULL; pw = &(*pw)->next)
+		if (snap_prio_before(&w, *pw))
 			break;
+	w.next = *pw;
+	*pw = &w;
+	s->stats[prio].queued++;
+	snap_sched_dispatch(s);
+
+	while (!w.admitted && (rc != ETIMEDOUT))
+		rc = (timeout_sec > 0) ?
+			pthread_cond_timedwait(&w.cond, &s->lock, &ts) :
+			ETIMEDOUT;
+
+	if (!w.admitted) {
+		for (pw = &s->waiters; *pw != &w; pw = &(*pw)->next)
+			;
+		*pw = w.next;
+		s->stats[prio].queued--;
+		s->stats[prio].rejected++;
+	} else
+		snap_stats_hist_add(&s->stats[prio].wait, tget_ns() - t0);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_cond_destroy(&w.cond);
+	return w.admitted ? SNAP_OK : SNAP_EATTACH;
+}
+
+static void snap_sched_leave(struct snap_sched *s, snap_prio_t prio,
+			     uint64_t t0, uint64_t deadline_ns)
+{
+	struct snap_prio_stats *st = &s->stats[prio];
+	uint64_t now = tget_ns();
+
+	pthread_mutex_lock(&s->lock);
+	s->running--;
+	st->running--;
+	snap_stats_hist_add(&st->total, now - t0);
+	if (deadline_ns != SNAP_DEADLINE_NONE) {
+		if (now <= deadline_ns)
+			st->deadline_met++;
+		else	st->deadline_missed++;
+	}
+	snap_sched_dispatch(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int snap_card_set_slots(struct snap_card *card, unsigned int slots)
+{
+	struct snap_sched *s;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	s = snap_card_sched(card);
+	if (s == NULL)
+		return SNAP_ENOMEM;
+
+	pthread_mutex_lock(&s->lock);
+	s->slots = slots ? slots : snap_sched_default_slots(card);
+	snap_sched_dispatch(s);
+	pthread_mutex_unlock(&s->lock);
+	return SNAP_OK;
+}
+
+int snap_card_set_prio_limit(struct snap_card *card, snap_prio_t prio,
+			     unsigned int max_jobs)
+{
+	struct snap_sched *s;
+
+	if ((card == NULL) || ((unsigned int)prio >= SNAP_PRIO_CLASSES)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	s = snap_card_sched(card);
+	if (s == NULL)
+		return SNAP_ENOMEM;
+
+	pthread_mutex_lock(&s->lock);
+	s->limit[prio] = max_jobs;
+	snap_sched_dispatch(s);
+	pthread_mutex_unlock(&s->lock);
+	return SNAP_OK;
+}
+
+int snap_prio_execute_job(struct snap_card *card,
+			  snap_action_type_t action_type,
+			  snap_action_flag_t action_flags,
+			  struct snap_job *cjob,
+			  snap_prio_t prio,
+			  unsigned int deadline_us,
+			  int attach_timeout_sec,
+			  int timeout_sec)
+{
+	int rc;
+	struct snap_sched *s;
+	struct snap_card *ctx;
+	uint64_t t0 = tget_ns();
+	uint64_t deadline_ns = deadline_us ?
+		t0 + deadline_us * 1000ull : SNAP_DEADLINE_NONE;
+
+	if ((card == NULL) || ((unsigned int)prio >= SNAP_PRIO_CLASSES)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	s = snap_card_sched(card);
+	if (s == NULL)
+		return SNAP_ENOMEM;
+
+	/* Like a busy action, no free slot sends the job to the CPU */
+	rc = snap_sched_enter(s, prio, t0, deadline_ns,
+			      snap_card_hybrid(card, action_type) ?
+			      0 : attach_timeout_sec);
+	if (rc != SNAP_OK) {
+		/* Like a busy card, the CPU might take it */
+		ctx = snap_card_hybrid(card, action_type) ?
+			snap_card_context(card) : NULL;
+		if (ctx != NULL)
+			rc = snap_overflow_execute_job(ctx, action_type,
+						       action_flags, cjob,
+						       timeout_sec);
+		if (rc == SNAP_EATTACH) {
+			snap_trace("%s: Error No slot for Action 0x%x "
+				   "Prio %d\n", __func__, action_type, prio);
+			errno = ETIME;
 		}
+		return rc;
 	}
 
- err_out:
-	snap_trace("  %s: Exit fd: %d rc: %d\n", __func__,
-		card->afu_fd, rc);
+	rc = snap_ctx_execute_job(card, action_type, action_flags, cjob,
+				  attach_timeout_sec, timeout_sec);
+	snap_sched_leave(s, prio, t0, deadline_ns);
 	return rc;
 }
 
-static struct snap_action *hw_attach_action(struct snap_card *card,
-				snap_action_type_t action_type,
-				snap_action_flag_t action_flags,
-				int timeout_sec)
+int snap_prio_stats_get(struct snap_card *card, snap_prio_t prio,
+			struct snap_prio_stats *stats)
 {
-	int i, rc = 0;
-	uint64_t data;
-	uint32_t mode;
-	uint32_t sat = INVALID_SAT;     /* Invalid short Action type */
-	int maid;                       /* Max Acition Id's */
-	unsigned long t0;               /* Time in msec */
-	int dt;
-	struct snap_action *action = NULL;
+	struct snap_sched *s;
+
+	if ((card == NULL) || (stats == NULL) ||
+	    ((unsigned int)prio >= SNAP_PRIO_CLASSES)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	s = __atomic_load_n(&card->sched, __ATOMIC_ACQUIRE);
+	if (s == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return SNAP_OK;
+	}
+	pthread_mutex_lock(&s->lock);
+	memcpy(stats, &s->stats[prio], sizeof(*stats));
+	pthread_mutex_unlock(&s->lock);
+	return SNAP_OK;
+}
+
+/******************************************************************************
+ * OFFLOAD DECISION
+ *
+ * For actions which exist in hardware and as software action, the
+ * library learns how long a job takes on the card and on the CPU, per
+ * action type and power of two job size. Times are taken as the caller
+ * sees them, attach, passing the parameters, execution and detach
+ * included. The first samples may include opening a context, so the
+ * fastest of the first SNAP_COST_WARMUP is taken, then a moving
+ * average. A job goes to the side which is expected to be faster. A
+ * side with too few samples for a size gets tried, unless smaller jobs
+ * took longer there already than the other side needs. Every
+ * SNAP_COST_EXPLORE-th job of a size runs on the slower side, if that
+ * one is not far behind, such that the model follows e.g. a card
+ * which gets busy.
+ *****************************************************************************/
+
+#define SNAP_COST_BUCKETS	48	/* Up to 128 TiB */
+#define SNAP_COST_EXPLORE	64	/* One job in 64 tries the slower side */
+#define SNAP_COST_EXPLORE_MAX	4	/* ... if it takes at most 4 times longer */
+#define SNAP_COST_WARMUP	4	/* Samples before a time is trusted */
+#define SNAP_COST_SHIFT		3	/* Then new samples count 1/8 */
+
+struct snap_cost_bucket {
+	uint64_t ns[SNAP_OFFLOAD_TARGETS];
+	uint32_t count[SNAP_OFFLOAD_TARGETS];
+	uint32_t decisions;
+};
+
+struct snap_cost {
+	snap_action_type_t action_type;
+	struct snap_cost_bucket bucket[SNAP_COST_BUCKETS];
+};
+
+static pthread_mutex_t cost_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_cost cost_model[SNAP_STATS_ACTIONS];
+static unsigned int cost_ntypes = 0;
+
+static unsigned int snap_cost_bucket(uint64_t size)
+{
+	unsigned int idx;
+
+	if (size < 2)
+		return 0;
+	idx = 64 - __builtin_clzll(size - 1);	/* Round up */
+	return (idx < SNAP_COST_BUCKETS) ? idx : SNAP_COST_BUCKETS - 1;
+}
+
+/* Call with cost_lock held, NULL if the action type is not known */
+static struct snap_cost *snap_cost_find(snap_action_type_t action_type)
+{
+	unsigned int i;
+
+	for (i = 0; i < cost_ntypes; i++)
+		if (cost_model[i].action_type == action_type)
+			return &cost_model[i];
+	return NULL;
+}
+
+/* Call with cost_lock held, NULL if there are too many action types */
+static struct snap_cost *snap_cost_get(snap_action_type_t action_type)
+{
+	struct snap_cost *c = snap_cost_find(action_type);
+
+	if (c != NULL)
+		return c;
+	if (cost_ntypes == SNAP_STATS_ACTIONS)
+		return NULL;
+	cost_model[cost_ntypes].action_type = action_type;
+	return &cost_model[cost_ntypes++];
+}
+
+/*
+ * Smallest time a side needs for jobs of bucket idx, taken from the
+ * next smaller size it ran, 0 if there is none. Larger jobs are
+ * assumed to never run faster.
+ */
+static uint64_t snap_cost_floor(struct snap_cost *c, unsigned int idx,
+				snap_offload_target_t t)
+{
+	while (idx-- > 0)
+		if (c->bucket[idx].count[t] >= SNAP_COST_WARMUP)
+			return c->bucket[idx].ns[t];
+	return 0;
+}
+
+/*
+ * Side expected to be faster, or the one which needs samples. Changes
+ * nothing, such that asking does not move the exploration schedule.
+ * Returns true if both sides are warm and the other one could be tried.
+ */
+static bool snap_cost_predict(struct snap_cost *c, unsigned int idx,
+			      struct snap_offload *offload)
+{
+	struct snap_cost_bucket *b = &c->bucket[idx];
+	snap_offload_target_t fast, slow;
+	uint64_t floor;
+	bool fpga = b->count[SNAP_OFFLOAD_FPGA] >= SNAP_COST_WARMUP;
+	bool cpu = b->count[SNAP_OFFLOAD_CPU] >= SNAP_COST_WARMUP;
+
+	if (!b->count[SNAP_OFFLOAD_FPGA] && !b->count[SNAP_OFFLOAD_CPU]) {
+		/* Nothing known for this size, guess from smaller jobs */
+		floor = snap_cost_floor(c, idx, SNAP_OFFLOAD_CPU);
+		offload->target = (floor != 0 && floor <
+				   snap_cost_floor(c, idx, SNAP_OFFLOAD_FPGA)) ?
+			SNAP_OFFLOAD_CPU : SNAP_OFFLOAD_FPGA;
+		return false;
+	}
+
+	if (!fpga || !cpu) {
+		/* Warm up the side with fewer samples, unless it loses */
+		slow = (b->count[SNAP_OFFLOAD_FPGA] <
+			b->count[SNAP_OFFLOAD_CPU]) ?
+			SNAP_OFFLOAD_FPGA : SNAP_OFFLOAD_CPU;
+		fast = (slow == SNAP_OFFLOAD_FPGA) ?
+			SNAP_OFFLOAD_CPU : SNAP_OFFLOAD_FPGA;
+		floor = snap_cost_floor(c, idx, slow);
+		offload->target = ((floor != 0) && (b->count[fast] != 0) &&
+				   (floor > b->ns[fast])) ? fast : slow;
+		return false;
+	}
+
+	offload->target = (b->ns[SNAP_OFFLOAD_FPGA] <=
+			   b->ns[SNAP_OFFLOAD_CPU]) ?
+		SNAP_OFFLOAD_FPGA : SNAP_OFFLOAD_CPU;
+	return true;
+}
+
+/* Decision for a job which runs, counts towards the exploration */
+static void snap_cost_decide(struct snap_cost *c, unsigned int idx,
+			     struct snap_offload *offload)
+{
+	struct snap_cost_bucket *b = &c->bucket[idx];
+	snap_offload_target_t fast, slow;
+
+	if (!snap_cost_predict(c, idx, offload))
+		return;
+
+	fast = offload->target;
+	slow = (fast == SNAP_OFFLOAD_FPGA) ?
+		SNAP_OFFLOAD_CPU : SNAP_OFFLOAD_FPGA;
+	if ((++b->decisions % SNAP_COST_EXPLORE == 0) &&
+	    (b->ns[slow] <= b->ns[fast] * SNAP_COST_EXPLORE_MAX))
+		offload->target = slow;
+}
+
+static void snap_cost_record(snap_action_type_t action_type, uint64_t size,
+			     snap_offload_target_t t, uint64_t ns)
+{
+	struct snap_cost *c;
+	struct snap_cost_bucket *b;
+
+	pthread_mutex_lock(&cost_lock);
+	c = snap_cost_get(action_type);
+	if (c == NULL)
+		goto out;
+	b = &c->bucket[snap_cost_bucket(size)];
+	if (b->count[t] < SNAP_COST_WARMUP) {
+		if ((b->count[t] == 0) || (ns < b->ns[t]))
+			b->ns[t] = ns;
+	} else if (ns > b->ns[t]) {
+		/* Single outliers, e.g. preemption, move it 1/8 at most */
+		if (ns > 2 * b->ns[t])
+			ns = 2 * b->ns[t];
+		b->ns[t] += (ns - b->ns[t]) >> SNAP_COST_SHIFT;
+	} else
+		b->ns[t] -= (b->ns[t] - ns) >> SNAP_COST_SHIFT;
+	if (b->count[t] != UINT32_MAX)
+		b->count[t]++;
+ out:
+	pthread_mutex_unlock(&cost_lock);
+}
+
+/*
+ * Fill offload for a job of size. Only a job which is going to run
+ * decides, asking predicts and leaves the model as it is.
+ */
+static void snap_offload_eval(struct snap_card *card,
+			      snap_action_type_t action_type,
+			      uint64_t size, struct snap_offload *offload,
+			      bool decide)
+{
+	struct snap_cost *c;
+	unsigned int idx = snap_cost_bucket(size);
+
+	memset(offload, 0, sizeof(*offload));
+	offload->target = (card->funcs == &software_funcs) ?
+		SNAP_OFFLOAD_CPU : SNAP_OFFLOAD_FPGA;
+
+	pthread_mutex_lock(&cost_lock);
+	c = decide ? snap_cost_get(action_type) : snap_cost_find(action_type);
+	if (c != NULL) {
+		struct snap_cost_bucket *b = &c->bucket[idx];
+
+		if (snap_card_hybrid(card, action_type)) {
+			if (decide)
+				snap_cost_decide(c, idx, offload);
+			else
+				snap_cost_predict(c, idx, offload);
+		}
+		if (b->count[SNAP_OFFLOAD_FPGA])
+			offload->fpga_ns = b->ns[SNAP_OFFLOAD_FPGA];
+		if (b->count[SNAP_OFFLOAD_CPU])
+			offload->cpu_ns = b->ns[SNAP_OFFLOAD_CPU];
+	}
+	pthread_mutex_unlock(&cost_lock);
+
+	offload->expected_ns = (offload->target == SNAP_OFFLOAD_CPU) ?
+		offload->cpu_ns : offload->fpga_ns;
+}
+
+int snap_offload_decide(struct snap_card *card,
+			snap_action_type_t action_type,
+			uint64_t size,
+			struct snap_offload *offload)
+{
+	if ((card == NULL) || (offload == NULL))
+		return SNAP_EINVAL;
+
+	snap_offload_eval(card, action_type, size, offload, false);
+	return SNAP_OK;
+}
+
+int snap_offload_execute_job(struct snap_card *card,
+			     snap_action_type_t action_type,
+			     snap_action_flag_t action_flags,
+			     struct snap_job *cjob,
+			     uint64_t size,
+			     int attach_timeout_sec,
+			     int timeout_sec,
+			     struct snap_offload *offload)
+{
+	int rc;
+	struct snap_card *ctx;
+	struct snap_offload o;
+	unsigned long long t0;
+
+	ctx = snap_card_context(card);
+	if (ctx == NULL) {
+		errno = ENODEV;
+		return SNAP_ENODEV;
+	}
+
+	snap_offload_eval(ctx, action_type, size, &o, true);
+	snap_trace("%s: Action 0x%x size %llu on %s, expect %llu ns\n",
+		   __func__, action_type, (unsigned long long)size,
+		   (o.target == SNAP_OFFLOAD_CPU) ? "CPU" : "FPGA",
+		   (unsigned long long)o.expected_ns);
+
+	t0 = tget_ns();
+	if ((o.target == SNAP_OFFLOAD_CPU) && (ctx->funcs != &software_funcs))
+		rc = snap_cpu_execute_job(ctx, action_type, action_flags,
+					  cjob, timeout_sec);
+	else
+		rc = snap_sync_execute_job(card, action_type, action_flags,
+					   cjob, attach_timeout_sec,
+					   timeout_sec);
+	/*
+	 * Waiting for a busy card makes it more expensive, also if the
+	 * job went to the CPU because all action slots were in use.
+	 */
+	if (rc == SNAP_OK)
+		snap_cost_record(action_type, size, o.target, tget_ns() - t0);
+
+	if (offload != NULL)
+		*offload = o;
+	return rc;
+}
+
+/******************************************************************************
+ * JOB QUEUE Operations
+ *****************************************************************************/
+
+/*
+ * The direct action access mode offers one set of action registers per
+ * context. The queue keeps the action attached for its whole lifetime
+ * and holds up to queue_length staged workitem cachelines. Submitters
+ * prepare their cacheline outside of the queue lock, while the action
+ * is busy with an earlier job. Whoever finds the action unused becomes
+ * the runner and drains the staged jobs in order, waking up the
+ * submitters as their jobs complete.
+ *
+ * Asynchronous jobs are driven by a completion thread, which is started
+ * with the first asynchronous submission. Finished asynchronous jobs
+ * are handed over to it, such that the finished callbacks are always
+ * called from the completion thread and never from a submitter.
+ */
+#define SNAP_ASYNC_TIMEOUT_SEC	3600	/* Default timeout for async jobs */
+
+enum snap_slot_state {
+	SLOT_FREE = 0,
+	SLOT_STAGING,                   /* Submitter fills the workitem */
+	SLOT_READY,                     /* Workitem can be passed to action */
+};
+
+struct snap_queue_req {
+	struct snap_job *cjob;
+	unsigned int timeout_sec;
+	int rc;
+	bool done;
+	snap_job_finished_t finished;   /* NULL for synchronous jobs */
+	struct snap_queue_req *next;    /* Completion list */
+};
+
+struct snap_queue_slot {
+	struct snap_queue_workitem job; /* Staged cacheline */
+	unsigned int mmio_in;           /* # of words to pass */
+	enum snap_slot_state state;
+	struct snap_queue_req *req;
+};
+
+struct snap_queue {
+	struct snap_card *card;
+	struct snap_action *action;     /* NULL if not attached */
+	snap_action_type_t action_type;
+	snap_action_flag_t action_flags;
+	unsigned int attach_timeout_sec;
+	unsigned int timeout_sec;       /* Job timeout for async jobs */
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;            /* Slot freed or job completed */
+	bool running;                   /* Someone drives the action */
+	unsigned int length;
+	unsigned int head;              /* Next slot to execute */
+	unsigned int tail;              /* Next slot to stage */
+	unsigned int count;             /* Slots in use */
+	struct snap_queue_slot *slots;
+
+	pthread_t completion_thread;
+	bool completion_started;
+	bool completion_stop;
+	unsigned int async_pending;     /* Async jobs not yet reported */
+	struct snap_queue_req *done_head; /* Finished async jobs */
+	struct snap_queue_req *done_tail;
+};
+
+struct snap_queue *snap_queue_alloc(struct snap_card *card,
+				    snap_action_type_t action_type,
+				    snap_action_flag_t action_flags,
+				    unsigned int queue_length,
+				    unsigned int attach_timeout_sec)
+{
+	struct snap_queue *q;
 
 	if (card == NULL) {
 		errno = EINVAL;
 		return NULL;
 	}
+	if (queue_length == 0)
+		queue_length = 1;
 
-	snap_trace("%s Enter Action: 0x%x Old Action: %x "
-		   "Flags: 0x%x Base: %x timeout: %d sec Seq: %x\n",
-		   __func__, action_type, card->action_type, action_flags,
-		   card->action_base, timeout_sec, card->seq);
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return NULL;
 
-	if (card->master) {
-		snap_trace("%s Exit Error Master is not allowed to use "
-			   "Action\n",  __func__);
-		errno = ENODEV;
+	q->slots = calloc(queue_length, sizeof(*q->slots));
+	if (q->slots == NULL) {
+		free(q);
 		return NULL;
 	}
+	q->card = card;
+	q->action_type = action_type;
+	q->action_flags = action_flags;
+	q->attach_timeout_sec = attach_timeout_sec;
+	q->timeout_sec = SNAP_ASYNC_TIMEOUT_SEC;
+	q->length = queue_length;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	snap_trace("%s: Action 0x%x Flags 0x%x Length %d\n", __func__,
+		   action_type, action_flags, queue_length);
+	return q;
+}
+
+/* Attach, pass the staged workitem, start and wait for the action */
+static int snap_queue_run_slot(struct snap_queue *q,
+			       struct snap_queue_slot *slot)
+{
+	int rc;
+	struct snap_card *card = q->card;
+	struct snap_queue_req *req = slot->req;
+
+	if (req->rc != 0)               /* Staging failed */
+		return req->rc;
+
+	if (q->action == NULL) {
+		q->action = snap_lease_get(card, q->action_type,
+					   q->action_flags,
+					   snap_card_hybrid(card, q->action_type) ?
+					   0 : q->attach_timeout_sec);
+		if (q->action == NULL) {
+			rc = snap_overflow_execute_job(card, q->action_type,
+						       q->action_flags,
+						       req->cjob,
+						       req->timeout_sec);
+			if (rc != SNAP_EATTACH)
+				return rc;
+			snap_trace("%s: Error Can not attach to Action 0x%x\n",
+				   __func__, q->action_type);
+			errno = ETIME;
+			return SNAP_EATTACH;
+		}
+	}
+
+	snap_workitem_bind(card, &slot->job);
+
+	rc = snap_workitem_write(card, &slot->job, slot->mmio_in);
+	if (rc != 0)
+		return rc;
 
-	if (action_type != card->action_type) {
+	rc = snap_action_start(q->action);
+	if (rc != 0) {
+		snap_trace("%s: Error Can not start Action 0x%x rc=%d\n",
+			   __func__, q->action_type, rc);
+		rc = SNAP_EIO;
+	} else
+		rc = snap_action_sync_execute_job_check_completion(q->action,
+					req->cjob, req->timeout_sec);
+	if ((rc == SNAP_ECANCELED) || (rc == SNAP_ETIMEDOUT) ||
+	    (rc == SNAP_EIO)) {
 		/*
-		 * FIXME I think this code is better done in functions with
-		 * more meaningful names. Should make the code better
-		 * maintain and readable.
+		 * Canceled, or the action might still run. The next job
+		 * must not go to it, detach and attach again for that one.
 		 */
+		snap_lease_put(card, q->action, rc);
+		q->action = NULL;
+	}
+	return rc;
+}
 
-		hw_snap_mmio_read64(card, SNAP_S_SSR, &data);
-		/* Check if configure Slave s done */
-		if (0x100 != (data & 0x100)) {
-			snap_trace("%s Error AFU SLAVE need's setup\n",
-				   __func__);
-			errno = ENODEV;
-			return NULL;
-		}
-		maid = (int)(data & 0xf) + 1;	/* Max Actions */
+/* Called with q->lock held, returns with q->lock held */
+static void snap_queue_run(struct snap_queue *q)
+{
+	struct snap_queue_slot *slot;
+	struct snap_queue_req *req;
+	int rc;
 
-		/* Search action to get Short Action type */
-		for (i = 0; i < maid; i++) {
-			hw_snap_mmio_read64(card, SNAP_S_ATRI + i*8, &data);
-			if (action_type ==
-			    (snap_action_type_t)(data & 0xffffffff)) {
-				sat = (uint32_t)(data >>  32ll);
-				/* Short Action Type */
-				break;	/* Found */
-			}
-		}
-		if (INVALID_SAT == sat) {
-			snap_trace("%s Exit Error Can not find Action\n",
-				   __func__);
-			errno = ENODEV;
-			return NULL;
+	q->running = true;
+	while (q->count != 0) {
+		slot = &q->slots[q->head];
+		if (slot->state != SLOT_READY)
+			break;          /* Submitter still staging */
+
+		pthread_mutex_unlock(&q->lock);
+		rc = snap_queue_run_slot(q, slot);
+		pthread_mutex_lock(&q->lock);
+
+		req = slot->req;
+		req->rc = rc;
+		req->done = true;
+		if (req->finished) {
+			/* Hand over to the completion thread */
+			req->next = NULL;
+			if (q->done_tail)
+				q->done_tail->next = req;
+			else	q->done_head = req;
+			q->done_tail = req;
 		}
+		slot->req = NULL;
+		slot->state = SLOT_FREE;
+		q->head = (q->head + 1) % q->length;
+		q->count--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	q->running = false;
+	pthread_cond_broadcast(&q->cond);
+}
 
-		card->flags = action_flags;    /* Save Flags */
-		/* Make Mode bits 0, 1, 2 for Job Manager for CCR Register */
-		mode = SNAP_CCR_DIRECT_MODE;   /* Set Job manager bit to access Action */
-		/* This interrupt is generated by the job-manager in both modes */
-		if (action_flags & SNAP_ATTACH_IRQ)
-			mode |= SNAP_CCR_IRQ_ATTACH;
-		card->sat = sat;            /* Save short Action Type */
-		card->seq = 0xf000;
-		card->action_type = action_type;
-		data = ((uint64_t)card->seq << 48ll);
-		data |= (card->sat << 12) | mode;
-
-		/* Short Action Type and Direct Access */
-		hw_snap_mmio_write64(card, SNAP_S_CCR, data);
-		card->start_attach = true;
-		card->attach_timeout_sec = timeout_sec; /* Save timeout */ 
+/*
+ * Reserve the next free slot and build the workitem for the request.
+ * Called with q->lock held, returns with q->lock held.
+ */
+static void snap_queue_stage(struct snap_queue *q,
+			     struct snap_queue_req *req)
+{
+	int rc;
+	struct snap_queue_slot *slot;
+
+	while (q->count == q->length) {
+		/* Help draining, the caller might be the completion thread */
+		if (!q->running && (q->slots[q->head].state == SLOT_READY))
+			snap_queue_run(q);
+		else
+			pthread_cond_wait(&q->cond, &q->lock);
 	}
 
-	if (card->start_attach) {
-		card->start_attach = false;
-		data = ((uint64_t)card->seq << 48ll) | 1;
+	slot = &q->slots[q->tail];
+	slot->state = SLOT_STAGING;
+	slot->req = req;
+	q->tail = (q->tail + 1) % q->length;
+	q->count++;
+	pthread_mutex_unlock(&q->lock);
 
-		/* Start: Attach action to context */
-		hw_snap_mmio_write64(card, SNAP_S_JCR, data);
-		card->seq++;
-	}
+	rc = snap_job_to_workitem(req->cjob, &slot->job, &slot->mmio_in, NULL);
 
-	if (SNAP_ATTACH_IRQ & card->flags)
-		rc = hw_wait_irq(card, timeout_sec, SNAP_ATTACH_IRQ_NUM);
-	else {
-		t0 = tget_ms();
-		dt = 0;
-		rc = EBUSY;
-		while (dt < (timeout_sec * 1000)) {
-			hw_snap_mmio_read64(card, SNAP_S_CSR, &data);
-			if (SNAP_CSR_ATTACHED == (data & SNAP_CSR_ATTACHED)) {
-				rc = 0;
-				break;
-			}
-			dt = (int)(tget_ms() - t0);
-		}
+	pthread_mutex_lock(&q->lock);
+	if (rc != 0)
+		req->rc = rc;   /* Runner passes the error on */
+	slot->state = SLOT_READY;
+	pthread_cond_broadcast(&q->cond);
+}
+
+/**
+ * Stage the job into the next free slot and wait until it got executed.
+ * While the action works on earlier jobs the workitem for this one is
+ * prepared, such that it can be passed on as soon as the action is done.
+ */
+int snap_queue_sync_execute_job(struct snap_queue *queue,
+			  struct snap_job *cjob,
+			  unsigned int timeout_sec)
+{
+	struct snap_queue *q = queue;
+	struct snap_queue_req req = {
+		.cjob = cjob,
+		.timeout_sec = timeout_sec,
+		.rc = 0,
+		.done = false,
+		.finished = NULL,
+		.next = NULL,
+	};
+
+	if ((q == NULL) || (cjob == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
 	}
-	/* Return Pointer if all went well */
-	if (0 == rc) {
-		card->action_base = ACTION_BASE_S;
-		action = (struct snap_action *)card;
+
+	pthread_mutex_lock(&q->lock);
+	snap_queue_stage(q, &req);
+
+	while (!req.done) {
+		if (!q->running && (q->slots[q->head].state == SLOT_READY))
+			snap_queue_run(q);
+		else
+			pthread_cond_wait(&q->cond, &q->lock);
 	}
-	snap_trace("%s Exit rc: %d Action: %p Base: 0x%x\n", __func__,
-		rc, action, card->action_base);
+	pthread_mutex_unlock(&q->lock);
 
-	return action;
+	snap_trace("%s: Seq 0x%x rc: %d\n", __func__, q->card->seq, req.rc);
+	return req.rc;
 }
 
-static int hw_detach_action(struct snap_action *action)
+/*
+ * Completion thread: drives the action for asynchronous jobs and calls
+ * the finished callbacks. The action completion itself is detected by
+ * snap_action_completed(), which waits for the action done interrupt
+ * if SNAP_ACTION_DONE_IRQ was requested and polls otherwise.
+ */
+static void *snap_queue_completion_thread(void *arg)
 {
-	int rc = 0;
-	uint64_t data = 0;
-	uint32_t action_control = 0;
-	struct snap_card *card;
-	unsigned long t0;
-	unsigned int dt = 0;
-
-	if (action == NULL) {
-		snap_trace("%s Error NULL Action\n", __func__);
-		errno = EINVAL;
-		return -1;
+	struct snap_queue *q = (struct snap_queue *)arg;
+	struct snap_queue_req *req;
+
+	snap_trace("%s: Enter Queue %p\n", __func__, q);
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->completion_stop || q->async_pending) {
+		if (q->done_head) {
+			req = q->done_head;
+			q->done_head = req->next;
+			if (q->done_head == NULL)
+				q->done_tail = NULL;
+			pthread_mutex_unlock(&q->lock);
+
+			/* Report library errors through retc */
+			if (req->rc == SNAP_ETIMEDOUT)
+				req->cjob->retc = SNAP_RETC_TIMEOUT;
+			else if (req->rc != 0)
+				req->cjob->retc = SNAP_RETC_FAILURE;
+			req->finished(q, req->cjob);
+			free(req);
+
+			pthread_mutex_lock(&q->lock);
+			q->async_pending--;
+			pthread_cond_broadcast(&q->cond);
+		} else if (!q->running &&
+			   (q->slots[q->head].state == SLOT_READY))
+			snap_queue_run(q);
+		else
+			pthread_cond_wait(&q->cond, &q->lock);
 	}
-	card = (struct snap_card *)action;
-	snap_trace("%s Enter Action: 0x%x "
-		   "Base: %x timeout: %d sec Seq: 0x%x\n",
-		   __func__, card->action_type, card->action_base,
-		   card->attach_timeout_sec, card->seq);
+	pthread_mutex_unlock(&q->lock);
 
-	card->start_attach = true;              /* Set Flag to Attach next Time again */
+	snap_trace("%s: Exit Queue %p\n", __func__, q);
+	return NULL;
+}
 
-	/* Read Action Control and check Action Status */
-	hw_snap_mmio_read32(card, ACTION_CONTROL, &action_control);
-	if (ACTION_CONTROL_IDLE & action_control)
-		data = SNAP_JCR_STOP;           /* Action is IDLE, send Stop */
-	else    data = SNAP_JCR_ABORT;          /* Action is not IDLE, send Abort */
-	hw_snap_mmio_write64(card, SNAP_S_JCR, data);
+static int snap_queue_submit(struct snap_queue *q,
+			     struct snap_job *cjob,
+			     snap_job_finished_t finished,
+			     unsigned int timeout_sec)
+{
+	int rc;
+	struct snap_queue_req *req;
 
-	/* Wait until Action gets detached. */
-	rc = SNAP_EDETACH;
-	t0 = tget_ms();
-	while (dt < (card->attach_timeout_sec * 1000)) {
-		/* Check if Action is detached */
-		hw_snap_mmio_read64(card, SNAP_S_CSR, &data);
-		if (0 == (data & SNAP_CSR_ATT)) {
-			rc = 0;             /* Ok */
-			break;              /* Detached */
+	req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		errno = ENOMEM;
+		return SNAP_ENOMEM;
+	}
+	req->cjob = cjob;
+	req->timeout_sec = timeout_sec;
+	req->finished = finished;
+
+	pthread_mutex_lock(&q->lock);
+	if (!q->completion_started) {
+		rc = pthread_create(&q->completion_thread, NULL,
+				    snap_queue_completion_thread, q);
+		if (rc != 0) {
+			pthread_mutex_unlock(&q->lock);
+			snap_trace("%s: Error Can not start completion thread "
+				   "%d\n", __func__, rc);
+			free(req);
+			errno = rc;
+			return SNAP_ENOMEM;
 		}
-		/* Action detach can take a while for ABORT */
-		usleep(1000);
-		dt = (unsigned int)(tget_ms() - t0);
+		q->completion_started = true;
 	}
+	q->async_pending++;
+	snap_queue_stage(q, req);
+	pthread_mutex_unlock(&q->lock);
 
-	card->action_base = 0;              /* FIXME use action_*32 instead */
-	snap_trace("%s Exit: rc: %d CSR 0x%llx after: %d msec\n",
-		   __func__, rc, (long long)data, dt);
-	return rc;
+	return SNAP_OK;
 }
 
-static int hw_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long parm)
+int snap_async_execute_job(struct snap_queue *queue,
+			   struct snap_job *cjob,
+			   snap_job_finished_t finished)
 {
-	int rc = 0;
-	unsigned long rc_val = 0;
-	unsigned long *arg = (unsigned long *)parm;
+	if ((queue == NULL) || (cjob == NULL) || (finished == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	return snap_queue_submit(queue, cjob, finished,
+				 __atomic_load_n(&queue->timeout_sec,
+						 __ATOMIC_RELAXED));
+}
 
-	if (NULL == arg) {
-		snap_trace("  %s Error Missing parm\n", __func__);
-		return -1;
-	}	
-	switch (cmd) {
-	case GET_CARD_TYPE:
-		rc_val = (unsigned long)(card->cap_reg & 0xff);
-		snap_trace("  %s GET CARD_TYPE: %d\n", __func__, (int)rc_val);
-		*arg = rc_val;
-		break;
-	case GET_NVME_ENABLED:
-		if (card->cap_reg & SNAP_NVME_ENA)
-			rc_val = 1;
-		else rc_val = 0;
-		snap_trace("  %s GET NVME: %d\n", __func__, (int)rc_val);
-		*arg = rc_val;
-		break;
-	case GET_SDRAM_SIZE:
-		rc_val = (unsigned long)(card->cap_reg >> 16);   /* in MB */
-		rc_val = rc_val & 0xffff;    /* Mask bits 16 ... 31 */
-		snap_trace("  %s Get MEM: %d MB\n", __func__, (int)rc_val);
-		*arg = rc_val;
-		break;
-	case GET_DMA_ALIGN:
-		/* Data alignment for DMA transfers to/from Host */
-		/* Value a means that transfers need to be 2^a B aligned */
-		rc_val = (unsigned long)(card->cap_reg >> 32)&0xf;   /* Get Bits 32 .. 35 */
-		rc_val = 1 << rc_val;
-		snap_trace("  %s Get DMA align: %d Bytes\n", __func__, (int)rc_val);
-		*arg = rc_val;
-		break;
-	case GET_DMA_MIN_SIZE:
-		/* Minimum size for DMA transfers to/from Host */
-		/* Value t means that minimum transfer size is 2^t B */ 
-		rc_val = (unsigned long)(card->cap_reg >> 36)&0xf;   /* Get Bits 36 .. 39 */
-		rc_val = 1 << rc_val;
-		snap_trace("  %s Get DMA Min Size: %d Bytes\n", __func__, (int)rc_val);
-		*arg = rc_val;
-		break;
-	case GET_CARD_NAME:
-		snap_trace("  %s Get Card name: %s\n", __func__, card->name);
-		strcpy((char*)parm, card->name);
-		break;
-	case SET_SDRAM_SIZE:
-		card->cap_reg = (card->cap_reg & 0xffff) | (parm << 16);
-		snap_trace("  %s Set MEM: %d MB\n", __func__, (int)parm);
-		break;
-	default:
-		snap_trace("  %s Invalid CMD %d Error\n", __func__, cmd);
-		*arg = 0;
-		rc = -1;
-		break;
+int snap_queue_set_timeout(struct snap_queue *queue,
+			   unsigned int timeout_sec)
+{
+	if ((queue == NULL) || (timeout_sec == 0)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
 	}
-	return rc;
+	__atomic_store_n(&queue->timeout_sec, timeout_sec, __ATOMIC_RELAXED);
+	return SNAP_OK;
 }
 
-/* Hardware version of the lowlevel functions */
-static struct snap_funcs hardware_funcs = {
-	.card_alloc_dev = hw_snap_card_alloc_dev,
-	.attach_action = hw_attach_action,       /* attach Action */
-	.detach_action = hw_detach_action,       /* detach Action */
-	.mmio_write32 = hw_snap_mmio_write32,
-	.mmio_read32 = hw_snap_mmio_read32,
-	.mmio_write64 = hw_snap_mmio_write64,
-	.mmio_read64 = hw_snap_mmio_read64,
-	.card_free = hw_snap_card_free,
-	.card_ioctl = hw_card_ioctl,
+void snap_queue_free(struct snap_queue *queue)
+{
+	struct snap_queue *q = queue;
+
+	if (q == NULL)
+		return;
+
+	/* Let outstanding asynchronous jobs finish */
+	pthread_mutex_lock(&q->lock);
+	q->completion_stop = true;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	if (q->completion_started)
+		pthread_join(q->completion_thread, NULL);
+
+	if ((q->action == NULL) || !snap_lease_put(q->card, q->action, 0))
+		q->card->action_type = 0xffffffff;
+
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	__free(q->slots);
+	__free(q);
+}
+
+/******************************************************************************
+ * LARGE TRANSFERS
+ *****************************************************************************/
+
+/*
+ * A chain keeps up to depth pieces in flight on the queue. Pieces are
+ * completed in the order they were staged, since the queue executes
+ * them in that order and the completion thread reports them in the
+ * order they finished. If a piece comes back short, the pieces staged
+ * behind it are stale: their results are dropped and the chain goes on
+ * where the short piece stopped.
+ */
+#define SNAP_CHAIN_CHUNK_SIZE	(1ull << 30)	/* Default bytes per piece */
+
+struct snap_chain_run;
+
+struct snap_chain_piece {
+	struct snap_job job;		/* First, see snap_chain_finished() */
+	struct snap_chain_run *run;
+	uint64_t offs;
+	uint32_t len;
+	unsigned int gen;		/* Restart generation it belongs to */
+	bool busy;
 };
 
-/* We access the hardware via this function pointer struct */
-static struct snap_funcs *df = &hardware_funcs;
+struct snap_chain_run {
+	const struct snap_chain *chain;
+	struct snap_job *cjob;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* Piece completed */
+	unsigned int busy;		/* Pieces in flight */
+	unsigned int gen;
+	uint64_t next;			/* Offset of the next piece */
+	bool stop;
+	int rc;
+};
 
-struct snap_card *snap_card_alloc_dev(const char *path,
-				      uint16_t vendor_id,
-				      uint16_t device_id)
+static int snap_chain_finished(struct snap_queue *queue __unused,
+			       struct snap_job *job)
 {
-	return df->card_alloc_dev(path, vendor_id, device_id);
+	struct snap_chain_piece *p = (struct snap_chain_piece *)job;
+	struct snap_chain_run *r = p->run;
+	const struct snap_chain *ch = r->chain;
+	int64_t done = p->len;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->stop || (p->gen != r->gen))
+		goto out;		/* Stale, or chain failed already */
+
+	if (job->retc != SNAP_RETC_SUCCESS) {
+		if (job->retc == SNAP_RETC_TIMEOUT)
+			r->rc = SNAP_ETIMEDOUT;
+		r->stop = true;
+		goto out_copy;
+	}
+
+	if (ch->complete) {
+		/* Only called from here, never at the same time */
+		pthread_mutex_unlock(&r->lock);
+		done = ch->complete(job, p->offs, p->len, ch->priv);
+		pthread_mutex_lock(&r->lock);
+	}
+	if ((done <= 0) || (done > p->len)) {
+		snap_trace("%s: Error piece at 0x%llx returned %lld\n",
+			   __func__, (long long)p->offs, (long long)done);
+		r->rc = (done < 0) ? (int)done : SNAP_EINVAL;
+		r->stop = true;
+		goto out;
+	}
+	if (done < p->len) {
+		r->gen++;
+		r->next = p->offs + done;
+	}
+
+ out_copy:
+	r->cjob->retc = job->retc;
+	memcpy((void *)(unsigned long)r->cjob->wout_addr,
+	       (void *)(unsigned long)job->wout_addr, job->wout_size);
+ out:
+	p->busy = false;
+	r->busy--;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return 0;
 }
 
-struct snap_action *snap_attach_action(struct snap_card *card,
-				       snap_action_type_t action_type,
-				       snap_action_flag_t action_flags,
-				       int timeout_ms)
+int snap_chain_execute_job(struct snap_queue *queue,
+			   struct snap_job *cjob,
+			   const struct snap_chain *chain,
+			   unsigned int timeout_sec)
 {
-	if (software_action_enabled())
-		snap_map_funcs(card, action_type);
+	int rc;
+	unsigned int i, depth;
+	uint64_t chunk_size;
+	size_t win_size, wout_size;
+	uint8_t *data;
+	struct snap_chain_piece *pieces, *p;
+	struct snap_chain_run r;
+
+	if ((queue == NULL) || (cjob == NULL) || (chain == NULL) ||
+	    (chain->prepare == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	chunk_size = chain->chunk_size ? : SNAP_CHAIN_CHUNK_SIZE;
+	depth = chain->depth ? : 1;
+
+	/* Pieces, followed by the input and output data of each */
+	win_size = SNAP_ROUND_UP(cjob->win_size, 8);
+	wout_size = SNAP_ROUND_UP(cjob->wout_size, 8);
+	pieces = calloc(depth, sizeof(*pieces) + win_size + wout_size);
+	if (pieces == NULL)
+		return SNAP_ENOMEM;
+	data = (uint8_t *)&pieces[depth];
+	for (i = 0; i < depth; i++) {
+		p = &pieces[i];
+		p->run = &r;
+		snap_job_set(&p->job, data, cjob->win_size,
+			     data + win_size, cjob->wout_size);
+		data += win_size + wout_size;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.chain = chain;
+	r.cjob = cjob;
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+
+	snap_trace("%s: Size 0x%llx Chunk 0x%llx Depth %d\n", __func__,
+		   (long long)chain->size, (long long)chunk_size, depth);
+
+	pthread_mutex_lock(&r.lock);
+	while (!r.stop && ((r.next < chain->size) || r.busy)) {
+		if ((r.next >= chain->size) || (r.busy == depth)) {
+			pthread_cond_wait(&r.cond, &r.lock);
+			continue;
+		}
+		for (p = pieces; p->busy; p++)
+			;
+		p->busy = true;
+		p->gen = r.gen;
+		p->offs = r.next;
+		p->len = MIN(chain->size - r.next, chunk_size);
+		r.next += p->len;
+		r.busy++;
+		pthread_mutex_unlock(&r.lock);
+
+		p->job.retc = 0;
+		memcpy((void *)(unsigned long)p->job.win_addr,
+		       (void *)(unsigned long)cjob->win_addr, cjob->win_size);
+		memcpy((void *)(unsigned long)p->job.wout_addr,
+		       (void *)(unsigned long)cjob->wout_addr, cjob->wout_size);
+		rc = chain->prepare(&p->job, p->offs, p->len, chain->priv);
+		if (rc == 0)
+			rc = snap_queue_submit(queue, &p->job,
+					       snap_chain_finished,
+					       timeout_sec);
+
+		pthread_mutex_lock(&r.lock);
+		if (rc != 0) {
+			p->busy = false;
+			r.busy--;
+			r.rc = rc;
+			r.stop = true;
+		}
+	}
+	while (r.busy)		/* Outstanding pieces refer to r */
+		pthread_cond_wait(&r.cond, &r.lock);
+	pthread_mutex_unlock(&r.lock);
+
+	pthread_cond_destroy(&r.cond);
+	pthread_mutex_destroy(&r.lock);
+	free(pieces);
 
-	return df->attach_action(card, action_type, action_flags, timeout_ms);
+	snap_trace("%s: Offset 0x%llx rc: %d\n", __func__,
+		   (long long)r.next, r.rc);
+	return r.rc;
 }
 
-int snap_detach_action(struct snap_action *action)
-{
+/******************************************************************************
+ * CARD GROUPS
+ *****************************************************************************/
+
+/*
+ * All job lists of a group are protected by the group lock. Jobs take
+ * milliseconds on the card, compared to that the lock is held for a
+ * short time only. Workers pop jobs from the head of their own list,
+ * stealing takes the head of the longest other list, so jobs are
+ * started roughly in submission order.
+ */
+struct snap_group_req {
+	struct snap_job *cjob;
+	unsigned int timeout_sec;
 	int rc;
+	bool done;
+	snap_group_finished_t finished;	/* NULL for synchronous jobs */
+	struct snap_group_req *next;
+};
 
-	snap_trace("%s Enter\n", __func__);
-	rc = df->detach_action(action);
-	snap_trace("%s Exit rc: %d\n", __func__, rc);
-	return rc;
-}
+struct snap_group_member {
+	struct snap_group *group;
+	unsigned int card_no;
+	struct snap_card *card;
+	struct snap_queue *queue;
+	pthread_t thread;
+	bool started;
+	pthread_cond_t work;		/* Job queued or stop */
+
+	struct snap_group_req *head;	/* Waiting jobs */
+	struct snap_group_req *tail;
+	unsigned int count;
+	bool running;			/* Executes a job */
+	unsigned long jobs;
+	unsigned long stolen;
+};
 
-int snap_mmio_write32(struct snap_card *_card,
-		      uint64_t offset, uint32_t data)
-{
-	int rc;
-	rc = df->mmio_write32(_card, offset, data);
-	return rc;
-}
+struct snap_group {
+	pthread_mutex_t lock;
+	pthread_cond_t done;		/* Job completed */
+	bool stop;
+	unsigned int timeout_sec;	/* Job timeout for async jobs */
+	unsigned int next;		/* Round robin start for ties */
+	unsigned int num;
+	struct snap_group_member *members;
+};
 
-int snap_mmio_read32(struct snap_card *_card,
-		     uint64_t offset, uint32_t *data)
+static struct snap_group_req *snap_group_pop(struct snap_group_member *m)
 {
-	int rc;
-	rc = df->mmio_read32(_card, offset, data);
-	return rc;
+	struct snap_group_req *req = m->head;
+
+	if (req == NULL)
+		return NULL;
+	m->head = req->next;
+	if (m->head == NULL)
+		m->tail = NULL;
+	m->count--;
+	return req;
 }
 
-/*
- * FIXME Remove adding action_base in plain mmio_read32/write32.
- */
-int snap_action_write32(struct snap_action *action,
-		      uint64_t offset, uint32_t data)
+/* Called with g->lock held */
+static struct snap_group_req *snap_group_steal(struct snap_group *g,
+					       struct snap_group_member *self)
 {
-	int rc;
-	struct snap_card *card = (struct snap_card *)action;
+	unsigned int i;
+	struct snap_group_member *m, *victim = NULL;
 
-	if (card->action_base == 0) /* must be attached to make this work */
-		return SNAP_EATTACH;
+	for (i = 0; i < g->num; i++) {
+		m = &g->members[i];
+		if ((m != self) && m->count &&
+		    ((victim == NULL) || (m->count > victim->count)))
+			victim = m;
+	}
+	if (victim == NULL)
+		return NULL;
 
-	rc = df->mmio_write32(card, card->action_base + offset, data);
-	return rc;
+	self->stolen++;
+	snap_trace("%s: Card %d takes job from Card %d\n", __func__,
+		   self->card_no, victim->card_no);
+	return snap_group_pop(victim);
 }
 
-int snap_action_read32(struct snap_action *action,
-		     uint64_t offset, uint32_t *data)
+static void *snap_group_worker(void *arg)
 {
 	int rc;
-	struct snap_card *card = (struct snap_card *)action;
+	struct snap_group_member *m = (struct snap_group_member *)arg;
+	struct snap_group *g = m->group;
+	struct snap_group_req *req;
+
+	snap_trace("%s: Enter Card %d\n", __func__, m->card_no);
+
+	pthread_mutex_lock(&g->lock);
+	while (1) {
+		req = snap_group_pop(m);
+		if (req == NULL)
+			req = snap_group_steal(g, m);
+		if (req == NULL) {
+			if (g->stop)
+				break;
+			pthread_cond_wait(&m->work, &g->lock);
+			continue;
+		}
+		m->running = true;
+		pthread_mutex_unlock(&g->lock);
+
+		rc = snap_queue_sync_execute_job(m->queue, req->cjob,
+						 req->timeout_sec);
+		if (req->finished) {
+			/* Report library errors through retc */
+			if (rc == SNAP_ETIMEDOUT)
+				req->cjob->retc = SNAP_RETC_TIMEOUT;
+			else if (rc != 0)
+				req->cjob->retc = SNAP_RETC_FAILURE;
+			req->finished(g, req->cjob);
+			free(req);
+			req = NULL;
+		}
 
-	if (card->action_base == 0) /* must be attached to make this work */
-		return SNAP_EATTACH;
+		pthread_mutex_lock(&g->lock);
+		m->running = false;
+		m->jobs++;
+		if (req) {		/* Submitter waits for it */
+			req->rc = rc;
+			req->done = true;
+			pthread_cond_broadcast(&g->done);
+		}
+	}
+	pthread_mutex_unlock(&g->lock);
 
-	rc = df->mmio_read32(card, card->action_base + offset, data);
-	return rc;
+	snap_trace("%s: Exit Card %d Jobs %ld Stolen %ld\n", __func__,
+		   m->card_no, m->jobs, m->stolen);
+	return NULL;
 }
 
-int snap_mmio_write64(struct snap_card *_card,
-			uint64_t offset, uint64_t data)
+/* Called with g->lock held */
+static void snap_group_queue(struct snap_group *g, struct snap_group_req *req)
 {
-	int rc;
-
-	rc = df->mmio_write64(_card, offset, data);
-	return rc;
+	unsigned int i, load, best_load = UINT_MAX;
+	struct snap_group_member *m, *best = NULL;
+
+	for (i = 0; i < g->num; i++) {
+		m = &g->members[(g->next + i) % g->num];
+		load = m->count + m->running;
+		if (load < best_load) {
+			best = m;
+			best_load = load;
+		}
+	}
+	g->next = (g->next + 1) % g->num;
+
+	req->next = NULL;
+	if (best->tail)
+		best->tail->next = req;
+	else	best->head = req;
+	best->tail = req;
+	best->count++;
+	pthread_cond_signal(&best->work);
 }
 
-int snap_mmio_read64(struct snap_card *_card,
-		       uint64_t offset, uint64_t *data)
+int snap_group_sync_execute_job(struct snap_group *group,
+				struct snap_job *cjob,
+				unsigned int timeout_sec)
 {
-	int rc;
+	struct snap_group *g = group;
+	struct snap_group_req req = {
+		.cjob = cjob,
+		.timeout_sec = timeout_sec,
+		.rc = 0,
+		.done = false,
+		.finished = NULL,
+		.next = NULL,
+	};
+
+	if ((g == NULL) || (cjob == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
 
-	rc = df->mmio_read64(_card, offset, data);
-	return rc;
-}
+	pthread_mutex_lock(&g->lock);
+	snap_group_queue(g, &req);
+	while (!req.done)
+		pthread_cond_wait(&g->done, &g->lock);
+	pthread_mutex_unlock(&g->lock);
 
+	return req.rc;
+}
 
-void snap_card_free(struct snap_card *_card)
+int snap_group_async_execute_job(struct snap_group *group,
+				 struct snap_job *cjob,
+				 snap_group_finished_t finished)
 {
-	df->card_free(_card);
+	struct snap_group *g = group;
+	struct snap_group_req *req;
+
+	if ((g == NULL) || (cjob == NULL) || (finished == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		errno = ENOMEM;
+		return SNAP_ENOMEM;
+	}
+	req->cjob = cjob;
+	req->finished = finished;
+
+	pthread_mutex_lock(&g->lock);
+	req->timeout_sec = g->timeout_sec;
+	snap_group_queue(g, req);
+	pthread_mutex_unlock(&g->lock);
+
+	return SNAP_OK;
 }
 
-int snap_card_ioctl(struct snap_card *_card, unsigned int cmd, unsigned long arg)
+int snap_group_set_timeout(struct snap_group *group,
+			   unsigned int timeout_sec)
 {
-	return df->card_ioctl(_card, cmd, arg);
+	if ((group == NULL) || (timeout_sec == 0)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	pthread_mutex_lock(&group->lock);
+	group->timeout_sec = timeout_sec;
+	pthread_mutex_unlock(&group->lock);
+	return SNAP_OK;
 }
 
-/******************************************************************************
- * JOB QUEUE Operations
- *****************************************************************************/
-
-struct snap_queue *snap_queue_alloc(struct snap_card *card,
+struct snap_group *snap_group_alloc(const unsigned int *card_no,
+				    unsigned int num_cards,
 				    snap_action_type_t action_type,
 				    snap_action_flag_t action_flags,
-				    unsigned int queue_length __unused,
 				    unsigned int attach_timeout_sec)
 {
-	card->action_typeq = action_type;     /* Save Action Type */
-	card->action_flags = action_flags;
-	card->queue_length = queue_length;
-	card->attach_timeout_sec = attach_timeout_sec;
+	int rc;
+	unsigned int i;
+	char device[64];
+	struct snap_card *card;
+	struct snap_group *g;
+	struct snap_group_member *m;
 
-	return (struct snap_queue *)card;
-}
+	if ((card_no == NULL) || (num_cards == 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-/*
- * @note At this point in time we emulate a real queue behavior by
- * doing the same as we do when using snap_sync_execute_job directly.
- * This is basically a queue of length 1. Once there are use-cases
- * which will profit from a real hardware job queue, this must be
- * changed along with a real hardware queue implementation.
- */
-int snap_queue_sync_execute_job(struct snap_queue *queue,
-                          struct snap_job *cjob,
-                          unsigned int timeout_sec)
-{
-	struct snap_card *card = (struct snap_card *)queue;
+	g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		return NULL;
+	g->members = calloc(num_cards, sizeof(*g->members));
+	if (g->members == NULL) {
+		free(g);
+		return NULL;
+	}
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->done, NULL);
+	g->timeout_sec = SNAP_ASYNC_TIMEOUT_SEC;
+
+	for (i = 0; i < num_cards; i++) {
+		snprintf(device, sizeof(device) - 1, "/dev/cxl/afu%d.0s",
+			 card_no[i]);
+		card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+					   SNAP_DEVICE_ID_SNAP);
+		if (card == NULL) {
+			snap_trace("%s: Skip %s: %s\n", __func__, device,
+				   strerror(errno));
+			continue;
+		}
+		if (!card->funcs->has_action(card, action_type)) {
+			snap_trace("%s: Skip %s: No Action 0x%x\n", __func__,
+				   device, action_type);
+			snap_card_free(card);
+			continue;
+		}
+
+		m = &g->members[g->num];
+		m->group = g;
+		m->card_no = card_no[i];
+		m->card = card;
+		m->queue = snap_queue_alloc(card, action_type, action_flags,
+					    1, attach_timeout_sec);
+		if (m->queue == NULL) {
+			snap_card_free(card);
+			goto out_error;
+		}
+		pthread_cond_init(&m->work, NULL);
+		pthread_mutex_lock(&g->lock);
+		g->num++;	/* Workers look at all members up to num */
+		pthread_mutex_unlock(&g->lock);
+
+		rc = pthread_create(&m->thread, NULL, snap_group_worker, m);
+		if (rc != 0) {
+			errno = rc;
+			goto out_error;
+		}
+		m->started = true;
+	}
+	if (g->num == 0) {
+		errno = ENODEV;
+		goto out_error;
+	}
 
-	return snap_sync_execute_job(card, card->action_typeq, /* Uses Save Action type */
-				     card->action_flags,
-				     cjob,
-				     card->attach_timeout_sec,
-				     timeout_sec);
+	snap_trace("%s: Action 0x%x %d of %d Cards\n", __func__,
+		   action_type, g->num, num_cards);
+	return g;
+
+ out_error:
+	rc = errno;
+	snap_group_free(g);
+	errno = rc;
+	return NULL;
 }
 
-void snap_queue_free(struct snap_queue *queue __unused)
+unsigned int snap_group_cards(struct snap_group *group)
 {
-	struct snap_card *card = (struct snap_card *)queue;
-	card->action_type = 0xffffffff;
+	return group ? group->num : 0;
 }
 
-/*****************************************************************************
- * FIXED ACTION ASSIGNMENT MODE
- * E.g. for data streaming if action must stay alive for the whole
- *	program runtime.
- ****************************************************************************/
-
-int snap_action_start(struct snap_action *action)
+unsigned int snap_group_stats(struct snap_group *group, unsigned int idx,
+			      unsigned long *jobs, unsigned long *stolen)
 {
-	struct snap_card *card = (struct snap_card *)action;
+	struct snap_group_member *m;
 
-	snap_trace("%s: START Action 0x%x Flags %x\n", __func__, card->action_type, card->flags);
-	/* Enable Ready IRQ if set by application */
-	if (SNAP_ACTION_DONE_IRQ  & card->flags) {
-		snap_mmio_write32(card, ACTION_IRQ_APP, ACTION_IRQ_APP_DONE);
-		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_ON);
+	if ((group == NULL) || (idx >= group->num)) {
+		errno = EINVAL;
+		return UINT_MAX;
 	}
-	return snap_mmio_write32(card, ACTION_CONTROL, ACTION_CONTROL_START);
+	m = &group->members[idx];
+
+	pthread_mutex_lock(&group->lock);
+	if (jobs)
+		*jobs = m->jobs;
+	if (stolen)
+		*stolen = m->stolen;
+	pthread_mutex_unlock(&group->lock);
+	return m->card_no;
 }
 
-int snap_action_stop(struct snap_action *action __unused)
+void snap_group_free(struct snap_group *group)
 {
-	/* FIXME Missing */
-	return 0;
-}
+	unsigned int i;
+	struct snap_group *g = group;
+	struct snap_group_member *m;
 
-int snap_action_is_idle(struct snap_action *action, int *rc)
-{
-	int _rc = 0;
-	uint32_t action_data = 0;
-	struct snap_card *card = (struct snap_card *)action;
+	if (g == NULL)
+		return;
 
-	_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
-	if (rc)
-		*rc = _rc;
+	/* Workers drain all job lists before they stop */
+	pthread_mutex_lock(&g->lock);
+	g->stop = true;
+	for (i = 0; i < g->num; i++)
+		pthread_cond_signal(&g->members[i].work);
+	pthread_mutex_unlock(&g->lock);
+
+	for (i = 0; i < g->num; i++) {
+		m = &g->members[i];
+		if (m->started)
+			pthread_join(m->thread, NULL);
+		snap_queue_free(m->queue);
+		snap_card_free(m->card);
+		pthread_cond_destroy(&m->work);
+	}
 
-	return (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
+	pthread_cond_destroy(&g->done);
+	pthread_mutex_destroy(&g->lock);
+	__free(g->members);
+	__free(g);
 }
 
-int snap_action_completed(struct snap_action *action, int *rc, int timeout)
+/******************************************************************************
+ * STREAMING MODE
+ *
+ * The action is started once and then takes 128 bytes work descriptors
+ * from a ring in host memory, see struct snap_stream_job in
+ * snap_types.h. Posting a job is a copy into the ring and one store to
+ * sq_tail, there is no MMIO, attach or interrupt per job. Completions
+ * come back in a second ring, which the caller polls. The stream has
+ * a context of its own, such that other jobs on the card are not
+ * affected while the action stays resident.
+ *****************************************************************************/
+
+#define SNAP_STREAM_ENTRIES	256	/* Default ring size */
+
+struct snap_stream {
+	struct snap_card *card;		/* Own context on the card */
+	struct snap_action *action;
+	struct snap_stream_ctrl *ctrl;
+	struct snap_queue_workitem *sq;
+	struct snap_completion *cq;
+	uint32_t mask;
+
+	pthread_mutex_t post_lock;
+	uint32_t tail;			/* Posted, under post_lock */
+	pthread_mutex_t poll_lock;
+	uint32_t head;			/* Completions taken, under poll_lock */
+
+	struct snap_stream_job sjob;
+	struct snap_job cjob;
+};
+
+/* An action which might still run keeps its rings, they are leaked */
+static void snap_stream_release(struct snap_stream *s, bool running)
 {
-	int _rc = 0;
-	uint32_t action_data = 0;
-	struct snap_card *card = (struct snap_card *)action;
-	unsigned long t0;
-	int dt, timeout_ms;
-
-	if (SNAP_ACTION_DONE_IRQ & card->flags) {
-		hw_wait_irq(card, timeout, SNAP_ACTION_IRQ_NUM);
-		snap_mmio_write32(card, ACTION_IRQ_STATUS, ACTION_IRQ_STATUS_DONE);
-		snap_mmio_write32(card, ACTION_IRQ_APP, 0);
-		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_OFF);
-		_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
-	} else {
-		/* Busy poll timout sec */
-		t0 = tget_ms();
-		dt = 0;
-		timeout_ms = timeout * 1000;
-		while (dt < timeout_ms) {
-			_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
-			if ((action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE)
-				break;
-			dt = (int)(tget_ms() - t0);
-		}
+	if (s->action)
+		snap_detach_action(s->action);
+	if (s->card)
+		s->card->funcs->card_free(s->card);
+	if (!running) {
+		snap_buf_free(s->ctrl);
+		snap_buf_free(s->sq);
+		snap_buf_free(s->cq);
 	}
-	if (rc)
-		*rc = _rc;
-
-	return (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
+	pthread_mutex_destroy(&s->post_lock);
+	pthread_mutex_destroy(&s->poll_lock);
+	free(s);
 }
 
-/**
- * Synchronous way to send a job away.  First step : set registers
- * This function writes through MMIO interface the registers
- * to the action / in the FPGA internal memory
- *
- * @action	handle to streaming framework action/action
- * @cjob	streaming framework job
- * @return	0 on success.
- */
-
-int snap_action_sync_execute_job_set_regs(struct snap_action *action,
-				 struct snap_job *cjob)
+struct snap_stream *snap_stream_alloc(struct snap_card *card,
+				      snap_action_type_t action_type,
+				      snap_action_flag_t action_flags,
+				      unsigned int entries,
+				      int attach_timeout_sec)
 {
-	int rc = 0;
-	unsigned int i;
-	struct snap_card *card = (struct snap_card *)action;
+	int rc;
+	struct snap_stream *s;
 	struct snap_queue_workitem job;
-	uint32_t action_addr;
-	uint32_t *job_data;
-	unsigned int mmio_in, mmio_out;
-
-	/* Size must be less than addr[6] */
-	if (cjob->wout_size > SNAP_JOBSIZE) {
-		snap_trace("  %s: err: wout_size too large %d > %d\n", __func__,
-			   cjob->wout_size, SNAP_JOBSIZE);
-		snap_trace("      win_addr  = %llx size = %d\n",
-			   (long long)cjob->win_addr, cjob->win_size);
-		snap_trace("      wout_addr = %llx size = %d\n",
-			   (long long)cjob->wout_addr, cjob->wout_size);
+	unsigned int mmio_in;
 
+	if (entries == 0)
+		entries = SNAP_STREAM_ENTRIES;
+	if ((card == NULL) || (entries & (entries - 1)) ||
+	    (entries > 65536)) {
 		errno = EINVAL;
-		return -1;
+		return NULL;
 	}
 
-	/* job.short_action = 0x00; */	/* Set later */
-	job.flags = 0x01; /* FIXME Set Flag to Execute */
-	job.seq = 0x0000; /* Set later */
-	job.retc = 0x00000000;
-	job.priv_data = 0xdeadbeefc0febabeull;
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	pthread_mutex_init(&s->post_lock, NULL);
+	pthread_mutex_init(&s->poll_lock, NULL);
+	s->mask = entries - 1;
+
+	s->ctrl = snap_buf_alloc(card, sizeof(*s->ctrl), 0);
+	s->sq = snap_buf_alloc(card, entries * sizeof(*s->sq), 0);
+	s->cq = snap_buf_alloc(card, entries * sizeof(*s->cq), 0);
+	if ((s->ctrl == NULL) || (s->sq == NULL) || (s->cq == NULL))
+		goto err;
+	memset(s->ctrl, 0, sizeof(*s->ctrl));
+	memset(s->cq, 0, entries * sizeof(*s->cq));
+
+	s->card = card->funcs->card_alloc_dev(card->path, card->vendor_id,
+					      card->device_id);
+	if (s->card == NULL)
+		goto err;
+	s->card->funcs = card->funcs;
+	s->card->wait_policy = card->wait_policy;
+	s->card->mmio_policy = card->mmio_policy;
+
+	s->action = snap_attach_action(s->card, action_type, action_flags,
+				       attach_timeout_sec);
+	if (s->action == NULL)
+		goto err;
+
+	s->sjob.ctrl_addr = (unsigned long)s->ctrl;
+	s->sjob.sq_addr = (unsigned long)s->sq;
+	s->sjob.cq_addr = (unsigned long)s->cq;
+	s->sjob.entries = entries;
+	snap_job_set(&s->cjob, &s->sjob, sizeof(s->sjob), NULL, 0);
+
+	rc = snap_job_to_workitem(&s->cjob, &job, &mmio_in, NULL);
+	if (rc != 0)
+		goto err;
+	job.flags |= SNAP_JOBFLAG_STREAM;
+	snap_workitem_bind(s->card, &job);
+	rc = snap_workitem_write(s->card, &job, mmio_in);
+	if (rc != 0)
+		goto err;
+	rc = snap_action_start(s->action);
+	if (rc != 0)
+		goto err;
+
+	snap_trace("%s: Action 0x%x Entries %d Context %p\n", __func__,
+		   action_type, entries, s->card);
+	return s;
 
-	/* Fill workqueue cacheline which we need to transfer to the action */
-	if (cjob->win_size <= (6 * 16)) {
-		memcpy(&job.user, (void *)(unsigned long)cjob->win_addr,
-		       MIN(cjob->win_size, sizeof(job.user)));
-		mmio_out = cjob->win_size / sizeof(uint32_t);
-	} else {
-		job.user.ext.addr  = cjob->win_addr;
-		job.user.ext.size  = cjob->win_size;
-		job.user.ext.type  = SNAP_ADDRTYPE_HOST_DRAM;
-		job.user.ext.flags = (SNAP_ADDRFLAG_EXT |
-				      SNAP_ADDRFLAG_END);
-		mmio_out = sizeof(job.user.ext) / sizeof(uint32_t);
+ err:
+	snap_trace("%s: Error Can not start stream for Action 0x%x\n",
+		   __func__, action_type);
+	snap_stream_release(s, false);
+	return NULL;
+}
+
+int snap_stream_post(struct snap_stream *stream, const void *job,
+		     unsigned int job_size, uint64_t tag)
+{
+	struct snap_stream *s = stream;
+	struct snap_queue_workitem *w;
+
+	if ((s == NULL) || (job_size > sizeof(w->user)) ||
+	    ((job == NULL) && (job_size != 0))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
 	}
-	mmio_in = 16 / sizeof(uint32_t) + mmio_out;
 
-	snap_trace("    win_size: %d wout_size: %d mmio_in: %d mmio_out: %d\n",
-		cjob->win_size, cjob->wout_size, mmio_in, mmio_out);
-	
-	job.short_action = card->sat;/* Set correct Value after attach */
-	job.seq = card->seq++; /* Set correct Value after attach */
+	pthread_mutex_lock(&s->post_lock);
+	if (s->tail - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) > s->mask) {
+		pthread_mutex_unlock(&s->post_lock);
+		return SNAP_EBUSY;	/* All slots in flight */
+	}
 
-	snap_trace("%s: PASS PARAMETERS to Short Action %d Seq: %x\n",
-		   __func__, job.short_action, job.seq);
+	w = &s->sq[s->tail & s->mask];
+	w->short_action = s->card->sat;
+	w->flags = SNAP_JOBFLAG_EXECUTE;
+	w->seq = (uint16_t)s->tail;
+	w->retc = 0;
+	w->priv_data = tag;
+	memcpy(w->user.data, job, job_size);
+	memset(w->user.data + job_size, 0, sizeof(w->user) - job_size);
+
+	s->tail++;
+	__atomic_store_n(&s->ctrl->sq_tail, s->tail, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&s->post_lock);
+	return SNAP_OK;
+}
 
-	/* __hexdump(stderr, &job, sizeof(job)); */
+int snap_stream_poll(struct snap_stream *stream,
+		     struct snap_completion *done, unsigned int num,
+		     unsigned int timeout_ms)
+{
+	struct snap_stream *s = stream;
+	struct snap_completion *c;
+	unsigned int n = 0;
+	unsigned long t0 = 0;
 
-	/* Pass action control and job to the action, should be 128
-	   bytes or a little less */
-	job_data = (uint32_t *)(unsigned long)&job;
-	for (i = 0, action_addr = ACTION_PARAMS_IN; i < mmio_in;
-		i++, action_addr += sizeof(uint32_t)) {
-		rc = snap_mmio_write32(card, action_addr, job_data[i]);
-		if (rc != 0)
-			goto __snap_action_sync_execute_job_exit;
+	if ((s == NULL) || ((done == NULL) && (num != 0))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
 	}
 
-__snap_action_sync_execute_job_exit:
-	snap_action_stop(action);
+	pthread_mutex_lock(&s->poll_lock);
+	while (n < num) {
+		c = &s->cq[s->head & s->mask];
+		if (!(__atomic_load_n(&c->flags, __ATOMIC_ACQUIRE) &
+		      SNAP_JOBFLAG_DONE) || (c->seq != (uint16_t)s->head)) {
+			if (n != 0)
+				break;
+			if (t0 == 0)
+				t0 = tget_ms();
+			if (tget_ms() - t0 >= timeout_ms)
+				break;
+			sched_yield();
+			continue;
+		}
+		memcpy(&done[n++], c, sizeof(*c));
+		c->flags = 0;
+		__atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&s->poll_lock);
+	return n;
+}
+
+int snap_stream_free(struct snap_stream *stream, int timeout_sec)
+{
+	int rc;
+	struct snap_stream *s = stream;
+
+	if (s == NULL)
+		return SNAP_OK;
+
+	__atomic_or_fetch(&s->ctrl->flags, SNAP_STREAM_STOP, __ATOMIC_RELEASE);
+	rc = snap_action_sync_execute_job_check_completion(s->action,
+				&s->cjob, timeout_sec);
+	if ((rc == SNAP_OK) && (s->cjob.retc != SNAP_RETC_SUCCESS))
+		rc = SNAP_EIO;
+	snap_trace("%s: Stopped after %d jobs rc %d\n", __func__,
+		   s->ctrl->sq_head, rc);
+	snap_stream_release(s, (rc == SNAP_ETIMEDOUT) || (rc == SNAP_EIO));
 	return rc;
 }
-/**
- * Synchronous way to send a job away.  Last step : check completion
- * This function check the completion of the action, manage the IRQ
- * if needed, and read all action registers through MMIO interface
+
+/******************************************************************************
+ * DAEMON CLIENT
  *
- * @action	handle to streaming framework action/action
- * @cjob	streaming framework job
- * timeout_sec  timeout used if polling mode
- * @return	0 on success.
- */
+ * Jobs are passed to snapd, which owns the card contexts and keeps the
+ * actions attached, see snap_daemon.h for the protocol. Submission and
+ * completion go through rings in shared memory. The eventfds are only
+ * used if the other side sleeps.
+ *****************************************************************************/
 
-int snap_action_sync_execute_job_check_completion(struct snap_action *action,
-				 struct snap_job *cjob,
-				 unsigned int timeout_sec)
+#define SNAP_CLIENT_ENTRIES	256	/* Default ring size */
+#define SNAP_CLIENT_SPIN_US	50	/* Spin before sleeping in poll */
+#define SNAP_CLIENT_RETRIES	4	/* Addresses tried for the memfd */
+
+struct snap_client {
+	int sock;
+	int memfd;
+	int doorbell;			/* Wakes the daemon */
+	int wakeup;			/* Wakes us */
+	void *base;
+	size_t size;
+	struct snapd_ctrl *ctrl;
+	struct snapd_job *sq;
+	struct snap_completion *cq;
+	void *data;
+	size_t data_size;
+	uint32_t mask;
+
+	pthread_mutex_t post_lock;
+	uint32_t tail;			/* Posted, under post_lock */
+	pthread_mutex_t poll_lock;
+	uint32_t head;			/* Completions taken, under poll_lock */
+};
+
+/* Connect, pass the memfd and eventfds and wait for the answer */
+static int snap_client_hello(struct snap_client *c, const char *path,
+			     uint32_t entries)
 {
-	int rc;
-	unsigned int i;
-	int completed;
-	struct snap_card *card = (struct snap_card *)action;
-	struct snap_queue_workitem job;
-	uint32_t action_addr;
-	uint32_t *job_data;
-	unsigned int mmio_out;
+	struct sockaddr_un sa;
+	struct snapd_hello h;
+	struct snapd_reply r;
+	struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+	union {
+		char buf[CMSG_SPACE(SNAPD_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fds[SNAPD_FDS] = { c->memfd, c->doorbell, c->wakeup };
+
+	c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->sock < 0)
+		return -errno;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+	if (connect(c->sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return -errno;
+
+	memset(&h, 0, sizeof(h));
+	h.version = SNAPD_VERSION;
+	h.entries = entries;
+	h.addr = (unsigned long)c->base;
+	h.size = c->size;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(c->sock, &msg, MSG_NOSIGNAL) != sizeof(h))
+		return -errno;
+	if (recv(c->sock, &r, sizeof(r), MSG_WAITALL) != sizeof(r))
+		return -EPROTO;
+
+	snap_trace("%s: Client %d at %p rc %d\n", __func__, r.client_id,
+		   c->base, r.rc);
+	return r.rc;
+}
+
+void snap_client_close(struct snap_client *client)
+{
+	struct snap_client *c = client;
+
+	if (c == NULL)
+		return;
+
+	/* The daemon drops us once the socket is closed */
+	if (c->sock >= 0)
+		close(c->sock);
+	if (c->base)
+		munmap(c->base, c->size);
+	if (c->memfd >= 0)
+		close(c->memfd);
+	if (c->doorbell >= 0)
+		close(c->doorbell);
+	if (c->wakeup >= 0)
+		close(c->wakeup);
+	pthread_mutex_destroy(&c->post_lock);
+	pthread_mutex_destroy(&c->poll_lock);
+	free(c);
+}
 
-	completed = snap_action_completed(action, &rc, timeout_sec);
-	/* Issue #360 */
-	if (rc != 0) {
-		snap_trace("%s: EIO rc=%d completed=%d\n", __func__,
-			   rc, completed);
-		rc = SNAP_EIO;
-		goto __snap_action_sync_execute_job_exit;
-	}
-	if (completed == 0) {
-		/* Not done */
-		snap_trace("%s: rc=%d\n", __func__, rc);
-		if (rc == 0) {
-			errno = ETIME;
-			rc = SNAP_ETIMEDOUT;
-		}
-		goto __snap_action_sync_execute_job_exit;
+struct snap_client *snap_client_open(const char *path,
+				     unsigned int entries,
+				     size_t data_size)
+{
+	int rc = -EINVAL;
+	unsigned int i;
+	size_t rings;
+	void *taken[SNAP_CLIENT_RETRIES];
+	unsigned int ntaken = 0;
+	struct snap_client *c;
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (path == NULL)
+		path = getenv("SNAPD_SOCKET");
+	if (path == NULL)
+		path = SNAPD_SOCKET;
+	if (entries == 0)
+		entries = SNAP_CLIENT_ENTRIES;
+	if ((entries & (entries - 1)) || (entries > 65536)) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	/* job.short_action = 0x00; */	/* Set later */
-	job.flags = 0x01; /* FIXME Set Flag to Execute */
-	job.seq = 0x0000; /* Set later */
-	job.retc = 0x00000000;
-	job.priv_data = 0xdeadbeefc0febabeull;
-
-	/* Fill workqueue cacheline which we need to transfer to the action */
-	if (cjob->win_size <= (6 * 16)) {
-		memcpy(&job.user, (void *)(unsigned long)cjob->win_addr,
-		       MIN(cjob->win_size, sizeof(job.user)));
-		mmio_out = cjob->win_size / sizeof(uint32_t);
-	} else {
-		job.user.ext.addr  = cjob->win_addr;
-		job.user.ext.size  = cjob->win_size;
-		job.user.ext.type  = SNAP_ADDRTYPE_HOST_DRAM;
-		job.user.ext.flags = (SNAP_ADDRFLAG_EXT |
-				      SNAP_ADDRFLAG_END);
-		mmio_out = sizeof(job.user.ext) / sizeof(uint32_t);
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->sock = c->memfd = c->doorbell = c->wakeup = -1;
+	pthread_mutex_init(&c->post_lock, NULL);
+	pthread_mutex_init(&c->poll_lock, NULL);
+	c->mask = entries - 1;
+
+	rings = SNAP_ROUND_UP(snapd_rings_size(entries), page_size);
+	c->data_size = SNAP_ROUND_UP(data_size, page_size);
+	c->size = rings + c->data_size;
+
+	c->memfd = memfd_create("snap_client", MFD_CLOEXEC);
+	c->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	c->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((c->memfd < 0) || (c->doorbell < 0) || (c->wakeup < 0) ||
+	    (ftruncate(c->memfd, c->size) < 0)) {
+		rc = -errno;
+		goto out;
 	}
 
-	/* Get RETC (0x184) back to the caller */
-	rc = snap_mmio_read32(card, ACTION_RETC_OUT, &cjob->retc);
+	/*
+	 * The daemon needs the same address. If it is taken there, keep
+	 * the mapping while trying the next one, such that it differs.
+	 */
+	for (i = 0; i < SNAP_CLIENT_RETRIES; i++) {
+		c->base = mmap(NULL, c->size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, c->memfd, 0);
+		if (c->base == MAP_FAILED) {
+			c->base = NULL;
+			rc = -errno;
+			break;
+		}
+		rc = snap_client_hello(c, path, entries);
+		if (rc != -EADDRINUSE)
+			break;
+		taken[ntaken++] = c->base;
+		c->base = NULL;
+		close(c->sock);
+		c->sock = -1;
+	}
+	while (ntaken--)
+		munmap(taken[ntaken], c->size);
 	if (rc != 0)
-		goto __snap_action_sync_execute_job_exit;
-	snap_trace("%s: RETURN RESULTS %ld bytes (%d)\n", __func__,
-		   mmio_out * sizeof(uint32_t), mmio_out);
+		goto out;
+
+	c->ctrl = c->base;
+	c->sq = (struct snapd_job *)(c->ctrl + 1);
+	c->cq = (struct snap_completion *)(c->sq + entries);
+	c->data = (uint8_t *)c->base + rings;
+	return c;
+
+ out:
+	snap_trace("%s: Error Can not connect to %s rc %d\n", __func__,
+		   path, rc);
+	snap_client_close(c);
+	errno = -rc;
+	return NULL;
+}
 
-	/* Get job results max 6*16 bytes back to the caller */
-	if (cjob->wout_addr == 0) {
-		/* No out Address, mmio_out is set */
-		job_data = (uint32_t *)(unsigned long)cjob->win_addr;
-	} else {
-		job_data = (uint32_t *)(unsigned long)cjob->wout_addr;
-		mmio_out = cjob->wout_size / sizeof(uint32_t);
+void *snap_client_data(struct snap_client *client, size_t *size)
+{
+	if (client == NULL)
+		return NULL;
+	if (size)
+		*size = client->data_size;
+	return client->data;
+}
+
+int snap_client_post(struct snap_client *client,
+		     snap_action_type_t action_type,
+		     const void *job, unsigned int job_size,
+		     unsigned int out_size, uint64_t tag)
+{
+	struct snap_client *c = client;
+	struct snapd_job *j;
+	uint64_t one = 1;
+
+	if ((c == NULL) || (job_size > sizeof(j->data)) ||
+	    (out_size > SNAP_JOBSIZE) || ((job == NULL) && (job_size != 0))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
 	}
 
-	/* No need to read back 0x190, 0x194, 0x198 and 0x19c .... */
-	for (i = 0, action_addr = ACTION_PARAMS_OUT+0x10; i < mmio_out;
-	     i++, action_addr += sizeof(uint32_t)) {
-		rc = snap_mmio_read32(card, action_addr, &job_data[i]);
-		if (rc != 0)
-			goto __snap_action_sync_execute_job_exit;
-		snap_trace("  %s: %d Addr: %x Data: %x\n", __func__, i,
-			   action_addr, job_data[i]);
+	pthread_mutex_lock(&c->post_lock);
+	if (c->tail - __atomic_load_n(&c->head, __ATOMIC_ACQUIRE) > c->mask) {
+		pthread_mutex_unlock(&c->post_lock);
+		return SNAP_EBUSY;	/* All slots in flight */
 	}
 
-__snap_action_sync_execute_job_exit:
-	snap_action_stop(action);
-	return rc;
+	j = &c->sq[c->tail & c->mask];
+	j->action_type = action_type;
+	j->win_size = job_size;
+	j->wout_size = out_size;
+	j->tag = tag;
+	memcpy(j->data, job, job_size);
+
+	c->tail++;
+	__atomic_store_n(&c->ctrl->sq_tail, c->tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->ctrl->daemon_wait, __ATOMIC_SEQ_CST) &&
+	    (write(c->doorbell, &one, sizeof(one)) < 0) && (errno != EAGAIN)) {
+		pthread_mutex_unlock(&c->post_lock);
+		return SNAP_EIO;
+	}
+	pthread_mutex_unlock(&c->post_lock);
+	return SNAP_OK;
 }
 
-/**
- * Synchronous way to send a job away. Blocks until job is done.
- * These 3 steps can be called separately from the application
- * BUT manage carefully the action timeout
- *  * 1rst step: write Action registers into the FPGA
- *  * 2nd  step: start the Action
- *  *      step: processing - exchange data
- *  * 3rd  step: check completion and manage IRQ if needed
- *
- * @action	handle to streaming framework action/action
- * @cjob	streaming framework job
- * @return	0 on success.
- */
-
-int snap_action_sync_execute_job(struct snap_action *action,
-				 struct snap_job *cjob,
-				 unsigned int timeout_sec)
+static inline bool snap_client_done(struct snap_client *c)
 {
-	int rc;
-
-	/* Set action registers through MMIO */
-	rc = snap_action_sync_execute_job_set_regs(action, cjob);
-	if (rc != 0)
-		return rc;
+	struct snap_completion *cc = &c->cq[c->head & c->mask];
 
-	/* Start Action */
-	snap_action_start(action);
+	return (__atomic_load_n(&cc->flags, __ATOMIC_ACQUIRE) &
+		SNAP_JOBFLAG_DONE) && (cc->seq == (uint16_t)c->head);
+}
 
-	/* Wait for finish */
-	rc = snap_action_sync_execute_job_check_completion(action, cjob, 
-				timeout_sec);
-	return rc;
+/* Sleep until the daemon completes the next job, 1 if it went away */
+static int snap_client_sleep(struct snap_client *c, int timeout_ms)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = c->wakeup, .events = POLLIN },
+		{ .fd = c->sock, .events = POLLIN },
+	};
+	uint64_t cnt;
+	int hangup = 0;
+
+	/* Store before the recheck, else both sides might go to sleep */
+	__atomic_store_n(&c->ctrl->client_wait, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!snap_client_done(c) && (poll(pfd, 2, timeout_ms) > 0)) {
+		if (pfd[0].revents & POLLIN)
+			(void)read(c->wakeup, &cnt, sizeof(cnt));
+		if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR))
+			hangup = 1;	/* The daemon sends nothing */
+	}
+	__atomic_store_n(&c->ctrl->client_wait, 0, __ATOMIC_RELAXED);
+	return hangup;
 }
 
-int snap_sync_execute_job(struct snap_card *card,
-			  snap_action_type_t action_type,
-			  snap_action_flag_t action_flags,
-			  struct snap_job *cjob,
-			  int attach_timeout_sec,
-			  int timeout_sec)
+int snap_client_poll(struct snap_client *client,
+		     struct snap_completion *done, unsigned int num,
+		     unsigned int timeout_ms)
 {
-	int rc = SNAP_OK;
-	struct snap_action *action;
+	struct snap_client *c = client;
+	unsigned int n = 0;
+	unsigned long long t0 = 0, now;
+	int rc = 0;
 
-	action = snap_attach_action(card, action_type, action_flags,
-				    attach_timeout_sec);
-	if (NULL == action) {
-		snap_trace("%s: Error Can not attach to Action 0x%x\n",
-			   __func__, card->action_type);
-		errno = ETIME;
-		return SNAP_EATTACH;
+	if ((c == NULL) || ((done == NULL) && (num != 0))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
 	}
 
-	rc = snap_action_sync_execute_job(action, cjob, timeout_sec);
-	snap_detach_action(action);
-	return rc;
- }
+	pthread_mutex_lock(&c->poll_lock);
+	while (n < num) {
+		if (snap_client_done(c)) {
+			struct snap_completion *cc = &c->cq[c->head & c->mask];
+
+			memcpy(&done[n++], cc, sizeof(*cc));
+			cc->flags = 0;
+			__atomic_store_n(&c->head, c->head + 1,
+					 __ATOMIC_RELEASE);
+			continue;
+		}
+		if ((n != 0) || (timeout_ms == 0))
+			break;
+
+		now = tget_us();
+		if (t0 == 0)
+			t0 = now;
+		if (now - t0 >= timeout_ms * 1000ull)
+			break;
+		if (now - t0 < SNAP_CLIENT_SPIN_US) {
+			sched_yield();
+			continue;
+		}
+		if (snap_client_sleep(c, timeout_ms - (now - t0) / 1000)) {
+			errno = ECONNRESET;
+			rc = SNAP_EIO;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->poll_lock);
+	return (n == 0 && rc) ? rc : (int)n;
+}
 
 /******************************************************************************
  * SOFTWARE EMULATION OF FPGA ACTIONS
  *****************************************************************************/
 
+/*
+ * Emulated action control. Writing ACTION_CONTROL_START hands the job
+ * to a library worker thread, the action is RUNNING until main()
+ * returned. The done interrupt is signalled on the done condition.
+ */
+struct snap_sim_ctl {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	uint32_t irq_app;		/* Last write to ACTION_IRQ_APP */
+	uint32_t irq_control;		/* Last write to ACTION_IRQ_CONTROL */
+	bool irq_pending;
+	bool stop;			/* ACTION_CONTROL_STOP written */
+	bool orphan;			/* Aborted, worker frees it */
+	struct snap_sim_action *run_next;
+};
+
+/* Copy of a registered action owned by one card */
+struct snap_sim_instance {
+	struct snap_sim_action action;
+	struct snap_sim_ctl ctl;
+};
+
 int snap_action_register(struct snap_sim_action *new_action)
 {
 	if (new_action == NULL) {
@@ -1180,6 +5637,54 @@ struct snap_sim_action *snap_card_to_sim_action(struct snap_card *card)
 	return card->action;
 }
 
+int snap_sim_action_stopping(struct snap_sim_action *a)
+{
+	return __atomic_load_n(&a->ctl->stop, __ATOMIC_ACQUIRE);
+}
+
+void snap_stream_serve(const struct snap_stream_job *sj,
+		       snap_stream_run_t run, void *priv)
+{
+	struct snap_stream_ctrl *ctrl = (struct snap_stream_ctrl *)
+		(unsigned long)sj->ctrl_addr;
+	struct snap_queue_workitem *sq = (struct snap_queue_workitem *)
+		(unsigned long)sj->sq_addr;
+	struct snap_completion *cq = (struct snap_completion *)
+		(unsigned long)sj->cq_addr;
+	struct snap_queue_workitem w;
+	struct snap_completion *c;
+	uint32_t mask = sj->entries - 1;
+	uint32_t head = ctrl->sq_head;
+	unsigned int idle = 0;
+
+	while (1) {
+		if (head == __atomic_load_n(&ctrl->sq_tail, __ATOMIC_ACQUIRE)) {
+			/* Posted before the stop request means still to do */
+			if ((__atomic_load_n(&ctrl->flags, __ATOMIC_ACQUIRE) &
+			     SNAP_STREAM_STOP) &&
+			    (head == __atomic_load_n(&ctrl->sq_tail,
+						     __ATOMIC_ACQUIRE)))
+				break;
+			if (++idle < 1000)
+				sched_yield();
+			else	usleep(100);
+			continue;
+		}
+		idle = 0;
+
+		memcpy(&w, &sq[head & mask], sizeof(w));
+		run(&w, priv);
+
+		c = &cq[head & mask];
+		memcpy(c, &w, sizeof(*c));
+		c->flags = 0;
+		__atomic_store_n(&c->flags, w.flags | SNAP_JOBFLAG_DONE,
+				 __ATOMIC_RELEASE);
+		__atomic_store_n(&ctrl->sq_head, ++head, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&ctrl->status, SNAP_STREAM_STOPPED, __ATOMIC_RELEASE);
+}
+
 static struct snap_sim_action *find_action(snap_action_type_t action_type)
 {
 	struct snap_sim_action *a;
@@ -1193,24 +5698,83 @@ static struct snap_sim_action *find_action(snap_action_type_t action_type)
 	return NULL;
 }
 
+static void sw_action_free(struct snap_sim_action *a)
+{
+	struct snap_sim_ctl *ctl;
+
+	if (a == NULL)
+		return;
+
+	/* A worker might still run the last job */
+	ctl = a->ctl;
+	pthread_mutex_lock(&ctl->lock);
+	while (__atomic_load_n(&a->state, __ATOMIC_ACQUIRE) == ACTION_RUNNING)
+		pthread_cond_wait(&ctl->done, &ctl->lock);
+	pthread_mutex_unlock(&ctl->lock);
+
+	if (a->exit)
+		a->exit(a);
+	pthread_cond_destroy(&ctl->done);
+	pthread_mutex_destroy(&ctl->lock);
+	free(a);
+}
+
+static struct snap_sim_action *sw_action_alloc(struct snap_sim_action *tmpl)
+{
+	struct snap_sim_instance *inst;
+	struct snap_sim_action *a;
+
+	inst = calloc(1, sizeof(*inst));
+	if (inst == NULL)
+		return NULL;
+
+	a = &inst->action;
+	*a = *tmpl;
+	a->next = NULL;
+	a->state = ACTION_IDLE;
+	a->ctl = &inst->ctl;
+	pthread_mutex_init(&inst->ctl.lock, NULL);
+	pthread_cond_init(&inst->ctl.done, NULL);
+
+	if (a->init && (a->init(a) != 0)) {
+		pthread_cond_destroy(&inst->ctl.done);
+		pthread_mutex_destroy(&inst->ctl.lock);
+		free(inst);
+		return NULL;
+	}
+	return a;
+}
+
 static int snap_map_funcs(struct snap_card *card,
 			  snap_action_type_t action_type)
 {
-	struct snap_sim_action *a;
+	struct snap_sim_action *tmpl, *a;
 
 	snap_trace("%s: Mapping action_type %x\n", __func__, action_type);
 
 	card->action_type = action_type;
 
+	/* Keep the copy we got from the last attach */
+	a = card->action;
+	if ((a != NULL) && (a->action_type == action_type))
+		return SNAP_OK;
+
 	/* search action and map in its mmios */
-	a = find_action(action_type);
-	if (a == NULL) {
+	tmpl = find_action(action_type);
+	if (tmpl == NULL) {
 		snap_trace("  %s: No action found!!\n", __func__);
 		errno = ENOENT;
 		return SNAP_ENOENT;
 	}
 
-	snap_trace("  %s: Action found %p.\n", __func__, a);
+	a = sw_action_alloc(tmpl);
+	if (a == NULL) {
+		errno = ENOMEM;
+		return SNAP_ENOMEM;
+	}
+	sw_action_free(card->action);
+
+	snap_trace("  %s: Action found %p instance %p.\n", __func__, tmpl, a);
 	card->action = a;
 	return SNAP_OK;
 }
@@ -1226,6 +5790,8 @@ static void *sw_card_alloc_dev(const char *path __unused,
 		goto __snap_alloc_err;
 
 	dn->priv = NULL;
+	dn->cancel_fd = -1;
+	dn->numa_node = -1;
 	dn->vendor_id = vendor_id;
 	dn->device_id = device_id;
 	dn->name = snap_card_id_2_name(vendor_id); /* Makes invalid name */ 
@@ -1237,15 +5803,211 @@ static void *sw_card_alloc_dev(const char *path __unused,
 
 static void sw_card_free(struct snap_card *card)
 {
+	sw_action_free(card->action);
 	__free(card);
 }
 
+/*
+ * Emulated actions run on library worker threads, such that
+ * snap_action_start() returns while the action is still RUNNING like
+ * it does with the FPGA. A new worker is started if all are busy, up
+ * to one per online CPU. Workers left with the job of an aborted or
+ * detached copy do not count, such that new jobs do not wait for it.
+ * A stream runs until it is stopped, it gets a thread of its own.
+ */
+static pthread_mutex_t sw_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sw_run_cond = PTHREAD_COND_INITIALIZER;
+static struct snap_sim_action *sw_run_head = NULL;
+static struct snap_sim_action *sw_run_tail = NULL;
+static unsigned int sw_workers = 0;
+static unsigned int sw_workers_idle = 0;
+static unsigned int sw_queued = 0;
+static unsigned int sw_orphans = 0;	/* Jobs nobody waits for */
+
+/* One posted workitem of a stream, run like a job of its own */
+static void sw_stream_run(struct snap_queue_workitem *w, void *priv)
+{
+	struct snap_sim_action *a = priv;
+
+	memcpy(&a->job, w, sizeof(*w));
+	a->job.retc = SNAP_RETC_FAILURE;
+	a->main(a, &a->job.user, sizeof(a->job.user));
+	memcpy(w, &a->job, sizeof(*w));
+}
+
+/*
+ * A stream occupies its worker until it is stopped. The workitem of
+ * the stream job is kept, since the posted ones pass through a->job.
+ */
+static void sw_stream_serve(struct snap_sim_action *a)
+{
+	struct snap_queue_workitem w;
+
+	memcpy(&w, &a->job, sizeof(w));
+	snap_stream_serve((struct snap_stream_job *)w.user.data,
+			  sw_stream_run, a);
+	memcpy(&a->job, &w, sizeof(w));
+	a->job.retc = SNAP_RETC_SUCCESS;
+}
+
+static void sw_action_run(struct snap_sim_action *a)
+{
+	struct snap_sim_ctl *ctl = a->ctl;
+	struct snap_queue_workitem *w = &a->job;
+	bool orphan;
+
+	/* __hexdump(stdout, &w->user, sizeof(w->user)); */
+	if (w->flags & SNAP_JOBFLAG_STREAM)
+		sw_stream_serve(a);
+	else	a->main(a, &w->user, sizeof(w->user));
+
+	if (w->flags & SNAP_JOBFLAG_COMPLETION) {
+		struct snap_completion *crec = (struct snap_completion *)
+			(unsigned long)w->priv_data;
+
+		memcpy(crec, w, sizeof(*crec));
+		crec->flags = 0;
+		__atomic_store_n(&crec->flags, w->flags |
+				 SNAP_JOBFLAG_DONE, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_lock(&ctl->lock);
+	__atomic_store_n(&a->state, ACTION_IDLE, __ATOMIC_RELEASE);
+	if ((ctl->irq_app & ACTION_IRQ_APP_DONE) &&
+	    (ctl->irq_control & ACTION_IRQ_CONTROL_ON))
+		ctl->irq_pending = true;
+	pthread_cond_broadcast(&ctl->done);
+	orphan = ctl->orphan;
+	pthread_mutex_unlock(&ctl->lock);
+
+	/* The job got aborted and the card continued with a new copy */
+	if (orphan) {
+		__atomic_sub_fetch(&sw_orphans, 1, __ATOMIC_RELAXED);
+		sw_action_free(a);
+	}
+}
+
+static void *sw_action_worker(void *arg __unused)
+{
+	struct snap_sim_action *a;
+
+	pthread_mutex_lock(&sw_run_lock);
+	while (1) {
+		sw_workers_idle++;
+		while (sw_run_head == NULL)
+			pthread_cond_wait(&sw_run_cond, &sw_run_lock);
+		sw_workers_idle--;
+		a = sw_run_head;
+		sw_run_head = a->ctl->run_next;
+		if (sw_run_head == NULL)
+			sw_run_tail = NULL;
+		sw_queued--;
+		pthread_mutex_unlock(&sw_run_lock);
+
+		sw_action_run(a);
+
+		pthread_mutex_lock(&sw_run_lock);
+	}
+	return NULL;
+}
+
+static void *sw_stream_worker(void *arg)
+{
+	sw_action_run(arg);
+	return NULL;
+}
+
+static void sw_action_submit(struct snap_sim_action *a)
+{
+	pthread_t worker;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* Else the stream would hold a pool worker for its lifetime */
+	if ((a->job.flags & SNAP_JOBFLAG_STREAM) &&
+	    (pthread_create(&worker, NULL, sw_stream_worker, a) == 0)) {
+		pthread_detach(worker);
+		return;
+	}
+
+	pthread_mutex_lock(&sw_run_lock);
+	if ((sw_workers_idle <= sw_queued) &&
+	    ((sw_workers == 0) ||
+	     ((long)sw_workers -
+	      (long)__atomic_load_n(&sw_orphans, __ATOMIC_RELAXED) < cpus)) &&
+	    (pthread_create(&worker, NULL, sw_action_worker, NULL) == 0)) {
+		pthread_detach(worker);
+		sw_workers++;
+	}
+	if (sw_workers == 0) {
+		/* No threads, the job is done when start returns */
+		pthread_mutex_unlock(&sw_run_lock);
+		sw_action_run(a);
+		return;
+	}
+	a->ctl->run_next = NULL;
+	if (sw_run_tail)
+		sw_run_tail->ctl->run_next = a;
+	else	sw_run_head = a;
+	sw_run_tail = a;
+	sw_queued++;
+	pthread_cond_signal(&sw_run_cond);
+	pthread_mutex_unlock(&sw_run_lock);
+}
+
+/* Wait until the emulated action raised its done interrupt */
+static int sw_wait_irq(struct snap_card *card, int timeout_sec,
+		       int expect_irq)
+{
+	struct snap_sim_action *a = card->action;
+	struct snap_sim_ctl *ctl;
+	struct timespec deadline;
+	int rc = 0;
+
+	snap_btrace(SNAP_BT_IRQ_WAIT, card, expect_irq, timeout_sec);
+	if ((a == NULL) || (expect_irq != SNAP_ACTION_IRQ_NUM)) {
+		errno = EINVAL;
+		return EINVAL;
+	}
+	ctl = a->ctl;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_sec;
+
+	pthread_mutex_lock(&ctl->lock);
+	while (!ctl->irq_pending && (rc == 0)) {
+		if (snap_cancel_pending(card)) {
+			rc = ECANCELED;
+			break;
+		}
+		rc = pthread_cond_timedwait(&ctl->done, &ctl->lock,
+					    &deadline);
+	}
+	pthread_mutex_unlock(&ctl->lock);
+	if (rc == ETIMEDOUT)
+		rc = EBUSY;		/* Like hw_wait_irq() */
+
+	snap_btrace(SNAP_BT_IRQ_DONE, card, expect_irq, rc);
+	return rc;
+}
+
+/* Wake up sw_wait_irq() to see the cancel request */
+static void sw_cancel_kick(struct snap_card *card)
+{
+	struct snap_sim_action *a = card->action;
+
+	if (a == NULL)
+		return;
+	pthread_mutex_lock(&a->ctl->lock);
+	pthread_cond_broadcast(&a->ctl->done);
+	pthread_mutex_unlock(&a->ctl->lock);
+}
+
 static int sw_mmio_write32(struct snap_card *card,
 			   uint64_t offs, uint32_t data)
 {
 	int rc = 0;
 	struct snap_sim_action *a = card->action;
-	struct snap_queue_workitem *w;
+	struct snap_sim_ctl *ctl;
 
 	snap_trace("  %s(%p, %llx, %x) a=%p\n", __func__, card,
 		   (long long)offs, data, a);
@@ -1258,16 +6020,45 @@ static int sw_mmio_write32(struct snap_card *card,
 		errno = EFAULT;
 		return -1;
 	}
-	w = &a->job;
+	ctl = a->ctl;
+	snap_btrace(SNAP_BT_MMIO_WRITE32, card, offs, data);
 
-	if (offs == ACTION_CONTROL) {
+	switch (offs) {
+	case ACTION_CONTROL:
+		if (data & ACTION_CONTROL_STOP)
+			__atomic_store_n(&ctl->stop, true, __ATOMIC_RELEASE);
+		if (!(data & ACTION_CONTROL_START))
+			break;
 		snap_trace("  starting action!!\n");
-		a->state = ACTION_RUNNING;
-		/* __hexdump(stdout, &w->user, sizeof(w->user)); */
-		a->main(a, &w->user, sizeof(w->user));
-		a->state = ACTION_IDLE;
+		pthread_mutex_lock(&ctl->lock);
+		if (a->state == ACTION_RUNNING) {
+			pthread_mutex_unlock(&ctl->lock);
+			errno = EBUSY;
+			return -1;
+		}
+		__atomic_store_n(&a->state, ACTION_RUNNING, __ATOMIC_RELEASE);
+		ctl->irq_pending = false;
+		ctl->stop = false;
+		pthread_mutex_unlock(&ctl->lock);
+
+		/* Results are returned in the same workitem, unlike hw */
+		card->param_valid = 0;
 
+		sw_action_submit(a);
 		return 0;
+	case ACTION_IRQ_APP:
+		ctl->irq_app = data;
+		break;
+	case ACTION_IRQ_CONTROL:
+		ctl->irq_control = data;
+		break;
+	case ACTION_IRQ_STATUS:
+		if (data & ACTION_IRQ_STATUS_DONE) {
+			pthread_mutex_lock(&ctl->lock);
+			ctl->irq_pending = false;
+			pthread_mutex_unlock(&ctl->lock);
+		}
+		break;
 	}
 
 	if ((offs >= ACTION_PARAMS_IN) &&
@@ -1302,10 +6093,12 @@ static int sw_mmio_read32(struct snap_card *card,
 
 	switch (offs) {
 	case ACTION_CONTROL:
-		switch (a->state) {
+		switch (__atomic_load_n(&a->state, __ATOMIC_ACQUIRE)) {
 		case ACTION_IDLE:
 			*data = ACTION_CONTROL_IDLE; break;
 		case ACTION_RUNNING:
+			/* Pollers should not starve the worker */
+			sched_yield();
 			*data = ACTION_CONTROL_RUN; break;
 		case ACTION_ERROR:
 			*data = 0x0; break;
@@ -1321,6 +6114,7 @@ static int sw_mmio_read32(struct snap_card *card,
 			rc = a->mmio_read32(card, offs, data);
 	}
 
+	snap_btrace(SNAP_BT_MMIO_READ32, card, offs, *data);
 	snap_trace("  %s(%p, %llx, %x) rc=%d\n", __func__, card,
 		   (long long)offs, *data, rc);
 	return rc;
@@ -1336,6 +6130,14 @@ static int sw_mmio_write64(struct snap_card *card,
 		errno = EFAULT;
 		return -1;
 	}
+	/* Job parameters are 32-bit registers, split like the hardware */
+	if ((offs >= ACTION_PARAMS_IN) &&
+	    (offs < ACTION_PARAMS_IN + CACHELINE_BYTES)) {
+		rc = sw_mmio_write32(card, offs, (uint32_t)(data >> 32));
+		if (rc == 0)
+			rc = sw_mmio_write32(card, offs + 4, (uint32_t)data);
+		return rc;
+	}
 	if (a->mmio_write64)
 		rc = a->mmio_write64(card, offs, data);
 
@@ -1352,6 +6154,16 @@ static int sw_mmio_read64(struct snap_card *card,
 		errno = EFAULT;
 		return -1;
 	}
+	if ((offs >= ACTION_PARAMS_OUT) &&
+	    (offs < ACTION_PARAMS_OUT + CACHELINE_BYTES)) {
+		uint32_t hi = 0, lo = 0;
+
+		rc = sw_mmio_read32(card, offs, &hi);
+		if (rc == 0)
+			rc = sw_mmio_read32(card, offs + 4, &lo);
+		*data = ((uint64_t)hi << 32) | lo;
+		return rc;
+	}
 	if (a->mmio_read64)
 		rc = a->mmio_read64(card, offs, data);
 
@@ -1366,15 +6178,58 @@ static struct snap_action *sw_attach_action(struct snap_card *card,
 	snap_trace("  %s(%p, %x %d %d)\n", __func__,
 		   card, action_type, action_flags, timeout_ms);
 
+	/* The done interrupt is emulated, see sw_wait_irq() */
+	card->flags = action_flags & (SNAP_ACTION_DONE_IRQ | SNAP_ACTION_MMIO64);
 	return (struct snap_action *)card;
 }
 
+/*
+ * A thread cannot be aborted safely. A running copy of the action is
+ * left to its worker, which frees it once main() returns, and the card
+ * gets a new copy on the next attach.
+ */
+static void sw_action_orphan(struct snap_card *card)
+{
+	struct snap_sim_action *a = card->action;
+	struct snap_sim_ctl *ctl;
+
+	if (a == NULL)
+		return;
+
+	ctl = a->ctl;
+	pthread_mutex_lock(&ctl->lock);
+	if (a->state == ACTION_RUNNING) {
+		ctl->stop = true;	/* Actions checking it finish early */
+		ctl->orphan = true;
+		card->action = NULL;
+		__atomic_add_fetch(&sw_orphans, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ctl->lock);
+}
+
+/* E.g. after a timeout, the next job must not go to a running copy */
 static int sw_detach_action(struct snap_action *action)
 {
 	snap_trace("  %s(%p)\n", __func__, action);
+	sw_action_orphan((struct snap_card *)action);
+	return 0;
+}
+
+static int sw_abort_action(struct snap_action *action)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	snap_trace("  %s(%p) a=%p\n", __func__, action, card->action);
+	sw_action_orphan(card);
 	return 0;
 }
 
+static int sw_has_action(struct snap_card *card __unused,
+			 snap_action_type_t action_type)
+{
+	return find_action(action_type) != NULL;
+}
+
 static int sw_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long parm)
 {
 	int rc = 0;
@@ -1420,12 +6275,15 @@ static struct snap_funcs software_funcs = {
 	.card_alloc_dev = sw_card_alloc_dev,
 	.attach_action = sw_attach_action, /* attach Action */
 	.detach_action = sw_detach_action, /* detach Action */
+	.abort_action = sw_abort_action,
 	.mmio_write32 = sw_mmio_write32,
 	.mmio_read32 = sw_mmio_read32,
 	.mmio_write64 = sw_mmio_write64,
 	.mmio_read64 = sw_mmio_read64,
 	.card_free = sw_card_free,
 	.card_ioctl = sw_card_ioctl,
+	.wait_irq = sw_wait_irq,
+	.has_action = sw_has_action,
 };
 
 /**********************************************************************
@@ -1438,6 +6296,11 @@ static void _init(void)
 {
 	const char *trace_env;
 	const char *config_env;
+	const char *lease_env;
+	const char *btrace_env;
+	const char *size_env;
+	const char *cache_env;
+	const char *mmio_env;
 
 	trace_env = getenv("SNAP_TRACE");
 	if (trace_env != NULL)
@@ -1451,11 +6314,46 @@ static void _init(void)
 		else if ( (strcmp(config_env, "CPU") == 0) ||
 			(strcmp(config_env, "cpu") == 0) )
 			snap_config = 0x1;
+		else if ( (strcmp(config_env, "HYBRID") == 0) ||
+			(strcmp(config_env, "hybrid") == 0) )
+			snap_config = 0x2;
 		else {
 			snap_config = strtol(config_env, (char **)NULL, 0);
 		}
 	}
 
+	lease_env = getenv("SNAP_LEASE_MS");
+	if (lease_env != NULL)
+		snap_lease_ms = strtol(lease_env, (char **)NULL, 0);
+
+	btrace_env = getenv("SNAP_BTRACE");
+	if ((btrace_env != NULL) && (*btrace_env != '\0')) {
+		size_env = getenv("SNAP_BTRACE_SIZE");
+		if (size_env != NULL)
+			btrace_size = strtoul(size_env, (char **)NULL, 0);
+		if (btrace_size < 2)
+			btrace_size = SNAP_BTRACE_DEFAULT;
+		/* Round up to the next power of 2 */
+		while (btrace_size & (btrace_size - 1))
+			btrace_size += btrace_size & -btrace_size;
+		btrace_fname = btrace_env;
+		atexit(snap_btrace_exit);
+	}
+
+	mmio_env = getenv("SNAP_MMIO");
+	if ((mmio_env != NULL) &&
+	    ((strcmp(mmio_env, "BATCH") == 0) ||
+	     (strcmp(mmio_env, "batch") == 0)))
+		snap_mmio_policy = SNAP_MMIO_BATCH;
+
+	cache_env = getenv("SNAP_BUF_CACHE");
+	if (cache_env != NULL)
+		buf_cache_max = strtoull(cache_env, (char **)NULL, 0);
+
+	stats_fname = getenv("SNAP_STATS");
+	if ((stats_fname != NULL) && (*stats_fname != '\0'))
+		atexit(snap_stats_exit);
+
 	if (software_action_enabled())
 		df = &software_funcs; /* Map Software Functions */
 }
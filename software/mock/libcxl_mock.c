@@ -0,0 +1,623 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Virtual AFU: a libcxl replacement which emulates the SNAP job manager
+ * and one action register file per context in the calling process.
+ * Preload it with LD_LIBRARY_PATH=software/mock to run the hardware code
+ * path of libsnap (SNAP_CONFIG=FPGA) without a card, e.g. to compare
+ * IRQ against polling or to measure attach and MMIO costs.
+ *
+ * The action copies the SRC to the DST host buffer of the first two
+ * struct snap_addr of the job, if there are such and they are no
+ * scatter-gather lists, and returns SNAP_RETC_SUCCESS together with
+ * the job parameters as output.
+ * Streaming jobs, see struct snap_stream_job, are served the same
+ * way for each posted workitem.
+ * ACTION_CONTROL_STOP ends a running job at once with
+ * SNAP_RETC_STOPPED, as if it stopped at a checkpoint before the copy.
+ *
+ * SNAP_MOCK_ACTIONS    Action types, comma separated (0x10141000)
+ * SNAP_MOCK_CAP        Capability register (0x10000000, 4 GiB SDRAM)
+ * SNAP_MOCK_MMIO_NS    Extra time spent in each MMIO access (0)
+ * SNAP_MOCK_ATTACH_US  Time from JCR start to action attached (0)
+ * SNAP_MOCK_SLOTS      Contexts which can be attached at a time (0, any)
+ * SNAP_MOCK_JOB_US     Time from action start to action done (0)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <libcxl.h>
+#include <libsnap.h>
+#include <snap_queue.h>
+#include <snap_s_regs.h>
+#include <snap_hls_if.h>
+#include <snap_internal.h>
+
+#define MOCK_MMIO_SIZE		0x10000		/* One slave context */
+#define MOCK_ACTIONS_MAX	16
+#define MOCK_EVENTS		64
+
+/* Pending work of the emulated hardware */
+#define MOCK_WORK_ATTACH	0x01
+#define MOCK_WORK_JOB		0x02
+#define MOCK_WORK_EXIT		0x04
+
+struct cxl_afu_h {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_t thread;
+	bool thread_running;
+	unsigned int work;
+	uint64_t attach_due;		/* CLOCK_MONOTONIC ns */
+	bool slot;			/* Holds one of SNAP_MOCK_SLOTS */
+	uint64_t job_due;
+	bool job_stop;			/* ACTION_CONTROL_STOP for the job */
+
+	int efd;			/* Readable while events are queued */
+	struct cxl_event events[MOCK_EVENTS];
+	unsigned int ev_head, ev_count;
+	unsigned long ev_lost;
+
+	uint8_t mmio[MOCK_MMIO_SIZE] __attribute__((aligned(128)));
+};
+
+static int mock_ctx_next = 0;
+static uint64_t mock_cap = 0x10000000ull;
+static uint32_t mock_actions[MOCK_ACTIONS_MAX] = { 0x10141000 };
+static unsigned int mock_nactions = 1;
+static unsigned long mock_mmio_ns = 0;
+static unsigned long mock_attach_us = 0;
+static unsigned long mock_job_us = 0;
+static unsigned long mock_slots = 0;
+static unsigned long mock_slots_used = 0;
+static pthread_once_t mock_once = PTHREAD_ONCE_INIT;
+
+static uint64_t mock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void mock_mmio_delay(void)
+{
+	uint64_t t0;
+
+	if (mock_mmio_ns == 0)
+		return;
+	t0 = mock_ns();
+	while (mock_ns() - t0 < mock_mmio_ns)
+		;
+}
+
+static unsigned long mock_env(const char *name, unsigned long def)
+{
+	const char *s = getenv(name);
+
+	return s ? strtoul(s, NULL, 0) : def;
+}
+
+static void mock_setup(void)
+{
+	const char *s = getenv("SNAP_MOCK_ACTIONS");
+	char *end;
+
+	mock_cap = mock_env("SNAP_MOCK_CAP", mock_cap);
+	mock_mmio_ns = mock_env("SNAP_MOCK_MMIO_NS", 0);
+	mock_attach_us = mock_env("SNAP_MOCK_ATTACH_US", 0);
+	mock_job_us = mock_env("SNAP_MOCK_JOB_US", 0);
+	mock_slots = mock_env("SNAP_MOCK_SLOTS", 0);
+
+	if (s == NULL)
+		return;
+	for (mock_nactions = 0; mock_nactions < MOCK_ACTIONS_MAX; ) {
+		mock_actions[mock_nactions++] = strtoul(s, &end, 0);
+		if (*end != ',')
+			break;
+		s = end + 1;
+	}
+}
+
+/* Registers are kept big endian, as seen through cxl_mmio_ptr() */
+static uint32_t reg32(struct cxl_afu_h *afu, uint64_t offs)
+{
+	return be32toh(*(uint32_t *)&afu->mmio[offs]);
+}
+
+static void reg32_set(struct cxl_afu_h *afu, uint64_t offs, uint32_t data)
+{
+	*(uint32_t *)&afu->mmio[offs] = htobe32(data);
+}
+
+static uint64_t reg64(struct cxl_afu_h *afu, uint64_t offs)
+{
+	return be64toh(*(uint64_t *)&afu->mmio[offs]);
+}
+
+static void reg64_set(struct cxl_afu_h *afu, uint64_t offs, uint64_t data)
+{
+	*(uint64_t *)&afu->mmio[offs] = htobe64(data);
+}
+
+/* Called with lock held */
+static void mock_raise_irq(struct cxl_afu_h *afu, int irq)
+{
+	struct cxl_event *ev;
+	uint64_t one = 1;
+
+	if (afu->ev_count == MOCK_EVENTS) {
+		afu->ev_lost++;
+		return;
+	}
+	ev = &afu->events[(afu->ev_head + afu->ev_count) % MOCK_EVENTS];
+	memset(ev, 0, sizeof(*ev));
+	ev->header.type = CXL_EVENT_AFU_INTERRUPT;
+	ev->header.size = sizeof(ev->header) + sizeof(ev->irq);
+	ev->irq.irq = irq;
+	afu->ev_count++;
+	if (write(afu->efd, &one, sizeof(one)) != sizeof(one))
+		afu->ev_lost++;
+}
+
+/* Called with lock held, false if all slots are in use */
+static bool mock_attach_done(struct cxl_afu_h *afu)
+{
+	unsigned long used = __atomic_load_n(&mock_slots_used,
+					     __ATOMIC_RELAXED);
+
+	do {
+		if (mock_slots && (used >= mock_slots))
+			return false;
+	} while (!__atomic_compare_exchange_n(&mock_slots_used, &used,
+					      used + 1, false,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+	afu->slot = true;
+	reg64_set(afu, SNAP_S_CSR, SNAP_CSR_ATTACHED);
+	if (reg64(afu, SNAP_S_CCR) & SNAP_CCR_IRQ_ATTACH)
+		mock_raise_irq(afu, SNAP_ATTACH_IRQ_NUM);
+	return true;
+}
+
+/* Called with lock held */
+static void mock_detach(struct cxl_afu_h *afu)
+{
+	if (afu->slot)
+		__atomic_sub_fetch(&mock_slots_used, 1, __ATOMIC_RELEASE);
+	afu->slot = false;
+	reg64_set(afu, SNAP_S_CSR, 0);
+}
+
+/* The action itself, also run for each workitem of a stream */
+static void mock_run(struct snap_queue_workitem *w, void *priv __unused)
+{
+	struct snap_addr *src = &w->user.addr[0];
+	struct snap_addr *dst = &w->user.addr[1];
+
+	if ((src->type == SNAP_ADDRTYPE_HOST_DRAM) &&
+	    (src->flags & SNAP_ADDRFLAG_SRC) &&
+	    (dst->type == SNAP_ADDRTYPE_HOST_DRAM) &&
+	    (dst->flags & SNAP_ADDRFLAG_DST) && src->addr && dst->addr &&
+	    !((src->flags | dst->flags) & SNAP_ADDRFLAG_EXT))
+		memcpy((void *)(unsigned long)dst->addr,
+		       (void *)(unsigned long)src->addr,
+		       src->size < dst->size ? src->size : dst->size);
+
+	w->retc = SNAP_RETC_SUCCESS;
+}
+
+/* Called with lock held */
+static void mock_job_done(struct cxl_afu_h *afu)
+{
+	struct snap_queue_workitem w;
+	uint64_t in = ACTION_BASE_S + ACTION_PARAMS_IN;
+	uint64_t out = ACTION_BASE_S + ACTION_PARAMS_OUT;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(w) / sizeof(uint32_t); i++)
+		((uint32_t *)&w)[i] = reg32(afu, in + i * sizeof(uint32_t));
+
+	if (w.flags & SNAP_JOBFLAG_STREAM) {
+		/*
+		 * MMIO goes on while the action serves the rings. The
+		 * ring code comes from the libsnap which loaded us.
+		 */
+		pthread_mutex_unlock(&afu->lock);
+		snap_stream_serve((struct snap_stream_job *)w.user.data,
+				  mock_run, NULL);
+		pthread_mutex_lock(&afu->lock);
+		w.retc = SNAP_RETC_SUCCESS;
+	} else if (afu->job_stop)
+		w.retc = SNAP_RETC_STOPPED;	/* Checkpoint before the copy */
+	else
+		mock_run(&w, NULL);
+
+	for (i = 0; i < sizeof(w) / sizeof(uint32_t); i++)
+		reg32_set(afu, out + i * sizeof(uint32_t),
+			  ((uint32_t *)&w)[i]);
+
+	if (w.flags & SNAP_JOBFLAG_COMPLETION) {
+		struct snap_completion *crec = (struct snap_completion *)
+			(unsigned long)w.priv_data;
+
+		memcpy(crec, &w, sizeof(*crec));
+		crec->flags = 0;
+		__atomic_store_n(&crec->flags, w.flags | SNAP_JOBFLAG_DONE,
+				 __ATOMIC_RELEASE);
+	}
+
+	reg32_set(afu, ACTION_BASE_S + ACTION_CONTROL,
+		  ACTION_CONTROL_IDLE | ACTION_CONTROL_DONE);
+	if ((reg32(afu, ACTION_BASE_S + ACTION_IRQ_APP) & ACTION_IRQ_APP_DONE) &&
+	    (reg32(afu, ACTION_BASE_S + ACTION_IRQ_CONTROL) &
+	     ACTION_IRQ_CONTROL_ON)) {
+		reg32_set(afu, ACTION_BASE_S + ACTION_IRQ_STATUS,
+			  ACTION_IRQ_STATUS_DONE);
+		mock_raise_irq(afu, SNAP_ACTION_IRQ_NUM);
+	}
+}
+
+static void mock_wait_until(struct cxl_afu_h *afu, uint64_t due)
+{
+	struct timespec ts;
+
+	ts.tv_sec = due / 1000000000ull;
+	ts.tv_nsec = due % 1000000000ull;
+	pthread_cond_timedwait(&afu->work_cond, &afu->lock, &ts);
+}
+
+/* The card: completes attach and job requests once they are due */
+static void *mock_afu_thread(void *arg)
+{
+	struct cxl_afu_h *afu = arg;
+	uint64_t now, due;
+
+	pthread_mutex_lock(&afu->lock);
+	while (!(afu->work & MOCK_WORK_EXIT)) {
+		if (afu->work == 0) {
+			pthread_cond_wait(&afu->work_cond, &afu->lock);
+			continue;
+		}
+		now = mock_ns();
+		due = UINT64_MAX;
+		if (afu->work & MOCK_WORK_ATTACH) {
+			if (afu->attach_due <= now) {
+				if (mock_attach_done(afu))
+					afu->work &= ~MOCK_WORK_ATTACH;
+				else	/* Try again when a slot is free */
+					afu->attach_due = now + 100000;
+			}
+			if ((afu->work & MOCK_WORK_ATTACH) &&
+			    (afu->attach_due < due))
+				due = afu->attach_due;
+		}
+		if (afu->work & MOCK_WORK_JOB) {
+			if (afu->job_due <= now) {
+				afu->work &= ~MOCK_WORK_JOB;
+				mock_job_done(afu);
+			} else if (afu->job_due < due)
+				due = afu->job_due;
+		}
+		if (due != UINT64_MAX)
+			mock_wait_until(afu, due);
+	}
+	pthread_mutex_unlock(&afu->lock);
+	return NULL;
+}
+
+/* Called with lock held */
+static void mock_work(struct cxl_afu_h *afu, unsigned int work,
+		      unsigned long delay_us)
+{
+	uint64_t due = mock_ns() + delay_us * 1000ull;
+
+	if (work & MOCK_WORK_ATTACH)
+		afu->attach_due = due;
+	if (work & MOCK_WORK_JOB)
+		afu->job_due = due;
+	afu->work |= work;
+	pthread_cond_signal(&afu->work_cond);
+}
+
+/* Called with lock held, returns -1 if the write is not possible */
+static int mock_write(struct cxl_afu_h *afu, uint64_t offs, uint64_t data,
+		      int size)
+{
+	uint64_t act = offs - ACTION_BASE_S;
+
+	if (offs == SNAP_S_JCR) {
+		if (data & (SNAP_JCR_STOP | SNAP_JCR_ABORT)) {
+			afu->work &= ~(MOCK_WORK_ATTACH | MOCK_WORK_JOB);
+			mock_detach(afu);
+			reg32_set(afu, ACTION_BASE_S + ACTION_CONTROL,
+				  ACTION_CONTROL_IDLE);
+		} else if (data & SNAP_JCR_START)
+			mock_work(afu, MOCK_WORK_ATTACH, mock_attach_us);
+		return 0;
+	}
+	if ((offs == SNAP_S_CSR) || (offs == SNAP_S_CIR) ||
+	    (offs == SNAP_S_CAP) || (offs == SNAP_S_SSR) ||
+	    ((offs >= SNAP_S_ATRI) && (offs < SNAP_S_ATRI + 16 * 8)))
+		return 0;		/* Read only for a slave */
+
+	if ((offs < ACTION_BASE_S) || (size != 4)) {
+		if (size == 8)
+			reg64_set(afu, offs, data);
+		else	reg32_set(afu, offs, (uint32_t)data);
+		return 0;
+	}
+
+	switch (act) {
+	case ACTION_CONTROL:
+		if ((data & ACTION_CONTROL_STOP) &&
+		    (afu->work & MOCK_WORK_JOB)) {
+			afu->job_stop = true;
+			mock_work(afu, MOCK_WORK_JOB, 0);
+		}
+		if (!(data & ACTION_CONTROL_START))
+			return 0;
+		if (!(reg64(afu, SNAP_S_CSR) & SNAP_CSR_ATT) ||
+		    (afu->work & MOCK_WORK_JOB)) {
+			errno = EBUSY;
+			return -1;
+		}
+		reg32_set(afu, offs, ACTION_CONTROL_RUN);
+		afu->job_stop = false;
+		mock_work(afu, MOCK_WORK_JOB, mock_job_us);
+		return 0;
+	case ACTION_IRQ_STATUS:		/* Toggle on write */
+		reg32_set(afu, offs, reg32(afu, offs) & ~(uint32_t)data);
+		return 0;
+	}
+	if ((act >= ACTION_PARAMS_OUT) &&
+	    (act < ACTION_PARAMS_OUT + sizeof(struct snap_queue_workitem)))
+		return 0;
+	reg32_set(afu, offs, (uint32_t)data);
+	return 0;
+}
+
+static int mock_check(struct cxl_afu_h *afu, uint64_t offs, int size)
+{
+	if ((afu == NULL) || (offs & (size - 1)) ||
+	    (offs + size > MOCK_MMIO_SIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	mock_mmio_delay();
+	return 0;
+}
+
+struct cxl_afu_h *cxl_afu_open_dev(char *path)
+{
+	struct cxl_afu_h *afu;
+	pthread_condattr_t attr;
+	size_t len = strlen(path);
+	uint64_t cir;
+	unsigned int i;
+
+	pthread_once(&mock_once, mock_setup);
+
+	afu = calloc(1, sizeof(*afu));
+	if (afu == NULL)
+		return NULL;
+
+	afu->efd = eventfd(0, EFD_SEMAPHORE);
+	if (afu->efd < 0) {
+		free(afu);
+		return NULL;
+	}
+	pthread_mutex_init(&afu->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&afu->work_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	cir = __atomic_fetch_add(&mock_ctx_next, 1, __ATOMIC_RELAXED) & 0xffff;
+	if (len && (path[len - 1] == 'm'))
+		cir |= 0x8000000000000000ull;	/* Master context */
+	reg64_set(afu, SNAP_S_CIR, cir);
+	reg64_set(afu, SNAP_S_CAP, mock_cap);
+	reg64_set(afu, SNAP_S_SSR, 0x100 | (mock_nactions - 1));
+	for (i = 0; i < mock_nactions; i++)
+		reg64_set(afu, SNAP_S_ATRI + i * 8,
+			  ((uint64_t)i << 32) | mock_actions[i]);
+	reg32_set(afu, ACTION_BASE_S + ACTION_CONTROL, ACTION_CONTROL_IDLE);
+	return afu;
+}
+
+void cxl_afu_free(struct cxl_afu_h *afu)
+{
+	if (afu == NULL)
+		return;
+	if (afu->thread_running) {
+		pthread_mutex_lock(&afu->lock);
+		afu->work |= MOCK_WORK_EXIT;
+		pthread_cond_signal(&afu->work_cond);
+		pthread_mutex_unlock(&afu->lock);
+		pthread_join(afu->thread, NULL);
+	}
+	mock_detach(afu);
+	close(afu->efd);
+	pthread_cond_destroy(&afu->work_cond);
+	pthread_mutex_destroy(&afu->lock);
+	free(afu);
+}
+
+int cxl_afu_attach(struct cxl_afu_h *afu, uint64_t wed __attribute__((unused)))
+{
+	int rc;
+
+	if (afu == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (afu->thread_running)
+		return 0;
+	rc = pthread_create(&afu->thread, NULL, mock_afu_thread, afu);
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	afu->thread_running = true;
+	return 0;
+}
+
+int cxl_afu_fd(struct cxl_afu_h *afu)
+{
+	return afu ? afu->efd : -1;
+}
+
+int cxl_get_cr_vendor(struct cxl_afu_h *afu __attribute__((unused)),
+		      long cr __attribute__((unused)), long *val)
+{
+	*val = SNAP_VENDOR_ID_IBM;
+	return 0;
+}
+
+int cxl_get_cr_device(struct cxl_afu_h *afu __attribute__((unused)),
+		      long cr __attribute__((unused)), long *val)
+{
+	*val = SNAP_DEVICE_ID_SNAP;
+	return 0;
+}
+
+int cxl_errinfo_size(struct cxl_afu_h *afu __attribute__((unused)),
+		     size_t *valp)
+{
+	*valp = 64;
+	return 0;
+}
+
+int cxl_event_pending(struct cxl_afu_h *afu)
+{
+	int pending;
+
+	pthread_mutex_lock(&afu->lock);
+	pending = (afu->ev_count != 0);
+	pthread_mutex_unlock(&afu->lock);
+	return pending;
+}
+
+int cxl_read_event(struct cxl_afu_h *afu, struct cxl_event *event)
+{
+	uint64_t cnt;
+
+	/* Blocks like read() on the cxl device */
+	if (read(afu->efd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return -1;
+
+	pthread_mutex_lock(&afu->lock);
+	*event = afu->events[afu->ev_head];
+	afu->ev_head = (afu->ev_head + 1) % MOCK_EVENTS;
+	afu->ev_count--;
+	pthread_mutex_unlock(&afu->lock);
+	return 0;
+}
+
+int cxl_fprint_event(FILE *stream, struct cxl_event *event)
+{
+	return fprintf(stream, "mock event type: %d irq: %d\n",
+		       event->header.type, event->irq.irq);
+}
+
+int cxl_mmio_map(struct cxl_afu_h *afu, uint32_t flags __attribute__((unused)))
+{
+	return afu ? 0 : -1;
+}
+
+int cxl_mmio_ptr(struct cxl_afu_h *afu, void **mmio_ptrp)
+{
+	if (afu == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	*mmio_ptrp = afu->mmio;
+	return 0;
+}
+
+int cxl_mmio_install_sigbus_handler(void)
+{
+	return 0;
+}
+
+int cxl_mmio_write64(struct cxl_afu_h *afu, uint64_t offset, uint64_t data)
+{
+	int rc;
+
+	if (mock_check(afu, offset, 8) != 0)
+		return -1;
+
+	pthread_mutex_lock(&afu->lock);
+	/* The action registers are 32 bit wide, the upper word goes first */
+	if (offset >= ACTION_BASE_S) {
+		rc = mock_write(afu, offset, data >> 32, 4);
+		if (rc == 0)
+			rc = mock_write(afu, offset + 4, (uint32_t)data, 4);
+	} else
+		rc = mock_write(afu, offset, data, 8);
+	pthread_mutex_unlock(&afu->lock);
+	return rc;
+}
+
+int cxl_mmio_read64(struct cxl_afu_h *afu, uint64_t offset, uint64_t *data)
+{
+	if (mock_check(afu, offset, 8) != 0)
+		return -1;
+
+	pthread_mutex_lock(&afu->lock);
+	*data = reg64(afu, offset);
+	pthread_mutex_unlock(&afu->lock);
+	return 0;
+}
+
+int cxl_mmio_write32(struct cxl_afu_h *afu, uint64_t offset, uint32_t data)
+{
+	int rc;
+
+	if (mock_check(afu, offset, 4) != 0)
+		return -1;
+
+	pthread_mutex_lock(&afu->lock);
+	rc = mock_write(afu, offset, data, 4);
+	pthread_mutex_unlock(&afu->lock);
+	return rc;
+}
+
+int cxl_mmio_read32(struct cxl_afu_h *afu, uint64_t offset, uint32_t *data)
+{
+	if (mock_check(afu, offset, 4) != 0)
+		return -1;
+
+	pthread_mutex_lock(&afu->lock);
+	*data = reg32(afu, offset);
+	/* ap_done is clear on read */
+	if (offset == ACTION_BASE_S + ACTION_CONTROL)
+		reg32_set(afu, offset, *data & ~ACTION_CONTROL_DONE);
+	pthread_mutex_unlock(&afu->lock);
+	return 0;
+}
@@ -0,0 +1,670 @@
+/*
+ * Copyright 2018, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libsnap microbenchmarks. Measures attach and detach, the round trip
+ * of an empty job with polling and with interrupt, MMIO latency and
+ * rate, and DMA bandwidth by copying host memory with the memcopy
+ * action. Results are printed as table, JSON or CSV, such that runs
+ * of different releases and machines can be compared.
+ *
+ * With SNAP_CONFIG=CPU the built-in software memcopy is measured, so
+ * the numbers show the library overhead without a card.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <snap_tools.h>
+#include <libsnap.h>
+#include <snap_hls_if.h>
+#include <snap_internal.h>
+#include "force_cpu.h"
+
+#define BENCH_ACTION_TYPE	0x10141000	/* HLS Memcopy */
+#define BENCH_DMA_BYTES		(1ull << 30)	/* Copied per DMA size */
+
+static const char *version = GIT_VERSION;
+int verbose_flag = 0;
+
+/* Job layout of the memcopy action */
+struct bench_job {
+	struct snap_addr in;
+	struct snap_addr out;
+};
+
+enum bench_format {
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_CSV,
+};
+
+struct bench_result {
+	const char *name;
+	uint64_t size;			/* Bytes per operation, 0 if none */
+	unsigned int count;
+	uint64_t min_ns;
+	uint64_t mean_ns;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+	double ops_per_sec;
+	double mib_per_sec;
+};
+
+struct bench {
+	struct snap_card *card;
+	snap_action_type_t action_type;
+	unsigned int count;		/* Measured iterations per test */
+	unsigned int warmup;		/* Not measured iterations */
+	unsigned int timeout;
+	uint64_t *samples;
+	unsigned int nresults;
+	struct bench_result results[64];
+};
+
+static const char *tests_all = "attach,job,mmio,dma";
+
+/*
+ * Software memcopy, used with SNAP_CONFIG=CPU. The card has the
+ * hardware action, this one is only looked up in software mode.
+ */
+static int bench_action_main(struct snap_sim_action *action,
+			     void *job, unsigned int job_len __unused)
+{
+	struct bench_job *js = (struct bench_job *)job;
+
+	action->job.retc = SNAP_RETC_FAILURE;
+	if ((js->in.size != js->out.size) ||
+	    (js->in.type != SNAP_ADDRTYPE_HOST_DRAM) ||
+	    (js->out.type != SNAP_ADDRTYPE_HOST_DRAM))
+		return 0;
+
+	memcpy((void *)js->out.addr, (void *)js->in.addr, js->in.size);
+	action->job.retc = SNAP_RETC_SUCCESS;
+	return 0;
+}
+
+static struct snap_sim_action bench_action = {
+	.vendor_id = SNAP_VENDOR_ID_ANY,
+	.device_id = SNAP_DEVICE_ID_ANY,
+	.action_type = BENCH_ACTION_TYPE,
+
+	.job = { .retc = SNAP_RETC_FAILURE, },
+	.state = ACTION_IDLE,
+	.main = bench_action_main,
+	.priv_data = NULL,
+	.next = NULL,
+};
+
+static inline uint64_t get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, unsigned int n, double p)
+{
+	unsigned int idx = (unsigned int)(p / 100.0 * n);
+
+	return sorted[(idx < n) ? idx : n - 1];
+}
+
+/**
+ * Sort the samples of a test and add its summary to the results.
+ *
+ * @n		number of samples.
+ * @total_ns	wall time of all samples, for the rate.
+ */
+static void bench_add(struct bench *b, const char *name, uint64_t size,
+		      unsigned int n, uint64_t total_ns)
+{
+	struct bench_result *r;
+	uint64_t sum = 0;
+	unsigned int i;
+
+	if ((n == 0) || (b->nresults == ARRAY_SIZE(b->results)))
+		return;
+
+	qsort(b->samples, n, sizeof(b->samples[0]), u64_cmp);
+	for (i = 0; i < n; i++)
+		sum += b->samples[i];
+
+	r = &b->results[b->nresults++];
+	r->name = name;
+	r->size = size;
+	r->count = n;
+	r->min_ns = b->samples[0];
+	r->mean_ns = sum / n;
+	r->p50_ns = percentile(b->samples, n, 50.0);
+	r->p90_ns = percentile(b->samples, n, 90.0);
+	r->p99_ns = percentile(b->samples, n, 99.0);
+	r->p999_ns = percentile(b->samples, n, 99.9);
+	r->max_ns = b->samples[n - 1];
+	r->ops_per_sec = total_ns ? (double)n * 1e9 / total_ns : 0.0;
+	r->mib_per_sec = r->ops_per_sec * size / (1024.0 * 1024.0);
+
+	if (verbose_flag)
+		fprintf(stderr, "  %-12s %10llu bytes p50 %llu ns\n", name,
+			(unsigned long long)size,
+			(unsigned long long)r->p50_ns);
+}
+
+/* Attach and detach, each measured on its own */
+static int bench_attach(struct bench *b)
+{
+	struct snap_action *action;
+	uint64_t *detach;
+	unsigned int i, n = 0;
+	uint64_t t0, t1, total_attach = 0, total_detach = 0;
+
+	detach = calloc(b->count, sizeof(*detach));
+	if (detach == NULL)
+		return -1;
+
+	for (i = 0; i < b->warmup + b->count; i++) {
+		t0 = get_ns();
+		action = snap_attach_action(b->card, b->action_type, 0,
+					    b->timeout);
+		t1 = get_ns();
+		if (action == NULL) {
+			fprintf(stderr, "err: attach failed: %s\n",
+				strerror(errno));
+			free(detach);
+			return -1;
+		}
+		snap_detach_action(action);
+		if (i < b->warmup)
+			continue;
+
+		b->samples[n] = t1 - t0;
+		detach[n] = get_ns() - t1;
+		total_attach += b->samples[n];
+		total_detach += detach[n];
+		n++;
+	}
+	bench_add(b, "attach", 0, n, total_attach);
+	memcpy(b->samples, detach, n * sizeof(*detach));
+	bench_add(b, "detach", 0, n, total_detach);
+	free(detach);
+	return 0;
+}
+
+/**
+ * Run memcopy jobs of one size on an attached action.
+ *
+ * @return	0 on success, -1 if a job failed.
+ */
+static int bench_jobs(struct bench *b, struct snap_action *action,
+		      const char *name, void *src, void *dst, uint64_t size,
+		      unsigned int count)
+{
+	struct bench_job mjob;
+	struct snap_job cjob;
+	unsigned int i;
+	uint64_t t0, t1, start = 0;
+	int rc;
+
+	snap_addr_set(&mjob.in, src, size, SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+	snap_addr_set(&mjob.out, dst, size, SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+		      SNAP_ADDRFLAG_END);
+
+	for (i = 0; i < b->warmup + count; i++) {
+		if (i == b->warmup)
+			start = get_ns();
+		snap_job_set(&cjob, &mjob, sizeof(mjob), NULL, 0);
+		t0 = get_ns();
+		rc = snap_action_sync_execute_job(action, &cjob, b->timeout);
+		t1 = get_ns();
+		if ((rc != 0) || (cjob.retc != SNAP_RETC_SUCCESS)) {
+			fprintf(stderr, "err: %s job failed rc=%d retc=%x\n",
+				name, rc, cjob.retc);
+			return -1;
+		}
+		if (i >= b->warmup)
+			b->samples[i - b->warmup] = t1 - t0;
+	}
+	bench_add(b, name, size, count, get_ns() - start);
+	return 0;
+}
+
+/* Round trip of a job which copies nothing, polling and with irq */
+static int bench_job(struct bench *b)
+{
+	static const struct {
+		const char *name;
+		snap_action_flag_t flags;
+	} modes[] = {
+		{ "job_poll", 0 },
+		{ "job_irq", SNAP_ACTION_DONE_IRQ },
+	};
+	struct snap_action *action;
+	unsigned int i;
+	int rc = 0;
+
+	for (i = 0; (i < ARRAY_SIZE(modes)) && (rc == 0); i++) {
+		action = snap_attach_action(b->card, b->action_type,
+					    modes[i].flags, b->timeout);
+		if (action == NULL) {
+			fprintf(stderr, "err: attach failed: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		rc = bench_jobs(b, action, modes[i].name, NULL, NULL, 0,
+				b->count);
+		snap_detach_action(action);
+	}
+	return rc;
+}
+
+/* MMIO latency and rate on the job registers of an idle action */
+static int bench_mmio(struct bench *b)
+{
+	struct snap_action *action;
+	unsigned int i, n;
+	uint64_t t0, start = 0;
+	uint64_t val64;
+	uint32_t val32;
+	int t, rc = 0;
+
+	action = snap_attach_action(b->card, b->action_type, 0, b->timeout);
+	if (action == NULL) {
+		fprintf(stderr, "err: attach failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (t = 0; (t < 3) && (rc == 0); t++) {
+		for (i = 0, n = 0; i < b->warmup + b->count; i++) {
+			if (i == b->warmup)
+				start = get_ns();
+			t0 = get_ns();
+			switch (t) {
+			case 0:
+				rc = snap_mmio_read32(b->card,
+						ACTION_PARAMS_OUT + 0x10,
+						&val32);
+				break;
+			case 1:
+				rc = snap_mmio_write32(b->card,
+						ACTION_PARAMS_IN + 0x10, i);
+				break;
+			default:
+				rc = snap_mmio_read64(b->card, 0x0, &val64);
+				break;
+			}
+			if (rc != 0) {
+				fprintf(stderr, "err: MMIO failed rc=%d\n", rc);
+				break;
+			}
+			if (i >= b->warmup)
+				b->samples[n++] = get_ns() - t0;
+		}
+		bench_add(b, (t == 0) ? "mmio_read32" :
+			  (t == 1) ? "mmio_write32" : "mmio_read64",
+			  (t == 2) ? 8 : 4, n, get_ns() - start);
+	}
+	snap_detach_action(action);
+	return rc;
+}
+
+/* Host to host copies for each power of two size from min to max */
+static int bench_dma(struct bench *b, uint64_t min, uint64_t max)
+{
+	struct snap_action *action;
+	uint64_t size;
+	unsigned int count;
+	void *src, *dst;
+	int rc = 0;
+
+	src = snap_buf_alloc(b->card, max, SNAP_BUF_PREFAULT);
+	dst = snap_buf_alloc(b->card, max, SNAP_BUF_PREFAULT);
+	if ((src == NULL) || (dst == NULL)) {
+		fprintf(stderr, "err: can not allocate %llu bytes\n",
+			(unsigned long long)max);
+		rc = -1;
+		goto out;
+	}
+	memset(src, 0xa5, max);
+
+	action = snap_attach_action(b->card, b->action_type, 0, b->timeout);
+	if (action == NULL) {
+		fprintf(stderr, "err: attach failed: %s\n", strerror(errno));
+		rc = -1;
+		goto out;
+	}
+
+	for (size = min; (size <= max) && (rc == 0); size *= 2) {
+		/* Large copies take long, limit the bytes per size */
+		count = MIN((uint64_t)b->count, BENCH_DMA_BYTES / size);
+		count = MAX(count, 1u);
+		rc = bench_jobs(b, action, "dma", src, dst, size, count);
+	}
+	snap_detach_action(action);
+ out:
+	snap_buf_free(src);
+	snap_buf_free(dst);
+	return rc;
+}
+
+static void print_text(struct bench *b, FILE *fp)
+{
+	unsigned int i;
+
+	fprintf(fp, "%-12s %10s %8s %9s %9s %9s %9s %9s %9s %10s %10s\n",
+		"test", "bytes", "count", "min_ns", "mean_ns", "p50_ns",
+		"p99_ns", "p999_ns", "max_ns", "ops/s", "MiB/s");
+	for (i = 0; i < b->nresults; i++) {
+		struct bench_result *r = &b->results[i];
+
+		fprintf(fp, "%-12s %10llu %8u %9llu %9llu %9llu %9llu %9llu "
+			"%9llu %10.0f %10.1f\n", r->name,
+			(unsigned long long)r->size, r->count,
+			(unsigned long long)r->min_ns,
+			(unsigned long long)r->mean_ns,
+			(unsigned long long)r->p50_ns,
+			(unsigned long long)r->p99_ns,
+			(unsigned long long)r->p999_ns,
+			(unsigned long long)r->max_ns,
+			r->ops_per_sec, r->mib_per_sec);
+	}
+}
+
+static void print_csv(struct bench *b, FILE *fp)
+{
+	unsigned int i;
+
+	fprintf(fp, "test,bytes,count,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,"
+		"p999_ns,max_ns,ops_per_sec,mib_per_sec\n");
+	for (i = 0; i < b->nresults; i++) {
+		struct bench_result *r = &b->results[i];
+
+		fprintf(fp, "%s,%llu,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,"
+			"%.1f,%.1f\n", r->name, (unsigned long long)r->size,
+			r->count, (unsigned long long)r->min_ns,
+			(unsigned long long)r->mean_ns,
+			(unsigned long long)r->p50_ns,
+			(unsigned long long)r->p90_ns,
+			(unsigned long long)r->p99_ns,
+			(unsigned long long)r->p999_ns,
+			(unsigned long long)r->max_ns,
+			r->ops_per_sec, r->mib_per_sec);
+	}
+}
+
+static void print_json(struct bench *b, FILE *fp, int card_no)
+{
+	const char *config = getenv("SNAP_CONFIG");
+	char host[64] = "";
+	unsigned int i;
+
+	gethostname(host, sizeof(host) - 1);
+	fprintf(fp, "{\n  \"tool\": \"snap_bench\",\n"
+		"  \"version\": \"%s\",\n  \"host\": \"%s\",\n"
+		"  \"config\": \"%s\",\n  \"card\": %d,\n"
+		"  \"action_type\": \"0x%08x\",\n  \"results\": [",
+		version, host, config ? config : "FPGA", card_no,
+		b->action_type);
+	for (i = 0; i < b->nresults; i++) {
+		struct bench_result *r = &b->results[i];
+
+		fprintf(fp, "%s\n    { \"test\": \"%s\", \"bytes\": %llu, "
+			"\"count\": %u, \"min_ns\": %llu, \"mean_ns\": %llu, "
+			"\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+			"\"p999_ns\": %llu, \"max_ns\": %llu, "
+			"\"ops_per_sec\": %.1f, \"mib_per_sec\": %.1f }",
+			i ? "," : "", r->name, (unsigned long long)r->size,
+			r->count, (unsigned long long)r->min_ns,
+			(unsigned long long)r->mean_ns,
+			(unsigned long long)r->p50_ns,
+			(unsigned long long)r->p90_ns,
+			(unsigned long long)r->p99_ns,
+			(unsigned long long)r->p999_ns,
+			(unsigned long long)r->max_ns,
+			r->ops_per_sec, r->mib_per_sec);
+	}
+	fprintf(fp, "\n  ]\n}\n");
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t size = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; break;
+	case 'm': case 'M': size <<= 20; break;
+	case 'g': case 'G': size <<= 30; break;
+	}
+	return size;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -C, --card <cardno>       can be (0...3)\n"
+	       "  -V, --version             print version.\n"
+	       "  -X, --cpu <id>            only run on this CPU.\n"
+	       "  -t, --tests <list>        comma separated, default %s\n"
+	       "  -A, --action <type>       memcopy compatible action, "
+	       "default 0x%08x\n"
+	       "  -n, --count <num>         iterations per test, default 1000\n"
+	       "  -w, --warmup <num>        iterations not measured, "
+	       "default 10\n"
+	       "  -s, --min <size>          smallest DMA size, default 4K\n"
+	       "  -S, --max <size>          largest DMA size, default 16M\n"
+	       "  -T, --timeout <sec>       attach and job timeout, "
+	       "default 10\n"
+	       "  -f, --format <fmt>        text, json or csv\n"
+	       "  -o, --output <file>       write results to file\n"
+	       "\n"
+	       "Example:\n"
+	       "  $ SNAP_CONFIG=CPU %s -t job,dma -f json -o bench.json\n"
+	       "\n",
+	       prog, tests_all, BENCH_ACTION_TYPE, prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, rc = 0;
+	int card_no = 0;
+	int cpu = -1;
+	const char *tests = tests_all;
+	const char *output = NULL;
+	enum bench_format format = FORMAT_TEXT;
+	uint64_t dma_min = 4096, dma_max = 16 * 1024 * 1024;
+	char device[128];
+	char *list, *test, *saveptr = NULL;
+	struct bench *b;
+	FILE *fp = stdout;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		exit(EXIT_FAILURE);
+	b->action_type = BENCH_ACTION_TYPE;
+	b->count = 1000;
+	b->warmup = 10;
+	b->timeout = 10;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "card",	 required_argument, NULL, 'C' },
+			{ "cpu",	 required_argument, NULL, 'X' },
+			{ "tests",	 required_argument, NULL, 't' },
+			{ "action",	 required_argument, NULL, 'A' },
+			{ "count",	 required_argument, NULL, 'n' },
+			{ "warmup",	 required_argument, NULL, 'w' },
+			{ "min",	 required_argument, NULL, 's' },
+			{ "max",	 required_argument, NULL, 'S' },
+			{ "timeout",	 required_argument, NULL, 'T' },
+			{ "format",	 required_argument, NULL, 'f' },
+			{ "output",	 required_argument, NULL, 'o' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "C:X:t:A:n:w:s:S:T:f:o:Vvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'C':
+			card_no = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'X':
+			cpu = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tests = optarg;
+			break;
+		case 'A':
+			b->action_type = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b->count = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			b->warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			dma_min = parse_size(optarg);
+			break;
+		case 'S':
+			dma_max = parse_size(optarg);
+			break;
+		case 'T':
+			b->timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0)
+				format = FORMAT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				format = FORMAT_CSV;
+			else if (strcmp(optarg, "text") == 0)
+				format = FORMAT_TEXT;
+			else {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((optind != argc) || (b->count == 0) || (dma_min == 0) ||
+	    (dma_min > dma_max)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	b->samples = calloc(b->count, sizeof(*b->samples));
+	if (b->samples == NULL)
+		exit(EXIT_FAILURE);
+
+	switch_cpu(cpu, verbose_flag);
+	snap_action_register(&bench_action);
+
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
+	b->card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+				      SNAP_DEVICE_ID_SNAP);
+	if (b->card == NULL) {
+		fprintf(stderr, "err: failed to open card %u: %s\n", card_no,
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	list = strdup(tests);
+	for (test = strtok_r(list, ",", &saveptr); test && (rc == 0);
+	     test = strtok_r(NULL, ",", &saveptr)) {
+		if (verbose_flag)
+			fprintf(stderr, "[%s] %s\n", argv[0], test);
+		if (strcmp(test, "attach") == 0)
+			rc = bench_attach(b);
+		else if (strcmp(test, "job") == 0)
+			rc = bench_job(b);
+		else if (strcmp(test, "mmio") == 0)
+			rc = bench_mmio(b);
+		else if (strcmp(test, "dma") == 0)
+			rc = bench_dma(b, dma_min, dma_max);
+		else {
+			fprintf(stderr, "err: unknown test %s\n", test);
+			rc = -1;
+		}
+	}
+	free(list);
+	snap_card_free(b->card);
+
+	if (output != NULL) {
+		fp = fopen(output, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "err: can not write %s: %s\n", output,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	switch (format) {
+	case FORMAT_JSON:
+		print_json(b, fp, card_no);
+		break;
+	case FORMAT_CSV:
+		print_csv(b, fp);
+		break;
+	default:
+		print_text(b, fp);
+		break;
+	}
+	if (fp != stdout)
+		fclose(fp);
+
+	free(b->samples);
+	free(b);
+	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2018, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decode the binary trace written by libsnap if SNAP_BTRACE is set.
+ * Prints the events of all threads ordered by time, either as text or
+ * as Chrome trace JSON, which can be loaded into chrome://tracing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <snap_tools.h>
+#include <snap_btrace.h>
+
+static const char *version = GIT_VERSION;
+
+struct event {
+	uint32_t tid;
+	struct snap_btrace_rec rec;
+};
+
+/* Begin and end events are shown as duration in Chrome trace */
+static const struct {
+	uint32_t event;
+	const char *name;
+	char ph;
+} events[] = {
+	{ SNAP_BT_MMIO_WRITE32, "mmio_write32", 'i' },
+	{ SNAP_BT_MMIO_READ32,	"mmio_read32",	'i' },
+	{ SNAP_BT_MMIO_WRITE64, "mmio_write64", 'i' },
+	{ SNAP_BT_MMIO_READ64,	"mmio_read64",	'i' },
+	{ SNAP_BT_IRQ_WAIT,	"irq",		'B' },
+	{ SNAP_BT_IRQ_DONE,	"irq",		'E' },
+	{ SNAP_BT_ATTACH,	"attach",	'i' },
+	{ SNAP_BT_DETACH,	"detach",	'i' },
+	{ SNAP_BT_JOB_START,	"job",		'B' },
+	{ SNAP_BT_JOB_DONE,	"job",		'E' },
+	{ SNAP_BT_BLOCK_STATUS, "block_status", 'i' },
+	{ SNAP_BT_BLOCK_START,	"block_req",	'i' },
+	{ SNAP_BT_BLOCK_DONE,	"block_done",	'i' },
+};
+
+static const char *event_name(uint32_t event, char *ph)
+{
+	static char buf[32];
+	unsigned int i;
+
+	*ph = 'i';
+	for (i = 0; i < ARRAY_SIZE(events); i++) {
+		if (events[i].event == event) {
+			*ph = events[i].ph;
+			return events[i].name;
+		}
+	}
+	snprintf(buf, sizeof(buf), "user_%x", event);
+	return buf;
+}
+
+static int ts_cmp(const void *a, const void *b)
+{
+	const struct event *ea = a, *eb = b;
+
+	if (ea->rec.ts != eb->rec.ts)
+		return (ea->rec.ts < eb->rec.ts) ? -1 : 1;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-V] [-j] [-o <out>] <tracefile>\n"
+	       "  -j, --json          write Chrome trace JSON instead of text.\n"
+	       "  -o, --output <file> write to file instead of stdout.\n"
+	       "  -V, --version       print version.\n"
+	       "\n"
+	       "Example:\n"
+	       "  $ SNAP_BTRACE=/tmp/snap.trc snap_memcopy ...\n"
+	       "  $ %s -j -o snap.json /tmp/snap.trc\n",
+	       prog, prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, json = 0;
+	const char *fname, *oname = NULL;
+	FILE *fp, *out = stdout;
+	struct snap_btrace_hdr hdr;
+	struct snap_btrace_thread th;
+	struct event *ev = NULL, *tmp;
+	size_t n = 0, i;
+	uint32_t t, j;
+	uint64_t t0, lost = 0;
+	const char *name;
+	char ph;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "json",	no_argument,	   NULL, 'j' },
+			{ "output",	required_argument, NULL, 'o' },
+			{ "version",	no_argument,	   NULL, 'V' },
+			{ "help",	no_argument,	   NULL, 'h' },
+			{ 0,		no_argument,	   NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "jo:Vh",
+				 long_options, &option_index);
+		if (ch == -1)	/* all params processed ? */
+			break;
+
+		switch (ch) {
+		case 'j':
+			json = 1;
+			break;
+		case 'o':
+			oname = optarg;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	fname = argv[optind];
+
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "err: Can not open %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+	if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) ||
+	    (memcmp(hdr.magic, SNAP_BTRACE_MAGIC, sizeof(hdr.magic)) != 0) ||
+	    (hdr.rec_size != sizeof(struct snap_btrace_rec))) {
+		fprintf(stderr, "err: %s is no libsnap trace\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	for (t = 0; t < hdr.nthreads; t++) {
+		if (fread(&th, sizeof(th), 1, fp) != 1)
+			goto err_trunc;
+		tmp = realloc(ev, (n + th.count) * sizeof(*ev));
+		if (tmp == NULL) {
+			fprintf(stderr, "err: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		ev = tmp;
+		for (j = 0; j < th.count; j++, n++) {
+			ev[n].tid = th.tid;
+			if (fread(&ev[n].rec, sizeof(ev[n].rec), 1, fp) != 1)
+				goto err_trunc;
+		}
+		lost += th.lost;
+	}
+	fclose(fp);
+
+	qsort(ev, n, sizeof(*ev), ts_cmp);
+	t0 = n ? ev[0].rec.ts : 0;
+
+	if (oname) {
+		out = fopen(oname, "w");
+		if (out == NULL) {
+			fprintf(stderr, "err: Can not write %s\n", oname);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (json)
+		fprintf(out, "{ \"displayTimeUnit\": \"ns\",\n"
+			"  \"traceEvents\": [");
+	else
+		fprintf(out, "# pid %u, %u threads, %zu events, %llu lost\n",
+			hdr.pid, hdr.nthreads, n, (unsigned long long)lost);
+
+	for (i = 0; i < n; i++) {
+		struct snap_btrace_rec *r = &ev[i].rec;
+
+		name = event_name(r->event, &ph);
+		if (json) {
+			fprintf(out, "%s\n    { \"name\": \"%s\", \"ph\": \"%c\", "
+				"\"ts\": %.3f, \"pid\": %u, \"tid\": %u, %s"
+				"\"args\": { \"a0\": \"0x%llx\", "
+				"\"a1\": \"0x%llx\", \"a2\": \"0x%llx\" } }",
+				i ? "," : "", name, ph,
+				(double)(r->ts - t0) / 1000.0,
+				hdr.pid, ev[i].tid,
+				(ph == 'i') ? "\"s\": \"t\", " : "",
+				(unsigned long long)r->arg[0],
+				(unsigned long long)r->arg[1],
+				(unsigned long long)r->arg[2]);
+		} else {
+			fprintf(out, "%14.3f %6u %-14s %016llx %016llx "
+				"%016llx\n",
+				(double)(r->ts - t0) / 1000.0, ev[i].tid,
+				name, (unsigned long long)r->arg[0],
+				(unsigned long long)r->arg[1],
+				(unsigned long long)r->arg[2]);
+		}
+	}
+	if (json)
+		fprintf(out, "\n  ]\n}\n");
+
+	if (out != stdout)
+		fclose(out);
+	free(ev);
+	exit(EXIT_SUCCESS);
+
+ err_trunc:
+	fprintf(stderr, "err: %s is truncated\n", fname);
+	exit(EXIT_FAILURE);
+}
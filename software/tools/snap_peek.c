@@ -187,23 +187,28 @@ int main(int argc, char *argv[])
 	if (verbose_flag)
 		printf("[%s] Open CAPI Card Got handle: %p\n", argv[0], card);
 
+	/*
+	 * Nothing in host memory depends on the values read, so there is
+	 * no need for a hwsync on each of the peeks.
+	 */
 	for (i = 0; i < count; i++) {
 		dump_more:
 		switch (width) {
 		case 32: {
 			if (verbose_flag > 1)
-				printf("[%s] snap_mmio_read32(%p, %x)\n",
+				printf("[%s] snap_mmio_read32_nohwsync(%p, %x)\n",
 					argv[0], card, offs);
-			rc = snap_mmio_read32(card, offs, (uint32_t *)&val);
+			rc = snap_mmio_read32_nohwsync(card, offs,
+						       (uint32_t *)&val);
 			val &= 0xffffffff; /* mask off obsolete bits ... */
 			break;
 		}
 		default:
 		case 64:
 			if (verbose_flag > 1)
-				printf("[%s] snap_mmio_read64(%p, %x)\n",
+				printf("[%s] snap_mmio_read64_nohwsync(%p, %x)\n",
 					argv[0], card, offs);
-			rc = snap_mmio_read64(card, offs, &val);
+			rc = snap_mmio_read64_nohwsync(card, offs, &val);
 			break;
 		}
 
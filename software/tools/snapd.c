@@ -0,0 +1,622 @@
+/*
+ * Copyright 2018, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * snapd shares one card among many processes. Clients connect with
+ * snap_client_open() and post jobs into rings in shared memory, see
+ * snap_daemon.h. The daemon owns the card, its worker threads take
+ * one job per client in turn and execute it with snap_sync_execute_job().
+ * Each worker keeps its own context with the actions attached, so
+ * clients neither attach nor wait for each other's contexts.
+ *
+ * Jobs carry addresses the card uses as they are. The daemon trusts
+ * its clients, access is controlled by the permissions of the socket.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <snap_tools.h>
+#include <libsnap.h>
+#include <snap_internal.h>
+#include <snap_daemon.h>
+#include "force_cpu.h"
+
+#define SNAPD_CLIENTS_MAX	64
+#define SNAPD_WORKERS_MAX	64
+
+static const char *version = GIT_VERSION;
+int verbose_flag = 0;
+
+struct snapd_client {
+	unsigned int id;
+	int sock;
+	int doorbell;			/* Client rings us */
+	int wakeup;			/* We wake the client */
+	void *base;
+	size_t size;
+	struct snapd_ctrl *ctrl;
+	struct snapd_job *sq;
+	struct snap_completion *cq;
+	uint32_t mask;
+
+	/* Under snapd.lock */
+	uint32_t head;			/* Next job to take */
+	unsigned int inflight;
+	bool dead;
+	unsigned long jobs;
+};
+
+static struct snapd {
+	struct snap_card *card;
+	snap_action_flag_t action_flags;
+	int attach_timeout;
+	int timeout;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* Jobs posted or stopping */
+	struct snapd_client *clients[SNAPD_CLIENTS_MAX];
+	unsigned int next;		/* Round robin start */
+	unsigned int ids;
+	unsigned int sleeping;		/* Workers without a job */
+	bool waiting;			/* daemon_wait set in the clients */
+	bool stop;
+} snapd = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+};
+
+static volatile sig_atomic_t snapd_exit = 0;
+
+static void snapd_signal(int sig __unused)
+{
+	snapd_exit = 1;
+}
+
+/* Tell the clients to ring the doorbell, under snapd.lock */
+static void snapd_set_waiting(bool waiting)
+{
+	unsigned int i;
+
+	if (snapd.waiting == waiting)
+		return;
+	for (i = 0; i < SNAPD_CLIENTS_MAX; i++) {
+		struct snapd_client *c = snapd.clients[i];
+
+		if (c && !c->dead)
+			__atomic_store_n(&c->ctrl->daemon_wait, waiting,
+					 __ATOMIC_SEQ_CST);
+	}
+	snapd.waiting = waiting;
+}
+
+/*
+ * Take the next job, one per client in turn, under snapd.lock. The
+ * job is copied, such that the client can not change it while it runs.
+ */
+static struct snapd_client *snapd_take(struct snapd_job *job,
+				       uint32_t *idx)
+{
+	unsigned int i, k;
+
+	for (k = 0; k < SNAPD_CLIENTS_MAX; k++) {
+		struct snapd_client *c;
+
+		i = (snapd.next + k) % SNAPD_CLIENTS_MAX;
+		c = snapd.clients[i];
+		if ((c == NULL) || c->dead || (c->head ==
+		    __atomic_load_n(&c->ctrl->sq_tail, __ATOMIC_ACQUIRE)))
+			continue;
+
+		memcpy(job, &c->sq[c->head & c->mask], sizeof(*job));
+		*idx = c->head++;
+		__atomic_store_n(&c->ctrl->sq_head, c->head,
+				 __ATOMIC_RELEASE);
+		c->inflight++;
+		c->jobs++;
+		snapd.next = i + 1;
+		return c;
+	}
+	return NULL;
+}
+
+static void snapd_execute(struct snapd_client *c, struct snapd_job *job,
+			  uint32_t idx)
+{
+	int rc;
+	uint64_t one = 1;
+	uint8_t out[SNAP_JOBSIZE];
+	struct snap_job cjob;
+	struct snap_completion done, *cc = &c->cq[idx & c->mask];
+
+	memset(&done, 0, sizeof(done));
+	done.seq = (uint16_t)idx;
+	done.priv_data = job->tag;
+
+	if ((job->win_size > sizeof(job->data)) ||
+	    (job->wout_size > sizeof(out))) {
+		done.retc = SNAP_RETC_FAILURE;
+	} else {
+		snap_job_set(&cjob, job->data, job->win_size,
+			     job->wout_size ? out : NULL, job->wout_size);
+		rc = snap_sync_execute_job(snapd.card, job->action_type,
+					   snapd.action_flags, &cjob,
+					   snapd.attach_timeout,
+					   snapd.timeout);
+		if (rc == 0) {
+			done.retc = cjob.retc;
+			memcpy(done.data, out, job->wout_size);
+		} else {
+			done.retc = (rc == SNAP_ETIMEDOUT) ?
+				SNAP_RETC_TIMEOUT : SNAP_RETC_FAILURE;
+			pr_info("client %u job %u action %08x rc %d\n",
+				 c->id, idx, job->action_type, rc);
+		}
+	}
+
+	/* DONE last, then wake the client if it sleeps */
+	memcpy(cc, &done, sizeof(done));
+	__atomic_store_n(&cc->flags, SNAP_JOBFLAG_DONE, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->ctrl->client_wait, __ATOMIC_SEQ_CST))
+		(void)write(c->wakeup, &one, sizeof(one));
+}
+
+static void snapd_client_free(struct snapd_client *c)
+{
+	if (c->base)
+		munmap(c->base, c->size);
+	if (c->sock >= 0)
+		close(c->sock);
+	if (c->doorbell >= 0)
+		close(c->doorbell);
+	if (c->wakeup >= 0)
+		close(c->wakeup);
+	free(c);
+}
+
+static void *snapd_worker(void *arg __unused)
+{
+	struct snapd_client *c;
+	struct snapd_job job;
+	uint32_t idx;
+
+	pthread_mutex_lock(&snapd.lock);
+	while (!snapd.stop) {
+		c = snapd_take(&job, &idx);
+		if (c == NULL) {
+			/*
+			 * Ask for the doorbell, then look once more. The
+			 * fence orders the store before the load of
+			 * sq_tail, like in snap_client_post().
+			 */
+			snapd.sleeping++;
+			snapd_set_waiting(true);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			c = snapd_take(&job, &idx);
+			if (c == NULL)
+				pthread_cond_wait(&snapd.work, &snapd.lock);
+			snapd.sleeping--;
+			if (c == NULL)
+				continue;
+		}
+		/* Idle workers still want the doorbell */
+		snapd_set_waiting(snapd.sleeping != 0);
+		pthread_mutex_unlock(&snapd.lock);
+
+		snapd_execute(c, &job, idx);
+
+		pthread_mutex_lock(&snapd.lock);
+		if (--c->inflight == 0 && c->dead) {
+			/* Dropped while we ran its job, we free it */
+			pthread_mutex_unlock(&snapd.lock);
+			snapd_client_free(c);
+			pthread_mutex_lock(&snapd.lock);
+		}
+	}
+	pthread_mutex_unlock(&snapd.lock);
+	return NULL;
+}
+
+/*
+ * Forget the client and release its memory. Workers may still run
+ * jobs of it, the last of them releases it then, such that the poll
+ * loop never waits for a job.
+ */
+static void snapd_drop(unsigned int i)
+{
+	struct snapd_client *c = snapd.clients[i];
+	bool idle;
+
+	pthread_mutex_lock(&snapd.lock);
+	c->dead = true;
+	snapd.clients[i] = NULL;
+	idle = (c->inflight == 0);
+	pr_info("client %u gone after %lu jobs, %u in flight\n",
+		c->id, c->jobs, c->inflight);
+	pthread_mutex_unlock(&snapd.lock);
+
+	if (idle)
+		snapd_client_free(c);
+}
+
+/* Receive the hello and the fds, map the client memory */
+static int snapd_hello(struct snapd_client *c, int *memfd)
+{
+	struct snapd_hello h;
+	struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+	union {
+		char buf[CMSG_SPACE(SNAPD_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct stat st;
+	int fds[SNAPD_FDS];
+	void *p;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	if (recvmsg(c->sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) !=
+	    sizeof(h))
+		return -EPROTO;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) ||
+	    (cmsg->cmsg_type != SCM_RIGHTS) ||
+	    (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))))
+		return -EPROTO;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	*memfd = fds[0];
+	c->doorbell = fds[1];
+	c->wakeup = fds[2];
+
+	if (h.version != SNAPD_VERSION)
+		return -EPROTONOSUPPORT;
+	if ((h.entries == 0) || (h.entries & (h.entries - 1)) ||
+	    (h.entries > 65536) || (h.size < snapd_rings_size(h.entries)))
+		return -EINVAL;
+	if ((fstat(*memfd, &st) < 0) || ((uint64_t)st.st_size < h.size))
+		return -EINVAL;
+
+	p = mmap((void *)(unsigned long)h.addr, h.size,
+		 PROT_READ | PROT_WRITE, MAP_SHARED, *memfd, 0);
+	if (p == MAP_FAILED)
+		return -errno;
+	if (p != (void *)(unsigned long)h.addr) {
+		munmap(p, h.size);
+		return -EADDRINUSE;	/* Client retries elsewhere */
+	}
+
+	c->base = p;
+	c->size = h.size;
+	c->mask = h.entries - 1;
+	c->ctrl = p;
+	c->sq = (struct snapd_job *)(c->ctrl + 1);
+	c->cq = (struct snap_completion *)(c->sq + h.entries);
+	c->head = __atomic_load_n(&c->ctrl->sq_tail, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+static void snapd_accept(int lsock)
+{
+	int rc, memfd = -1;
+	unsigned int i;
+	struct snapd_reply r;
+	struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+	struct snapd_client *c;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return;
+	c->doorbell = c->wakeup = -1;
+	c->sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+	if (c->sock < 0) {
+		free(c);
+		return;
+	}
+	/* A client which does not send its hello must not block us */
+	setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	for (i = 0; i < SNAPD_CLIENTS_MAX; i++)
+		if (snapd.clients[i] == NULL)
+			break;
+
+	rc = (i == SNAPD_CLIENTS_MAX) ? -EUSERS : snapd_hello(c, &memfd);
+	if (memfd >= 0)
+		close(memfd);		/* The mapping stays */
+
+	c->id = snapd.ids++;
+	r.rc = rc;
+	r.client_id = c->id;
+	if (send(c->sock, &r, sizeof(r), MSG_NOSIGNAL) != sizeof(r))
+		rc = -EPIPE;
+	if (rc != 0) {
+		pr_info("client %u refused rc %d\n", c->id, rc);
+		snapd_client_free(c);
+		return;
+	}
+
+	pr_info("client %u at %p %zu bytes %u entries\n", c->id, c->base,
+		 c->size, c->mask + 1);
+	pthread_mutex_lock(&snapd.lock);
+	if (snapd.waiting)
+		__atomic_store_n(&c->ctrl->daemon_wait, 1, __ATOMIC_SEQ_CST);
+	snapd.clients[i] = c;
+	pthread_cond_broadcast(&snapd.work);	/* Jobs posted before */
+	pthread_mutex_unlock(&snapd.lock);
+}
+
+static int snapd_listen(const char *path)
+{
+	int lsock;
+	struct sockaddr_un sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "err: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lsock < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(path);
+	if ((bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) < 0) ||
+	    (listen(lsock, SNAPD_CLIENTS_MAX) < 0)) {
+		fprintf(stderr, "err: can not listen on %s: %s\n", path,
+			strerror(errno));
+		close(lsock);
+		return -1;
+	}
+	return lsock;
+}
+
+/*
+ * Wait for new clients, disconnects and doorbells. Doorbells only
+ * come while the workers sleep.
+ */
+static void snapd_serve(int lsock)
+{
+	struct pollfd pfd[1 + 2 * SNAPD_CLIENTS_MAX];
+	unsigned int slot[1 + 2 * SNAPD_CLIENTS_MAX];
+	unsigned int i, n;
+	uint64_t cnt;
+	char buf[64];
+
+	while (!snapd_exit) {
+		n = 0;
+		pfd[n].fd = lsock;
+		pfd[n++].events = POLLIN;
+		for (i = 0; i < SNAPD_CLIENTS_MAX; i++) {
+			struct snapd_client *c = snapd.clients[i];
+
+			if (c == NULL)
+				continue;
+			slot[n] = i;
+			pfd[n].fd = c->sock;
+			pfd[n++].events = POLLIN;
+			slot[n] = i;
+			pfd[n].fd = c->doorbell;
+			pfd[n++].events = POLLIN;
+		}
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		for (i = 1; i < n; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			if (pfd[i].fd == snapd.clients[slot[i]]->doorbell) {
+				(void)read(pfd[i].fd, &cnt, sizeof(cnt));
+				pthread_mutex_lock(&snapd.lock);
+				pthread_cond_broadcast(&snapd.work);
+				pthread_mutex_unlock(&snapd.lock);
+				continue;
+			}
+			/* Clients do not send after the hello */
+			if (recv(pfd[i].fd, buf, sizeof(buf),
+				 MSG_DONTWAIT) != -1 || errno != EAGAIN) {
+				snapd_drop(slot[i]);
+				i++;	/* Skip its doorbell */
+			}
+		}
+		if (pfd[0].revents & POLLIN)
+			snapd_accept(lsock);
+	}
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -C, --card <cardno>       can be (0...3)\n"
+	       "  -V, --version             print version.\n"
+	       "  -X, --cpu <id>            only run on this CPU.\n"
+	       "  -s, --socket <path>       default $SNAPD_SOCKET or %s\n"
+	       "  -w, --workers <num>       jobs executed in parallel, "
+	       "default 2\n"
+	       "  -L, --lease <msec>        keep unused actions attached, "
+	       "default 1000\n"
+	       "  -a, --attach-timeout <sec> default 10\n"
+	       "  -t, --timeout <sec>       job timeout, default 10\n"
+	       "  -I, --irq                 wait for jobs with interrupts\n"
+	       "\n"
+	       "Example:\n"
+	       "  $ %s -C0 -w4 -s /run/snapd.sock\n"
+	       "\n",
+	       prog, SNAPD_SOCKET, prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, rc = 0;
+	int card_no = 0;
+	int cpu = -1;
+	int lsock;
+	unsigned int i, workers = 2, lease_ms = 1000;
+	const char *path = getenv("SNAPD_SOCKET");
+	char device[128];
+	pthread_t tid[SNAPD_WORKERS_MAX];
+	struct sigaction sa;
+
+	snapd.attach_timeout = 10;
+	snapd.timeout = 10;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "card",	 required_argument, NULL, 'C' },
+			{ "cpu",	 required_argument, NULL, 'X' },
+			{ "socket",	 required_argument, NULL, 's' },
+			{ "workers",	 required_argument, NULL, 'w' },
+			{ "lease",	 required_argument, NULL, 'L' },
+			{ "attach-timeout", required_argument, NULL, 'a' },
+			{ "timeout",	 required_argument, NULL, 't' },
+			{ "irq",	 no_argument,	    NULL, 'I' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "C:X:s:w:L:a:t:IVvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'C':
+			card_no = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'X':
+			cpu = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'w':
+			workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			lease_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			snapd.attach_timeout = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			snapd.timeout = strtol(optarg, NULL, 0);
+			break;
+		case 'I':
+			snapd.action_flags |= SNAP_ACTION_DONE_IRQ;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((optind != argc) || (workers == 0) ||
+	    (workers > SNAPD_WORKERS_MAX)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (path == NULL)
+		path = SNAPD_SOCKET;
+
+	switch_cpu(cpu, verbose_flag);
+
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
+	snapd.card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+					 SNAP_DEVICE_ID_SNAP);
+	if (snapd.card == NULL) {
+		fprintf(stderr, "err: failed to open card %u: %s\n",
+			card_no, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	snap_card_set_lease(snapd.card, lease_ms);
+
+	lsock = snapd_listen(path);
+	if (lsock < 0) {
+		snap_card_free(snapd.card);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = snapd_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&tid[i], NULL, snapd_worker, NULL) != 0) {
+			workers = i;
+			rc = -1;
+			snapd_exit = 1;
+			break;
+		}
+	}
+	pr_info("snapd listening on %s with %u workers\n", path, workers);
+
+	snapd_serve(lsock);
+
+	for (i = 0; i < SNAPD_CLIENTS_MAX; i++)
+		if (snapd.clients[i])
+			snapd_drop(i);
+
+	pthread_mutex_lock(&snapd.lock);
+	snapd.stop = true;
+	pthread_cond_broadcast(&snapd.work);
+	pthread_mutex_unlock(&snapd.lock);
+	for (i = 0; i < workers; i++)
+		pthread_join(tid[i], NULL);
+
+	close(lsock);
+	unlink(path);
+	snap_card_free(snapd.card);
+	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+}